@@ -0,0 +1,392 @@
+/*
+ * Copyright (C) 2015-2016 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "config.h"
+#include "common/hdf5-filters.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+/* Values of the fifth bitshuffle filter parameter */
+#define BITSHUFFLE_NONE     0
+#define BITSHUFFLE_LZ4      2
+
+static guint64
+read_be (const guint8 *data, guint n_bytes)
+{
+    guint64 result = 0;
+
+    for (guint i = 0; i < n_bytes; i++)
+        result = (result << 8) | data[i];
+
+    return result;
+}
+
+static gboolean
+decode_shuffle (const guint8 *in, gsize in_size, guint8 *out, gsize *out_size, gsize elem_size)
+{
+    gsize n_elems = in_size / elem_size;
+
+    for (gsize j = 0; j < elem_size; j++)
+        for (gsize i = 0; i < n_elems; i++)
+            out[i * elem_size + j] = in[j * n_elems + i];
+
+    /* trailing bytes that do not form a complete element are not shuffled */
+    memcpy (out + n_elems * elem_size, in + n_elems * elem_size, in_size - n_elems * elem_size);
+    *out_size = in_size;
+    return TRUE;
+}
+
+static void
+bitunshuffle_block (const guint8 *in, guint8 *out, gsize n_elems, gsize elem_size)
+{
+    const gsize row_size = n_elems / 8;
+
+    /* Row (8 * byte + bit) holds that bit of that byte for all elements */
+    memset (out, 0, n_elems * elem_size);
+
+    for (gsize b = 0; b < elem_size; b++) {
+        for (guint bit = 0; bit < 8; bit++) {
+            const guint8 *row = in + (b * 8 + bit) * row_size;
+
+            for (gsize i = 0; i < n_elems; i++)
+                out[i * elem_size + b] |= ((row[i / 8] >> (i % 8)) & 1) << bit;
+        }
+    }
+}
+
+static gboolean
+decode_bitshuffle (const guint8 *in, gsize in_size, guint8 *out, gsize *out_size,
+                   gsize capacity, gsize elem_size, guint compression, gsize stored_block_size)
+{
+    const guint8 *end = in + in_size;
+    guint8 *block;
+    gsize block_size;
+    gsize n_elems;
+    gsize n_done = 0;
+
+    if (compression == BITSHUFFLE_NONE) {
+        /* Without compression the block size is only known from the filter
+         * parameters, zero selects the default of the reference filter */
+        n_elems = in_size / elem_size;
+        block_size = stored_block_size ? stored_block_size : MAX ((8192 / elem_size) / 8 * 8, 128);
+    }
+    else {
+        if (in_size < 12)
+            return FALSE;
+
+        n_elems = read_be (in, 8) / elem_size;
+        block_size = read_be (in + 8, 4) / elem_size;
+        in += 12;
+    }
+
+    if (n_elems * elem_size > capacity || block_size == 0 || block_size % 8)
+        return FALSE;
+
+    block = g_malloc (block_size * elem_size);
+
+    while (n_done < n_elems) {
+        gsize n_block = MIN (block_size, n_elems - n_done);
+        gsize n_bytes;
+
+        /* the last elements that do not fill eight are stored verbatim */
+        n_block -= n_block % 8;
+
+        if (n_block == 0)
+            break;
+
+        n_bytes = n_block * elem_size;
+
+        if (compression == BITSHUFFLE_LZ4) {
+#ifdef HAVE_LZ4
+            gsize compressed;
+
+            if (in + 4 > end)
+                break;
+
+            compressed = read_be (in, 4);
+            in += 4;
+
+            if (in + compressed > end ||
+                LZ4_decompress_safe ((const char *) in, (char *) block, (int) compressed, (int) n_bytes) != (int) n_bytes)
+                break;
+
+            bitunshuffle_block (block, out + n_done * elem_size, n_block, elem_size);
+            in += compressed;
+#else
+            break;
+#endif
+        }
+        else {
+            if (in + n_bytes > end)
+                break;
+
+            bitunshuffle_block (in, out + n_done * elem_size, n_block, elem_size);
+            in += n_bytes;
+        }
+
+        n_done += n_block;
+    }
+
+    g_free (block);
+
+    if (n_done < n_elems) {
+        gsize n_left = (n_elems - n_done) * elem_size;
+
+        if (n_elems - n_done >= 8 || in + n_left > end)
+            return FALSE;
+
+        memcpy (out + n_done * elem_size, in, n_left);
+    }
+
+    *out_size = n_elems * elem_size;
+    return TRUE;
+}
+
+#ifdef HAVE_LZ4
+static gboolean
+decode_lz4 (const guint8 *in, gsize in_size, guint8 *out, gsize *out_size, gsize capacity)
+{
+    const guint8 *end = in + in_size;
+    gsize total;
+    gsize block_size;
+    gsize written = 0;
+
+    if (in_size < 12)
+        return FALSE;
+
+    total = read_be (in, 8);
+    block_size = read_be (in + 8, 4);
+    in += 12;
+
+    if (total > capacity || block_size == 0)
+        return FALSE;
+
+    while (written < total) {
+        gsize size = MIN (block_size, total - written);
+        gsize compressed;
+
+        if (in + 4 > end)
+            return FALSE;
+
+        compressed = read_be (in, 4);
+        in += 4;
+
+        if (in + compressed > end)
+            return FALSE;
+
+        /* incompressible blocks are stored as they are */
+        if (compressed == size)
+            memcpy (out + written, in, size);
+        else if (LZ4_decompress_safe ((const char *) in, (char *) out + written, (int) compressed, (int) size) != (int) size)
+            return FALSE;
+
+        in += compressed;
+        written += size;
+    }
+
+    *out_size = total;
+    return TRUE;
+}
+#endif
+
+static gboolean
+decode_filter (UfoHdf5Pipeline *pipeline, guint index,
+               const guint8 *in, gsize in_size,
+               guint8 *out, gsize *out_size, gsize capacity)
+{
+    switch (pipeline->filters[index]) {
+        case H5Z_FILTER_SHUFFLE:
+            return in_size <= capacity && decode_shuffle (in, in_size, out, out_size, pipeline->elem_size);
+        case H5Z_FILTER_FLETCHER32:
+            /* drop the checksum without verifying it */
+            if (in_size < 4 || in_size - 4 > capacity)
+                return FALSE;
+
+            memcpy (out, in, in_size - 4);
+            *out_size = in_size - 4;
+            return TRUE;
+#ifdef HAVE_ZLIB
+        case H5Z_FILTER_DEFLATE:
+            {
+                uLongf size = capacity;
+
+                if (uncompress (out, &size, in, in_size) != Z_OK)
+                    return FALSE;
+
+                *out_size = size;
+                return TRUE;
+            }
+#endif
+#ifdef HAVE_ZSTD
+        case UFO_HDF5_FILTER_ZSTD:
+            {
+                gsize size = ZSTD_decompress (out, capacity, in, in_size);
+
+                if (ZSTD_isError (size))
+                    return FALSE;
+
+                *out_size = size;
+                return TRUE;
+            }
+#endif
+#ifdef HAVE_LZ4
+        case UFO_HDF5_FILTER_LZ4:
+            return decode_lz4 (in, in_size, out, out_size, capacity);
+#endif
+        case UFO_HDF5_FILTER_BITSHUFFLE:
+            return decode_bitshuffle (in, in_size, out, out_size, capacity,
+                                      pipeline->elem_size, pipeline->compression[index],
+                                      pipeline->block_size[index]);
+        default:
+            return FALSE;
+    }
+}
+
+/**
+ * ufo_hdf5_pipeline_init:
+ * @pipeline: Pipeline to initialize
+ * @dcpl_id: Creation property list of a chunked data set
+ * @elem_size: Size of one data set element in bytes
+ *
+ * Returns: %TRUE if all filters of @dcpl_id can be decoded without the HDF5
+ * library, which makes it safe to decode chunks from several threads.
+ */
+gboolean
+ufo_hdf5_pipeline_init (UfoHdf5Pipeline *pipeline,
+                        hid_t dcpl_id,
+                        gsize elem_size)
+{
+    gint n_filters;
+
+    n_filters = H5Pget_nfilters (dcpl_id);
+
+    if (n_filters < 0 || n_filters > UFO_HDF5_MAX_FILTERS)
+        return FALSE;
+
+    pipeline->n_filters = (guint) n_filters;
+    pipeline->elem_size = elem_size;
+
+    for (guint i = 0; i < pipeline->n_filters; i++) {
+        unsigned int flags;
+        unsigned int config;
+        unsigned int cd_values[8] = { 0, };
+        size_t cd_nelmts = G_N_ELEMENTS (cd_values);
+        char name[64];
+
+        pipeline->filters[i] = H5Pget_filter2 (dcpl_id, i, &flags, &cd_nelmts, cd_values, sizeof (name), name, &config);
+        pipeline->block_size[i] = cd_nelmts > 3 ? cd_values[3] : 0;
+        pipeline->compression[i] = cd_nelmts > 4 ? cd_values[4] : BITSHUFFLE_NONE;
+
+        switch (pipeline->filters[i]) {
+            case H5Z_FILTER_SHUFFLE:
+            case H5Z_FILTER_FLETCHER32:
+#ifdef HAVE_ZLIB
+            case H5Z_FILTER_DEFLATE:
+#endif
+#ifdef HAVE_ZSTD
+            case UFO_HDF5_FILTER_ZSTD:
+#endif
+#ifdef HAVE_LZ4
+            case UFO_HDF5_FILTER_LZ4:
+#endif
+                break;
+            case UFO_HDF5_FILTER_BITSHUFFLE:
+#ifdef HAVE_LZ4
+                if (pipeline->compression[i] == BITSHUFFLE_LZ4)
+                    break;
+#endif
+                if (pipeline->compression[i] == BITSHUFFLE_NONE)
+                    break;
+
+                return FALSE;
+            default:
+                return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/**
+ * ufo_hdf5_pipeline_decode:
+ * @pipeline: An initialized pipeline
+ * @filter_mask: Filter mask returned by H5Dread_chunk
+ * @src: Raw chunk data as stored in the file
+ * @src_size: Size of @src in bytes
+ * @dst: Location for the decoded chunk
+ * @dst_size: Size of an uncompressed chunk in bytes
+ *
+ * Reverts the filters in the opposite order they were applied when writing,
+ * skipping those flagged in @filter_mask. This does not call into HDF5 and may
+ * be used from any thread.
+ *
+ * Returns: %TRUE if @dst holds exactly @dst_size decoded bytes.
+ */
+gboolean
+ufo_hdf5_pipeline_decode (UfoHdf5Pipeline *pipeline,
+                          guint filter_mask,
+                          const guint8 *src,
+                          gsize src_size,
+                          guint8 *dst,
+                          gsize dst_size)
+{
+    guint8 *buffers[2];
+    const guint8 *in;
+    gsize in_size;
+    guint current = 0;
+    gboolean success = TRUE;
+
+    buffers[0] = g_malloc (dst_size);
+    buffers[1] = g_malloc (dst_size);
+    in = src;
+    in_size = src_size;
+
+    for (gint i = (gint) pipeline->n_filters - 1; i >= 0 && success; i--) {
+        gsize out_size;
+
+        if (filter_mask & (1 << i))
+            continue;
+
+        success = decode_filter (pipeline, (guint) i, in, in_size, buffers[current], &out_size, dst_size);
+        in = buffers[current];
+        in_size = out_size;
+        current = 1 - current;
+    }
+
+    success = success && in_size == dst_size;
+
+    if (success)
+        memcpy (dst, in, dst_size);
+
+    g_free (buffers[0]);
+    g_free (buffers[1]);
+    return success;
+}
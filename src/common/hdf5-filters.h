@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2015-2016 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UFO_HDF5_FILTERS_H
+#define UFO_HDF5_FILTERS_H
+
+#include "common/hdf5.h"
+
+#define UFO_HDF5_MAX_FILTERS    4
+
+/* Filter identifiers registered with The HDF Group */
+#define UFO_HDF5_FILTER_LZ4         32004
+#define UFO_HDF5_FILTER_BITSHUFFLE  32008
+#define UFO_HDF5_FILTER_ZSTD        32015
+
+typedef struct {
+    guint           n_filters;
+    H5Z_filter_t    filters[UFO_HDF5_MAX_FILTERS];
+    guint           compression[UFO_HDF5_MAX_FILTERS];
+    guint           block_size[UFO_HDF5_MAX_FILTERS];
+    gsize           elem_size;
+} UfoHdf5Pipeline;
+
+gboolean ufo_hdf5_pipeline_init     (UfoHdf5Pipeline    *pipeline,
+                                     hid_t               dcpl_id,
+                                     gsize               elem_size);
+gboolean ufo_hdf5_pipeline_decode   (UfoHdf5Pipeline    *pipeline,
+                                     guint               filter_mask,
+                                     const guint8       *src,
+                                     gsize               src_size,
+                                     guint8             *dst,
+                                     gsize               dst_size);
+
+#endif
@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2011-2015 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <string.h>
+#include "common/ufo-histogram.h"
+
+UfoHistogram *
+ufo_histogram_new (guint n_bins)
+{
+    UfoHistogram *histogram;
+
+    /* Merging pairs of bins requires an even number */
+    g_return_val_if_fail (n_bins >= 2 && n_bins % 2 == 0, NULL);
+
+    histogram = g_new0 (UfoHistogram, 1);
+    histogram->bins = g_new0 (guint64, n_bins);
+    histogram->n_bins = n_bins;
+    ufo_histogram_clear (histogram);
+
+    return histogram;
+}
+
+void
+ufo_histogram_free (UfoHistogram *histogram)
+{
+    g_free (histogram->bins);
+    g_free (histogram);
+}
+
+void
+ufo_histogram_clear (UfoHistogram *histogram)
+{
+    memset (histogram->bins, 0, histogram->n_bins * sizeof (guint64));
+    histogram->lower = 0.0;
+    histogram->width = 0.0;
+    histogram->min = G_MAXFLOAT;
+    histogram->max = -G_MAXFLOAT;
+    histogram->total = 0;
+}
+
+static void
+grow (UfoHistogram *histogram, gfloat min, gfloat max)
+{
+    const guint half = histogram->n_bins / 2;
+    guint64 *bins = histogram->bins;
+
+    while (min < histogram->lower ||
+           max >= histogram->lower + histogram->width * histogram->n_bins) {
+        /* Extend towards the side that does not fit, preferring the top */
+        if (max >= histogram->lower + histogram->width * histogram->n_bins) {
+            for (guint i = 0; i < half; i++)
+                bins[i] = bins[2 * i] + bins[2 * i + 1];
+
+            memset (bins + half, 0, half * sizeof (guint64));
+        }
+        else {
+            for (guint i = histogram->n_bins - 1; i >= half; i--)
+                bins[i] = bins[2 * (i - half)] + bins[2 * (i - half) + 1];
+
+            memset (bins, 0, half * sizeof (guint64));
+            histogram->lower -= histogram->width * histogram->n_bins;
+        }
+
+        histogram->width *= 2.0;
+    }
+}
+
+void
+ufo_histogram_add (UfoHistogram *histogram,
+                   const gfloat *data,
+                   gsize n_elements)
+{
+    gfloat min = G_MAXFLOAT;
+    gfloat max = -G_MAXFLOAT;
+    gdouble lower;
+    gdouble scale;
+    guint last;
+
+    /* NaN and infinite values carry no information about the limits */
+    for (gsize i = 0; i < n_elements; i++) {
+        if (isfinite (data[i])) {
+            min = MIN (min, data[i]);
+            max = MAX (max, data[i]);
+        }
+    }
+
+    if (min > max)
+        return;
+
+    if (histogram->width == 0.0) {
+        histogram->lower = min;
+        histogram->width = ((gdouble) max - min) / histogram->n_bins;
+
+        /* Constant data still needs a range that max falls into */
+        if (histogram->width == 0.0)
+            histogram->width = MAX (fabs (min), 1.0) * 1e-6;
+
+        histogram->width *= 1.0 + 1e-6;
+    }
+
+    grow (histogram, min, max);
+    histogram->min = MIN (histogram->min, min);
+    histogram->max = MAX (histogram->max, max);
+
+    lower = histogram->lower;
+    scale = 1.0 / histogram->width;
+    last = histogram->n_bins - 1;
+
+    for (gsize i = 0; i < n_elements; i++) {
+        if (isfinite (data[i])) {
+            guint index = (guint) ((data[i] - lower) * scale);
+            histogram->bins[MIN (index, last)]++;
+            histogram->total++;
+        }
+    }
+}
+
+/**
+ * ufo_histogram_get_percentile:
+ * @histogram: A #UfoHistogram
+ * @percentile: Percentile between 0 and 100
+ *
+ * Returns: The value below which @percentile percent of the values fall,
+ * linearly interpolated within a bin. 0 and 100 return the exact minimum and
+ * maximum.
+ */
+gfloat
+ufo_histogram_get_percentile (UfoHistogram *histogram,
+                              gdouble percentile)
+{
+    gdouble target;
+    guint64 count = 0;
+
+    if (histogram->total == 0)
+        return 0.0f;
+
+    if (percentile <= 0.0)
+        return histogram->min;
+
+    if (percentile >= 100.0)
+        return histogram->max;
+
+    target = percentile / 100.0 * histogram->total;
+
+    for (guint i = 0; i < histogram->n_bins; i++) {
+        if (count + histogram->bins[i] >= target) {
+            gdouble fraction = (target - count) / histogram->bins[i];
+            gdouble value = histogram->lower + (i + fraction) * histogram->width;
+
+            return (gfloat) CLAMP (value, histogram->min, histogram->max);
+        }
+
+        count += histogram->bins[i];
+    }
+
+    return histogram->max;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2011-2015 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UFO_HISTOGRAM_H
+#define UFO_HISTOGRAM_H
+
+#include <glib.h>
+
+/*
+ * Histogram over a stream of values whose range is not known in advance. The
+ * range doubles whenever new values fall outside of it, merging neighbouring
+ * bins, so the bin width is at most twice the range seen so far divided by
+ * the number of bins.
+ */
+typedef struct {
+    guint64 *bins;
+    guint    n_bins;
+    gdouble  lower;
+    gdouble  width;
+    gfloat   min;
+    gfloat   max;
+    guint64  total;
+} UfoHistogram;
+
+UfoHistogram    *ufo_histogram_new              (guint           n_bins);
+void             ufo_histogram_free             (UfoHistogram   *histogram);
+void             ufo_histogram_clear            (UfoHistogram   *histogram);
+void             ufo_histogram_add              (UfoHistogram   *histogram,
+                                                 const gfloat   *data,
+                                                 gsize           n_elements);
+gfloat           ufo_histogram_get_percentile   (UfoHistogram   *histogram,
+                                                 gdouble         percentile);
+
+#endif
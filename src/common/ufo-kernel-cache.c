@@ -0,0 +1,291 @@
+/*
+ * Copyright (C) 2011-2019 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "ufo-kernel-cache.h"
+
+/*
+ * Program binaries are stored per device under the user cache directory. The
+ * file name is a hash of everything that influences the binary: the source,
+ * the build options and the identity of device, driver and platform. Changing
+ * any of them simply results in a different file, stale entries are never
+ * read again.
+ */
+
+static void
+checksum_update_device_info (GChecksum *checksum, cl_device_id device, cl_device_info param)
+{
+    gchar *value;
+    gsize size;
+
+    if (clGetDeviceInfo (device, param, 0, NULL, &size) != CL_SUCCESS)
+        return;
+
+    value = g_malloc0 (size + 1);
+
+    if (clGetDeviceInfo (device, param, size, value, NULL) == CL_SUCCESS)
+        g_checksum_update (checksum, (const guchar *) value, size);
+
+    g_free (value);
+}
+
+static void
+checksum_update_platform_info (GChecksum *checksum, cl_platform_id platform, cl_platform_info param)
+{
+    gchar *value;
+    gsize size;
+
+    if (clGetPlatformInfo (platform, param, 0, NULL, &size) != CL_SUCCESS)
+        return;
+
+    value = g_malloc0 (size + 1);
+
+    if (clGetPlatformInfo (platform, param, size, value, NULL) == CL_SUCCESS)
+        g_checksum_update (checksum, (const guchar *) value, size);
+
+    g_free (value);
+}
+
+static gchar *
+get_cache_filename (const gchar *source, const gchar *kernel_name, const gchar *options, cl_device_id device)
+{
+    GChecksum *checksum;
+    cl_platform_id platform;
+    gchar *basename;
+    gchar *filename;
+
+    checksum = g_checksum_new (G_CHECKSUM_SHA256);
+    g_checksum_update (checksum, (const guchar *) source, -1);
+    g_checksum_update (checksum, (const guchar *) "", 1);
+    g_checksum_update (checksum, (const guchar *) kernel_name, -1);
+    g_checksum_update (checksum, (const guchar *) "", 1);
+
+    if (options != NULL)
+        g_checksum_update (checksum, (const guchar *) options, -1);
+
+    g_checksum_update (checksum, (const guchar *) "", 1);
+    checksum_update_device_info (checksum, device, CL_DEVICE_NAME);
+    checksum_update_device_info (checksum, device, CL_DEVICE_VENDOR);
+    checksum_update_device_info (checksum, device, CL_DEVICE_VERSION);
+    checksum_update_device_info (checksum, device, CL_DRIVER_VERSION);
+
+    if (clGetDeviceInfo (device, CL_DEVICE_PLATFORM, sizeof (cl_platform_id), &platform, NULL) == CL_SUCCESS) {
+        checksum_update_platform_info (checksum, platform, CL_PLATFORM_NAME);
+        checksum_update_platform_info (checksum, platform, CL_PLATFORM_VERSION);
+    }
+
+    basename = g_strconcat (g_checksum_get_string (checksum), ".bin", NULL);
+    filename = g_build_filename (g_get_user_cache_dir (), "ufo", "kernels", basename, NULL);
+    g_checksum_free (checksum);
+    g_free (basename);
+
+    return filename;
+}
+
+static cl_device_id *
+get_context_devices (cl_context context, cl_uint *num_devices)
+{
+    cl_device_id *devices;
+
+    if (clGetContextInfo (context, CL_CONTEXT_NUM_DEVICES, sizeof (cl_uint), num_devices, NULL) != CL_SUCCESS ||
+        *num_devices == 0)
+        return NULL;
+
+    devices = g_new0 (cl_device_id, *num_devices);
+
+    if (clGetContextInfo (context, CL_CONTEXT_DEVICES, *num_devices * sizeof (cl_device_id), devices, NULL) != CL_SUCCESS) {
+        g_free (devices);
+        return NULL;
+    }
+
+    return devices;
+}
+
+static cl_kernel
+load_kernel (cl_context context, cl_device_id *devices, cl_uint num_devices,
+             gchar **filenames, const gchar *kernel_name, const gchar *options)
+{
+    guchar **binaries;
+    gsize *sizes;
+    cl_program program = NULL;
+    cl_kernel kernel = NULL;
+    cl_int errcode = CL_SUCCESS;
+    gboolean complete = TRUE;
+
+    binaries = g_new0 (guchar *, num_devices);
+    sizes = g_new0 (gsize, num_devices);
+
+    for (cl_uint i = 0; i < num_devices && complete; i++)
+        complete = g_file_get_contents (filenames[i], (gchar **) &binaries[i], &sizes[i], NULL);
+
+    if (complete) {
+        program = clCreateProgramWithBinary (context, num_devices, devices, sizes,
+                                             (const guchar **) binaries, NULL, &errcode);
+    }
+
+    /* Binaries must still be built, which is cheap compared to compiling */
+    if (program != NULL && errcode == CL_SUCCESS &&
+        clBuildProgram (program, num_devices, devices, options, NULL, NULL) == CL_SUCCESS) {
+        kernel = clCreateKernel (program, kernel_name, &errcode);
+
+        if (errcode != CL_SUCCESS)
+            kernel = NULL;
+    }
+
+    if (program != NULL)
+        clReleaseProgram (program);
+
+    for (cl_uint i = 0; i < num_devices; i++)
+        g_free (binaries[i]);
+
+    g_free (binaries);
+    g_free (sizes);
+
+    return kernel;
+}
+
+static void
+store_kernel (cl_kernel kernel, cl_device_id *devices, cl_uint num_devices, gchar **filenames)
+{
+    cl_program program;
+    cl_device_id *program_devices;
+    cl_uint num_program_devices;
+    gsize *sizes;
+    guchar **binaries;
+    gchar *dirname;
+
+    if (clGetKernelInfo (kernel, CL_KERNEL_PROGRAM, sizeof (cl_program), &program, NULL) != CL_SUCCESS ||
+        clGetProgramInfo (program, CL_PROGRAM_NUM_DEVICES, sizeof (cl_uint), &num_program_devices, NULL) != CL_SUCCESS)
+        return;
+
+    program_devices = g_new0 (cl_device_id, num_program_devices);
+    sizes = g_new0 (gsize, num_program_devices);
+    binaries = g_new0 (guchar *, num_program_devices);
+
+    if (clGetProgramInfo (program, CL_PROGRAM_DEVICES, num_program_devices * sizeof (cl_device_id), program_devices, NULL) != CL_SUCCESS ||
+        clGetProgramInfo (program, CL_PROGRAM_BINARY_SIZES, num_program_devices * sizeof (gsize), sizes, NULL) != CL_SUCCESS)
+        goto cleanup;
+
+    for (cl_uint i = 0; i < num_program_devices; i++)
+        binaries[i] = g_malloc (sizes[i]);
+
+    if (clGetProgramInfo (program, CL_PROGRAM_BINARIES, num_program_devices * sizeof (guchar *), binaries, NULL) != CL_SUCCESS)
+        goto cleanup;
+
+    dirname = g_path_get_dirname (filenames[0]);
+
+    if (g_mkdir_with_parents (dirname, 0755)) {
+        g_log ("gbp", G_LOG_LEVEL_DEBUG, "Could not create kernel cache `%s'", dirname);
+        g_free (dirname);
+        goto cleanup;
+    }
+
+    g_free (dirname);
+
+    /* Binaries are returned in program device order, files are in context order */
+    for (cl_uint i = 0; i < num_devices; i++) {
+        for (cl_uint j = 0; j < num_program_devices; j++) {
+            GError *error = NULL;
+
+            if (program_devices[j] != devices[i] || sizes[j] == 0)
+                continue;
+
+            if (!g_file_set_contents (filenames[i], (const gchar *) binaries[j], sizes[j], &error)) {
+                g_log ("gbp", G_LOG_LEVEL_DEBUG, "Could not store kernel binary: %s", error->message);
+                g_error_free (error);
+            }
+        }
+    }
+
+cleanup:
+    for (cl_uint i = 0; i < num_program_devices; i++)
+        g_free (binaries[i]);
+
+    g_free (binaries);
+    g_free (sizes);
+    g_free (program_devices);
+}
+
+/**
+ * ufo_kernel_cache_get_kernel:
+ * @resources: A #UfoResources object
+ * @source: OpenCL source code
+ * @kernel_name: Name of the kernel in @source
+ * @options: (allow-none): Compiler options
+ * @error: Location for an error or %NULL
+ *
+ * Like ufo_resources_get_kernel_from_source() but looks up the program binary
+ * of @source for all devices of the context in the user cache directory
+ * first. Freshly compiled programs are added to the cache.
+ *
+ * Returns: A kernel owned by the caller which must be released with
+ * clReleaseKernel(), or %NULL on error.
+ */
+cl_kernel
+ufo_kernel_cache_get_kernel (UfoResources *resources,
+                             const gchar *source,
+                             const gchar *kernel_name,
+                             const gchar *options,
+                             GError **error)
+{
+    cl_context context;
+    cl_device_id *devices;
+    cl_uint num_devices;
+    cl_kernel kernel;
+    gchar **filenames;
+
+    context = ufo_resources_get_context (resources);
+    devices = get_context_devices (context, &num_devices);
+
+    if (devices == NULL) {
+        kernel = ufo_resources_get_kernel_from_source (resources, source, kernel_name, options, error);
+
+        if (kernel != NULL)
+            UFO_RESOURCES_CHECK_CLERR (clRetainKernel (kernel));
+
+        return kernel;
+    }
+
+    filenames = g_new0 (gchar *, num_devices + 1);
+
+    for (cl_uint i = 0; i < num_devices; i++)
+        filenames[i] = get_cache_filename (source, kernel_name, options, devices[i]);
+
+    kernel = load_kernel (context, devices, num_devices, filenames, kernel_name, options);
+
+    if (kernel != NULL) {
+        g_log ("gbp", G_LOG_LEVEL_DEBUG, "Loaded `%s' from kernel cache `%s'", kernel_name, filenames[0]);
+    }
+    else {
+        kernel = ufo_resources_get_kernel_from_source (resources, source, kernel_name, options, error);
+
+        if (kernel != NULL) {
+            /* The resources own this kernel, the caller owns the returned reference */
+            UFO_RESOURCES_CHECK_CLERR (clRetainKernel (kernel));
+            store_kernel (kernel, devices, num_devices, filenames);
+        }
+    }
+
+    g_strfreev (filenames);
+    g_free (devices);
+
+    return kernel;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2011-2015 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define SUBTRACT_DARK   1
+#define DIVIDE_FLAT     2
+
+/*
+ * Expand integer input to float and optionally subtract a dark field and
+ * divide by the dark-subtracted flat field in the same pass. The input may be
+ * a stack of frames, each of frame_size pixels, sharing the same references.
+ */
+#define CONVERT(name, type)                                                 \
+kernel void                                                                 \
+name (global const type *input,                                             \
+      global float *output,                                                 \
+      global const float *dark,                                             \
+      global const float *flat,                                             \
+      const int correct,                                                    \
+      const uint frame_size)                                                \
+{                                                                           \
+    const size_t idx = get_global_id (0);                                   \
+    const size_t ref = idx % frame_size;                                    \
+    const float cdark = (correct & SUBTRACT_DARK) ? dark[ref] : 0.0f;       \
+    float value = ((float) input[idx]) - cdark;                             \
+                                                                            \
+    if (correct & DIVIDE_FLAT)                                              \
+        value /= flat[ref] - cdark;                                         \
+                                                                            \
+    output[idx] = value;                                                    \
+}
+
+CONVERT (convert_u8, uchar)
+CONVERT (convert_s8, char)
+CONVERT (convert_u16, ushort)
+CONVERT (convert_s16, short)
+CONVERT (convert_u32, uint)
+CONVERT (convert_s32, int)
+CONVERT (convert_f32, float)
@@ -30,3 +30,77 @@ unsplit (global float *input,
 
     output[idy * width * depth + idx * depth + idz] = input[idz * width * height + idy * width + idx];
 }
+
+/*
+ * Minimum and maximum of size elements starting at offset. Every work group
+ * writes its minimum and maximum to output[2 * group] and output[2 * group +
+ * 1], the host reduces these. The local size must be a power of two.
+ */
+kernel void
+min_max (global float *input,
+         global float *output,
+         local float *local_min,
+         local float *local_max,
+         const ulong offset,
+         const ulong size)
+{
+    size_t lid = get_local_id (0);
+    float cmin = FLT_MAX;
+    float cmax = -FLT_MAX;
+
+    for (size_t i = get_global_id (0); i < size; i += get_global_size (0)) {
+        cmin = fmin (cmin, input[offset + i]);
+        cmax = fmax (cmax, input[offset + i]);
+    }
+
+    local_min[lid] = cmin;
+    local_max[lid] = cmax;
+    barrier (CLK_LOCAL_MEM_FENCE);
+
+    for (size_t s = get_local_size (0) / 2; s > 0; s >>= 1) {
+        if (lid < s) {
+            local_min[lid] = fmin (local_min[lid], local_min[lid + s]);
+            local_max[lid] = fmax (local_max[lid], local_max[lid + s]);
+        }
+
+        barrier (CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (lid == 0) {
+        output[2 * get_group_id (0)] = local_min[0];
+        output[2 * get_group_id (0) + 1] = local_max[0];
+    }
+}
+
+/*
+ * Clamp to [lower, upper], map min to zero and narrow. A plain cast uses the
+ * whole float range as bounds, zero for min and one for scale. Values are
+ * truncated like a C cast, those outside of the output range saturate.
+ */
+kernel void
+convert_8bit (global float *input,
+              global uchar *output,
+              const ulong offset,
+              const float min,
+              const float lower,
+              const float upper,
+              const float scale)
+{
+    size_t idx = get_global_id (0);
+
+    output[idx] = convert_uchar_sat ((clamp (input[offset + idx], lower, upper) - min) * scale);
+}
+
+kernel void
+convert_16bit (global float *input,
+               global ushort *output,
+               const ulong offset,
+               const float min,
+               const float lower,
+               const float upper,
+               const float scale)
+{
+    size_t idx = get_global_id (0);
+
+    output[idx] = convert_ushort_sat ((clamp (input[offset + idx], lower, upper) - min) * scale);
+}
@@ -28,6 +28,7 @@ struct _UfoEdfReaderPrivate {
     FILE *fp;
     guint start;
     gssize size;
+    gsize width;
     gsize height;
     guint bytes_per_sample;
     gboolean big_endian;
@@ -96,41 +97,44 @@ ufo_edf_reader_data_available (UfoReader *reader)
 }
 
 static gsize
-ufo_edf_reader_read (UfoReader *reader,
-                     UfoBuffer *buffer,
-                     UfoRequisition *requisition,
-                     guint roi_y,
-                     guint roi_height,
-                     guint roi_step,
-                     guint image_step)
+read_frame (UfoEdfReaderPrivate *priv,
+            gchar *data,
+            UfoRequisition *requisition,
+            guint roi_x,
+            guint roi_x_step,
+            guint roi_y,
+            guint roi_height,
+            guint roi_step,
+            guint image_step)
 {
-    UfoEdfReaderPrivate *priv;
     gsize num_bytes;
     gsize num_read;
     gssize offset;
-    gchar *data;
+    gchar *row;
     gsize to_skip;
     guint start = 0;
 
-    priv = UFO_EDF_READER_GET_PRIVATE (reader);
-    data = (gchar *) ufo_buffer_get_host_array (buffer, NULL);
-
-    /* size of the image width in bytes */
+    /* size of the full and of the region of interest row in bytes */
+    const gsize row_size = priv->width * priv->bytes_per_sample;
     const gsize width = requisition->dims[0] * priv->bytes_per_sample;
+    const gsize span = ((requisition->dims[0] - 1) * roi_x_step + 1) * priv->bytes_per_sample;
     const guint num_rows = requisition->dims[1];
     if (priv->start) {
         start = priv->start;
         priv->start = 0;
     }
-    const gsize end_position = ftell (priv->fp) + priv->height * width;
-
-    offset = 0;
 
     /* Go to the first desired row at *start* image index */
-    fseek (priv->fp, start * priv->height * width + roi_y * width, SEEK_CUR);
+    fseek (priv->fp, start * priv->height * row_size, SEEK_CUR);
+
+    const gsize image_position = ftell (priv->fp);
+    const gsize end_position = image_position + priv->height * row_size;
+
+    offset = 0;
 
-    if (roi_step == 1) {
+    if (roi_step == 1 && width == row_size) {
         /* Read the full ROI at once if no stepping is specified */
+        fseek (priv->fp, roi_y * row_size, SEEK_CUR);
         num_bytes = width * roi_height;
         num_read = fread (data, 1, num_bytes, priv->fp);
 
@@ -138,33 +142,35 @@ ufo_edf_reader_read (UfoReader *reader,
             return 0;
     }
     else {
-        for (guint i = 0; i < num_rows - 1; i++) {
-            num_read = fread (data + offset, 1, width, priv->fp);
+        row = roi_x_step > 1 ? g_malloc (span) : NULL;
 
-            if (num_read != width)
+        for (guint i = 0; i < num_rows; i++) {
+            fseek (priv->fp, image_position + (roi_y + i * roi_step) * row_size + roi_x * priv->bytes_per_sample, SEEK_SET);
+            num_read = fread (row != NULL ? row : data + offset, 1, span, priv->fp);
+
+            if (num_read != span) {
+                g_free (row);
                 return 0;
+            }
+
+            if (row != NULL)
+                ufo_reader_copy_columns (data + offset, row, priv->bytes_per_sample, requisition->dims[0], roi_x_step);
 
             offset += width;
-            fseek (priv->fp, (roi_step - 1) * width, SEEK_CUR);
         }
 
-        /* Read the last row without moving the file pointer so that the fseek to
-         * the image end works properly */
-        num_read = fread (data + offset, 1, width, priv->fp);
-
-        if (num_read != width)
-            return 0;
+        g_free (row);
     }
 
     /* Go to the image end to be in a consistent state for the next read */
     fseek (priv->fp, end_position, SEEK_SET);
 
     /* Skip the desired number of images */
-    to_skip = MIN (image_step - 1, (priv->size - (gsize) ftell (priv->fp)) / (priv->height * width));
-    fseek (priv->fp, to_skip * priv->height * width, SEEK_CUR);
+    to_skip = MIN (image_step - 1, (priv->size - (gsize) ftell (priv->fp)) / (priv->height * row_size));
+    fseek (priv->fp, to_skip * priv->height * row_size, SEEK_CUR);
 
     if ((G_BYTE_ORDER == G_LITTLE_ENDIAN) && priv->big_endian) {
-        guint32 *conv = (guint32 *) ufo_buffer_get_host_array (buffer, NULL);
+        guint32 *conv = (guint32 *) data;
         guint n_pixels = requisition->dims[0] * requisition->dims[1];
 
         for (guint i = 0; i < n_pixels; i++)
@@ -174,6 +180,39 @@ ufo_edf_reader_read (UfoReader *reader,
     return to_skip + 1;
 }
 
+static gsize
+ufo_edf_reader_read (UfoReader *reader,
+                     gpointer data,
+                     UfoRequisition *requisition,
+                     guint num_frames,
+                     guint roi_x,
+                     guint roi_width,
+                     guint roi_x_step,
+                     guint roi_y,
+                     guint roi_height,
+                     guint roi_step,
+                     guint image_step)
+{
+    UfoEdfReaderPrivate *priv;
+    gsize frame_size;
+    gsize num_read = 0;
+
+    priv = UFO_EDF_READER_GET_PRIVATE (reader);
+    frame_size = requisition->dims[0] * requisition->dims[1] * priv->bytes_per_sample;
+
+    for (guint i = 0; i < num_frames && ufo_edf_reader_data_available (reader); i++) {
+        gsize n = read_frame (priv, ((gchar *) data) + i * frame_size, requisition,
+                              roi_x, roi_x_step, roi_y, roi_height, roi_step, image_step);
+
+        if (n == 0)
+            break;
+
+        num_read += n;
+    }
+
+    return num_read;
+}
+
 static void
 ufo_edf_reader_get_depth (const gchar *value, UfoBufferDepth *depth, guint *bytes)
 {
@@ -263,7 +302,7 @@ ufo_edf_reader_get_meta (UfoReader *reader,
         value = g_strstrip (key_value[1]);
 
         if (!g_strcmp0 (key, "Dim_1")) {
-            requisition->dims[0] = (guint) atoi (value);
+            requisition->dims[0] = priv->width = atoi (value);
         }
         else if (!g_strcmp0 (key, "Dim_2")) {
             requisition->dims[1] = priv->height = atoi (value);
@@ -17,11 +17,25 @@
  * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <string.h>
+
 #include "common/hdf5.h"
+#include "common/hdf5-filters.h"
 #include "readers/ufo-reader.h"
 #include "readers/ufo-hdf5-reader.h"
 
 
+typedef enum {
+    ELEM_UNSUPPORTED,
+    ELEM_UINT8,
+    ELEM_UINT16,
+    ELEM_UINT32,
+    ELEM_INT16,
+    ELEM_INT32,
+    ELEM_FLOAT,
+    ELEM_DOUBLE
+} ElemType;
+
 struct _UfoHdf5ReaderPrivate {
     hid_t file_id;
     hid_t dataset_id;
@@ -30,8 +44,50 @@ struct _UfoHdf5ReaderPrivate {
     gint n_dims;
     hsize_t dims[3];
     guint current;
+
+    guint batch;
+    gboolean swmr;
+    guint swmr_timeout;
+
+    gfloat *staging;
+    gsize frame_size;
+    guint num_staged;
+    guint next_staged;
+
+    guint decompress_threads;
+    GThreadPool *pool;
+    UfoHdf5Pipeline pipeline;
+    gboolean direct_chunks;
+    ElemType elem_type;
+    gsize elem_size;
+    hsize_t chunk[3];
+    guint8 fill_value[8];
+    gboolean zero_fill;
+
+    /* decoded chunks of one chunk layer covering the vertical ROI */
+    guint8 *slab;
+    gsize slab_capacity;
+    hsize_t slab_layer;
+    hsize_t slab_frames;
+    hsize_t slab_x;
+    hsize_t slab_width;
+    hsize_t slab_y;
+    hsize_t slab_height;
+
+    GMutex lock;
+    GCond finished;
+    guint pending;
+    gboolean failed;
 };
 
+typedef struct {
+    UfoHdf5ReaderPrivate *priv;
+    guint8 *data;
+    hsize_t size;
+    guint32 filter_mask;
+    hsize_t offset[3];
+} ChunkJob;
+
 static void ufo_reader_interface_init (UfoReaderIface *iface);
 
 G_DEFINE_TYPE_WITH_CODE (UfoHdf5Reader, ufo_hdf5_reader, G_TYPE_OBJECT,
@@ -40,12 +96,33 @@ G_DEFINE_TYPE_WITH_CODE (UfoHdf5Reader, ufo_hdf5_reader, G_TYPE_OBJECT,
 
 #define UFO_HDF5_READER_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), UFO_TYPE_HDF5_READER, UfoHdf5ReaderPrivate))
 
+enum {
+    PROP_0,
+    PROP_BATCH,
+    PROP_SWMR,
+    PROP_SWMR_TIMEOUT,
+    PROP_DECOMPRESS_THREADS,
+    N_PROPERTIES
+};
+
+static GParamSpec *properties[N_PROPERTIES] = { NULL, };
+
 UfoHdf5Reader *
 ufo_hdf5_reader_new (void)
 {
     return g_object_new (UFO_TYPE_HDF5_READER, NULL);
 }
 
+gboolean
+ufo_hdf5_reader_supports_swmr (void)
+{
+#if H5_VERSION_GE(1, 10, 0)
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
 static gboolean
 ufo_hdf5_reader_can_open (UfoReader *reader,
                           const gchar *filename)
@@ -53,6 +130,328 @@ ufo_hdf5_reader_can_open (UfoReader *reader,
     return ufo_hdf5_can_open (filename);
 }
 
+static gsize
+next_prime (gsize n)
+{
+    for (;; n++) {
+        gboolean prime = n > 1;
+
+        for (gsize i = 2; prime && i * i <= n; i++)
+            prime = n % i != 0;
+
+        if (prime)
+            return n;
+    }
+}
+
+static hid_t
+create_access_plist (UfoHdf5ReaderPrivate *priv)
+{
+    hid_t dcpl_id;
+    hid_t dapl_id;
+    hid_t type_id;
+    hsize_t chunk[3];
+    gsize num_chunks;
+    gsize chunk_size;
+
+    dapl_id = H5Pcreate (H5P_DATASET_ACCESS);
+    dcpl_id = H5Dget_create_plist (priv->dataset_id);
+
+    if (H5Pget_layout (dcpl_id) != H5D_CHUNKED || priv->n_dims != 3) {
+        H5Pclose (dcpl_id);
+        return dapl_id;
+    }
+
+    H5Pget_chunk (dcpl_id, 3, chunk);
+    type_id = H5Dget_type (priv->dataset_id);
+    chunk_size = H5Tget_size (type_id) * chunk[0] * chunk[1] * chunk[2];
+
+    /*
+     * Keep all chunks touched by one batch of frames, plus one more layer
+     * because a batch does not have to start at a chunk boundary.
+     */
+    num_chunks = ((MAX (priv->batch, 1) - 1) / chunk[0] + 2) *
+                 ((priv->dims[1] + chunk[1] - 1) / chunk[1]) *
+                 ((priv->dims[2] + chunk[2] - 1) / chunk[2]);
+
+    /* HDF5 recommends a prime number of slots about 100 times the number of chunks */
+    H5Pset_chunk_cache (dapl_id, next_prime (num_chunks * 100), num_chunks * chunk_size, 1.0);
+
+    H5Tclose (type_id);
+    H5Pclose (dcpl_id);
+    return dapl_id;
+}
+
+static ElemType
+get_elem_type (hid_t type_id)
+{
+    struct {
+        hid_t native;
+        ElemType type;
+    } map[] = {
+        { H5T_NATIVE_UINT8,  ELEM_UINT8 },
+        { H5T_NATIVE_UINT16, ELEM_UINT16 },
+        { H5T_NATIVE_UINT32, ELEM_UINT32 },
+        { H5T_NATIVE_INT16,  ELEM_INT16 },
+        { H5T_NATIVE_INT32,  ELEM_INT32 },
+        { H5T_NATIVE_FLOAT,  ELEM_FLOAT },
+        { H5T_NATIVE_DOUBLE, ELEM_DOUBLE },
+    };
+
+    /* H5Tequal also compares byte order, so swapped data is left to HDF5 */
+    for (guint i = 0; i < G_N_ELEMENTS (map); i++) {
+        if (H5Tequal (type_id, map[i].native) > 0)
+            return map[i].type;
+    }
+
+    return ELEM_UNSUPPORTED;
+}
+
+static void
+convert_row (const guint8 *src, gfloat *dst, gsize n, gsize step, ElemType type)
+{
+    switch (type) {
+        case ELEM_UINT8:
+            for (gsize i = 0; i < n; i++)
+                dst[i] = (gfloat) src[i * step];
+            break;
+        case ELEM_UINT16:
+            for (gsize i = 0; i < n; i++)
+                dst[i] = (gfloat) ((const guint16 *) src)[i * step];
+            break;
+        case ELEM_UINT32:
+            for (gsize i = 0; i < n; i++)
+                dst[i] = (gfloat) ((const guint32 *) src)[i * step];
+            break;
+        case ELEM_INT16:
+            for (gsize i = 0; i < n; i++)
+                dst[i] = (gfloat) ((const gint16 *) src)[i * step];
+            break;
+        case ELEM_INT32:
+            for (gsize i = 0; i < n; i++)
+                dst[i] = (gfloat) ((const gint32 *) src)[i * step];
+            break;
+        case ELEM_FLOAT:
+            if (step == 1)
+                memcpy (dst, src, n * sizeof (gfloat));
+            else
+                for (gsize i = 0; i < n; i++)
+                    dst[i] = ((const gfloat *) src)[i * step];
+            break;
+        case ELEM_DOUBLE:
+            for (gsize i = 0; i < n; i++)
+                dst[i] = (gfloat) ((const gdouble *) src)[i * step];
+            break;
+        case ELEM_UNSUPPORTED:
+            break;
+    }
+}
+
+static void
+decode_chunk (ChunkJob *job, UfoHdf5ReaderPrivate *priv)
+{
+    const hsize_t *chunk = priv->chunk;
+    const gsize elem_size = priv->elem_size;
+    const gsize chunk_size = chunk[0] * chunk[1] * chunk[2] * elem_size;
+    guint8 *decoded;
+    hsize_t nz, ny, nx;
+    gboolean success = TRUE;
+
+    decoded = g_malloc0 (chunk_size);
+
+    /* Chunks that were never written read as the fill value like with H5Dread */
+    if (job->size > 0)
+        success = ufo_hdf5_pipeline_decode (&priv->pipeline, job->filter_mask, job->data, job->size, decoded, chunk_size);
+    else if (!priv->zero_fill)
+        for (gsize i = 0; i < chunk_size; i += elem_size)
+            memcpy (decoded + i, priv->fill_value, elem_size);
+
+    if (success) {
+        /* chunks at the border are padded, only copy what is inside the data set */
+        nz = MIN (chunk[0], priv->slab_frames);
+        ny = MIN (chunk[1], priv->dims[1] - job->offset[1]);
+        nx = MIN (chunk[2], priv->dims[2] - job->offset[2]);
+
+        for (hsize_t z = 0; z < nz; z++) {
+            for (hsize_t y = 0; y < ny; y++) {
+                gsize dst_offset = (z * priv->slab_height + job->offset[1] - priv->slab_y + y) * priv->slab_width +
+                                   job->offset[2] - priv->slab_x;
+                gsize src_offset = (z * chunk[1] + y) * chunk[2];
+
+                memcpy (priv->slab + dst_offset * elem_size, decoded + src_offset * elem_size, nx * elem_size);
+            }
+        }
+    }
+
+    g_free (decoded);
+    g_free (job->data);
+    g_free (job);
+
+    g_mutex_lock (&priv->lock);
+
+    if (!success)
+        priv->failed = TRUE;
+
+    if (--priv->pending == 0)
+        g_cond_signal (&priv->finished);
+
+    g_mutex_unlock (&priv->lock);
+}
+
+static void
+setup_direct_chunks (UfoHdf5ReaderPrivate *priv)
+{
+    priv->direct_chunks = FALSE;
+    priv->slab_layer = G_MAXUINT64;
+
+#if H5_VERSION_GE(1, 10, 3)
+    hid_t dcpl_id;
+    hid_t type_id;
+
+    if (priv->decompress_threads == 0 || priv->n_dims != 3)
+        return;
+
+    dcpl_id = H5Dget_create_plist (priv->dataset_id);
+    type_id = H5Dget_type (priv->dataset_id);
+    priv->elem_type = get_elem_type (type_id);
+    priv->elem_size = H5Tget_size (type_id);
+
+    if (H5Pget_layout (dcpl_id) == H5D_CHUNKED && priv->elem_type != ELEM_UNSUPPORTED) {
+        H5Pget_chunk (dcpl_id, 3, priv->chunk);
+        priv->direct_chunks = ufo_hdf5_pipeline_init (&priv->pipeline, dcpl_id, priv->elem_size);
+        memset (priv->fill_value, 0, sizeof (priv->fill_value));
+
+        /* The element type is native, so the value needs no conversion */
+        if (H5Pget_fill_value (dcpl_id, type_id, priv->fill_value) < 0)
+            priv->direct_chunks = FALSE;
+
+        priv->zero_fill = TRUE;
+
+        for (gsize i = 0; i < priv->elem_size; i++)
+            priv->zero_fill = priv->zero_fill && priv->fill_value[i] == 0;
+    }
+
+    if (priv->direct_chunks && priv->pool == NULL)
+        priv->pool = g_thread_pool_new ((GFunc) decode_chunk, priv, priv->decompress_threads, TRUE, NULL);
+
+    H5Tclose (type_id);
+    H5Pclose (dcpl_id);
+#endif
+}
+
+static gboolean
+decode_layer (UfoHdf5ReaderPrivate *priv,
+              hsize_t layer,
+              guint roi_x,
+              guint roi_width,
+              guint roi_y,
+              guint roi_height)
+{
+#if H5_VERSION_GE(1, 10, 3)
+    const hsize_t *chunk = priv->chunk;
+    hsize_t x_end;
+    hsize_t y_end;
+    gsize size;
+    gboolean read_failed = FALSE;
+
+    priv->slab_x = roi_x / chunk[2] * chunk[2];
+    x_end = MIN (priv->dims[2], (roi_x + roi_width + chunk[2] - 1) / chunk[2] * chunk[2]);
+    priv->slab_width = x_end - priv->slab_x;
+    priv->slab_y = roi_y / chunk[1] * chunk[1];
+    y_end = MIN (priv->dims[1], (roi_y + roi_height + chunk[1] - 1) / chunk[1] * chunk[1]);
+    priv->slab_height = y_end - priv->slab_y;
+    priv->slab_frames = MIN (chunk[0], priv->dims[0] - layer * chunk[0]);
+    size = chunk[0] * priv->slab_height * priv->slab_width * priv->elem_size;
+
+    if (size > priv->slab_capacity) {
+        g_free (priv->slab);
+        priv->slab = g_malloc (size);
+        priv->slab_capacity = size;
+    }
+
+    priv->failed = FALSE;
+    priv->pending = 0;
+
+    /* HDF5 is not thread-safe, so raw chunks are read here and only decoded in parallel */
+    for (hsize_t y = priv->slab_y; y < y_end && !read_failed; y += chunk[1]) {
+        for (hsize_t x = priv->slab_x; x < x_end && !read_failed; x += chunk[2]) {
+            ChunkJob *job;
+
+            job = g_new0 (ChunkJob, 1);
+            job->offset[0] = layer * chunk[0];
+            job->offset[1] = y;
+            job->offset[2] = x;
+
+            if (H5Dget_chunk_storage_size (priv->dataset_id, job->offset, &job->size) < 0)
+                job->size = 0;
+
+            if (job->size > 0) {
+                job->data = g_malloc (job->size);
+
+                if (H5Dread_chunk (priv->dataset_id, H5P_DEFAULT, job->offset, &job->filter_mask, job->data) < 0) {
+                    g_free (job->data);
+                    g_free (job);
+                    read_failed = TRUE;
+                    continue;
+                }
+            }
+
+            g_mutex_lock (&priv->lock);
+            priv->pending++;
+            g_mutex_unlock (&priv->lock);
+            g_thread_pool_push (priv->pool, job, NULL);
+        }
+    }
+
+    g_mutex_lock (&priv->lock);
+
+    while (priv->pending > 0)
+        g_cond_wait (&priv->finished, &priv->lock);
+
+    read_failed = read_failed || priv->failed;
+    g_mutex_unlock (&priv->lock);
+
+    priv->slab_layer = read_failed ? G_MAXUINT64 : layer;
+    return !read_failed;
+#else
+    return FALSE;
+#endif
+}
+
+static gboolean
+read_direct_chunks (UfoHdf5ReaderPrivate *priv,
+                    gfloat *data,
+                    gsize width,
+                    guint roi_x,
+                    guint roi_width,
+                    guint roi_x_step,
+                    guint roi_y,
+                    guint roi_height,
+                    guint roi_step)
+{
+    hsize_t layer;
+    hsize_t z;
+    const guint8 *frame;
+
+    layer = priv->current / priv->chunk[0];
+    z = priv->current - layer * priv->chunk[0];
+
+    /* A growing SWMR data set may have had only part of this layer before */
+    if (layer != priv->slab_layer || z >= priv->slab_frames) {
+        if (!decode_layer (priv, layer, roi_x, roi_width, roi_y, roi_height))
+            return FALSE;
+    }
+
+    frame = priv->slab + (z * priv->slab_height * priv->slab_width + roi_x - priv->slab_x) * priv->elem_size;
+
+    for (guint y = roi_y; y < roi_y + roi_height; y += roi_step) {
+        convert_row (frame + (y - priv->slab_y) * priv->slab_width * priv->elem_size, data, width, roi_x_step, priv->elem_type);
+        data += width;
+    }
+
+    return TRUE;
+}
+
 static gboolean
 ufo_hdf5_reader_open (UfoReader *reader,
                       const gchar *filename,
@@ -63,6 +462,8 @@ ufo_hdf5_reader_open (UfoReader *reader,
     gchar *h5_filename;
     gchar *h5_dataset;
     gchar **components;
+    hid_t dapl_id;
+    unsigned flags;
 
     priv = UFO_HDF5_READER_GET_PRIVATE (reader);
     components = g_strsplit (filename, ":", 2);
@@ -75,8 +476,30 @@ ufo_hdf5_reader_open (UfoReader *reader,
 
     h5_filename = components[0];
     h5_dataset = components[1];
+    flags = H5F_ACC_RDONLY;
+
+    if (priv->swmr) {
+        if (!ufo_hdf5_reader_supports_swmr ()) {
+            g_set_error_literal (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                                 "hdf5: SWMR requires HDF5 1.10");
+            g_strfreev (components);
+            return FALSE;
+        }
+
+#if H5_VERSION_GE(1, 10, 0)
+        flags |= H5F_ACC_SWMR_READ;
+#endif
+    }
+
+    priv->file_id = H5Fopen (h5_filename, flags, H5P_DEFAULT);
+
+    if (priv->file_id < 0) {
+        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                     "hdf5: cannot open `%s'", h5_filename);
+        g_strfreev (components);
+        return FALSE;
+    }
 
-    priv->file_id = H5Fopen (h5_filename, H5F_ACC_RDWR, H5P_DEFAULT);
     priv->dataset_id = H5Dopen (priv->file_id, h5_dataset, H5P_DEFAULT);
     priv->src_dataspace_id = H5Dget_space (priv->dataset_id);
     priv->n_dims = H5Sget_simple_extent_ndims (priv->src_dataspace_id);
@@ -89,7 +512,19 @@ ufo_hdf5_reader_open (UfoReader *reader,
 
     H5Sget_simple_extent_dims (priv->src_dataspace_id, priv->dims, NULL);
 
+    /* The chunk cache can only be configured when opening the data set */
+    dapl_id = create_access_plist (priv);
+    H5Sclose (priv->src_dataspace_id);
+    H5Dclose (priv->dataset_id);
+    priv->dataset_id = H5Dopen (priv->file_id, h5_dataset, dapl_id);
+    priv->src_dataspace_id = H5Dget_space (priv->dataset_id);
+    H5Pclose (dapl_id);
+
+    setup_direct_chunks (priv);
+
     priv->current = start;
+    priv->num_staged = 0;
+    priv->next_staged = 0;
     g_strfreev (components);
     return TRUE;
 }
@@ -104,49 +539,162 @@ ufo_hdf5_reader_close (UfoReader *reader)
     H5Sclose (priv->src_dataspace_id);
     H5Dclose (priv->dataset_id);
     H5Fclose (priv->file_id);
+
+    g_free (priv->staging);
+    priv->staging = NULL;
+}
+
+static gboolean
+refresh_extent (UfoHdf5ReaderPrivate *priv)
+{
+#if H5_VERSION_GE(1, 10, 0)
+    hsize_t old_length = priv->dims[0];
+
+    H5Drefresh (priv->dataset_id);
+    H5Sclose (priv->src_dataspace_id);
+    priv->src_dataspace_id = H5Dget_space (priv->dataset_id);
+    H5Sget_simple_extent_dims (priv->src_dataspace_id, priv->dims, NULL);
+    return priv->dims[0] > old_length;
+#else
+    return FALSE;
+#endif
 }
 
 static gboolean
 ufo_hdf5_reader_data_available (UfoReader *reader)
 {
     UfoHdf5ReaderPrivate *priv;
+    gint64 deadline;
 
     priv = UFO_HDF5_READER_GET_PRIVATE (reader);
 
+    if (priv->current < priv->dims[0] || !priv->swmr)
+        return priv->current < priv->dims[0];
+
+    /* The writer may still append, wait a bit for new frames to show up */
+    deadline = g_get_monotonic_time () + ((gint64) priv->swmr_timeout) * G_USEC_PER_SEC;
+
+    do {
+        if (refresh_extent (priv) && priv->current < priv->dims[0])
+            return TRUE;
+
+        g_usleep (G_USEC_PER_SEC / 10);
+    } while (g_get_monotonic_time () < deadline);
+
     return priv->current < priv->dims[0];
 }
 
+static void
+read_frames (UfoHdf5ReaderPrivate *priv,
+             gpointer data,
+             guint num_frames,
+             gsize width,
+             guint roi_x,
+             guint roi_x_step,
+             guint roi_y,
+             guint roi_height,
+             guint roi_step,
+             guint image_step)
+{
+    hid_t dst_dataspace_id;
+    hsize_t dst_dims[3];
+    hsize_t offset[3] = { priv->current, roi_y, roi_x };
+    hsize_t stride[3] = { image_step, roi_step, roi_x_step };
+    hsize_t count[3] = { num_frames, (roi_height - 1) / roi_step + 1, width };
+
+    dst_dims[0] = count[0];
+    dst_dims[1] = count[1];
+    dst_dims[2] = count[2];
+    dst_dataspace_id = H5Screate_simple (3, dst_dims, NULL);
+
+    H5Sselect_hyperslab (priv->src_dataspace_id, H5S_SELECT_SET, offset, stride, count, NULL);
+    H5Dread (priv->dataset_id, H5T_NATIVE_FLOAT, dst_dataspace_id, priv->src_dataspace_id, H5P_DEFAULT, data);
+    H5Sclose (dst_dataspace_id);
+}
+
+static gsize
+read_frame (UfoHdf5ReaderPrivate *priv,
+            gfloat *data,
+            UfoRequisition *requisition,
+            guint roi_x,
+            guint roi_width,
+            guint roi_x_step,
+            guint roi_y,
+            guint roi_height,
+            guint roi_step,
+            guint image_step)
+{
+    gsize num_read = 0;
+
+    if (priv->direct_chunks &&
+        !read_direct_chunks (priv, data, requisition->dims[0], roi_x, roi_width, roi_x_step,
+                             roi_y, roi_height, roi_step)) {
+        g_warning ("hdf5: could not decode chunks, falling back to H5Dread");
+        priv->direct_chunks = FALSE;
+    }
+
+    if (!priv->direct_chunks) {
+        if (priv->batch > 1) {
+            if (priv->next_staged == priv->num_staged) {
+                /* Read the next frames with a single hyperslab selection */
+                priv->frame_size = requisition->dims[0] * requisition->dims[1];
+                priv->num_staged = MIN (priv->batch, (priv->dims[0] - priv->current - 1) / image_step + 1);
+                priv->next_staged = 0;
+
+                if (priv->staging == NULL)
+                    priv->staging = g_new0 (gfloat, priv->batch * priv->frame_size);
+
+                read_frames (priv, priv->staging, priv->num_staged, requisition->dims[0], roi_x, roi_x_step, roi_y, roi_height, roi_step, image_step);
+            }
+
+            memcpy (data, priv->staging + priv->next_staged * priv->frame_size, priv->frame_size * sizeof (gfloat));
+            priv->next_staged++;
+        }
+        else {
+            read_frames (priv, data, 1, requisition->dims[0], roi_x, roi_x_step, roi_y, roi_height, roi_step, image_step);
+        }
+    }
+
+    num_read = MIN (image_step, priv->dims[0] - priv->current);
+    priv->current += num_read;
+
+    return num_read;
+}
+
 static gsize
 ufo_hdf5_reader_read (UfoReader *reader,
-                      UfoBuffer *buffer,
+                      gpointer data,
                       UfoRequisition *requisition,
+                      guint num_frames,
+                      guint roi_x,
+                      guint roi_width,
+                      guint roi_x_step,
                       guint roi_y,
                       guint roi_height,
                       guint roi_step,
                       guint image_step)
 {
     UfoHdf5ReaderPrivate *priv;
-    gpointer data;
-    hid_t dst_dataspace_id;
-    hsize_t dst_dims[2];
+    gsize frame_size;
     gsize num_read = 0;
 
     priv = UFO_HDF5_READER_GET_PRIVATE (reader);
-    data = ufo_buffer_get_host_array (buffer, NULL);
 
-    hsize_t offset[3] = { priv->current, roi_y, 0 };
-    hsize_t count[3] = { 1, roi_height, requisition->dims[0] };
+    if (!priv->direct_chunks && num_frames > 1 && priv->next_staged == priv->num_staged) {
+        /* The caller wants a stack, read it with a single hyperslab selection */
+        guint n = MIN (num_frames, (priv->dims[0] - priv->current - 1) / image_step + 1);
 
-    dst_dims[0] = roi_height;
-    dst_dims[1] = requisition->dims[0];
-    dst_dataspace_id = H5Screate_simple (2, dst_dims, NULL);
+        read_frames (priv, data, n, requisition->dims[0], roi_x, roi_x_step, roi_y, roi_height, roi_step, image_step);
+        num_read = MIN ((hsize_t) n * image_step, priv->dims[0] - priv->current);
+        priv->current += num_read;
+        return num_read;
+    }
 
-    H5Sselect_hyperslab (priv->src_dataspace_id, H5S_SELECT_SET, offset, NULL, count, NULL);
-    H5Dread (priv->dataset_id, H5T_NATIVE_FLOAT, dst_dataspace_id, priv->src_dataspace_id, H5P_DEFAULT, data);
-    H5Sclose (dst_dataspace_id);
+    frame_size = requisition->dims[0] * requisition->dims[1];
 
-    num_read = MIN (image_step, priv->dims[0] - priv->current);
-    priv->current += num_read;
+    for (guint i = 0; i < num_frames && priv->current < priv->dims[0]; i++)
+        num_read += read_frame (priv, ((gfloat *) data) + i * frame_size, requisition,
+                                roi_x, roi_width, roi_x_step, roi_y, roi_height, roi_step, image_step);
 
     return num_read;
 }
@@ -181,14 +729,139 @@ ufo_reader_interface_init (UfoReaderIface *iface)
     iface->data_available = ufo_hdf5_reader_data_available;
 }
 
+static void
+ufo_hdf5_reader_set_property (GObject *object,
+                              guint property_id,
+                              const GValue *value,
+                              GParamSpec *pspec)
+{
+    UfoHdf5ReaderPrivate *priv = UFO_HDF5_READER_GET_PRIVATE (object);
+
+    switch (property_id) {
+        case PROP_BATCH:
+            priv->batch = g_value_get_uint (value);
+            break;
+        case PROP_SWMR:
+            priv->swmr = g_value_get_boolean (value);
+            break;
+        case PROP_SWMR_TIMEOUT:
+            priv->swmr_timeout = g_value_get_uint (value);
+            break;
+        case PROP_DECOMPRESS_THREADS:
+            priv->decompress_threads = g_value_get_uint (value);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+ufo_hdf5_reader_get_property (GObject *object,
+                              guint property_id,
+                              GValue *value,
+                              GParamSpec *pspec)
+{
+    UfoHdf5ReaderPrivate *priv = UFO_HDF5_READER_GET_PRIVATE (object);
+
+    switch (property_id) {
+        case PROP_BATCH:
+            g_value_set_uint (value, priv->batch);
+            break;
+        case PROP_SWMR:
+            g_value_set_boolean (value, priv->swmr);
+            break;
+        case PROP_SWMR_TIMEOUT:
+            g_value_set_uint (value, priv->swmr_timeout);
+            break;
+        case PROP_DECOMPRESS_THREADS:
+            g_value_set_uint (value, priv->decompress_threads);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+ufo_hdf5_reader_finalize (GObject *object)
+{
+    UfoHdf5ReaderPrivate *priv;
+
+    priv = UFO_HDF5_READER_GET_PRIVATE (object);
+    g_free (priv->staging);
+    g_free (priv->slab);
+
+    if (priv->pool != NULL)
+        g_thread_pool_free (priv->pool, FALSE, TRUE);
+
+    g_mutex_clear (&priv->lock);
+    g_cond_clear (&priv->finished);
+
+    G_OBJECT_CLASS (ufo_hdf5_reader_parent_class)->finalize (object);
+}
+
 static void
 ufo_hdf5_reader_class_init(UfoHdf5ReaderClass *klass)
 {
-    g_type_class_add_private (G_OBJECT_CLASS (klass), sizeof (UfoHdf5ReaderPrivate));
+    GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+    gobject_class->set_property = ufo_hdf5_reader_set_property;
+    gobject_class->get_property = ufo_hdf5_reader_get_property;
+    gobject_class->finalize = ufo_hdf5_reader_finalize;
+
+    properties[PROP_BATCH] =
+        g_param_spec_uint ("batch",
+            "Number of frames read at once",
+            "Number of frames read at once",
+            1, G_MAXUINT, 1,
+            G_PARAM_READWRITE);
+
+    properties[PROP_SWMR] =
+        g_param_spec_boolean ("swmr",
+            "Open in single-writer/multiple-reader mode",
+            "Open in single-writer/multiple-reader mode and follow a growing data set",
+            FALSE,
+            G_PARAM_READWRITE);
+
+    properties[PROP_SWMR_TIMEOUT] =
+        g_param_spec_uint ("swmr-timeout",
+            "Seconds to wait for new frames in SWMR mode",
+            "Seconds to wait for new frames in SWMR mode",
+            0, G_MAXUINT, 5,
+            G_PARAM_READWRITE);
+
+    properties[PROP_DECOMPRESS_THREADS] =
+        g_param_spec_uint ("decompress-threads",
+            "Number of threads decompressing chunks",
+            "Number of threads decompressing chunks outside of HDF5, 0 lets HDF5 decompress",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
+    for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
+        g_object_class_install_property (gobject_class, i, properties[i]);
+
+    g_type_class_add_private (gobject_class, sizeof (UfoHdf5ReaderPrivate));
 }
 
 static void
 ufo_hdf5_reader_init (UfoHdf5Reader *self)
 {
-    self->priv = UFO_HDF5_READER_GET_PRIVATE (self);
+    UfoHdf5ReaderPrivate *priv = NULL;
+
+    self->priv = priv = UFO_HDF5_READER_GET_PRIVATE (self);
+    priv->batch = 1;
+    priv->swmr = FALSE;
+    priv->swmr_timeout = 5;
+    priv->staging = NULL;
+    priv->num_staged = 0;
+    priv->next_staged = 0;
+    priv->decompress_threads = 0;
+    priv->pool = NULL;
+    priv->direct_chunks = FALSE;
+    priv->slab = NULL;
+    priv->slab_capacity = 0;
+    priv->slab_layer = G_MAXUINT64;
+    g_mutex_init (&priv->lock);
+    g_cond_init (&priv->finished);
 }
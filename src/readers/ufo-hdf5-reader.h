@@ -46,8 +46,9 @@ struct _UfoHdf5ReaderClass {
     GObjectClass parent_class;
 };
 
-UfoHdf5Reader  *ufo_hdf5_reader_new       (void);
-GType           ufo_hdf5_reader_get_type  (void);
+UfoHdf5Reader  *ufo_hdf5_reader_new             (void);
+GType           ufo_hdf5_reader_get_type        (void);
+gboolean        ufo_hdf5_reader_supports_swmr   (void);
 
 G_END_DECLS
 
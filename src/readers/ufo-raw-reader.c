@@ -19,6 +19,12 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "readers/ufo-reader.h"
 #include "readers/ufo-raw-reader.h"
@@ -26,6 +32,12 @@
 
 struct _UfoRawReaderPrivate {
     FILE *fp;
+    gint fd;
+    gchar *map;
+    gsize offset;
+    gboolean use_mmap;
+    gboolean mapped;
+    gboolean advised;
     gsize total_size;
     gsize frame_size;
     gsize bytes_per_pixel;
@@ -51,6 +63,7 @@ enum {
     PROP_BITDEPTH,
     PROP_PRE_OFFSET,
     PROP_POST_OFFSET,
+    PROP_MMAP,
     N_PROPERTIES
 };
 
@@ -82,6 +95,68 @@ ufo_raw_reader_can_open (UfoReader *reader,
     return TRUE;
 }
 
+static gboolean
+open_mapped (UfoRawReaderPrivate *priv,
+             const gchar *filename,
+             guint start,
+             GError **error)
+{
+    struct stat st;
+
+    priv->fd = open (filename, O_RDONLY);
+
+    if (priv->fd < 0) {
+        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                     "Cannot open %s", filename);
+        return FALSE;
+    }
+
+    if (fstat (priv->fd, &st) != 0) {
+        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                     "Cannot determine size of %s", filename);
+        close (priv->fd);
+        priv->fd = -1;
+        return FALSE;
+    }
+
+    /* Empty files cannot be mapped, the caller reads them with stdio */
+    if (st.st_size == 0) {
+        close (priv->fd);
+        priv->fd = -1;
+        return FALSE;
+    }
+
+    priv->total_size = (gsize) st.st_size;
+    priv->map = mmap (NULL, priv->total_size, PROT_READ, MAP_SHARED, priv->fd, 0);
+
+    if (priv->map == MAP_FAILED) {
+        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                     "Cannot map %s: %s", filename, g_strerror (errno));
+        priv->map = NULL;
+        close (priv->fd);
+        priv->fd = -1;
+        return FALSE;
+    }
+
+    priv->offset = start * priv->frame_size;
+    priv->advised = FALSE;
+    return TRUE;
+}
+
+static void
+close_mapped (UfoRawReaderPrivate *priv)
+{
+    if (priv->map != NULL) {
+        munmap (priv->map, priv->total_size);
+        priv->map = NULL;
+    }
+
+    if (priv->fd >= 0) {
+        close (priv->fd);
+        priv->fd = -1;
+    }
+}
+
 static gboolean
 ufo_raw_reader_open (UfoReader *reader,
                      const gchar *filename,
@@ -91,11 +166,28 @@ ufo_raw_reader_open (UfoReader *reader,
     UfoRawReaderPrivate *priv;
 
     priv = UFO_RAW_READER_GET_PRIVATE (reader);
+    priv->frame_size = priv->width * priv->height * priv->bytes_per_pixel;
+
+    priv->mapped = FALSE;
+
+    if (priv->use_mmap) {
+        GError *tmp_error = NULL;
+
+        priv->mapped = open_mapped (priv, filename, start, &tmp_error);
+
+        if (priv->mapped)
+            return TRUE;
+
+        if (tmp_error != NULL) {
+            g_propagate_error (error, tmp_error);
+            return FALSE;
+        }
+    }
+
     priv->fp = fopen (filename, "rb");
 
     fseek (priv->fp, 0L, SEEK_END);
     priv->total_size = (gsize) ftell (priv->fp);
-    priv->frame_size = priv->width * priv->height * priv->bytes_per_pixel;
     fseek (priv->fp, start * priv->frame_size, SEEK_SET);
     return TRUE;
 }
@@ -106,9 +198,18 @@ ufo_raw_reader_close (UfoReader *reader)
     UfoRawReaderPrivate *priv;
 
     priv = UFO_RAW_READER_GET_PRIVATE (reader);
-    g_assert (priv->fp != NULL);
-    fclose (priv->fp);
-    priv->fp = NULL;
+
+    if (priv->mapped) {
+        g_assert (priv->map != NULL);
+        close_mapped (priv);
+        priv->mapped = FALSE;
+    }
+    else {
+        g_assert (priv->fp != NULL);
+        fclose (priv->fp);
+        priv->fp = NULL;
+    }
+
     priv->total_size = 0;
 }
 
@@ -119,35 +220,139 @@ ufo_raw_reader_data_available (UfoReader *reader)
     glong pos;
 
     priv = UFO_RAW_READER_GET_PRIVATE (reader);
+
+    if (priv->mapped)
+        return priv->map != NULL && priv->offset + priv->pre_offset + priv->frame_size <= priv->total_size;
+
     pos = ftell (priv->fp);
     return priv->fp != NULL && pos >= 0 && (((gulong) pos) + priv->pre_offset + priv->frame_size) <= priv->total_size;
 }
 
+static void
+advise_mapped (UfoRawReaderPrivate *priv,
+               gsize start,
+               gsize length,
+               gint advice)
+{
+    gsize page;
+    gsize end;
+
+    page = (gsize) sysconf (_SC_PAGESIZE);
+    end = MIN (start + length, priv->total_size);
+    start = start - start % page;
+
+    if (start < end)
+        madvise (priv->map + start, end - start, advice);
+}
+
 static gsize
-ufo_raw_reader_read (UfoReader *reader,
-                     UfoBuffer *buffer,
-                     UfoRequisition *requisition,
-                     guint roi_y,
-                     guint roi_height,
-                     guint roi_step,
-                     guint image_step)
+read_mapped (UfoRawReaderPrivate *priv,
+             gchar *data,
+             guint num_columns,
+             guint roi_x,
+             guint roi_x_step,
+             guint roi_y,
+             guint roi_height,
+             guint roi_step,
+             guint image_step)
+{
+    const gchar *src;
+    gsize row_size;
+    gsize dst_row_size;
+    gsize page_size;
+    gsize to_skip;
+
+    row_size = priv->width * priv->bytes_per_pixel;
+    dst_row_size = num_columns * priv->bytes_per_pixel;
+    page_size = priv->frame_size + priv->pre_offset + priv->post_offset;
+
+    if (!priv->advised) {
+        /* Only full frames read one after the other are truly sequential */
+        advise_mapped (priv, 0, priv->total_size,
+                       image_step == 1 && roi_step == 1 ? MADV_SEQUENTIAL : MADV_RANDOM);
+        priv->advised = TRUE;
+    }
+
+    src = priv->map + priv->offset + priv->pre_offset;
+
+    if (roi_step == 1 && dst_row_size == row_size) {
+        memcpy (data, src + roi_y * row_size, roi_height * row_size);
+    }
+    else {
+        for (guint i = roi_y; i < roi_y + roi_height; i += roi_step) {
+            ufo_reader_copy_columns (data, src + i * row_size + roi_x * priv->bytes_per_pixel,
+                                     priv->bytes_per_pixel, num_columns, roi_x_step);
+            data += dst_row_size;
+        }
+    }
+
+    priv->offset += page_size;
+
+    /* Skip the desired number of images */
+    to_skip = priv->offset < priv->total_size ? MIN (image_step - 1, (priv->total_size - priv->offset) / page_size) : 0;
+    priv->offset += to_skip * page_size;
+
+    /* Let the kernel fetch the rows of the next frame while we process this one */
+    advise_mapped (priv, priv->offset + priv->pre_offset + roi_y * row_size,
+                   roi_height * row_size, MADV_WILLNEED);
+
+    return to_skip + 1;
+}
+
+static gsize
+read_frame (UfoRawReaderPrivate *priv,
+            gchar *data,
+            guint num_columns,
+            guint roi_x,
+            guint roi_x_step,
+            guint roi_y,
+            guint roi_height,
+            guint roi_step,
+            guint image_step)
 {
-    UfoRawReaderPrivate *priv;
-    gchar *data;
     gsize to_skip;
     gsize page_size;
+    gsize row_size;
+    gsize dst_row_size;
+    glong frame_start;
 
-    priv = UFO_RAW_READER_GET_PRIVATE (reader);
-    data = (gchar *) ufo_buffer_get_host_array (buffer, NULL);
     page_size = priv->frame_size + priv->pre_offset + priv->post_offset;
+    row_size = priv->width * priv->bytes_per_pixel;
+    dst_row_size = num_columns * priv->bytes_per_pixel;
 
     fseek (priv->fp, priv->pre_offset, SEEK_CUR);
+    frame_start = ftell (priv->fp);
+
+    if (roi_step == 1 && dst_row_size == row_size) {
+        /* Consecutive full rows are read at once */
+        fseek (priv->fp, roi_y * row_size, SEEK_CUR);
 
-    /* We never read more than we can store */
-    if (fread (data, 1, priv->frame_size, priv->fp) != ((gsize) priv->frame_size))
-        g_warning ("Could not read enough data");
+        if (fread (data, 1, roi_height * row_size, priv->fp) != roi_height * row_size)
+            g_warning ("Could not read enough data");
+    }
+    else {
+        /* Only read the part of each row from the first to the last column we need */
+        gsize span = ((num_columns - 1) * roi_x_step + 1) * priv->bytes_per_pixel;
+        gchar *row = roi_x_step > 1 ? g_malloc (span) : NULL;
+
+        for (guint i = roi_y; i < roi_y + roi_height; i += roi_step) {
+            fseek (priv->fp, frame_start + i * row_size + roi_x * priv->bytes_per_pixel, SEEK_SET);
+
+            if (fread (row != NULL ? row : data, 1, span, priv->fp) != span) {
+                g_warning ("Could not read enough data");
+                break;
+            }
 
-    fseek (priv->fp, priv->post_offset, SEEK_CUR);
+            if (row != NULL)
+                ufo_reader_copy_columns (data, row, priv->bytes_per_pixel, num_columns, roi_x_step);
+
+            data += dst_row_size;
+        }
+
+        g_free (row);
+    }
+
+    fseek (priv->fp, frame_start + priv->frame_size + priv->post_offset, SEEK_SET);
 
     /* Skip the desired number of images */
     to_skip = MIN (image_step - 1, (priv->total_size - (gsize) ftell (priv->fp)) / page_size);
@@ -156,6 +361,51 @@ ufo_raw_reader_read (UfoReader *reader,
     return to_skip + 1;
 }
 
+static gsize
+ufo_raw_reader_read (UfoReader *reader,
+                     gpointer data,
+                     UfoRequisition *requisition,
+                     guint num_frames,
+                     guint roi_x,
+                     guint roi_width,
+                     guint roi_x_step,
+                     guint roi_y,
+                     guint roi_height,
+                     guint roi_step,
+                     guint image_step)
+{
+    UfoRawReaderPrivate *priv;
+    gsize dst_frame_size;
+    gsize num_read = 0;
+
+    priv = UFO_RAW_READER_GET_PRIVATE (reader);
+    dst_frame_size = requisition->dims[0] * requisition->dims[1] * priv->bytes_per_pixel;
+
+    if (!priv->mapped && image_step == 1 && priv->pre_offset == 0 && priv->post_offset == 0 &&
+        dst_frame_size == priv->frame_size) {
+        /* Consecutive full frames without headers are read at once */
+        gsize num_left = (priv->total_size - (gsize) ftell (priv->fp)) / priv->frame_size;
+
+        num_read = MIN (num_frames, num_left);
+
+        if (fread (data, priv->frame_size, num_read, priv->fp) != num_read)
+            g_warning ("Could not read enough data");
+
+        return num_read;
+    }
+
+    for (guint i = 0; i < num_frames && ufo_raw_reader_data_available (reader); i++) {
+        gchar *dst = ((gchar *) data) + i * dst_frame_size;
+
+        if (priv->mapped)
+            num_read += read_mapped (priv, dst, requisition->dims[0], roi_x, roi_x_step, roi_y, roi_height, roi_step, image_step);
+        else
+            num_read += read_frame (priv, dst, requisition->dims[0], roi_x, roi_x_step, roi_y, roi_height, roi_step, image_step);
+    }
+
+    return num_read;
+}
+
 static gboolean
 ufo_raw_reader_get_meta (UfoReader *reader,
                          UfoRequisition *requisition,
@@ -213,6 +463,9 @@ ufo_raw_reader_set_property (GObject *object,
         case PROP_POST_OFFSET:
             priv->post_offset = g_value_get_ulong (value);
             break;
+        case PROP_MMAP:
+            priv->use_mmap = g_value_get_boolean (value);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -235,7 +488,8 @@ ufo_raw_reader_get_property (GObject *object,
             g_value_set_uint (value, priv->height);
             break;
         case PROP_BITDEPTH:
-            g_value_set_uint (value, priv->bitdepth);
+            /* Report bits like they are set and not the UfoBufferDepth */
+            g_value_set_uint (value, priv->bitdepth != UFO_BUFFER_DEPTH_INVALID ? priv->bytes_per_pixel * 8 : 0);
             break;
         case PROP_PRE_OFFSET:
             g_value_set_ulong (value, priv->pre_offset);
@@ -243,6 +497,9 @@ ufo_raw_reader_get_property (GObject *object,
         case PROP_POST_OFFSET:
             g_value_set_ulong (value, priv->post_offset);
             break;
+        case PROP_MMAP:
+            g_value_set_boolean (value, priv->use_mmap);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -261,6 +518,8 @@ ufo_raw_reader_finalize (GObject *object)
         priv->fp = NULL;
     }
 
+    close_mapped (priv);
+
     G_OBJECT_CLASS (ufo_raw_reader_parent_class)->finalize (object);
 }
 
@@ -319,6 +578,13 @@ ufo_raw_reader_class_init (UfoRawReaderClass *klass)
             0, G_MAXULONG, 0,
             G_PARAM_READWRITE);
 
+    properties[PROP_MMAP] =
+        g_param_spec_boolean("mmap",
+            "Map the file into memory instead of reading it with stdio",
+            "Map the file into memory instead of reading it with stdio",
+            FALSE,
+            G_PARAM_READWRITE);
+
     for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
         g_object_class_install_property (gobject_class, i, properties[i]);
 
@@ -332,6 +598,12 @@ ufo_raw_reader_init (UfoRawReader *self)
 
     self->priv = priv = UFO_RAW_READER_GET_PRIVATE (self);
     priv->fp = NULL;
+    priv->fd = -1;
+    priv->map = NULL;
+    priv->offset = 0;
+    priv->use_mmap = FALSE;
+    priv->mapped = FALSE;
+    priv->advised = FALSE;
     priv->width = 0;
     priv->height = 0;
     priv->bitdepth = UFO_BUFFER_DEPTH_INVALID;
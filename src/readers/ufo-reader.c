@@ -17,6 +17,8 @@
  * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <string.h>
+
 #include "ufo-reader.h"
 
 typedef UfoReaderIface UfoReaderInterface;
@@ -62,16 +64,88 @@ ufo_reader_get_meta (UfoReader *reader,
     return UFO_READER_GET_IFACE (reader)->get_meta (reader, requisition, num_images, bitdepth, error);
 }
 
+/**
+ * ufo_reader_read:
+ * @reader: A #UfoReader
+ * @data: Location for the frames
+ * @requisition: Size of a single frame
+ * @num_frames: Maximum number of frames to read
+ * @roi_x: First column
+ * @roi_width: Number of columns
+ * @roi_x_step: Distance between two columns
+ * @roi_y: First row
+ * @roi_height: Number of rows
+ * @roi_step: Distance between two rows
+ * @image_step: Distance between two frames
+ *
+ * Read up to @num_frames frames of the current file one after the other into
+ * @data, each with its native depth. Readers use a single bulk read where
+ * possible.
+ *
+ * Returns: The number of images consumed, including skipped ones. The number
+ * of frames stored is this number divided by @image_step, rounded up.
+ */
 gsize
 ufo_reader_read (UfoReader *reader,
-                 UfoBuffer *buffer,
+                 gpointer data,
                  UfoRequisition *requisition,
+                 guint num_frames,
+                 guint roi_x,
+                 guint roi_width,
+                 guint roi_x_step,
                  guint roi_y,
                  guint roi_height,
                  guint roi_step,
                  guint image_step)
 {
-    return UFO_READER_GET_IFACE (reader)->read (reader, buffer, requisition, roi_y, roi_height, roi_step, image_step);
+    return UFO_READER_GET_IFACE (reader)->read (reader, data, requisition, num_frames,
+                                                roi_x, roi_width, roi_x_step,
+                                                roi_y, roi_height, roi_step, image_step);
+}
+
+/**
+ * ufo_reader_copy_columns:
+ * @dst: Destination row
+ * @src: First pixel of the horizontal region of interest
+ * @bytes_per_pixel: Size of one pixel in bytes
+ * @num_columns: Number of pixels to copy
+ * @roi_x_step: Distance between two copied pixels
+ *
+ * Copy every @roi_x_step'th pixel of a row, readers use this to implement the
+ * horizontal region of interest.
+ */
+void
+ufo_reader_copy_columns (gchar *dst,
+                         const gchar *src,
+                         gsize bytes_per_pixel,
+                         guint num_columns,
+                         guint roi_x_step)
+{
+    const gsize stride = bytes_per_pixel * roi_x_step;
+
+    if (roi_x_step == 1) {
+        memcpy (dst, src, num_columns * bytes_per_pixel);
+        return;
+    }
+
+    switch (bytes_per_pixel) {
+        case 1:
+            for (guint i = 0; i < num_columns; i++)
+                dst[i] = src[i * stride];
+            break;
+        case 2:
+            for (guint i = 0; i < num_columns; i++)
+                ((guint16 *) dst)[i] = *((const guint16 *) (src + i * stride));
+            break;
+        case 4:
+            for (guint i = 0; i < num_columns; i++)
+                ((guint32 *) dst)[i] = *((const guint32 *) (src + i * stride));
+            break;
+        default:
+            for (guint i = 0; i < num_columns; i++)
+                memcpy (dst + i * bytes_per_pixel, src + i * stride, bytes_per_pixel);
+            break;
+    }
 }
 
 static void
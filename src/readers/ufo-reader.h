@@ -52,8 +52,12 @@ struct _UfoReaderIface {
                                          guint          *bitdepth,
                                          GError        **error);
     gsize       (*read)                 (UfoReader      *reader,
-                                         UfoBuffer      *buffer,
+                                         gpointer        data,
                                          UfoRequisition *requisition,
+                                         guint           num_frames,
+                                         guint           roi_x,
+                                         guint           roi_width,
+                                         guint           roi_x_step,
                                          guint           roi_y,
                                          guint           roi_height,
                                          guint           roi_step,
@@ -74,12 +78,21 @@ gboolean    ufo_reader_get_meta         (UfoReader      *reader,
                                          UfoBufferDepth *bitdepth,
                                          GError        **error);
 gsize       ufo_reader_read             (UfoReader      *reader,
-                                         UfoBuffer      *buffer,
+                                         gpointer        data,
                                          UfoRequisition *requisition,
+                                         guint           num_frames,
+                                         guint           roi_x,
+                                         guint           roi_width,
+                                         guint           roi_x_step,
                                          guint           roi_y,
                                          guint           roi_height,
                                          guint           roi_step,
                                          guint           image_step);
+void        ufo_reader_copy_columns     (gchar          *dst,
+                                         const gchar    *src,
+                                         gsize           bytes_per_pixel,
+                                         guint           num_columns,
+                                         guint           roi_x_step);
 
 GType  ufo_reader_get_type        (void);
 
@@ -17,6 +17,10 @@
  * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
 #include <tiffio.h>
 
 #include "readers/ufo-reader.h"
@@ -27,6 +31,9 @@ struct _UfoTiffReaderPrivate {
     TIFF    *tiff;
     gboolean more;
     gsize num_images;
+    gsize current;
+    GArray *offsets;
+    gboolean index_cache;
 };
 
 static void ufo_reader_interface_init (UfoReaderIface *iface);
@@ -37,6 +44,23 @@ G_DEFINE_TYPE_WITH_CODE (UfoTiffReader, ufo_tiff_reader, G_TYPE_OBJECT,
 
 #define UFO_TIFF_READER_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), UFO_TYPE_TIFF_READER, UfoTiffReaderPrivate))
 
+#define INDEX_MAGIC "UFOTIDX1"
+
+enum {
+    PROP_0,
+    PROP_INDEX_CACHE,
+    N_PROPERTIES
+};
+
+typedef struct {
+    gchar   magic[8];
+    guint64 size;
+    gint64  mtime;
+    guint64 num_offsets;
+} IndexHeader;
+
+static GParamSpec *properties[N_PROPERTIES] = { NULL, };
+
 UfoTiffReader *
 ufo_tiff_reader_new (void)
 {
@@ -51,6 +75,209 @@ ufo_tiff_reader_can_open (UfoReader *reader,
     return g_str_has_suffix (filename, ".tiff") || g_str_has_suffix (filename, ".tif");
 }
 
+static guint64
+get_uint (const guint8 *data, guint n_bytes, gboolean big_endian)
+{
+    guint64 result = 0;
+
+    for (guint i = 0; i < n_bytes; i++)
+        result |= ((guint64) data[big_endian ? i : n_bytes - 1 - i]) << (8 * (n_bytes - 1 - i));
+
+    return result;
+}
+
+/*
+ * Follow the IFD chain by reading only the entry count and the next-IFD
+ * pointer of each directory. Unlike TIFFReadDirectory this does not parse any
+ * tags, so indexing a BigTIFF with many thousand pages costs two small reads
+ * per page.
+ */
+static GArray *
+read_directory_offsets (const gchar *filename, guint64 file_size)
+{
+    FILE *fp;
+    GArray *offsets;
+    guint8 header[16];
+    guint8 buffer[8];
+    gsize header_size;
+    gboolean big_endian;
+    gboolean big_tiff;
+    guint64 offset;
+    guint magic;
+
+    if ((fp = fopen (filename, "rb")) == NULL)
+        return NULL;
+
+    header_size = fread (header, 1, 16, fp);
+
+    if (header_size < 8) {
+        fclose (fp);
+        return NULL;
+    }
+
+    big_endian = header[0] == 'M';
+    magic = (guint) get_uint (header + 2, 2, big_endian);
+
+    /* the BigTIFF header holds an eight byte offset after eight bytes */
+    if ((magic != 42 && magic != 43) || (magic == 43 && header_size < 16)) {
+        fclose (fp);
+        return NULL;
+    }
+
+    big_tiff = magic == 43;
+    offset = big_tiff ? get_uint (header + 8, 8, big_endian) : get_uint (header + 4, 4, big_endian);
+    offsets = g_array_new (FALSE, FALSE, sizeof (guint64));
+
+    while (offset != 0 && offset < file_size) {
+        const guint count_size = big_tiff ? 8 : 2;
+        const guint entry_size = big_tiff ? 20 : 12;
+        const guint next_size = big_tiff ? 8 : 4;
+        guint64 count;
+
+        /* a corrupt file could loop forever */
+        if (offsets->len > file_size / (count_size + next_size))
+            break;
+
+        g_array_append_val (offsets, offset);
+
+        if (fseeko (fp, (off_t) offset, SEEK_SET) || fread (buffer, 1, count_size, fp) != count_size)
+            break;
+
+        count = get_uint (buffer, count_size, big_endian);
+
+        if (fseeko (fp, (off_t) (count * entry_size), SEEK_CUR) || fread (buffer, 1, next_size, fp) != next_size)
+            break;
+
+        offset = get_uint (buffer, next_size, big_endian);
+    }
+
+    fclose (fp);
+
+    if (offsets->len == 0) {
+        g_array_free (offsets, TRUE);
+        return NULL;
+    }
+
+    return offsets;
+}
+
+static gchar *
+get_index_cache_path (const gchar *filename)
+{
+    gchar *absolute;
+    gchar *checksum;
+    gchar *path;
+    gchar *cwd;
+
+    if (g_path_is_absolute (filename)) {
+        absolute = g_strdup (filename);
+    }
+    else {
+        cwd = g_get_current_dir ();
+        absolute = g_build_filename (cwd, filename, NULL);
+        g_free (cwd);
+    }
+
+    checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, absolute, -1);
+    path = g_build_filename (g_get_user_cache_dir (), "ufo", "tiff-index", checksum, NULL);
+
+    g_free (checksum);
+    g_free (absolute);
+    return path;
+}
+
+static GArray *
+load_index (const gchar *path, GStatBuf *st)
+{
+    GArray *offsets;
+    IndexHeader *header;
+    gchar *contents;
+    gsize length;
+
+    if (!g_file_get_contents (path, &contents, &length, NULL))
+        return NULL;
+
+    header = (IndexHeader *) contents;
+
+    /* the file changed since the index was made */
+    if (length < sizeof (IndexHeader) ||
+        memcmp (header->magic, INDEX_MAGIC, sizeof (header->magic)) ||
+        header->size != (guint64) st->st_size ||
+        header->mtime != (gint64) st->st_mtime ||
+        length != sizeof (IndexHeader) + header->num_offsets * sizeof (guint64) ||
+        header->num_offsets == 0) {
+        g_free (contents);
+        return NULL;
+    }
+
+    offsets = g_array_sized_new (FALSE, FALSE, sizeof (guint64), header->num_offsets);
+    g_array_append_vals (offsets, contents + sizeof (IndexHeader), header->num_offsets);
+    g_free (contents);
+    return offsets;
+}
+
+static void
+save_index (const gchar *path, GStatBuf *st, GArray *offsets)
+{
+    IndexHeader header;
+    gchar *contents;
+    gchar *dirname;
+    gsize length;
+
+    memcpy (header.magic, INDEX_MAGIC, sizeof (header.magic));
+    header.size = (guint64) st->st_size;
+    header.mtime = (gint64) st->st_mtime;
+    header.num_offsets = offsets->len;
+
+    length = sizeof (IndexHeader) + offsets->len * sizeof (guint64);
+    contents = g_malloc (length);
+    memcpy (contents, &header, sizeof (IndexHeader));
+    memcpy (contents + sizeof (IndexHeader), offsets->data, offsets->len * sizeof (guint64));
+
+    dirname = g_path_get_dirname (path);
+
+    /* The cache is an optimization, failing to write it is not an error */
+    if (g_mkdir_with_parents (dirname, 0755) == 0)
+        g_file_set_contents (path, contents, length, NULL);
+
+    g_free (dirname);
+    g_free (contents);
+}
+
+static GArray *
+get_directory_offsets (UfoTiffReaderPrivate *priv, const gchar *filename)
+{
+    GArray *offsets;
+    GStatBuf st;
+    gchar *cache_path;
+
+    /* Without the cache libtiff walks the directories as it always did */
+    if (!priv->index_cache || g_stat (filename, &st) != 0)
+        return NULL;
+
+    cache_path = get_index_cache_path (filename);
+    offsets = load_index (cache_path, &st);
+
+    if (offsets == NULL) {
+        offsets = read_directory_offsets (filename, (guint64) st.st_size);
+
+        if (offsets != NULL)
+            save_index (cache_path, &st, offsets);
+    }
+
+    g_free (cache_path);
+    return offsets;
+}
+
+static gboolean
+set_directory (UfoTiffReaderPrivate *priv, gsize index)
+{
+    if (priv->offsets != NULL)
+        return TIFFSetSubDirectory (priv->tiff, g_array_index (priv->offsets, guint64, index)) == 1;
+
+    return TIFFSetDirectory (priv->tiff, index) == 1;
+}
+
 static gboolean
 ufo_tiff_reader_open (UfoReader *reader,
                       const gchar *filename,
@@ -70,13 +297,22 @@ ufo_tiff_reader_open (UfoReader *reader,
         return FALSE;
     }
 
-	do {
-	    priv->num_images++;
-	} while (TIFFReadDirectory(priv->tiff));
+    priv->offsets = get_directory_offsets (priv, filename);
+
+    if (priv->offsets != NULL) {
+        priv->num_images = priv->offsets->len;
+    }
+    else {
+        do {
+            priv->num_images++;
+        } while (TIFFReadDirectory(priv->tiff));
+    }
+
+    priv->current = start;
 
     if (start < priv->num_images) {
         priv->more = TRUE;
-        if (TIFFSetDirectory (priv->tiff, start) != 1) {
+        if (!set_directory (priv, start)) {
             g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
                          "Cannot find first image in %s", filename);
             return FALSE;
@@ -95,6 +331,11 @@ ufo_tiff_reader_close (UfoReader *reader)
     g_assert (priv->tiff != NULL);
     TIFFClose (priv->tiff);
     priv->tiff = NULL;
+
+    if (priv->offsets != NULL) {
+        g_array_free (priv->offsets, TRUE);
+        priv->offsets = NULL;
+    }
 }
 
 static gboolean
@@ -107,39 +348,160 @@ ufo_tiff_reader_data_available (UfoReader *reader)
     return priv->more && priv->tiff != NULL;
 }
 
+/*
+ * Rows are decoded one strip or one row of tiles at a time and kept until a
+ * row outside of that block is requested. Strips and tiles that do not contain
+ * any row of the region of interest are never read nor decompressed.
+ */
+typedef struct {
+    TIFF     *tiff;
+    gchar    *block;
+    gchar    *tile;
+    gsize     scanline_size;
+    gsize     tile_row_size;
+    guint32   width;
+    guint32   height;
+    guint32   tile_width;
+    guint32   x_start;
+    guint32   x_end;
+    guint32   rows_per_block;
+    guint32   current;
+    gboolean  tiled;
+} RowReader;
+
+static void
+row_reader_init (RowReader *reader, TIFF *tiff, guint32 x_start, guint32 x_end)
+{
+    reader->tiff = tiff;
+    reader->x_start = x_start;
+    reader->x_end = x_end;
+    reader->tiled = TIFFIsTiled (tiff);
+    reader->scanline_size = TIFFScanlineSize (tiff);
+    reader->current = G_MAXUINT32;
+    reader->tile = NULL;
+
+    TIFFGetField (tiff, TIFFTAG_IMAGEWIDTH, &reader->width);
+    TIFFGetField (tiff, TIFFTAG_IMAGELENGTH, &reader->height);
+
+    if (reader->tiled) {
+        TIFFGetField (tiff, TIFFTAG_TILEWIDTH, &reader->tile_width);
+        TIFFGetField (tiff, TIFFTAG_TILELENGTH, &reader->rows_per_block);
+        reader->tile_row_size = TIFFTileRowSize (tiff);
+        reader->tile = g_malloc (TIFFTileSize (tiff));
+        reader->block = g_malloc (reader->scanline_size * reader->rows_per_block);
+    }
+    else {
+        TIFFGetFieldDefaulted (tiff, TIFFTAG_ROWSPERSTRIP, &reader->rows_per_block);
+        reader->rows_per_block = MIN (reader->rows_per_block, reader->height);
+        reader->block = g_malloc (TIFFStripSize (tiff));
+    }
+}
+
+static void
+row_reader_free (RowReader *reader)
+{
+    g_free (reader->block);
+    g_free (reader->tile);
+}
+
+static gboolean
+decode_tile_row (RowReader *reader, guint32 y)
+{
+    gsize x_offset;
+    guint32 x_first;
+    guint32 num_rows;
+
+    num_rows = MIN (reader->rows_per_block, reader->height - y);
+
+    /* only tiles overlapping the horizontal region of interest are decoded */
+    x_first = reader->x_start / reader->tile_width * reader->tile_width;
+    x_offset = (x_first / reader->tile_width) * reader->tile_row_size;
+
+    for (guint32 x = x_first; x < reader->x_end; x += reader->tile_width) {
+        gsize size;
+
+        if (TIFFReadEncodedTile (reader->tiff, TIFFComputeTile (reader->tiff, x, y, 0, 0), reader->tile, -1) < 0)
+            return FALSE;
+
+        /* the right-most tile may be padded beyond the image width */
+        size = MIN (reader->tile_row_size, reader->scanline_size - x_offset);
+
+        for (guint32 i = 0; i < num_rows; i++)
+            memcpy (reader->block + i * reader->scanline_size + x_offset, reader->tile + i * reader->tile_row_size, size);
+
+        x_offset += reader->tile_row_size;
+    }
+
+    return TRUE;
+}
+
+static const gchar *
+row_reader_get (RowReader *reader, guint32 row)
+{
+    guint32 block;
+
+    block = row / reader->rows_per_block;
+
+    if (block != reader->current) {
+        gboolean success;
+
+        if (reader->tiled)
+            success = decode_tile_row (reader, block * reader->rows_per_block);
+        else
+            success = TIFFReadEncodedStrip (reader->tiff, TIFFComputeStrip (reader->tiff, row, 0), reader->block, -1) >= 0;
+
+        if (!success) {
+            g_warning ("Could not decode row %u", row);
+            reader->current = G_MAXUINT32;
+            return NULL;
+        }
+
+        reader->current = block;
+    }
+
+    return reader->block + (row % reader->rows_per_block) * reader->scanline_size;
+}
+
 static void
 read_data (UfoTiffReaderPrivate *priv,
-           UfoBuffer *buffer,
+           gchar *dst,
            UfoRequisition *requisition,
            guint16 bits,
+           guint roi_x,
+           guint roi_x_step,
            guint roi_y,
            guint roi_height,
            guint roi_step)
 {
-    gchar *dst;
+    RowReader reader;
     gsize step;
     gsize offset;
+    gsize bytes_per_pixel;
+    guint32 x_end;
 
     step = requisition->dims[0] * bits / 8;
-    dst = (gchar *) ufo_buffer_get_host_array (buffer, NULL);
+    bytes_per_pixel = bits / 8;
     offset = 0;
+    x_end = roi_x + (requisition->dims[0] - 1) * roi_x_step + 1;
+
+    row_reader_init (&reader, priv->tiff, roi_x, x_end);
 
     if (requisition->n_dims == 3) {
         /* RGB data */
-        gchar *src;
         gsize plane_size;
 
         /* Allow things like roi_height=1 and roi_step=20 */
         plane_size = step * ((roi_height - 1) / roi_step + 1);
-        src = g_new0 (gchar, step * 3);
 
         for (guint i = roi_y; i < roi_y + roi_height; i += roi_step) {
+            const gchar *src;
             guint xd = 0;
-            guint xs = 0;
+            guint xs = roi_x * 3;
 
-            TIFFReadScanline (priv->tiff, src, i, 0);
+            if ((src = row_reader_get (&reader, i)) == NULL)
+                break;
 
-            for (; xd < requisition->dims[0]; xd += 1, xs += 3) {
+            for (; xd < requisition->dims[0]; xd += 1, xs += 3 * roi_x_step) {
                 dst[offset + xd] = src[xs];
                 dst[offset + plane_size + xd] = src[xs + 1];
                 dst[offset + 2 * plane_size + xd] = src[xs + 2];
@@ -147,47 +509,103 @@ read_data (UfoTiffReaderPrivate *priv,
 
             offset += step;
         }
-
-        g_free (src);
     }
     else {
         for (guint i = roi_y; i < roi_y + roi_height; i += roi_step) {
-            TIFFReadScanline (priv->tiff, dst + offset, i, 0);
+            const gchar *src;
+
+            if ((src = row_reader_get (&reader, i)) == NULL)
+                break;
+
+            /* sub-byte samples can only be read in full rows */
+            if (bytes_per_pixel == 0)
+                memcpy (dst + offset, src, step);
+            else
+                ufo_reader_copy_columns (dst + offset, src + roi_x * bytes_per_pixel, bytes_per_pixel,
+                                         requisition->dims[0], roi_x_step);
+
             offset += step;
         }
     }
+
+    row_reader_free (&reader);
 }
 
 static void
 read_64_bit_data (UfoTiffReaderPrivate *priv,
-                  UfoBuffer *buffer,
+                  gfloat *dst,
                   UfoRequisition *requisition,
+                  guint roi_x,
+                  guint roi_x_step,
                   guint roi_y,
                   guint roi_height,
                   guint roi_step)
 {
-    gdouble *src;
-    gfloat *dst;
+    RowReader reader;
 
-    dst = ufo_buffer_get_host_array (buffer, NULL);
-    src = g_new0 (gdouble, requisition->dims[0]);
+    row_reader_init (&reader, priv->tiff, roi_x, roi_x + (requisition->dims[0] - 1) * roi_x_step + 1);
 
     for (guint i = roi_y; i < roi_y + roi_height; i += roi_step) {
-        TIFFReadScanline (priv->tiff, src, i, 0);
+        const gdouble *src;
+
+        if ((src = (const gdouble *) row_reader_get (&reader, i)) == NULL)
+            break;
 
         for (guint j = 0; j < requisition->dims[0]; j++)
-            dst[j] = (gfloat) src[j];
+            dst[j] = (gfloat) src[roi_x + j * roi_x_step];
 
         dst += requisition->dims[0];
     }
 
-    g_free (src);
+    row_reader_free (&reader);
+}
+
+static gsize
+read_page (UfoTiffReaderPrivate *priv,
+           gchar *data,
+           UfoRequisition *requisition,
+           guint16 bits,
+           guint roi_x,
+           guint roi_x_step,
+           guint roi_y,
+           guint roi_height,
+           guint roi_step,
+           guint image_step)
+{
+    gsize num_read = 0;
+
+    if (bits == 64)
+        read_64_bit_data (priv, (gfloat *) data, requisition, roi_x, roi_x_step, roi_y, roi_height, roi_step);
+    else
+        read_data (priv, data, requisition, bits, roi_x, roi_x_step, roi_y, roi_height, roi_step);
+
+    if (priv->offsets != NULL) {
+        /* Jump straight to the next page instead of parsing the skipped ones */
+        num_read = MIN (image_step, priv->num_images - priv->current);
+        priv->current += num_read;
+        priv->more = priv->current < priv->num_images && set_directory (priv, priv->current);
+        return num_read;
+    }
+
+    do {
+        priv->more = TIFFReadDirectory (priv->tiff) == 1;
+        num_read++;
+        if (!priv->more) {
+            break;
+        }
+    } while (num_read < image_step);
+
+    return num_read;
 }
 
 static gsize
 ufo_tiff_reader_read (UfoReader *reader,
-                      UfoBuffer *buffer,
+                      gpointer data,
                       UfoRequisition *requisition,
+                      guint num_frames,
+                      guint roi_x,
+                      guint roi_width,
+                      guint roi_x_step,
                       guint roi_y,
                       guint roi_height,
                       guint roi_step,
@@ -195,24 +613,23 @@ ufo_tiff_reader_read (UfoReader *reader,
 {
     UfoTiffReaderPrivate *priv;
     guint16 bits;
+    gsize frame_size;
     gsize num_read = 0;
 
     priv = UFO_TIFF_READER_GET_PRIVATE (reader);
 
     TIFFGetField (priv->tiff, TIFFTAG_BITSPERSAMPLE, &bits);
 
-    if (bits == 64)
-        read_64_bit_data (priv, buffer, requisition, roi_y, roi_height, roi_step);
-    else
-        read_data (priv, buffer, requisition, bits, roi_y, roi_height, roi_step);
+    /* 64 bit data is narrowed to float while reading */
+    frame_size = requisition->dims[0] * requisition->dims[1] * (bits == 64 ? 32 : bits) / 8;
 
-    do {
-        priv->more = TIFFReadDirectory (priv->tiff) == 1;
-        num_read++;
-        if (!priv->more) {
-            break;
-        }
-    } while (num_read < image_step);
+    if (requisition->n_dims == 3)
+        frame_size *= requisition->dims[2];
+
+    /* Pages of a multi-page file are stored one after the other */
+    for (guint i = 0; i < num_frames && priv->more; i++)
+        num_read += read_page (priv, ((gchar *) data) + i * frame_size, requisition, bits,
+                               roi_x, roi_x_step, roi_y, roi_height, roi_step, image_step);
 
     return num_read;
 }
@@ -261,6 +678,42 @@ ufo_tiff_reader_get_meta (UfoReader *reader,
     return TRUE;
 }
 
+static void
+ufo_tiff_reader_set_property (GObject *object,
+                              guint property_id,
+                              const GValue *value,
+                              GParamSpec *pspec)
+{
+    UfoTiffReaderPrivate *priv = UFO_TIFF_READER_GET_PRIVATE (object);
+
+    switch (property_id) {
+        case PROP_INDEX_CACHE:
+            priv->index_cache = g_value_get_boolean (value);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+ufo_tiff_reader_get_property (GObject *object,
+                              guint property_id,
+                              GValue *value,
+                              GParamSpec *pspec)
+{
+    UfoTiffReaderPrivate *priv = UFO_TIFF_READER_GET_PRIVATE (object);
+
+    switch (property_id) {
+        case PROP_INDEX_CACHE:
+            g_value_set_boolean (value, priv->index_cache);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
 static void
 ufo_tiff_reader_finalize (GObject *object)
 {
@@ -290,8 +743,20 @@ ufo_tiff_reader_class_init(UfoTiffReaderClass *klass)
 {
     GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
 
+    gobject_class->set_property = ufo_tiff_reader_set_property;
+    gobject_class->get_property = ufo_tiff_reader_get_property;
     gobject_class->finalize = ufo_tiff_reader_finalize;
 
+    properties[PROP_INDEX_CACHE] =
+        g_param_spec_boolean ("index-cache",
+            "Cache page offsets of multi-page files",
+            "Cache page offsets of multi-page files in the user cache directory",
+            FALSE,
+            G_PARAM_READWRITE);
+
+    for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
+        g_object_class_install_property (gobject_class, i, properties[i]);
+
     g_type_class_add_private (gobject_class, sizeof (UfoTiffReaderPrivate));
 }
 
@@ -303,5 +768,7 @@ ufo_tiff_reader_init (UfoTiffReader *self)
     self->priv = priv = UFO_TIFF_READER_GET_PRIVATE (self);
     priv->tiff = NULL;
     priv->more = FALSE;
+    priv->offsets = NULL;
+    priv->index_cache = FALSE;
     TIFFSetWarningHandler(NULL);
 }
@@ -18,12 +18,16 @@
  */
 #include "config.h"
 
+#include <errno.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <glib.h>
 #include <glib/gprintf.h>
+#include <glib/gstdio.h>
 #ifdef __APPLE__
 #include <OpenCL/cl.h>
 #else
@@ -36,6 +40,7 @@
 #include "common/ufo-scarray.h"
 #include "common/ufo-ctgeometry.h"
 #include "common/ufo-addressing.h"
+#include "common/ufo-kernel-cache.h"
 #include "ufo-general-backproject-task.h"
 
 #define NUM_VECTOR_ARGUMENTS 11
@@ -45,6 +50,10 @@
 #define REGION_SIZE(region) (ceil ((ufo_scarray_get_double ((region), 1) - ufo_scarray_get_double ((region), 0)) /\
                              ufo_scarray_get_double ((region), 2)))
 #define NEXT_DIVISOR(dividend, divisor) ((dividend) + (divisor) - (dividend) % (divisor))
+#define ROUND_UP(dividend, divisor) ((dividend) % (divisor) ? NEXT_DIVISOR (dividend, divisor) : (dividend))
+/* Autotuning benchmarks at most this many slices per launch, each launch is repeated */
+#define AUTOTUNE_MAX_SLICES 256
+#define AUTOTUNE_REPETITIONS 3
 #define DEFINE_FILL_SINCOS(type)                      \
 static void                                           \
 fill_sincos_##type (type *array, const gdouble angle) \
@@ -398,11 +407,18 @@ struct _UfoGeneralBackprojectTaskPrivate {
     StoreType store_type;
     UfoUniRecoParameter parameter;
     gdouble gray_map_min, gray_map_max;
+    gboolean pipelined;
+    gboolean autotune;
+    gboolean multi_device;
+    gboolean out_of_core;
+    gchar *cache_directory;
     /* Private */
     gboolean vectorized;
     guint generated;
     UfoResources *resources;
     cl_mem *projections;
+    guint num_sets;
+    cl_event set_events[2];
     cl_mem *chunks;
     cl_mem *cl_regions, *vector_arguments;
     guint num_slices, num_slices_per_chunk, num_chunks;
@@ -414,6 +430,24 @@ struct _UfoGeneralBackprojectTaskPrivate {
     cl_context context;
     cl_kernel kernel, rest_kernel;
     cl_sampler sampler;
+    cl_command_queue upload_queue;
+    /* Chunk i is backprojected on queues[i % num_devices], queues[0] is the node's own */
+    guint num_devices;
+    cl_command_queue *queues;
+    /* Out-of-core mode: chunk i lives in chunks[i % num_slab_chunks] while slab
+     * i / num_slab_chunks is resident, projections are replayed from the cache */
+    guint num_slab_chunks;
+    guint current_slab;
+    gfloat *cache;
+    gsize cache_size;
+    gsize projection_width;
+    gsize projection_height;
+    /* Autotuning */
+    gchar *tuning_key;
+    gboolean tuned;
+    guint tuned_burst;
+    guint tuned_slices_per_chunk;
+    gsize local_work_size[3];
 };
 
 static void ufo_task_interface_init (UfoTaskIface *iface);
@@ -457,6 +491,11 @@ enum {
     PROP_ADDRESSING_MODE,
     PROP_GRAY_MAP_MIN,
     PROP_GRAY_MAP_MAX,
+    PROP_PIPELINED,
+    PROP_AUTOTUNE,
+    PROP_MULTI_DEVICE,
+    PROP_OUT_OF_CORE,
+    PROP_CACHE_DIRECTORY,
     N_PROPERTIES
 };
 
@@ -1197,7 +1236,7 @@ create_images (UfoGeneralBackprojectTaskPrivate *priv, gsize width, gsize height
     image_fmt.image_channel_order = CL_INTENSITY;
     image_fmt.image_channel_data_type = CL_FLOAT;
 
-    for (i = 0; i < priv->burst; i++) {
+    for (i = 0; i < priv->num_devices * priv->num_sets * priv->burst; i++) {
         /* TODO: what about the "other" API? */
         priv->projections[i] = clCreateImage2D (priv->context,
                                                 CL_MEM_READ_ONLY,
@@ -1270,13 +1309,340 @@ copy_to_image (const cl_command_queue cmd_queue,
     UFO_RESOURCES_CHECK_CLERR (clReleaseEvent (event));
 }
 
+/**
+ * Copy buffer to an image of projection set @set without waiting for running
+ * backprojections.
+ */
+static void
+upload_to_image (UfoGeneralBackprojectTaskPrivate *priv,
+                 const cl_command_queue cmd_queue,
+                 UfoBuffer *input,
+                 cl_mem output,
+                 guint set,
+                 gsize width,
+                 gsize height)
+{
+    cl_event event;
+    cl_int errcode;
+    cl_mem input_array;
+    const size_t origin[] = {0, 0, 0};
+    const size_t region[] = {width, height, 1};
+
+    if (ufo_buffer_get_location (input) != UFO_BUFFER_LOCATION_HOST) {
+        /* Data produced on the device is ordered by the in-order queue: the
+         * copy runs after its producer and before anyone overwrites it */
+        input_array = ufo_buffer_get_device_array (input, cmd_queue);
+        errcode = clEnqueueCopyBufferToImage (cmd_queue,
+                                              input_array,
+                                              output,
+                                              0, origin, region,
+                                              0, NULL, NULL);
+        UFO_RESOURCES_CHECK_CLERR (errcode);
+        return;
+    }
+
+    /* Host data goes through the upload queue and overlaps with the
+     * backprojection of the other set, it only waits for the last burst which
+     * read this set */
+    input_array = ufo_buffer_get_device_array (input, priv->upload_queue);
+    errcode = clEnqueueCopyBufferToImage (priv->upload_queue,
+                                          input_array,
+                                          output,
+                                          0, origin, region,
+                                          priv->set_events[set] ? 1 : 0,
+                                          priv->set_events[set] ? &priv->set_events[set] : NULL,
+                                          &event);
+
+    /* The input buffer is recycled as soon as we return */
+    UFO_RESOURCES_CHECK_CLERR (errcode);
+    UFO_RESOURCES_CHECK_CLERR (clWaitForEvents (1, &event));
+    UFO_RESOURCES_CHECK_CLERR (clReleaseEvent (event));
+}
+
+/**
+ * Write the projection into image @index of every device. Writing from the host
+ * avoids migrating the input buffer from one device to the next.
+ */
+static void
+broadcast_to_images (UfoGeneralBackprojectTaskPrivate *priv,
+                     UfoBuffer *input,
+                     guint index,
+                     gsize width,
+                     gsize height)
+{
+    cl_event *events;
+    gfloat *host_array;
+    const size_t origin[] = {0, 0, 0};
+    const size_t region[] = {width, height, 1};
+    guint i;
+
+    host_array = ufo_buffer_get_host_array (input, NULL);
+    events = g_new0 (cl_event, priv->num_devices);
+
+    for (i = 0; i < priv->num_devices; i++) {
+        UFO_RESOURCES_CHECK_CLERR (clEnqueueWriteImage (priv->queues[i],
+                                                        priv->projections[i * priv->burst + index],
+                                                        CL_FALSE, origin, region, 0, 0, host_array,
+                                                        0, NULL, &events[i]));
+        UFO_RESOURCES_CHECK_CLERR (clFlush (priv->queues[i]));
+    }
+
+    UFO_RESOURCES_CHECK_CLERR (clWaitForEvents (priv->num_devices, events));
+    for (i = 0; i < priv->num_devices; i++) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseEvent (events[i]));
+    }
+    g_free (events);
+}
+
+static void
+setup_devices (UfoGeneralBackprojectTaskPrivate *priv, const cl_command_queue cmd_queue)
+{
+    GList *queues, *it;
+    const gchar *override;
+    guint i, num_queues, num_devices;
+
+    queues = ufo_resources_get_cmd_queues (priv->resources);
+    num_queues = g_list_length (queues) + 1;
+
+    /* Not a property, only for exercising the multi-device paths on one device */
+    override = g_getenv ("UFO_GBP_NUM_DEVICES");
+    num_devices = override ? (guint) MAX (g_ascii_strtoull (override, NULL, 10), 1) : 0;
+
+    priv->queues = g_new0 (cl_command_queue, MAX (num_queues, num_devices));
+    priv->queues[0] = cmd_queue;
+    priv->num_devices = 1;
+
+    for (it = g_list_first (queues); it != NULL; it = g_list_next (it)) {
+        if (it->data != cmd_queue) {
+            priv->queues[priv->num_devices++] = (cl_command_queue) it->data;
+        }
+    }
+
+    g_list_free (queues);
+
+    if (num_devices) {
+        /* Additional devices reuse the existing queues in turn */
+        for (i = priv->num_devices; i < num_devices; i++) {
+            priv->queues[i] = priv->queues[i % priv->num_devices];
+        }
+        priv->num_devices = num_devices;
+    }
+
+    g_log ("gbp", G_LOG_LEVEL_DEBUG, "Backprojecting on %u devices", priv->num_devices);
+}
+
+/**
+ * Map memory for all projections, backed by an unlinked file in
+ * priv->cache_directory if that is set and by anonymous memory otherwise.
+ */
+static gboolean
+create_projection_cache (UfoGeneralBackprojectTaskPrivate *priv, gsize width, gsize height, GError **error)
+{
+    gchar *template;
+    gsize available;
+    gint fd;
+
+    priv->projection_width = width;
+    priv->projection_height = height;
+    priv->cache_size = ((gsize) priv->num_projections) * width * height * sizeof (gfloat);
+
+    if (priv->cache_directory && priv->cache_directory[0] != '\0') {
+        template = g_build_filename (priv->cache_directory, "ufo-projections-XXXXXX", NULL);
+        fd = g_mkstemp (template);
+        if (fd < 0) {
+            g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_GET_REQUISITION,
+                         "Could not create projection cache `%s': %s", template, g_strerror (errno));
+            g_free (template);
+            return FALSE;
+        }
+        /* The file disappears with the mapping */
+        g_unlink (template);
+        g_free (template);
+        if (ftruncate (fd, priv->cache_size)) {
+            g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_GET_REQUISITION,
+                         "Could not allocate %zu bytes for the projection cache: %s",
+                         priv->cache_size, g_strerror (errno));
+            close (fd);
+            return FALSE;
+        }
+        priv->cache = mmap (NULL, priv->cache_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close (fd);
+    } else {
+        /* Nothing is reserved, running out of memory kills the process later on */
+        available = ((gsize) sysconf (_SC_AVPHYS_PAGES)) * ((gsize) sysconf (_SC_PAGESIZE));
+        if (priv->cache_size > available) {
+            g_warning ("Projection cache of %zu bytes exceeds the available "
+                       "memory of %zu bytes, set `cache-directory' to keep it on disk",
+                       priv->cache_size, available);
+        }
+        priv->cache = mmap (NULL, priv->cache_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+
+    if (priv->cache == MAP_FAILED) {
+        priv->cache = NULL;
+        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_GET_REQUISITION,
+                     "Could not map %zu bytes for the projection cache: %s",
+                     priv->cache_size, g_strerror (errno));
+        return FALSE;
+    }
+    g_log ("gbp", G_LOG_LEVEL_DEBUG, "Projection cache size: %zu", priv->cache_size);
+
+    return TRUE;
+}
+
+static void
+set_rotation_angle (UfoGeneralBackprojectTaskPrivate *priv, cl_kernel kernel, guint arg_index, guint projection)
+{
+    gdouble rot_angle;
+    cl_float f_tomo_angle[2];
+    cl_double d_tomo_angle[2];
+
+    rot_angle = ufo_scarray_get_double (priv->geometry->axis->angle->z, projection);
+    if (priv->compute_type == CT_FLOAT) {
+        fill_sincos_cl_float (f_tomo_angle, rot_angle);
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, arg_index, sizeof (cl_float2), f_tomo_angle));
+    } else {
+        fill_sincos_cl_double (d_tomo_angle, rot_angle);
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, arg_index, sizeof (cl_double2), d_tomo_angle));
+    }
+}
+
+static gboolean load_tuned_parameters (UfoGeneralBackprojectTaskPrivate *priv);
+static void get_default_local_work_size (UfoGpuNode *node, gsize *local_work_size);
+static gboolean fits_local_work_size (UfoGeneralBackprojectTaskPrivate *priv, UfoGpuNode *node,
+                                      const gsize *local_work_size);
+
+static void
+get_work_size (UfoGeneralBackprojectTaskPrivate *priv,
+               UfoGpuNode *node,
+               UfoRequisition *requisition,
+               gsize *local_work_size,
+               gsize *global_work_size)
+{
+    /* Local work size either tuned or determined by the maximum supported work group size */
+    if (priv->tuned) {
+        memcpy (local_work_size, priv->local_work_size, 3 * sizeof (gsize));
+    } else {
+        get_default_local_work_size (node, local_work_size);
+    }
+
+    global_work_size[0] = requisition->dims[0] % local_work_size[0] ?
+                          NEXT_DIVISOR (requisition->dims[0], local_work_size[0]) :
+                          requisition->dims[0];
+    global_work_size[1] = requisition->dims[1] % local_work_size[1] ?
+                          NEXT_DIVISOR (requisition->dims[1], local_work_size[1]) :
+                          requisition->dims[1];
+    global_work_size[2] = priv->num_slices_per_chunk % local_work_size[2] ?
+                          NEXT_DIVISOR (priv->num_slices_per_chunk, local_work_size[2]) :
+                          priv->num_slices_per_chunk;
+}
+
+static void
+launch_chunk (UfoGeneralBackprojectTaskPrivate *priv,
+              UfoProfiler *profiler,
+              const cl_command_queue queue,
+              cl_kernel kernel,
+              guint arg_index,
+              guint chunk,
+              cl_mem chunk_mem,
+              UfoRequisition *requisition,
+              gsize *global_work_size,
+              gsize *local_work_size,
+              gboolean blocking)
+{
+    gint real_size[4];
+
+    /* The last chunk might be smaller */
+    real_size[0] = requisition->dims[0];
+    real_size[1] = requisition->dims[1];
+    real_size[2] = (gint) (MIN (priv->num_slices, (chunk + 1) * priv->num_slices_per_chunk) -
+                           chunk * priv->num_slices_per_chunk);
+    real_size[3] = 0;
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, REAL_SIZE_ARG_INDEX, sizeof (cl_int3), real_size));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, arg_index, sizeof (cl_mem), &chunk_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, arg_index + 1, sizeof (cl_mem), &priv->cl_regions[chunk]));
+    if (blocking) {
+        ufo_profiler_call_blocking (profiler, queue, kernel, 3, global_work_size, local_work_size);
+    } else {
+        ufo_profiler_call (profiler, queue, kernel, 3, global_work_size, local_work_size);
+    }
+}
+
+/**
+ * Backproject all cached projections into the chunks of @slab, one burst of
+ * projection images at a time. Projections go in the same order as in
+ * process () because the first burst initializes the volume.
+ */
+static void
+backproject_slab (UfoTask *task,
+                  UfoGpuNode *node,
+                  const cl_command_queue cmd_queue,
+                  UfoRequisition *requisition,
+                  guint slab)
+{
+    UfoGeneralBackprojectTaskPrivate *priv = UFO_GENERAL_BACKPROJECT_TASK_GET_PRIVATE (task);
+    UfoProfiler *profiler;
+    cl_kernel kernel;
+    cl_int iteration;
+    gsize local_work_size[3], global_work_size[3];
+    gsize projection_size;
+    const size_t origin[] = {0, 0, 0};
+    const size_t region[] = {priv->projection_width, priv->projection_height, 1};
+    guint start, burst, j, ki, chunk, first, last;
+
+    profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
+    get_work_size (priv, node, requisition, local_work_size, global_work_size);
+    projection_size = priv->projection_width * priv->projection_height;
+    first = slab * priv->num_slab_chunks;
+    last = MIN (priv->num_chunks, first + priv->num_slab_chunks);
+    g_log ("gbp", G_LOG_LEVEL_DEBUG, "Backprojecting slab %u with chunks %u to %u", slab, first, last - 1);
+
+    for (start = 0; start < priv->num_projections; start += burst) {
+        if (start + priv->burst <= priv->num_projections) {
+            kernel = priv->kernel;
+            burst = priv->burst;
+        } else {
+            kernel = priv->rest_kernel;
+            burst = priv->num_projections - start;
+        }
+
+        /* The in-order queue writes images only after the previous burst is done */
+        ki = STATIC_ARG_OFFSET + burst;
+        for (j = 0; j < burst; j++) {
+            UFO_RESOURCES_CHECK_CLERR (clEnqueueWriteImage (cmd_queue, priv->projections[j], CL_FALSE,
+                                                            origin, region, 0, 0,
+                                                            priv->cache + (start + j) * projection_size,
+                                                            0, NULL, NULL));
+            UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, STATIC_ARG_OFFSET + j, sizeof (cl_mem),
+                                                       &priv->projections[j]));
+            set_rotation_angle (priv, kernel, ki + j, start + j);
+        }
+        ki += burst;
+        iteration = (cl_int) start;
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, ki++, sizeof (cl_int), &iteration));
+
+        for (chunk = first; chunk < last; chunk++) {
+            launch_chunk (priv, profiler, cmd_queue, kernel, ki, chunk,
+                          priv->chunks[chunk % priv->num_slab_chunks],
+                          requisition, global_work_size, local_work_size, FALSE);
+        }
+        UFO_RESOURCES_CHECK_CLERR (clFlush (cmd_queue));
+    }
+
+    UFO_RESOURCES_CHECK_CLERR (clFinish (cmd_queue));
+}
+
 static void
 node_setup (UfoGeneralBackprojectTaskPrivate *priv,
-            UfoGpuNode *node)
+            UfoGpuNode *node,
+            UfoRequisition *requisition)
 {
     guint i;
     gboolean with_axis, with_volume, parallel_beam, perpendicular_detector, shifted_detector, shifted_source;
+    gboolean burst_given = priv->burst != 0;
     gchar *template, *kernel_code, *compiler_options = NULL;
+    gchar *device_name;
     const gchar *node_name;
     GValue *node_name_gvalue;
     const gchar compiler_options_tmpl[] = "-cl-nv-maxrregcount=%u";
@@ -1285,6 +1651,7 @@ node_setup (UfoGeneralBackprojectTaskPrivate *priv,
     /* GPU type specific settings */
     node_name_gvalue = ufo_gpu_node_get_info (node, UFO_GPU_NODE_INFO_NAME);
     node_name = g_value_get_string (node_name_gvalue);
+    device_name = g_strdup (node_name);
     if (!(node_props = g_hash_table_lookup (priv->node_props_table, node_name))) {
         g_log ("gbp", G_LOG_LEVEL_DEBUG, "GPU with name %s not in database", node_name);
         node_props = g_hash_table_lookup (priv->node_props_table, "GENERIC");
@@ -1344,6 +1711,27 @@ node_setup (UfoGeneralBackprojectTaskPrivate *priv,
              ft_values[priv->result_type].value_nick,
              st_values[priv->store_type].value_nick);
 
+    /* Parameters tuned earlier for this device and this kind of geometry */
+    g_free (priv->tuning_key);
+    priv->tuning_key = g_strdup_printf ("%s/vectorized=%d,axis=%d,volume=%d,perpendicular=%d,"
+                                        "shifted-detector=%d,shifted-source=%d,parallel=%d,"
+                                        "compute=%s,result=%s,store=%s,parameter=%s,size=%ux%u",
+                                        device_name, priv->vectorized, with_axis, with_volume,
+                                        perpendicular_detector, shifted_detector, shifted_source,
+                                        parallel_beam,
+                                        compute_type_values[priv->compute_type].value_nick,
+                                        ft_values[priv->result_type].value_nick,
+                                        st_values[priv->store_type].value_nick,
+                                        parameter_values[priv->parameter].value_nick,
+                                        1 << g_bit_storage (requisition->dims[0] - 1),
+                                        1 << g_bit_storage (requisition->dims[1] - 1));
+    g_free (device_name);
+
+    if (!priv->tuned && load_tuned_parameters (priv) && !burst_given) {
+        priv->burst = priv->tuned_burst;
+        g_log ("gbp", G_LOG_LEVEL_DEBUG, "Using tuned burst %u", priv->burst);
+    }
+
     if ((template = make_template (priv)) == NULL) {
         return;
     }
@@ -1360,11 +1748,12 @@ node_setup (UfoGeneralBackprojectTaskPrivate *priv,
         g_free (compiler_options);
         return;
     }
-    priv->kernel = ufo_resources_get_kernel_from_source (priv->resources,
-                                                         kernel_code,
-                                                         "backproject",
-                                                         compiler_options,
-                                                         NULL);
+    /* Generated kernels take seconds to compile, reuse binaries of earlier runs */
+    priv->kernel = ufo_kernel_cache_get_kernel (priv->resources,
+                                                kernel_code,
+                                                "backproject",
+                                                compiler_options,
+                                                NULL);
     g_free (kernel_code);
 
     if (priv->num_projections % priv->burst) {
@@ -1382,23 +1771,413 @@ node_setup (UfoGeneralBackprojectTaskPrivate *priv,
         }
 
         /* If num_projections % priv->burst != 0 we need one more kernel to process the remaining projections */
-        priv->rest_kernel = ufo_resources_get_kernel_from_source (priv->resources,
-                                                                  kernel_code,
-                                                                  "backproject",
-                                                                  compiler_options,
-                                                                  NULL);
+        priv->rest_kernel = ufo_kernel_cache_get_kernel (priv->resources,
+                                                         kernel_code,
+                                                         "backproject",
+                                                         compiler_options,
+                                                         NULL);
         /* g_printf ("%s", kernel_code); */
         g_free (kernel_code);
     }
     g_free (template);
     g_free (compiler_options);
 
+    /* The tuning file may stem from another driver or a different burst */
+    if (priv->tuned && !fits_local_work_size (priv, node, priv->local_work_size)) {
+        g_log ("gbp", G_LOG_LEVEL_DEBUG, "Tuned local size %zu x %zu x %zu too large for the kernels, using default",
+               priv->local_work_size[0], priv->local_work_size[1], priv->local_work_size[2]);
+        get_default_local_work_size (node, priv->local_work_size);
+    }
+}
+/*}}}*/
+
+/*{{{ Autotuning */
+static void
+get_default_local_work_size (UfoGpuNode *node, gsize *local_work_size)
+{
+    GValue *max_work_group_size_gval;
+    gulong max_work_group_size;
+    guint i;
+
+    /* Double the dimensions in turn up to the maximum work group size */
+    max_work_group_size_gval = ufo_gpu_node_get_info (node, UFO_GPU_NODE_INFO_MAX_WORK_GROUP_SIZE);
+    max_work_group_size = g_value_get_ulong (max_work_group_size_gval);
+    g_value_unset (max_work_group_size_gval);
+    local_work_size[0] = local_work_size[1] = local_work_size[2] = 1;
+    for (i = 0; i < (guint) log2 (max_work_group_size); i++) {
+        local_work_size[i % 3] *= 2;
+    }
+}
+
+static gboolean
+fits_local_work_size (UfoGeneralBackprojectTaskPrivate *priv,
+                      UfoGpuNode *node,
+                      const gsize *local_work_size)
+{
+    cl_kernel kernels[2] = {priv->kernel, priv->rest_kernel};
+    cl_command_queue cmd_queue;
+    cl_device_id device;
+    gsize max_work_item_sizes[3], kernel_work_group_size;
+    guint i;
+
+    cmd_queue = ufo_gpu_node_get_cmd_queue (node);
+    UFO_RESOURCES_CHECK_CLERR (clGetCommandQueueInfo (cmd_queue, CL_QUEUE_DEVICE,
+                                                      sizeof (cl_device_id), &device, NULL));
+    UFO_RESOURCES_CHECK_CLERR (clGetDeviceInfo (device, CL_DEVICE_MAX_WORK_ITEM_SIZES,
+                                                sizeof (max_work_item_sizes), max_work_item_sizes, NULL));
+
+    for (i = 0; i < 3; i++) {
+        if (local_work_size[i] > max_work_item_sizes[i]) {
+            return FALSE;
+        }
+    }
+
+    for (i = 0; i < G_N_ELEMENTS (kernels); i++) {
+        if (kernels[i] == NULL) {
+            continue;
+        }
+        UFO_RESOURCES_CHECK_CLERR (clGetKernelWorkGroupInfo (kernels[i], device, CL_KERNEL_WORK_GROUP_SIZE,
+                                                             sizeof (gsize), &kernel_work_group_size, NULL));
+        if (local_work_size[0] * local_work_size[1] * local_work_size[2] > kernel_work_group_size) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static gchar *
+get_tuning_filename (void)
+{
+    return g_build_filename (g_get_user_cache_dir (), "ufo", "general-backproject.tuning", NULL);
+}
+
+static gboolean
+load_tuned_parameters (UfoGeneralBackprojectTaskPrivate *priv)
+{
+    GKeyFile *key_file;
+    gchar *filename;
+    gint *local_work_size;
+    gsize length;
+    guint i;
+
+    key_file = g_key_file_new ();
+    filename = get_tuning_filename ();
+    priv->tuned = FALSE;
+
+    if (g_key_file_load_from_file (key_file, filename, G_KEY_FILE_NONE, NULL) &&
+        g_key_file_has_group (key_file, priv->tuning_key)) {
+        local_work_size = g_key_file_get_integer_list (key_file, priv->tuning_key, "local-work-size", &length, NULL);
+        priv->tuned_burst = (guint) g_key_file_get_integer (key_file, priv->tuning_key, "burst", NULL);
+        priv->tuned_slices_per_chunk = (guint) g_key_file_get_integer (key_file, priv->tuning_key, "slices-per-chunk", NULL);
+
+        if (local_work_size != NULL && length == 3 && priv->tuned_burst > 0) {
+            for (i = 0; i < 3; i++) {
+                priv->local_work_size[i] = (gsize) MAX (local_work_size[i], 1);
+            }
+            priv->tuned = TRUE;
+        }
+        g_free (local_work_size);
+    }
+
+    g_free (filename);
+    g_key_file_free (key_file);
+
+    return priv->tuned;
+}
+
+static void
+store_tuned_parameters (UfoGeneralBackprojectTaskPrivate *priv)
+{
+    GKeyFile *key_file;
+    GError *error = NULL;
+    gchar *filename, *dirname;
+    gint local_work_size[3];
+    guint i;
+
+    key_file = g_key_file_new ();
+    filename = get_tuning_filename ();
+    dirname = g_path_get_dirname (filename);
+
+    for (i = 0; i < 3; i++) {
+        local_work_size[i] = (gint) priv->local_work_size[i];
+    }
+
+    /* Keep the results for other devices and geometries */
+    g_key_file_load_from_file (key_file, filename, G_KEY_FILE_KEEP_COMMENTS, NULL);
+    g_key_file_set_integer (key_file, priv->tuning_key, "burst", (gint) priv->tuned_burst);
+    g_key_file_set_integer_list (key_file, priv->tuning_key, "local-work-size", local_work_size, 3);
+    g_key_file_set_integer (key_file, priv->tuning_key, "slices-per-chunk", (gint) priv->tuned_slices_per_chunk);
+
+    if (g_mkdir_with_parents (dirname, 0755) || !g_key_file_save_to_file (key_file, filename, &error)) {
+        g_warning ("Could not store tuned parameters in `%s': %s", filename,
+                   error ? error->message : g_strerror (errno));
+        g_clear_error (&error);
+    }
+
+    g_free (dirname);
+    g_free (filename);
+    g_key_file_free (key_file);
+}
+
+static void
+release_kernels (UfoGeneralBackprojectTaskPrivate *priv)
+{
     if (priv->kernel) {
-        UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->kernel));
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->kernel));
+        priv->kernel = NULL;
     }
     if (priv->rest_kernel) {
-        UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->rest_kernel));
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->rest_kernel));
+        priv->rest_kernel = NULL;
+    }
+}
+
+static void
+release_vector_arguments (UfoGeneralBackprojectTaskPrivate *priv)
+{
+    guint i;
+
+    if (priv->vector_arguments) {
+        for (i = 0; i < NUM_VECTOR_ARGUMENTS; i++) {
+            UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->vector_arguments[i]));
+        }
+        g_free (priv->vector_arguments);
+        priv->vector_arguments = NULL;
+    }
+}
+
+/**
+ * Time one backprojection of a burst of (blank) projections into @num_slices
+ * slices of @chunk. Returns seconds per projection and slice or G_MAXDOUBLE if
+ * the launch configuration is not supported.
+ */
+static gdouble
+run_benchmark (UfoGeneralBackprojectTaskPrivate *priv,
+               const cl_command_queue cmd_queue,
+               UfoRequisition *requisition,
+               guint num_slices,
+               const gsize *local_work_size,
+               cl_mem chunk,
+               cl_mem region)
+{
+    GTimer *timer;
+    gsize global_work_size[3];
+    gint real_size[4] = {requisition->dims[0], requisition->dims[1], num_slices, 0};
+    cl_float f_tomo_angle[2];
+    cl_double d_tomo_angle[2];
+    cl_int iteration = 0;
+    guint i, ki = STATIC_ARG_OFFSET + priv->burst;
+    gdouble elapsed;
+
+    global_work_size[0] = ROUND_UP (requisition->dims[0], local_work_size[0]);
+    global_work_size[1] = ROUND_UP (requisition->dims[1], local_work_size[1]);
+    global_work_size[2] = ROUND_UP (num_slices, local_work_size[2]);
+
+    for (i = 0; i < priv->burst; i++) {
+        if (priv->compute_type == CT_FLOAT) {
+            fill_sincos_cl_float (f_tomo_angle, i * G_PI / priv->burst);
+            UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, ki + i, sizeof (cl_float2), f_tomo_angle));
+        } else {
+            fill_sincos_cl_double (d_tomo_angle, i * G_PI / priv->burst);
+            UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, ki + i, sizeof (cl_double2), d_tomo_angle));
+        }
+    }
+    ki += priv->burst;
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, ki++, sizeof (cl_int), &iteration));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, ki++, sizeof (cl_mem), &chunk));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, ki, sizeof (cl_mem), &region));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, REAL_SIZE_ARG_INDEX, sizeof (cl_int3), real_size));
+
+    /* The first launch pays for lazy initialization in the driver */
+    if (clEnqueueNDRangeKernel (cmd_queue, priv->kernel, 3, NULL, global_work_size, local_work_size,
+                                0, NULL, NULL) != CL_SUCCESS) {
+        return G_MAXDOUBLE;
+    }
+    UFO_RESOURCES_CHECK_CLERR (clFinish (cmd_queue));
+
+    timer = g_timer_new ();
+    for (i = 0; i < AUTOTUNE_REPETITIONS; i++) {
+        UFO_RESOURCES_CHECK_CLERR (clEnqueueNDRangeKernel (cmd_queue, priv->kernel, 3, NULL, global_work_size,
+                                                           local_work_size, 0, NULL, NULL));
+    }
+    UFO_RESOURCES_CHECK_CLERR (clFinish (cmd_queue));
+    elapsed = g_timer_elapsed (timer, NULL);
+    g_timer_destroy (timer);
+
+    return elapsed / AUTOTUNE_REPETITIONS / (priv->burst * num_slices);
+}
+
+static gboolean
+setup_candidate (UfoTask *task,
+                 UfoGpuNode *node,
+                 const cl_command_queue cmd_queue,
+                 UfoRequisition *requisition,
+                 UfoRequisition *in_req,
+                 guint burst)
+{
+    UfoGeneralBackprojectTaskPrivate *priv = UFO_GENERAL_BACKPROJECT_TASK_GET_PRIVATE (task);
+    typedef void (*SetStaticArgsFunc) (UfoTask *, UfoRequisition *, const cl_kernel);
+    SetStaticArgsFunc set_static_args[2] = {set_static_args_cl_float, set_static_args_cl_double};
+    const size_t origin[] = {0, 0, 0};
+    const size_t region[] = {in_req->dims[0], in_req->dims[1], 1};
+    const cl_float zero[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    guint i;
+
+    release_kernels (priv);
+    release_vector_arguments (priv);
+    if (priv->projections) {
+        for (i = 0; i < priv->burst; i++) {
+            UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->projections[i]));
+        }
+        g_free (priv->projections);
+    }
+
+    priv->burst = burst;
+    priv->num_sets = 1;
+    priv->projections = (cl_mem *) g_malloc (burst * sizeof (cl_mem));
+    create_images (priv, in_req->dims[0], in_req->dims[1]);
+    for (i = 0; i < burst; i++) {
+        UFO_RESOURCES_CHECK_CLERR (clEnqueueFillImage (cmd_queue, priv->projections[i], zero,
+                                                       origin, region, 0, NULL, NULL));
+    }
+
+    node_setup (priv, node, requisition);
+    if (!priv->kernel) {
+        return FALSE;
+    }
+    set_static_args[priv->compute_type] (task, requisition, priv->kernel);
+
+    return TRUE;
+}
+
+/**
+ * Benchmark burst sizes, work group shapes and slices per chunk one after
+ * another with a synthetic problem of the real size and store the fastest
+ * combination for this device and geometry class. The kernels, images and
+ * vector arguments set up by this function are released again.
+ */
+static void
+autotune (UfoTask *task,
+          UfoGpuNode *node,
+          const cl_command_queue cmd_queue,
+          UfoRequisition *requisition,
+          UfoRequisition *in_req,
+          gboolean burst_given,
+          const gdouble region_start,
+          const gdouble region_step,
+          gsize slice_size,
+          cl_ulong max_global_mem_size)
+{
+    UfoGeneralBackprojectTaskPrivate *priv = UFO_GENERAL_BACKPROJECT_TASK_GET_PRIVATE (task);
+    typedef void (*CreateRegionFunc) (UfoGeneralBackprojectTaskPrivate *, const cl_command_queue,
+                                      const gdouble, const gdouble);
+    CreateRegionFunc create_regions[2] = {create_regions_cl_float, create_regions_cl_double};
+    static const guint bursts[] = {2, 4, 8, 12, 16, 24, 32};
+    static const gsize shapes[][3] = {{16, 16, 1}, {32, 8, 1}, {64, 4, 1}, {8, 8, 4},
+                                      {16, 8, 2}, {32, 4, 2}, {16, 4, 4}, {8, 8, 8}};
+    gsize default_shape[3], kernel_work_group_size, in_size;
+    guint i, num_slices, best_burst, best_slices;
+    guint saved_num_chunks, saved_slices_per_chunk;
+    cl_mem chunk, region, *saved_regions;
+    cl_device_id device;
+    cl_int cl_error;
+    gdouble time, best_time;
+
+    g_log ("gbp", G_LOG_LEVEL_MESSAGE, "Autotuning backprojection for %s", priv->tuning_key);
+    UFO_RESOURCES_CHECK_CLERR (clGetCommandQueueInfo (cmd_queue, CL_QUEUE_DEVICE,
+                                                      sizeof (cl_device_id), &device, NULL));
+    get_default_local_work_size (node, default_shape);
+    in_size = in_req->dims[0] * in_req->dims[1] * sizeof (cl_float);
+    num_slices = MIN (MIN (priv->num_slices, priv->num_slices_per_chunk), AUTOTUNE_MAX_SLICES);
+
+    /* Synthetic volume chunk and slice positions */
+    chunk = clCreateBuffer (priv->context, CL_MEM_WRITE_ONLY, num_slices * slice_size, NULL, &cl_error);
+    UFO_RESOURCES_CHECK_CLERR (cl_error);
+    saved_num_chunks = priv->num_chunks;
+    saved_slices_per_chunk = priv->num_slices_per_chunk;
+    saved_regions = priv->cl_regions;
+    priv->num_chunks = 1;
+    priv->num_slices_per_chunk = num_slices;
+    priv->cl_regions = &region;
+    create_regions[priv->compute_type] (priv, cmd_queue, region_start, region_step);
+    priv->num_chunks = saved_num_chunks;
+    priv->num_slices_per_chunk = saved_slices_per_chunk;
+    priv->cl_regions = saved_regions;
+
+    /* Burst sizes */
+    best_burst = priv->burst;
+    best_time = G_MAXDOUBLE;
+    for (i = 0; i < G_N_ELEMENTS (bursts); i++) {
+        if (burst_given && bursts[i] != best_burst) {
+            continue;
+        }
+        if (bursts[i] > priv->num_projections ||
+            bursts[i] * in_size + num_slices * slice_size > max_global_mem_size / 2) {
+            continue;
+        }
+        if (!setup_candidate (task, node, cmd_queue, requisition, in_req, bursts[i])) {
+            continue;
+        }
+        time = run_benchmark (priv, cmd_queue, requisition, num_slices, default_shape, chunk, region);
+        g_log ("gbp", G_LOG_LEVEL_DEBUG, "burst %u: %g ns per projection and slice", bursts[i], time * 1e9);
+        if (time < best_time) {
+            best_time = time;
+            best_burst = bursts[i];
+        }
+    }
+
+    /* Work group shapes with the fastest burst */
+    setup_candidate (task, node, cmd_queue, requisition, in_req, best_burst);
+    memcpy (priv->local_work_size, default_shape, sizeof (default_shape));
+    if (priv->kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clGetKernelWorkGroupInfo (priv->kernel, device, CL_KERNEL_WORK_GROUP_SIZE,
+                                                             sizeof (gsize), &kernel_work_group_size, NULL));
+        best_time = run_benchmark (priv, cmd_queue, requisition, num_slices, default_shape, chunk, region);
+        for (i = 0; i < G_N_ELEMENTS (shapes); i++) {
+            if (shapes[i][0] * shapes[i][1] * shapes[i][2] > kernel_work_group_size) {
+                continue;
+            }
+            time = run_benchmark (priv, cmd_queue, requisition, num_slices, shapes[i], chunk, region);
+            g_log ("gbp", G_LOG_LEVEL_DEBUG, "local size %zu x %zu x %zu: %g ns per projection and slice",
+                   shapes[i][0], shapes[i][1], shapes[i][2], time * 1e9);
+            if (time < best_time) {
+                best_time = time;
+                memcpy (priv->local_work_size, shapes[i], sizeof (shapes[i]));
+            }
+        }
+
+        /* Slices per chunk, 0 means as many as fit into one allocation */
+        best_slices = num_slices;
+        for (i = num_slices / 2; i >= priv->local_work_size[2] && i > 0; i /= 2) {
+            time = run_benchmark (priv, cmd_queue, requisition, i, priv->local_work_size, chunk, region);
+            g_log ("gbp", G_LOG_LEVEL_DEBUG, "%u slices: %g ns per projection and slice", i, time * 1e9);
+            if (time < best_time) {
+                best_time = time;
+                best_slices = i;
+            }
+        }
+        priv->tuned_slices_per_chunk = best_slices == num_slices ? 0 : best_slices;
+    }
+
+    priv->tuned_burst = best_burst;
+    g_log ("gbp", G_LOG_LEVEL_MESSAGE, "Tuned burst: %u, local size: %zu x %zu x %zu, slices per chunk: %u",
+           priv->tuned_burst, priv->local_work_size[0], priv->local_work_size[1], priv->local_work_size[2],
+           priv->tuned_slices_per_chunk);
+    store_tuned_parameters (priv);
+    priv->tuned = TRUE;
+
+    /* Leave everything as before apart from the burst */
+    release_kernels (priv);
+    release_vector_arguments (priv);
+    for (i = 0; i < priv->burst; i++) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->projections[i]));
     }
+    g_free (priv->projections);
+    priv->projections = NULL;
+    priv->burst = best_burst;
+    UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (region));
+    UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (chunk));
 }
 /*}}}*/
 
@@ -1474,9 +2253,11 @@ ufo_general_backproject_task_get_requisition (UfoTask *task,
     gdouble region_start, region_stop, region_step;
     gsize slice_size, chunk_size, volume_size, projections_size;
     GValue *max_global_mem_size_gvalue, *max_mem_alloc_size_gvalue;
-    cl_ulong max_global_mem_size, max_mem_alloc_size;
+    cl_ulong max_global_mem_size, max_mem_alloc_size, device_memory_limit;
+    const gchar *memory_limit;
     cl_int cl_error;
-    guint i;
+    gboolean burst_given;
+    guint i, num_slabs;
     typedef void (*CreateRegionFunc) (UfoGeneralBackprojectTaskPrivate *, const cl_command_queue,
                                       const gdouble, const gdouble);
     typedef void (*SetStaticArgsFunc) (UfoTask *, UfoRequisition *, const cl_kernel);
@@ -1508,7 +2289,8 @@ ufo_general_backproject_task_get_requisition (UfoTask *task,
 
     if (!priv->kernel) {
         /* First iteration, setup kernels */
-        node_setup (priv, node);
+        burst_given = priv->burst != 0;
+        node_setup (priv, node, requisition);
         if (!priv->kernel) {
             g_set_error_literal (error, UFO_TASK_ERROR, UFO_TASK_ERROR_GET_REQUISITION,
                                  "Error creating backprojection kernels");
@@ -1530,7 +2312,6 @@ ufo_general_backproject_task_get_requisition (UfoTask *task,
         max_global_mem_size_gvalue = ufo_gpu_node_get_info (node, UFO_GPU_NODE_INFO_GLOBAL_MEM_SIZE);
         max_global_mem_size = g_value_get_ulong (max_global_mem_size_gvalue);
         g_value_unset (max_global_mem_size_gvalue);
-        projections_size = priv->burst * in_req.dims[0] * in_req.dims[1] * sizeof (cl_float);
         slice_size = requisition->dims[0] * requisition->dims[1] * get_type_size (priv->store_type);
         volume_size = slice_size * priv->num_slices;
         max_mem_alloc_size_gvalue = ufo_gpu_node_get_info (node, UFO_GPU_NODE_INFO_MAX_MEM_ALLOC_SIZE);
@@ -1538,22 +2319,81 @@ ufo_general_backproject_task_get_requisition (UfoTask *task,
          * 8000) we get OpenCL errors, so limit it to 4 GB */
         max_mem_alloc_size = MIN (g_value_get_ulong (max_mem_alloc_size_gvalue), ((cl_ulong) 1) << 32);
         g_value_unset (max_mem_alloc_size_gvalue);
+        /* Not a property, only for exercising the out-of-core paths with small volumes */
+        if ((memory_limit = g_getenv ("UFO_GBP_DEVICE_MEMORY_LIMIT")) != NULL &&
+            (device_memory_limit = g_ascii_strtoull (memory_limit, NULL, 10)) > 0) {
+            /* Plan for less memory than the device has, keeping the usual ratio
+             * of the largest allocation to the global memory size */
+            max_global_mem_size = MIN (max_global_mem_size, device_memory_limit);
+            max_mem_alloc_size = MIN (max_mem_alloc_size, MAX (device_memory_limit / 4, slice_size));
+        }
         priv->num_slices_per_chunk = (guint) floor ((gdouble) MIN (max_mem_alloc_size, volume_size) / ((gdouble) slice_size));
-        if (projections_size + volume_size > max_global_mem_size) {
-            g_set_error_literal (error, UFO_TASK_ERROR, UFO_TASK_ERROR_GET_REQUISITION,
-                                 "Volume size doesn't fit to memory");
-            return;
+        if (priv->autotune && !priv->tuned) {
+            autotune (task, node, cmd_queue, requisition, &in_req, burst_given,
+                      region_start, region_step, slice_size, max_global_mem_size);
+            /* Build the kernels for the tuned burst */
+            node_setup (priv, node, requisition);
+            if (!priv->kernel) {
+                g_set_error_literal (error, UFO_TASK_ERROR, UFO_TASK_ERROR_GET_REQUISITION,
+                                     "Error creating backprojection kernels");
+                return;
+            }
         }
-
-        priv->projections = (cl_mem *) g_malloc (priv->burst * sizeof (cl_mem));
+        if (priv->tuned && priv->tuned_slices_per_chunk) {
+            priv->num_slices_per_chunk = MIN (priv->num_slices_per_chunk, priv->tuned_slices_per_chunk);
+        }
+        if (priv->multi_device) {
+            /* Every device gets at least one chunk */
+            setup_devices (priv, cmd_queue);
+            priv->num_slices_per_chunk = MIN (priv->num_slices_per_chunk,
+                                              (priv->num_slices - 1) / priv->num_devices + 1);
+        }
+        /* Projection sets alternate on one device, several devices already overlap */
+        priv->num_sets = priv->pipelined && priv->num_devices == 1 ? 2 : 1;
         /* Create subvolumes (because one large volume might be larger than the maximum allocatable memory chunk */
         priv->num_chunks = (priv->num_slices - 1) / priv->num_slices_per_chunk + 1;
         chunk_size = priv->num_slices_per_chunk * slice_size;
+        /* Each device holds only its own chunks */
+        projections_size = priv->num_sets * priv->burst * in_req.dims[0] * in_req.dims[1] * sizeof (cl_float);
+        priv->num_slab_chunks = priv->num_chunks;
+        priv->current_slab = 0;
+        if (projections_size + MIN (volume_size, ((priv->num_chunks - 1) / priv->num_devices + 1) * chunk_size) >
+            max_global_mem_size) {
+            if (priv->out_of_core && priv->num_devices > 1) {
+                g_set_error_literal (error, UFO_TASK_ERROR, UFO_TASK_ERROR_GET_REQUISITION,
+                                     "Volume size doesn't fit to memory and out-of-core "
+                                     "reconstruction is not supported on multiple devices");
+                return;
+            }
+            if (!priv->out_of_core || projections_size + chunk_size > max_global_mem_size) {
+                g_set_error_literal (error, UFO_TASK_ERROR, UFO_TASK_ERROR_GET_REQUISITION,
+                                     "Volume size doesn't fit to memory");
+                return;
+            }
+            /* As few slabs as possible, because every slab but the first reads
+             * all projections again, and all of them equally large */
+            num_slabs = (priv->num_chunks - 1) / ((max_global_mem_size - projections_size) / chunk_size) + 1;
+            priv->num_slab_chunks = (priv->num_chunks - 1) / num_slabs + 1;
+            g_log ("gbp", G_LOG_LEVEL_DEBUG, "Out-of-core: %u slabs of %u chunks", num_slabs, priv->num_slab_chunks);
+            if (!create_projection_cache (priv, in_req.dims[0], in_req.dims[1], error)) {
+                return;
+            }
+        }
+
+        priv->projections = (cl_mem *) g_malloc (priv->num_devices * priv->num_sets * priv->burst * sizeof (cl_mem));
+        if (priv->num_sets > 1) {
+            cl_device_id device;
+
+            UFO_RESOURCES_CHECK_CLERR (clGetCommandQueueInfo (cmd_queue, CL_QUEUE_DEVICE,
+                                                              sizeof (cl_device_id), &device, NULL));
+            priv->upload_queue = clCreateCommandQueue (priv->context, device, 0, &cl_error);
+            UFO_RESOURCES_CHECK_CLERR (cl_error);
+        }
         g_log ("gbp", G_LOG_LEVEL_DEBUG, "Max alloc size: %lu, max global size: %lu", max_mem_alloc_size, max_global_mem_size);
         g_log ("gbp", G_LOG_LEVEL_DEBUG, "Num chunks: %d, chunk size: %lu, num slices per chunk: %u",
                priv->num_chunks, chunk_size, priv->num_slices_per_chunk);
         g_log ("gbp", G_LOG_LEVEL_DEBUG, "Volume size: %lu, num slices: %u", volume_size, priv->num_slices);
-        priv->chunks = (cl_mem *) g_malloc (priv->num_chunks * sizeof (cl_mem));
+        priv->chunks = (cl_mem *) g_malloc (priv->num_slab_chunks * sizeof (cl_mem));
         if (!priv->chunks) {
             g_set_error_literal (error, UFO_TASK_ERROR, UFO_TASK_ERROR_GET_REQUISITION,
                                  "Error allocating volume chunks");
@@ -1565,7 +2405,7 @@ ufo_general_backproject_task_get_requisition (UfoTask *task,
                                  "Error allocating volume chunks");
             return;
         }
-        for (i = 0; i < priv->num_chunks; i++) {
+        for (i = 0; i < priv->num_slab_chunks; i++) {
             g_log ("gbp", G_LOG_LEVEL_DEBUG, "Creating chunk %d with size %lu",
                    i, MIN (volume_size, (i + 1) * chunk_size) - i * chunk_size);
             priv->chunks[i] = clCreateBuffer (priv->context,
@@ -1617,19 +2457,15 @@ ufo_general_backproject_task_process (UfoTask *task,
     UfoRequisition in_req;
     UfoGpuNode *node;
     UfoProfiler *profiler;
-    guint i, index, ki;
-    guint count, burst, num_slices_current_chunk;
+    guint i, j, index, ki, device;
+    guint count, burst, set;
+    gsize projection_size;
     cl_kernel kernel;
-    cl_command_queue cmd_queue;
-    gdouble rot_angle;
-    cl_float f_tomo_angle[2];
-    cl_double d_tomo_angle[2];
+    cl_mem *images;
+    cl_command_queue cmd_queue, queue;
     cl_int iteration;
     gsize local_work_size[3] = {1, 1, 1};
     gsize global_work_size[3];
-    gint real_size[4];
-    GValue *max_work_group_size_gval;
-    gulong max_work_group_size;
 
     priv = UFO_GENERAL_BACKPROJECT_TASK_GET_PRIVATE (task);
     node = UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task)));
@@ -1647,26 +2483,11 @@ ufo_general_backproject_task_process (UfoTask *task,
         index = count % burst;
     }
 
-    /* Local work size determined by the maximum supported work group size */
-    max_work_group_size_gval = ufo_gpu_node_get_info (node, UFO_GPU_NODE_INFO_MAX_WORK_GROUP_SIZE);
-    max_work_group_size = g_value_get_ulong (max_work_group_size_gval);
-    g_value_unset (max_work_group_size_gval);
-    for (i = 0; i < (guint) log2 (max_work_group_size); i++) {
-        local_work_size[i % 3] *= 2;
-    }
+    /* Consecutive bursts alternate between projection sets in pipelined mode */
+    set = (count / priv->burst) % priv->num_sets;
+    images = priv->projections + set * priv->burst;
 
-    global_work_size[0] = requisition->dims[0] % local_work_size[0] ?
-                          NEXT_DIVISOR (requisition->dims[0], local_work_size[0]) :
-                          requisition->dims[0];
-    global_work_size[1] = requisition->dims[1] % local_work_size[1] ?
-                          NEXT_DIVISOR (requisition->dims[1], local_work_size[1]) :
-                          requisition->dims[1];
-    global_work_size[2] = priv->num_slices_per_chunk % local_work_size[2] ?
-                          NEXT_DIVISOR (priv->num_slices_per_chunk, local_work_size[2]) :
-                          priv->num_slices_per_chunk;
-    real_size[0] = requisition->dims[0];
-    real_size[1] = requisition->dims[1];
-    real_size[3] = 0;
+    get_work_size (priv, node, requisition, local_work_size, global_work_size);
 
     if (!count) {
         g_log ("gbp", G_LOG_LEVEL_DEBUG, "Global work size: %lu %lu %lu, local: %lu %lu %lu",
@@ -1674,31 +2495,52 @@ ufo_general_backproject_task_process (UfoTask *task,
                local_work_size[0], local_work_size[1], local_work_size[2]);
     }
 
+    if (priv->cache && count < priv->num_projections) {
+        /* Keep the projection for the slabs which are not resident now */
+        projection_size = priv->projection_width * priv->projection_height;
+        memcpy (priv->cache + count * projection_size,
+                ufo_buffer_get_host_array (inputs[0], cmd_queue),
+                projection_size * sizeof (gfloat));
+    }
+
     /* Setup tomographic rotation angle dependent arguments */
     ki = STATIC_ARG_OFFSET + burst;
-    rot_angle = ufo_scarray_get_double (priv->geometry->axis->angle->z, count);
-    if (priv->compute_type == CT_FLOAT) {
-        fill_sincos_cl_float (f_tomo_angle, rot_angle);
-        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, ki + index, sizeof (cl_float2), f_tomo_angle));
+    set_rotation_angle (priv, kernel, ki + index, count);
+    if (priv->num_devices > 1) {
+        broadcast_to_images (priv, inputs[0], index, in_req.dims[0], in_req.dims[1]);
+    } else if (priv->num_sets > 1) {
+        upload_to_image (priv, cmd_queue, inputs[0], images[index], set, in_req.dims[0], in_req.dims[1]);
     } else {
-        fill_sincos_cl_double (d_tomo_angle, rot_angle);
-        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, ki + index, sizeof (cl_double2), d_tomo_angle));
+        copy_to_image (cmd_queue, inputs[0], images[index], in_req.dims[0], in_req.dims[1]);
     }
-    copy_to_image (cmd_queue, inputs[0], priv->projections[index], in_req.dims[0], in_req.dims[1]);
 
     if (index + 1 == burst) {
         profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
         ki += index + 1;
         iteration = (cl_int) (count + 1 - burst);
         UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, ki++, sizeof (cl_int), &iteration));
-        for (i = 0; i < priv->num_chunks; i++) {
-            /* The last chunk might be smaller */
-            num_slices_current_chunk = MIN (priv->num_slices,  (i + 1) * priv->num_slices_per_chunk) - i * priv->num_slices_per_chunk;
-            real_size[2] = (gint) num_slices_current_chunk;
-            UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, REAL_SIZE_ARG_INDEX, sizeof (cl_int3), real_size));
-            UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, ki, sizeof (cl_mem), &priv->chunks[i]));
-            UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, ki + 1, sizeof (cl_mem), &priv->cl_regions[i]));
-            ufo_profiler_call_blocking (profiler, cmd_queue, kernel, 3, global_work_size, local_work_size);
+        /* Only the first slab is resident while the projections stream in */
+        for (i = 0; i < priv->num_slab_chunks; i++) {
+            device = i % priv->num_devices;
+            queue = device ? priv->queues[device] : cmd_queue;
+            /* Arguments are captured at enqueue time, so one kernel serves all devices */
+            for (j = 0; j < burst; j++) {
+                UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, STATIC_ARG_OFFSET + j, sizeof (cl_mem),
+                                                           &images[device * priv->burst + j]));
+            }
+            launch_chunk (priv, profiler, queue, kernel, ki, i, priv->chunks[i], requisition,
+                          global_work_size, local_work_size, priv->num_sets == 1 && priv->num_devices == 1);
+        }
+        for (i = 1; i < priv->num_devices; i++) {
+            UFO_RESOURCES_CHECK_CLERR (clFlush (priv->queues[i]));
+        }
+        if (priv->num_sets > 1) {
+            /* Uploads into this set must wait until these kernels are done */
+            if (priv->set_events[set]) {
+                UFO_RESOURCES_CHECK_CLERR (clReleaseEvent (priv->set_events[set]));
+            }
+            UFO_RESOURCES_CHECK_CLERR (clEnqueueMarkerWithWaitList (cmd_queue, 0, NULL, &priv->set_events[set]));
+            UFO_RESOURCES_CHECK_CLERR (clFlush (cmd_queue));
         }
     }
 
@@ -1714,7 +2556,8 @@ ufo_general_backproject_task_generate (UfoTask *task,
     UfoGpuNode *node;
     cl_command_queue cmd_queue;
     cl_mem out_mem;
-    guint count, chunk_index;
+    guint count, chunk_index, device, slab;
+    cl_mem chunk;
     /* TODO: handle other data types */
     size_t bpp;
     size_t src_row_pitch, src_slice_pitch;
@@ -1725,8 +2568,9 @@ ufo_general_backproject_task_generate (UfoTask *task,
     priv = UFO_GENERAL_BACKPROJECT_TASK_GET_PRIVATE (task);
     node = UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task)));
     cmd_queue = ufo_gpu_node_get_cmd_queue (node);
-    out_mem = ufo_buffer_get_device_array (output, cmd_queue);
     chunk_index = priv->generated / priv->num_slices_per_chunk;
+    device = chunk_index % priv->num_devices;
+    slab = chunk_index / priv->num_slab_chunks;
     bpp = get_type_size (priv->store_type);
     g_object_get (task, "num_processed", &count, NULL);
 
@@ -1740,6 +2584,12 @@ ufo_general_backproject_task_generate (UfoTask *task,
         /* Don't send volume if not enough projections came */
         return FALSE;
     }
+    if (slab != priv->current_slab) {
+        /* All slices of the previous slab have been sent, compute the next one */
+        backproject_slab (task, node, cmd_queue, requisition, slab);
+        priv->current_slab = slab;
+    }
+    chunk = priv->chunks[chunk_index % priv->num_slab_chunks];
 
     src_row_pitch = requisition->dims[0] * bpp;
     src_slice_pitch = src_row_pitch * requisition->dims[1];
@@ -1751,12 +2601,24 @@ ufo_general_backproject_task_generate (UfoTask *task,
     g_log ("gbp", G_LOG_LEVEL_DEBUG, "region: %lu %lu %lu", region[0], region[1], region[2]);
     g_log ("gbp", G_LOG_LEVEL_DEBUG, "row pitch %lu, slice pitch %lu", src_row_pitch, src_slice_pitch);
 
-    UFO_RESOURCES_CHECK_CLERR (clEnqueueCopyBufferRect (cmd_queue,
-                                                        priv->chunks[chunk_index], out_mem,
-                                                        src_origin, dst_origin, region,
-                                                        src_row_pitch, src_slice_pitch,
-                                                        src_row_pitch, 0,
-                                                        0, NULL, NULL));
+    if (device) {
+        /* Gather slices from the other devices through the host */
+        UFO_RESOURCES_CHECK_CLERR (clEnqueueReadBufferRect (priv->queues[device],
+                                                            chunk, CL_TRUE,
+                                                            src_origin, dst_origin, region,
+                                                            src_row_pitch, src_slice_pitch,
+                                                            src_row_pitch, 0,
+                                                            ufo_buffer_get_host_array (output, NULL),
+                                                            0, NULL, NULL));
+    } else {
+        out_mem = ufo_buffer_get_device_array (output, cmd_queue);
+        UFO_RESOURCES_CHECK_CLERR (clEnqueueCopyBufferRect (cmd_queue,
+                                                            chunk, out_mem,
+                                                            src_origin, dst_origin, region,
+                                                            src_row_pitch, src_slice_pitch,
+                                                            src_row_pitch, 0,
+                                                            0, NULL, NULL));
+    }
 
     priv->generated++;
 
@@ -1866,6 +2728,22 @@ ufo_general_backproject_task_set_property (GObject *object,
         case PROP_GRAY_MAP_MAX:
             priv->gray_map_max = g_value_get_double (value);
             break;
+        case PROP_PIPELINED:
+            priv->pipelined = g_value_get_boolean (value);
+            break;
+        case PROP_AUTOTUNE:
+            priv->autotune = g_value_get_boolean (value);
+            break;
+        case PROP_MULTI_DEVICE:
+            priv->multi_device = g_value_get_boolean (value);
+            break;
+        case PROP_OUT_OF_CORE:
+            priv->out_of_core = g_value_get_boolean (value);
+            break;
+        case PROP_CACHE_DIRECTORY:
+            g_free (priv->cache_directory);
+            priv->cache_directory = g_value_dup_string (value);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -1971,6 +2849,21 @@ ufo_general_backproject_task_get_property (GObject *object,
         case PROP_GRAY_MAP_MAX:
             g_value_set_double (value, priv->gray_map_max);
             break;
+        case PROP_PIPELINED:
+            g_value_set_boolean (value, priv->pipelined);
+            break;
+        case PROP_AUTOTUNE:
+            g_value_set_boolean (value, priv->autotune);
+            break;
+        case PROP_MULTI_DEVICE:
+            g_value_set_boolean (value, priv->multi_device);
+            break;
+        case PROP_OUT_OF_CORE:
+            g_value_set_boolean (value, priv->out_of_core);
+            break;
+        case PROP_CACHE_DIRECTORY:
+            g_value_set_string (value, priv->cache_directory);
+            break;
         case PROP_ADDRESSING_MODE:
             g_value_set_enum (value, priv->addressing_mode);
             break;
@@ -1998,8 +2891,20 @@ ufo_general_backproject_task_finalize (GObject *object)
         g_hash_table_destroy (priv->node_props_table);
     }
 
+    for (i = 0; i < 2; i++) {
+        if (priv->set_events[i]) {
+            UFO_RESOURCES_CHECK_CLERR (clReleaseEvent (priv->set_events[i]));
+            priv->set_events[i] = NULL;
+        }
+    }
+
+    if (priv->upload_queue) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseCommandQueue (priv->upload_queue));
+        priv->upload_queue = NULL;
+    }
+
     if (priv->projections) {
-        for (i = 0; i < priv->burst; i++) {
+        for (i = 0; i < priv->num_devices * priv->num_sets * priv->burst; i++) {
             if (priv->projections[i] != NULL) {
                 UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->projections[i]));
                 priv->projections[i] = NULL;
@@ -2011,7 +2916,7 @@ ufo_general_backproject_task_finalize (GObject *object)
 
 
     if (priv->chunks) {
-        for (i = 0; i < priv->num_chunks; i++) {
+        for (i = 0; i < priv->num_slab_chunks; i++) {
             UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->chunks[i]));
         }
         g_free (priv->chunks);
@@ -2026,21 +2931,17 @@ ufo_general_backproject_task_finalize (GObject *object)
         priv->cl_regions = NULL;
     }
 
-    if (priv->vector_arguments) {
-        for (i = 0; i < NUM_VECTOR_ARGUMENTS; i++) {
-            UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->vector_arguments[i]));
-        }
-        g_free (priv->vector_arguments);
-        priv->vector_arguments = NULL;
-    }
-
-    if (priv->kernel) {
-        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->kernel));
-        priv->kernel = NULL;
-    }
-    if (priv->rest_kernel) {
-        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->rest_kernel));
-        priv->rest_kernel = NULL;
+    release_vector_arguments (priv);
+    release_kernels (priv);
+    g_free (priv->tuning_key);
+    priv->tuning_key = NULL;
+    g_free (priv->queues);
+    priv->queues = NULL;
+    g_free (priv->cache_directory);
+    priv->cache_directory = NULL;
+    if (priv->cache) {
+        munmap (priv->cache, priv->cache_size);
+        priv->cache = NULL;
     }
 
     if (priv->context) {
@@ -2303,6 +3204,41 @@ ufo_general_backproject_task_class_init (UfoGeneralBackprojectTaskClass *klass)
             -G_MAXDOUBLE, G_MAXDOUBLE, 0,
             G_PARAM_READWRITE);
 
+    properties[PROP_PIPELINED] =
+        g_param_spec_boolean ("pipelined",
+            "Overlap projection upload with backprojection",
+            "Use two sets of projection images and launch kernels without waiting, so that uploading a burst overlaps with backprojecting the previous one",
+            FALSE,
+            G_PARAM_READWRITE);
+
+    properties[PROP_AUTOTUNE] =
+        g_param_spec_boolean ("autotune",
+            "Benchmark launch parameters on first use",
+            "Benchmark burst, work group shape and slices per chunk if no tuned parameters are stored for this device and geometry class",
+            FALSE,
+            G_PARAM_READWRITE);
+
+    properties[PROP_MULTI_DEVICE] =
+        g_param_spec_boolean ("multi-device",
+            "Distribute volume chunks across all devices",
+            "Send every projection to all OpenCL devices and backproject the volume chunks on them in turn",
+            FALSE,
+            G_PARAM_READWRITE);
+
+    properties[PROP_OUT_OF_CORE] =
+        g_param_spec_boolean ("out-of-core",
+            "Reconstruct volumes larger than device memory in slabs",
+            "Keep projections in a host cache and reconstruct the volume in slabs which fit into device memory",
+            FALSE,
+            G_PARAM_READWRITE);
+
+    properties[PROP_CACHE_DIRECTORY] =
+        g_param_spec_string ("cache-directory",
+            "Directory for the out-of-core projection cache",
+            "Directory for the out-of-core projection cache, projections are kept in memory if not set",
+            NULL,
+            G_PARAM_READWRITE);
+
     properties[PROP_NUM_PROJECTIONS] =
         g_param_spec_uint ("num-projections",
             "Number of projections",
@@ -2330,6 +3266,20 @@ ufo_general_backproject_task_init(UfoGeneralBackprojectTask *self)
     self->priv->kernel = NULL;
     self->priv->rest_kernel = NULL;
     self->priv->sampler = NULL;
+    self->priv->upload_queue = NULL;
+    self->priv->set_events[0] = NULL;
+    self->priv->set_events[1] = NULL;
+    self->priv->num_sets = 1;
+    self->priv->num_devices = 1;
+    self->priv->queues = NULL;
+    self->priv->num_slab_chunks = 0;
+    self->priv->current_slab = 0;
+    self->priv->cache = NULL;
+    self->priv->cache_size = 0;
+    self->priv->tuning_key = NULL;
+    self->priv->tuned = FALSE;
+    self->priv->tuned_burst = 0;
+    self->priv->tuned_slices_per_chunk = 0;
 
     /* Scalars */
     self->priv->burst = 0;
@@ -2343,6 +3293,11 @@ ufo_general_backproject_task_init(UfoGeneralBackprojectTask *self)
     self->priv->addressing_mode = CL_ADDRESS_CLAMP;
     self->priv->gray_map_min = 0.0;
     self->priv->gray_map_max = 0.0;
+    self->priv->pipelined = FALSE;
+    self->priv->autotune = FALSE;
+    self->priv->multi_device = FALSE;
+    self->priv->out_of_core = FALSE;
+    self->priv->cache_directory = NULL;
 
     /* Value arrays */
     self->priv->region = ufo_scarray_new (3, G_TYPE_DOUBLE, NULL);
@@ -18,9 +18,16 @@
  */
 
 #include <gmodule.h>
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
 #include <stdlib.h>
 #include <string.h>
 #include <glob.h>
+#include <dirent.h>
+#include <glib/gstdio.h>
 
 #include "config.h"
 #include "ufo-read-task.h"
@@ -63,8 +70,33 @@ static GEnumValue type_values[] = {
     { 0, NULL, NULL}
 };
 
+typedef enum {
+    ITEM_FRAME,
+    ITEM_END_OF_FILE,
+    ITEM_END,
+    ITEM_ERROR
+} ItemKind;
+
+typedef struct {
+    ItemKind         kind;
+    UfoBuffer       *buffer;
+    UfoRequisition   requisition;
+    UfoBufferDepth   depth;
+    GError          *error;
+} ReadAheadItem;
+
+typedef struct {
+    UfoReadTaskPrivate  *priv;
+    GThread             *thread;
+    GAsyncQueue         *free_queue;
+    GAsyncQueue         *ready_queue;
+    UfoReader           *readers[TYPE_UNSPECIFIED];
+    guint                index;
+} ReadAheadWorker;
+
 struct _UfoReadTaskPrivate {
     gchar   *path;
+    gchar   *manifest;
     GList   *filenames;
     GList   *current_element;
     guint    current;
@@ -74,10 +106,15 @@ struct _UfoReadTaskPrivate {
     guint    number;
     gboolean done;
     gboolean single;
+    gboolean list_raw;
+    gboolean raw_warned;
 
     UfoBufferDepth  depth;
     gboolean convert;
 
+    guint    roi_x;
+    guint    roi_width;
+    guint    roi_x_step;
     guint    roi_y;
     guint    roi_height;
     guint    roi_step;
@@ -96,6 +133,35 @@ struct _UfoReadTaskPrivate {
 #endif
 
     FileType         type;
+
+    guint            prefetch;
+    guint            io_threads;
+    gint             cancelled;
+    guint            num_workers;
+    guint            current_worker;
+    ReadAheadWorker *workers;
+    ReadAheadItem   *item;
+    UfoRequisition   last_requisition;
+    gpointer         context;
+
+    gboolean         device_convert;
+    gchar           *dark;
+    gchar           *flat;
+    cl_kernel        kernels[7];
+    UfoBuffer       *native;
+    cl_mem           native_mem;
+    gsize            native_size;
+    cl_mem           dark_mem;
+    cl_mem           flat_mem;
+    gsize            reference_size;
+
+    guint            batch;
+    guint            num_batched;
+    gsize            batch_frame_size;
+    UfoBufferDepth   batch_depth;
+    UfoRequisition   batch_frame;
+    UfoRequisition   frame;
+    UfoBuffer       *staging;
 };
 
 static void ufo_task_interface_init (UfoTaskIface *iface);
@@ -113,6 +179,9 @@ enum {
     PROP_IMAGE_START,
     PROP_NUMBER,
     PROP_STEP,
+    PROP_ROI_X,
+    PROP_ROI_WIDTH,
+    PROP_ROI_X_STEP,
     PROP_ROI_Y,
     PROP_ROI_HEIGHT,
     PROP_ROI_STEP,
@@ -123,7 +192,20 @@ enum {
     PROP_RAW_BITDEPTH,
     PROP_RAW_PRE_OFFSET,
     PROP_RAW_POST_OFFSET,
+    PROP_RAW_MMAP,
+    PROP_TIFF_INDEX_CACHE,
+    PROP_HDF5_BATCH,
+    PROP_HDF5_SWMR,
+    PROP_HDF5_SWMR_TIMEOUT,
+    PROP_HDF5_DECOMPRESS_THREADS,
     PROP_TYPE,
+    PROP_PREFETCH,
+    PROP_IO_THREADS,
+    PROP_MANIFEST,
+    PROP_DEVICE_CONVERT,
+    PROP_DARK,
+    PROP_FLAT,
+    PROP_BATCH,
     N_PROPERTIES
 };
 
@@ -135,112 +217,1229 @@ ufo_read_task_new (void)
     return UFO_NODE (g_object_new (UFO_TYPE_READ_TASK, NULL));
 }
 
+/*
+ * Compare runs of digits by their numeric value so that "frame-10.tif" comes
+ * after "frame-9.tif". Zero-padded names sort exactly as with strcmp.
+ */
+static gint
+compare_natural (const gchar *a, const gchar *b)
+{
+    while (*a != '\0' && *b != '\0') {
+        if (g_ascii_isdigit (*a) && g_ascii_isdigit (*b)) {
+            const gchar *start_a;
+            const gchar *start_b;
+            gsize length_a;
+            gsize length_b;
+            gint result;
+
+            while (*a == '0' && g_ascii_isdigit (a[1]))
+                a++;
+
+            while (*b == '0' && g_ascii_isdigit (b[1]))
+                b++;
+
+            for (start_a = a; g_ascii_isdigit (*a); a++);
+            for (start_b = b; g_ascii_isdigit (*b); b++);
+
+            length_a = a - start_a;
+            length_b = b - start_b;
+
+            if (length_a != length_b)
+                return length_a < length_b ? -1 : 1;
+
+            result = strncmp (start_a, start_b, length_a);
+
+            if (result != 0)
+                return result;
+        }
+        else {
+            if (*a != *b)
+                return (guchar) *a < (guchar) *b ? -1 : 1;
+
+            a++;
+            b++;
+        }
+    }
+
+    return (guchar) *a - (guchar) *b;
+}
+
+static gint
+compare_filenames (gconstpointer a, gconstpointer b)
+{
+    const gchar *name_a = *((const gchar **) a);
+    const gchar *name_b = *((const gchar **) b);
+    gint result;
+
+    result = compare_natural (name_a, name_b);
+
+    /* "01" and "1" compare equal, keep the order stable anyway */
+    return result != 0 ? result : strcmp (name_a, name_b);
+}
+
+/*
+ * Listing only looks at the names. The suffixes are the ones the readers
+ * accept in can_open, which is not called to avoid touching every file.
+ */
+static gboolean
+is_readable (UfoReadTaskPrivate *priv, const gchar *filename)
+{
+    /* With an explicit type there is no need to ask every reader */
+    if (priv->type != TYPE_UNSPECIFIED)
+        return TRUE;
+
+#ifdef HAVE_TIFF
+    if (g_str_has_suffix (filename, ".tif") || g_str_has_suffix (filename, ".tiff"))
+        return TRUE;
+#endif
+
+    if (g_str_has_suffix (filename, ".edf"))
+        return TRUE;
+
+    if (!g_str_has_suffix (filename, ".raw"))
+        return FALSE;
+
+    if (!priv->list_raw && !priv->raw_warned) {
+        g_warning ("`raw-width', `raw-height' or `raw-bitdepth' was not set");
+        priv->raw_warned = TRUE;
+    }
+
+    return priv->list_raw;
+}
+
+static gboolean
+is_raw_configured (UfoReadTaskPrivate *priv)
+{
+    guint width;
+    guint height;
+    guint bitdepth;
+
+    g_object_get (priv->raw_reader, "width", &width, "height", &height, "bitdepth", &bitdepth, NULL);
+    return width > 0 && height > 0 && bitdepth > 0;
+}
+
+static gboolean
+has_wildcards (const gchar *pattern)
+{
+    return strpbrk (pattern, "*?[") != NULL;
+}
+
+/*
+ * List a single directory with readdir. Only the last path component may
+ * contain wildcards and only `*' and `?' are understood, everything else is
+ * left to glob.
+ */
+static gboolean
+list_directory (UfoReadTaskPrivate *priv, const gchar *pattern, GPtrArray *result)
+{
+    gchar *dirname;
+    gchar *basename;
+    GPatternSpec *spec;
+    DIR *dir;
+    struct dirent *entry;
+    gboolean prefix_dir;
+
+    if (pattern[0] == '~' || strpbrk (pattern, "[\\") != NULL)
+        return FALSE;
+
+    dirname = g_path_get_dirname (pattern);
+    basename = g_path_get_basename (pattern);
+
+    if (has_wildcards (dirname) || (dir = opendir (dirname)) == NULL) {
+        g_free (dirname);
+        g_free (basename);
+        return FALSE;
+    }
+
+    /* glob returns "name" and not "./name" for a pattern without a directory */
+    prefix_dir = strchr (pattern, G_DIR_SEPARATOR) != NULL;
+    spec = g_pattern_spec_new (basename);
+
+    while ((entry = readdir (dir)) != NULL) {
+        const gchar *name = entry->d_name;
+        gchar *filename;
+
+        /* like glob, wildcards do not match hidden files */
+        if (name[0] == '.' && basename[0] != '.')
+            continue;
+
+#ifdef _DIRENT_HAVE_D_TYPE
+        if (entry->d_type == DT_DIR)
+            continue;
+#endif
+
+        if (!g_pattern_match_string (spec, name))
+            continue;
+
+        filename = prefix_dir ? g_build_filename (dirname, name, NULL) : g_strdup (name);
+
+#ifdef _DIRENT_HAVE_D_TYPE
+        /* Some file systems do not report the type and links may point to
+         * directories, which glob excluded with GLOB_MARK */
+        if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK)
+#endif
+        {
+            GStatBuf st;
+
+            if (g_stat (filename, &st) == 0 && S_ISDIR (st.st_mode)) {
+                g_free (filename);
+                continue;
+            }
+        }
+
+        if (is_readable (priv, filename))
+            g_ptr_array_add (result, filename);
+        else
+            g_free (filename);
+    }
+
+    closedir (dir);
+    g_pattern_spec_free (spec);
+    g_free (dirname);
+    g_free (basename);
+    return TRUE;
+}
+
+static void
+list_glob (UfoReadTaskPrivate *priv, const gchar *pattern, GPtrArray *result)
+{
+    glob_t filenames;
+
+    glob (pattern, GLOB_MARK | GLOB_TILDE, NULL, &filenames);
+
+    for (guint i = 0; i < filenames.gl_pathc; i++) {
+        const gchar *filename = filenames.gl_pathv[i];
+
+        if (is_readable (priv, filename))
+            g_ptr_array_add (result, g_strdup (filename));
+    }
+
+    globfree (&filenames);
+}
+
+/*
+ * The manifest is a list of file names preceded by a header that identifies
+ * the pattern, the type and the modification time of the directory in
+ * nanoseconds. Adding, removing or renaming files changes the time, so a
+ * valid manifest is recognized without reading the directory at all. Changes
+ * within the resolution of the file system's time stamps go unnoticed.
+ */
+static gchar *
+get_manifest_header (UfoReadTaskPrivate *priv, const gchar *pattern)
+{
+    GStatBuf st;
+    gchar *dirname;
+    gchar *header = NULL;
+    glong nsec;
+
+    dirname = g_path_get_dirname (pattern);
+
+    if (g_stat (dirname, &st) == 0) {
+#ifdef __APPLE__
+        nsec = st.st_mtimespec.tv_nsec;
+#else
+        nsec = st.st_mtim.tv_nsec;
+#endif
+        header = g_strdup_printf ("# ufo-read manifest 3 %i %" G_GINT64_FORMAT ".%09li %s",
+                                  priv->type, (gint64) st.st_mtime, nsec, pattern);
+    }
+
+    g_free (dirname);
+    return header;
+}
+
+static GPtrArray *
+load_manifest (UfoReadTaskPrivate *priv, const gchar *header)
+{
+    GPtrArray *result;
+    gchar *contents;
+    gchar *line;
+    gchar *end;
+
+    if (!g_file_get_contents (priv->manifest, &contents, NULL, NULL))
+        return NULL;
+
+    end = strchr (contents, '\n');
+
+    if (end == NULL || strncmp (contents, header, end - contents) != 0 || strlen (header) != (gsize) (end - contents)) {
+        g_free (contents);
+        return NULL;
+    }
+
+    result = g_ptr_array_new ();
+
+    for (line = end + 1; *line != '\0'; line = end + 1) {
+        end = strchr (line, '\n');
+
+        if (end == NULL) {
+            g_ptr_array_add (result, g_strdup (line));
+            break;
+        }
+
+        if (end > line)
+            g_ptr_array_add (result, g_strndup (line, end - line));
+    }
+
+    g_free (contents);
+    return result;
+}
+
+static void
+save_manifest (UfoReadTaskPrivate *priv, const gchar *header, GPtrArray *filenames)
+{
+    GString *contents;
+    GError *error = NULL;
+
+    contents = g_string_new (header);
+    g_string_append_c (contents, '\n');
+
+    for (guint i = 0; i < filenames->len; i++) {
+        g_string_append (contents, g_ptr_array_index (filenames, i));
+        g_string_append_c (contents, '\n');
+    }
+
+    if (!g_file_set_contents (priv->manifest, contents->str, contents->len, &error)) {
+        g_warning ("Could not write manifest: %s", error->message);
+        g_error_free (error);
+    }
+
+    g_string_free (contents, TRUE);
+}
+
 static GList *
 read_filenames (UfoReadTaskPrivate *priv)
 {
     GList *result;
+    GPtrArray *filenames = NULL;
     gchar *pattern;
-    glob_t filenames;
+    gchar *header = NULL;
+
+    result = NULL;
+
+#ifdef WITH_HDF5
+    if (ufo_reader_can_open (UFO_READER (priv->hdf5_reader), priv->path) || priv->type == TYPE_HDF5)
+        return g_list_append (NULL, g_strdup (priv->path));
+#endif
+
+    priv->list_raw = is_raw_configured (priv);
+    priv->raw_warned = FALSE;
+
+    if (g_file_test (priv->path, G_FILE_TEST_IS_REGULAR)) {
+        /* This is a single file without any asterisks */
+        priv->single = TRUE;
+
+        if (is_readable (priv, priv->path))
+            return g_list_append (NULL, g_strdup (priv->path));
+
+        return NULL;
+    }
+
+    /* This is a directory which we may have to glob */
+    priv->single = FALSE;
+    pattern = strstr (priv->path, "*") != NULL ? g_strdup (priv->path) : g_build_filename (priv->path, "*", NULL);
+
+    if (priv->manifest != NULL) {
+        header = get_manifest_header (priv, pattern);
+
+        if (header != NULL)
+            filenames = load_manifest (priv, header);
+    }
+
+    if (filenames == NULL) {
+        filenames = g_ptr_array_new ();
+
+        if (!list_directory (priv, pattern, filenames))
+            list_glob (priv, pattern, filenames);
+
+        g_ptr_array_sort (filenames, compare_filenames);
+
+        if (header != NULL)
+            save_manifest (priv, header, filenames);
+    }
+
+    for (guint i = filenames->len; i > 0; i--)
+        result = g_list_prepend (result, g_ptr_array_index (filenames, i - 1));
+
+    g_ptr_array_free (filenames, TRUE);
+    g_free (header);
+    g_free (pattern);
+    return result;
+}
+
+static struct {
+    UfoBufferDepth   depth;
+    const gchar     *name;
+    gsize            size;
+} convert_kernels[] = {
+    { UFO_BUFFER_DEPTH_8U,  "convert_u8",  1 },
+    { UFO_BUFFER_DEPTH_8S,  "convert_s8",  1 },
+    { UFO_BUFFER_DEPTH_16U, "convert_u16", 2 },
+    { UFO_BUFFER_DEPTH_16S, "convert_s16", 2 },
+    { UFO_BUFFER_DEPTH_32U, "convert_u32", 4 },
+    { UFO_BUFFER_DEPTH_32S, "convert_s32", 4 },
+    { UFO_BUFFER_DEPTH_32F, "convert_f32", 4 },
+};
+
+static gint
+get_convert_kernel_index (UfoBufferDepth depth)
+{
+    for (guint i = 0; i < G_N_ELEMENTS (convert_kernels); i++) {
+        if (convert_kernels[i].depth == depth)
+            return i;
+    }
+
+    return -1;
+}
+
+static void
+release_device_data (UfoReadTaskPrivate *priv)
+{
+    for (guint i = 0; i < G_N_ELEMENTS (convert_kernels); i++) {
+        if (priv->kernels[i] != NULL) {
+            UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->kernels[i]));
+            priv->kernels[i] = NULL;
+        }
+    }
+
+    if (priv->native_mem != NULL) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->native_mem));
+        priv->native_mem = NULL;
+        priv->native_size = 0;
+    }
+
+    if (priv->dark_mem != NULL) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->dark_mem));
+        priv->dark_mem = NULL;
+    }
+
+    if (priv->flat_mem != NULL) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->flat_mem));
+        priv->flat_mem = NULL;
+    }
+
+    if (priv->native != NULL) {
+        g_object_unref (priv->native);
+        priv->native = NULL;
+    }
+
+    if (priv->staging != NULL) {
+        g_object_unref (priv->staging);
+        priv->staging = NULL;
+    }
+}
+
+static void start_read_ahead (UfoReadTaskPrivate *priv);
+static void stop_read_ahead (UfoReadTaskPrivate *priv);
+
+static void
+ufo_read_task_setup (UfoTask *task,
+                     UfoResources *resources,
+                     GError **error)
+{
+    UfoReadTaskPrivate *priv;
+
+    priv = UFO_READ_TASK_GET_PRIVATE (task);
+    priv->context = ufo_resources_get_context (resources);
+    stop_read_ahead (priv);
+    release_device_data (priv);
+
+    if ((priv->dark != NULL || priv->flat != NULL) && !priv->device_convert) {
+        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                     "`dark' and `flat' require `device-convert'");
+        return;
+    }
+
+#ifdef WITH_HDF5
+    {
+        gboolean swmr;
+
+        /* Otherwise every end of data would wait for the full timeout */
+        g_object_get (priv->hdf5_reader, "swmr", &swmr, NULL);
+
+        if (swmr && !ufo_hdf5_reader_supports_swmr ()) {
+            g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                         "`hdf5-swmr' requires HDF5 1.10 or newer");
+            return;
+        }
+    }
+#endif
+
+    if (priv->device_convert) {
+        for (guint i = 0; i < G_N_ELEMENTS (convert_kernels); i++) {
+            priv->kernels[i] = ufo_resources_get_kernel (resources, "convert.cl", convert_kernels[i].name, NULL, error);
+
+            if (priv->kernels[i] == NULL)
+                return;
+
+            UFO_RESOURCES_CHECK_SET_AND_RETURN (clRetainKernel (priv->kernels[i]), error);
+        }
+    }
+
+    if (priv->filenames != NULL) {
+        g_list_free_full (priv->filenames, (GDestroyNotify) g_free);
+        priv->filenames = NULL;
+    }
+
+    priv->filenames = read_filenames (priv);
+
+    if (priv->filenames == NULL) {
+        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                     "`%s' does not match any files", priv->path);
+        return;
+    }
+
+    if (priv->single)
+        priv->current_element = g_list_first (priv->filenames);
+    else
+        priv->current_element = g_list_nth (priv->filenames, priv->start);
+
+    if (priv->current_element == NULL) {
+        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                     "start=%i skips too many files", priv->start);
+        return;
+    }
+
+    priv->current = 0;
+    priv->done = FALSE;
+
+    if (priv->prefetch > 0)
+        start_read_ahead (priv);
+}
+
+/* Readers are probed in this order, the first one that accepts a file wins */
+static const FileType probe_order[] = {
+#ifdef HAVE_TIFF
+    TYPE_TIFF,
+#endif
+#ifdef WITH_HDF5
+    TYPE_HDF5,
+#endif
+    TYPE_EDF,
+    TYPE_RAW,
+};
+
+static UfoReader *
+select_reader (UfoReader **readers, FileType type, const gchar *filename)
+{
+    for (guint i = 0; i < G_N_ELEMENTS (probe_order); i++) {
+        UfoReader *reader = readers[probe_order[i]];
+
+        if (ufo_reader_can_open (reader, filename) || type == probe_order[i])
+            return reader;
+    }
+
+    return NULL;
+}
+
+static void
+get_readers (UfoReadTaskPrivate *priv, UfoReader **readers)
+{
+#ifdef HAVE_TIFF
+    readers[TYPE_TIFF] = UFO_READER (priv->tiff_reader);
+#endif
+#ifdef WITH_HDF5
+    readers[TYPE_HDF5] = UFO_READER (priv->hdf5_reader);
+#endif
+    readers[TYPE_EDF] = UFO_READER (priv->edf_reader);
+    readers[TYPE_RAW] = UFO_READER (priv->raw_reader);
+}
+
+static UfoReader *
+get_reader (UfoReadTaskPrivate *priv, const gchar *filename)
+{
+    UfoReader *readers[TYPE_UNSPECIFIED];
+
+    get_readers (priv, readers);
+    return select_reader (readers, priv->type, filename);
+}
+
+static UfoReader *
+clone_reader (UfoReader *reader)
+{
+    GObject *clone;
+    GParamSpec **pspecs;
+    guint n_pspecs;
+
+    clone = g_object_new (G_OBJECT_TYPE (reader), NULL);
+    pspecs = g_object_class_list_properties (G_OBJECT_GET_CLASS (reader), &n_pspecs);
+
+    for (guint i = 0; i < n_pspecs; i++) {
+        GValue value = G_VALUE_INIT;
+
+        if ((pspecs[i]->flags & G_PARAM_READWRITE) != G_PARAM_READWRITE)
+            continue;
+
+        g_value_init (&value, pspecs[i]->value_type);
+        g_object_get_property (G_OBJECT (reader), pspecs[i]->name, &value);
+        g_object_set_property (clone, pspecs[i]->name, &value);
+        g_value_unset (&value);
+    }
+
+    g_free (pspecs);
+    return UFO_READER (clone);
+}
+
+static UfoReader *
+get_worker_reader (ReadAheadWorker *worker, const gchar *filename)
+{
+    /*
+     * Only probe with the worker's own instances, can_open of the shared ones
+     * is not safe to call from several threads (HDF5 in particular)
+     */
+    return select_reader (worker->readers, worker->priv->type, filename);
+}
+
+static ReadAheadItem *
+make_marker (ItemKind kind, GError *error)
+{
+    ReadAheadItem *item;
+
+    item = g_new0 (ReadAheadItem, 1);
+    item->kind = kind;
+    item->error = error;
+    return item;
+}
+
+static ReadAheadItem *
+pop_free_item (ReadAheadWorker *worker)
+{
+    ReadAheadItem *item = NULL;
+
+    while (item == NULL && !g_atomic_int_get (&worker->priv->cancelled))
+        item = g_async_queue_timeout_pop (worker->free_queue, G_USEC_PER_SEC / 10);
+
+    return item;
+}
+
+static gpointer
+read_ahead_worker (ReadAheadWorker *worker)
+{
+    UfoReadTaskPrivate *priv;
+    UfoRequisition requisition;
+    UfoBufferDepth depth;
+    GList *element;
+    GError *error = NULL;
+    guint image_start;
+    guint roi_width;
+    guint roi_height;
+    guint stride;
+
+    priv = worker->priv;
+    image_start = priv->image_start;
+    roi_width = priv->roi_width;
+    roi_height = priv->roi_height;
+    stride = priv->step * priv->num_workers;
+    element = g_list_nth (priv->current_element, worker->index * priv->step);
+
+    /* Same logic as the synchronous path, just for every num_workers'th file */
+    while (element != NULL && !g_atomic_int_get (&priv->cancelled)) {
+        const gchar *filename;
+        UfoReader *reader;
+        gsize num_images = 0;
+
+        filename = (gchar *) element->data;
+        reader = get_worker_reader (worker, filename);
+
+        if (!ufo_reader_open (reader, filename, image_start, &error))
+            break;
+
+        if (!ufo_reader_get_meta (reader, &requisition, &num_images, &depth, &error)) {
+            ufo_reader_close (reader);
+            break;
+        }
+
+        if (!roi_width)
+            roi_width = requisition.dims[0] - MIN (priv->roi_x, requisition.dims[0]);
+
+        if (priv->roi_x >= requisition.dims[0] || priv->roi_x + roi_width > requisition.dims[0]) {
+            g_set_error (&error, UFO_TASK_ERROR, UFO_TASK_ERROR_GET_REQUISITION,
+                         "read: horizontal ROI %i:%i exceeds width %zu of `%s'",
+                         priv->roi_x, priv->roi_x + roi_width, requisition.dims[0], filename);
+            ufo_reader_close (reader);
+            break;
+        }
+
+        if (!roi_height)
+            roi_height = requisition.dims[1] - MIN (priv->roi_y, requisition.dims[1]);
+
+        if (priv->roi_y >= requisition.dims[1] || priv->roi_y + roi_height > requisition.dims[1]) {
+            g_set_error (&error, UFO_TASK_ERROR, UFO_TASK_ERROR_GET_REQUISITION,
+                         "read: vertical ROI %i:%i exceeds height %zu of `%s'",
+                         priv->roi_y, priv->roi_y + roi_height, requisition.dims[1], filename);
+            ufo_reader_close (reader);
+            break;
+        }
+
+        if (depth > 32)
+            depth = UFO_BUFFER_DEPTH_32F;
+
+        requisition.dims[0] = (roi_width - 1) / priv->roi_x_step + 1;
+        requisition.dims[1] = (roi_height - 1) / priv->roi_step + 1;
+
+        if (image_start >= num_images)
+            image_start -= num_images;
+        else
+            image_start = 0;
+
+        while (image_start == 0 && ufo_reader_data_available (reader)) {
+            ReadAheadItem *item;
+            guint num_processed;
+
+            item = pop_free_item (worker);
+
+            if (item == NULL)
+                break;
+
+            if (ufo_buffer_cmp_dimensions (item->buffer, &requisition))
+                ufo_buffer_resize (item->buffer, &requisition);
+
+            item->requisition = requisition;
+            item->depth = depth;
+            num_processed = ufo_reader_read (reader, ufo_buffer_get_host_array (item->buffer, NULL), &requisition, 1,
+                                             priv->roi_x, roi_width, priv->roi_x_step,
+                                             priv->roi_y, roi_height, priv->roi_step, priv->image_step);
+            image_start = priv->image_step - num_processed;
+
+            /* With device-convert the task converts while uploading */
+            if ((depth != UFO_BUFFER_DEPTH_32F) && priv->convert && !priv->device_convert) {
+                ufo_buffer_convert (item->buffer, depth);
+                item->depth = UFO_BUFFER_DEPTH_32F;
+            }
+
+            g_async_queue_push (worker->ready_queue, item);
+        }
+
+        ufo_reader_close (reader);
+        g_async_queue_push (worker->ready_queue, make_marker (ITEM_END_OF_FILE, NULL));
+        element = g_list_nth (element, stride);
+    }
+
+    g_async_queue_push (worker->ready_queue, make_marker (error != NULL ? ITEM_ERROR : ITEM_END, error));
+    return NULL;
+}
+
+static void
+free_item (ReadAheadItem *item)
+{
+    if (item->buffer != NULL)
+        g_object_unref (item->buffer);
+
+    if (item->error != NULL)
+        g_error_free (item->error);
+
+    g_free (item);
+}
+
+static void
+start_read_ahead (UfoReadTaskPrivate *priv)
+{
+    UfoRequisition requisition = { .n_dims = 2, .dims = { 1, 1 } };
+    guint buffers_per_worker;
+
+    priv->num_workers = priv->io_threads;
+
+    if (priv->num_workers > 1 && (priv->image_start > 0 || priv->image_step > 1)) {
+        /* Skipping images carries over file boundaries and is inherently sequential */
+        g_warning ("read: image-start and image-step require io-threads=1");
+        priv->num_workers = 1;
+    }
+
+    /* Per-worker pools, otherwise a worker that runs ahead could starve the one we wait for */
+    buffers_per_worker = (priv->prefetch + priv->num_workers - 1) / priv->num_workers;
+    priv->workers = g_new0 (ReadAheadWorker, priv->num_workers);
+    priv->current_worker = 0;
+    priv->item = NULL;
+    priv->last_requisition = requisition;
+    g_atomic_int_set (&priv->cancelled, FALSE);
+
+    for (guint i = 0; i < priv->num_workers; i++) {
+        ReadAheadWorker *worker = &priv->workers[i];
+
+        worker->priv = priv;
+        worker->index = i;
+        worker->free_queue = g_async_queue_new ();
+        worker->ready_queue = g_async_queue_new ();
+
+        /* Each worker reads with its own instances, configured like ours */
+        get_readers (priv, worker->readers);
+
+        for (guint j = 0; j < TYPE_UNSPECIFIED; j++)
+            worker->readers[j] = clone_reader (worker->readers[j]);
+
+        for (guint j = 0; j < buffers_per_worker; j++) {
+            ReadAheadItem *item = make_marker (ITEM_FRAME, NULL);
+
+            item->buffer = ufo_buffer_new (&requisition, priv->context);
+            g_async_queue_push (worker->free_queue, item);
+        }
+    }
+
+    for (guint i = 0; i < priv->num_workers; i++)
+        priv->workers[i].thread = g_thread_new ("read-ahead", (GThreadFunc) read_ahead_worker, &priv->workers[i]);
+}
+
+static void
+stop_read_ahead (UfoReadTaskPrivate *priv)
+{
+    ReadAheadItem *item;
+
+    if (priv->workers == NULL)
+        return;
+
+    g_atomic_int_set (&priv->cancelled, TRUE);
+
+    for (guint i = 0; i < priv->num_workers; i++) {
+        ReadAheadWorker *worker = &priv->workers[i];
+
+        g_thread_join (worker->thread);
+
+        while ((item = g_async_queue_try_pop (worker->ready_queue)) != NULL)
+            free_item (item);
+
+        while ((item = g_async_queue_try_pop (worker->free_queue)) != NULL)
+            free_item (item);
+
+        g_async_queue_unref (worker->ready_queue);
+        g_async_queue_unref (worker->free_queue);
+
+        for (guint j = 0; j < TYPE_UNSPECIFIED; j++)
+            g_object_unref (worker->readers[j]);
+    }
+
+    if (priv->item != NULL) {
+        free_item (priv->item);
+        priv->item = NULL;
+    }
+
+    g_free (priv->workers);
+    priv->workers = NULL;
+    priv->num_workers = 0;
+}
+
+static void
+get_read_ahead_requisition (UfoReadTaskPrivate *priv,
+                            UfoRequisition *requisition,
+                            GError **error)
+{
+    while (priv->item == NULL && !priv->done && priv->current < priv->number) {
+        ReadAheadWorker *worker;
+        ReadAheadItem *item;
+
+        worker = &priv->workers[priv->current_worker];
+        item = g_async_queue_pop (worker->ready_queue);
+
+        switch (item->kind) {
+            case ITEM_FRAME:
+                priv->item = item;
+                priv->last_requisition = item->requisition;
+                break;
+            case ITEM_END_OF_FILE:
+                /* Files are dealt out round-robin, so the next one is with the next worker */
+                priv->current_worker = (priv->current_worker + 1) % priv->num_workers;
+                free_item (item);
+                break;
+            case ITEM_ERROR:
+                g_propagate_error (error, item->error);
+                item->error = NULL;
+                priv->done = TRUE;
+                free_item (item);
+                return;
+            case ITEM_END:
+                priv->done = TRUE;
+                free_item (item);
+                break;
+        }
+    }
+
+    *requisition = priv->last_requisition;
+}
+
+static gsize
+get_num_pixels (UfoRequisition *requisition)
+{
+    gsize n = 1;
+
+    for (guint i = 0; i < requisition->n_dims; i++)
+        n *= requisition->dims[i];
+
+    return n;
+}
+
+static cl_mem
+load_reference (UfoReadTaskPrivate *priv,
+                const gchar *filename,
+                UfoRequisition *requisition,
+                GError **error)
+{
+    UfoReader *reader;
+    UfoBuffer *buffer;
+    UfoRequisition full;
+    UfoBufferDepth depth;
+    gsize num_images;
+    guint roi_width;
+    guint roi_height;
+    cl_mem mem;
+    cl_int errcode;
+
+    reader = get_reader (priv, filename);
+
+    if (reader == NULL) {
+        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_GET_REQUISITION,
+                     "read: cannot read `%s'", filename);
+        return NULL;
+    }
+
+    /* The shared reader may still have the current file open */
+    reader = clone_reader (reader);
+
+    if (!ufo_reader_open (reader, filename, 0, error) ||
+        !ufo_reader_get_meta (reader, &full, &num_images, &depth, error)) {
+        g_object_unref (reader);
+        return NULL;
+    }
+
+    roi_width = priv->roi_width ? priv->roi_width : full.dims[0] - MIN (priv->roi_x, full.dims[0]);
+    roi_height = priv->roi_height ? priv->roi_height : full.dims[1] - MIN (priv->roi_y, full.dims[1]);
+
+    if (priv->roi_x + roi_width > full.dims[0] || priv->roi_y + roi_height > full.dims[1] ||
+        (roi_width - 1) / priv->roi_x_step + 1 != requisition->dims[0] ||
+        (roi_height - 1) / priv->roi_step + 1 != requisition->dims[1]) {
+        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_GET_REQUISITION,
+                     "read: size of `%s' does not match the data", filename);
+        ufo_reader_close (reader);
+        g_object_unref (reader);
+        return NULL;
+    }
+
+    buffer = ufo_buffer_new (requisition, priv->context);
+    ufo_reader_read (reader, ufo_buffer_get_host_array (buffer, NULL), requisition, 1,
+                     priv->roi_x, roi_width, priv->roi_x_step,
+                     priv->roi_y, roi_height, priv->roi_step, 1);
+    ufo_reader_close (reader);
+
+    if (depth > 32)
+        depth = UFO_BUFFER_DEPTH_32F;
+
+    if (depth != UFO_BUFFER_DEPTH_32F)
+        ufo_buffer_convert (buffer, depth);
+
+    mem = clCreateBuffer (priv->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                          get_num_pixels (requisition) * sizeof (gfloat),
+                          ufo_buffer_get_host_array (buffer, NULL), &errcode);
+    UFO_RESOURCES_CHECK_CLERR (errcode);
+
+    g_object_unref (buffer);
+    g_object_unref (reader);
+    return mem;
+}
+
+static void
+prepare_references (UfoReadTaskPrivate *priv,
+                    UfoRequisition *requisition,
+                    GError **error)
+{
+    /* Setup refuses references without device-convert, nothing would apply them */
+    if ((priv->dark == NULL && priv->flat == NULL) || !priv->device_convert)
+        return;
+
+    if (priv->dark_mem == NULL && priv->flat_mem == NULL) {
+        priv->reference_size = get_num_pixels (requisition);
+
+        if (priv->dark != NULL && (priv->dark_mem = load_reference (priv, priv->dark, requisition, error)) == NULL)
+            return;
+
+        if (priv->flat != NULL)
+            priv->flat_mem = load_reference (priv, priv->flat, requisition, error);
+    }
+    else if (priv->reference_size != get_num_pixels (requisition)) {
+        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_GET_REQUISITION,
+                     "read: dark and flat field do not match the size of the current file");
+    }
+}
+
+static gboolean
+needs_device_conversion (UfoReadTaskPrivate *priv, UfoBufferDepth depth)
+{
+    if (!priv->device_convert)
+        return FALSE;
+
+    return (priv->convert && depth != UFO_BUFFER_DEPTH_32F) || priv->dark_mem != NULL || priv->flat_mem != NULL;
+}
+
+/*
+ * Upload the data with its native depth and expand it on the device. Dark
+ * and flat field correction is done in the same pass if requested.
+ */
+static void
+convert_on_device (UfoTask *task,
+                   UfoBuffer *native,
+                   UfoBufferDepth depth,
+                   UfoBuffer *output,
+                   UfoRequisition *requisition)
+{
+    UfoReadTaskPrivate *priv;
+    UfoGpuNode *node;
+    UfoProfiler *profiler;
+    cl_command_queue cmd_queue;
+    cl_kernel kernel;
+    cl_mem out_mem;
+    cl_int errcode;
+    cl_int correct;
+    cl_uint frame_size;
+    gsize num_pixels;
+    gsize size;
+    gint index;
+
+    priv = UFO_READ_TASK_GET_PRIVATE (task);
+    index = get_convert_kernel_index (depth);
+
+    if (index < 0) {
+        /* Packed formats like 12 bit are still expanded on the host */
+        ufo_buffer_convert (native, depth);
+        index = get_convert_kernel_index (UFO_BUFFER_DEPTH_32F);
+    }
+
+    node = UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task)));
+    cmd_queue = ufo_gpu_node_get_cmd_queue (node);
+    kernel = priv->kernels[index];
+    num_pixels = get_num_pixels (requisition);
+    size = num_pixels * convert_kernels[index].size;
+
+    if (size > priv->native_size) {
+        if (priv->native_mem != NULL)
+            UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->native_mem));
+
+        priv->native_mem = clCreateBuffer (priv->context, CL_MEM_READ_ONLY, size, NULL, &errcode);
+        UFO_RESOURCES_CHECK_CLERR (errcode);
+        priv->native_size = size;
+    }
+
+    /* Blocking, because the host buffer is reused right after */
+    UFO_RESOURCES_CHECK_CLERR (clEnqueueWriteBuffer (cmd_queue, priv->native_mem, CL_TRUE, 0, size,
+                                                     ufo_buffer_get_host_array (native, NULL), 0, NULL, NULL));
+
+    out_mem = ufo_buffer_get_device_array (output, cmd_queue);
+    correct = (priv->dark_mem != NULL ? 1 : 0) | (priv->flat_mem != NULL ? 2 : 0);
+    frame_size = correct ? priv->reference_size : num_pixels;
+
+    /* Unused correction arguments still need a valid buffer */
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 0, sizeof (cl_mem), &priv->native_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 1, sizeof (cl_mem), &out_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 2, sizeof (cl_mem), priv->dark_mem != NULL ? &priv->dark_mem : &out_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 3, sizeof (cl_mem), priv->flat_mem != NULL ? &priv->flat_mem : &out_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 4, sizeof (cl_int), &correct));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 5, sizeof (cl_uint), &frame_size));
+
+    profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
+    ufo_profiler_call (profiler, cmd_queue, kernel, 1, &num_pixels, NULL);
+}
+
+/*
+ * Open the next file that has images left after skipping priv->image_start
+ * and describe a single frame of it in priv->frame. Sets priv->done when there
+ * are no more files.
+ */
+static gboolean
+open_next_file (UfoReadTaskPrivate *priv,
+                GError **error)
+{
+    UfoRequisition *requisition = &priv->frame;
+    const gchar *filename;
+    gsize num_images = 0;
 
-    result = NULL;
+    while (TRUE) {
+        /* Keep skipping files until we find one with enough images to start
+         * reading at priv->image_start index. */
+        if (priv->reader) {
+            ufo_reader_close (priv->reader);
+            priv->current_element = g_list_nth (priv->current_element, priv->step);
+        }
 
-#ifdef WITH_HDF5
-    if (ufo_reader_can_open (UFO_READER (priv->hdf5_reader), priv->path) || priv->type == TYPE_HDF5)
-        return g_list_append (NULL, g_strdup (priv->path));
-#endif
+        if (priv->current_element == NULL) {
+            priv->done = TRUE;
+            priv->reader = NULL;
+            return TRUE;
+        }
 
-    if (g_file_test (priv->path, G_FILE_TEST_IS_REGULAR)) {
-        /* This is a single file without any asterisks */
-        priv->single = TRUE;
-        pattern = g_strdup (priv->path);
-    }
-    else {
-        /* This is a directory which we may have to glob */
-        priv->single = FALSE;
-        pattern = strstr (priv->path, "*") != NULL ? g_strdup (priv->path) : g_build_filename (priv->path, "*", NULL);
-    }
+        filename = (gchar *) priv->current_element->data;
+        priv->reader = get_reader (priv, filename);
 
-    glob (pattern, GLOB_MARK | GLOB_TILDE, NULL, &filenames);
+        if (!ufo_reader_open (priv->reader, filename, priv->image_start, error))
+            return FALSE;
+        if (!ufo_reader_get_meta (priv->reader, requisition, &num_images, &priv->depth, error))
+            return FALSE;
 
-    for (guint i = 0; i < filenames.gl_pathc; i++) {
-        const gchar *filename = filenames.gl_pathv[i];
+        if (priv->roi_x >= requisition->dims[0]) {
+            g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_GET_REQUISITION,
+                         "read: horizontal ROI start %i >= width %zu",
+                         priv->roi_x, requisition->dims[0]);
+            return FALSE;
+        }
 
-#ifdef HAVE_TIFF
-        if (ufo_reader_can_open (UFO_READER (priv->tiff_reader), filename) || priv->type == TYPE_TIFF) {
-            result = g_list_append (result, g_strdup (filename));
-            continue;
+        if (!priv->roi_width) {
+            priv->roi_width = requisition->dims[0] - priv->roi_x;
+        }
+        else {
+            if (priv->roi_x + priv->roi_width > requisition->dims[0]) {
+                g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_GET_REQUISITION,
+                             "read: horizontal ROI start + width %i >= width %zu",
+                             priv->roi_x + priv->roi_width, requisition->dims[0]);
+                return FALSE;
+            }
         }
-#endif
 
-        if (ufo_reader_can_open (UFO_READER (priv->edf_reader), filename) || priv->type == TYPE_EDF) {
-            result = g_list_append (result, g_strdup (filename));
-            continue;
+        if (priv->roi_y >= requisition->dims[1]) {
+            g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_GET_REQUISITION,
+                         "read: vertical ROI start %i >= height %zu",
+                         priv->roi_y, requisition->dims[1]);
+            return FALSE;
         }
 
-        if (ufo_reader_can_open (UFO_READER (priv->raw_reader), filename) || priv->type == TYPE_RAW) {
-            result = g_list_append (result, g_strdup (filename));
-            continue;
+        if (!priv->roi_height) {
+            priv->roi_height = requisition->dims[1] - priv->roi_y;
+        }
+        else {
+            if (priv->roi_y + priv->roi_height > requisition->dims[1]) {
+                g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_GET_REQUISITION,
+                             "read: vertical ROI start + height %i >= height %zu",
+                             priv->roi_y + priv->roi_height, requisition->dims[1]);
+                return FALSE;
+            }
+        }
+        if (priv->image_start >= num_images) {
+            priv->image_start -= num_images;
+        } else {
+            priv->image_start = 0;
+            break;
         }
     }
 
-    globfree (&filenames);
-    g_free (pattern);
-    return result;
+    if (priv->depth > 32)
+        /*
+         * We have to take care of this in the writers, because we cannot
+         * allocate larger buffers than those with float elements.
+         */
+        priv->depth = UFO_BUFFER_DEPTH_32F;
+
+    /* update size for reduced ROI and allow things like roi_height=1
+     * and roi_step=20 */
+    requisition->dims[0] = (priv->roi_width - 1) / priv->roi_x_step + 1;
+    requisition->dims[1] = (priv->roi_height - 1) / priv->roi_step + 1;
+
+    return TRUE;
 }
 
-static void
-ufo_read_task_setup (UfoTask *task,
-                     UfoResources *resources,
-                     GError **error)
+/*
+ * Check if a frame can be appended to the current batch. The first frame of a
+ * batch determines size and depth, a frame that differs starts the next batch.
+ */
+static gboolean
+fits_batch (UfoReadTaskPrivate *priv,
+            UfoRequisition *frame,
+            UfoBufferDepth depth,
+            GError **error)
 {
-    UfoReadTaskPrivate *priv;
+    UfoRequisition requisition;
+    gint index;
 
-    priv = UFO_READ_TASK_GET_PRIVATE (task);
+    if (priv->num_batched > 0) {
+        return depth == priv->batch_depth &&
+               frame->dims[0] == priv->batch_frame.dims[0] &&
+               frame->dims[1] == priv->batch_frame.dims[1];
+    }
 
-    priv->filenames = read_filenames (priv);
+    index = get_convert_kernel_index (depth);
 
-    if (priv->filenames == NULL) {
-        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
-                     "`%s' does not match any files", priv->path);
-        return;
+    if (index < 0 || frame->n_dims != 2) {
+        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_GET_REQUISITION,
+                     "read: batch does not support packed or multi-channel data");
+        return FALSE;
     }
 
-    priv->filenames = g_list_sort (priv->filenames, (GCompareFunc) g_strcmp0);
+    priv->batch_depth = depth;
+    priv->batch_frame = *frame;
+    priv->batch_frame_size = get_num_pixels (frame) * convert_kernels[index].size;
 
-    if (priv->single)
-        priv->current_element = g_list_first (priv->filenames);
-    else
-        priv->current_element = g_list_nth (priv->filenames, priv->start);
+    /* Native data is never larger than the float stack it expands to */
+    requisition.n_dims = 3;
+    requisition.dims[0] = frame->dims[0];
+    requisition.dims[1] = frame->dims[1];
+    requisition.dims[2] = priv->batch;
 
-    if (priv->current_element == NULL) {
-        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
-                     "start=%i skips too many files", priv->start);
-        return;
-    }
+    if (priv->staging == NULL)
+        priv->staging = ufo_buffer_new (&requisition, priv->context);
+    else if (ufo_buffer_cmp_dimensions (priv->staging, &requisition))
+        ufo_buffer_resize (priv->staging, &requisition);
 
-    priv->current = 0;
+    return TRUE;
 }
 
-static UfoReader *
-get_reader (UfoReadTaskPrivate *priv, const gchar *filename)
+static void
+get_batch_requisition (UfoReadTaskPrivate *priv,
+                       UfoRequisition *requisition,
+                       GError **error)
 {
-#ifdef HAVE_TIFF
-    if (ufo_reader_can_open (UFO_READER (priv->tiff_reader), filename) || priv->type == TYPE_TIFF)
-        return UFO_READER (priv->tiff_reader);
-#endif
+    guint limit;
 
-#ifdef WITH_HDF5
-    if (ufo_reader_can_open (UFO_READER (priv->hdf5_reader), filename) || priv->type == TYPE_HDF5)
-        return UFO_READER (priv->hdf5_reader);
-#endif
+    limit = MIN (priv->batch, priv->number - priv->current);
+    priv->num_batched = 0;
 
-    if (ufo_reader_can_open (UFO_READER (priv->edf_reader), filename) || priv->type == TYPE_EDF)
-        return UFO_READER (priv->edf_reader);
+    while (priv->num_batched < limit) {
+        gchar *staging;
+        gsize num_consumed;
+        guint num_read;
 
-    if (ufo_reader_can_open (UFO_READER (priv->raw_reader), filename) || priv->type == TYPE_RAW)
-        return UFO_READER (priv->raw_reader);
+        if (priv->workers != NULL) {
+            ReadAheadItem *item;
+            UfoRequisition frame;
 
-    return NULL;
+            get_read_ahead_requisition (priv, &frame, error);
+            item = priv->item;
+
+            if (item == NULL || !fits_batch (priv, &item->requisition, item->depth, error))
+                break;
+
+            staging = (gchar *) ufo_buffer_get_host_array (priv->staging, NULL);
+            memcpy (staging + priv->num_batched * priv->batch_frame_size,
+                    ufo_buffer_get_host_array (item->buffer, NULL), priv->batch_frame_size);
+            g_async_queue_push (priv->workers[priv->current_worker].free_queue, item);
+            priv->item = NULL;
+            priv->num_batched++;
+            continue;
+        }
+
+        if (!priv->reader || !ufo_reader_data_available (priv->reader)) {
+            if (!open_next_file (priv, error) || priv->done)
+                break;
+        }
+
+        if (!fits_batch (priv, &priv->frame, priv->depth, error))
+            break;
+
+        /* Let the reader fetch as many of the remaining frames as it can at once */
+        staging = (gchar *) ufo_buffer_get_host_array (priv->staging, NULL);
+        num_consumed = ufo_reader_read (priv->reader, staging + priv->num_batched * priv->batch_frame_size,
+                                        &priv->frame, limit - priv->num_batched,
+                                        priv->roi_x, priv->roi_width, priv->roi_x_step,
+                                        priv->roi_y, priv->roi_height, priv->roi_step, priv->image_step);
+
+        if (num_consumed == 0)
+            break;
+
+        num_read = (num_consumed + priv->image_step - 1) / priv->image_step;
+        priv->image_start = num_read * priv->image_step - num_consumed;
+        priv->num_batched += num_read;
+    }
+
+    if (priv->num_batched == 0)
+        return;
+
+    requisition->n_dims = 3;
+    requisition->dims[0] = priv->batch_frame.dims[0];
+    requisition->dims[1] = priv->batch_frame.dims[1];
+    requisition->dims[2] = priv->num_batched;
+
+    prepare_references (priv, &priv->batch_frame, error);
 }
 
 static void
@@ -250,72 +1449,30 @@ ufo_read_task_get_requisition (UfoTask *task,
                                GError **error)
 {
     UfoReadTaskPrivate *priv;
-    const gchar *filename;
-    gsize num_images = 0;
 
     priv = UFO_READ_TASK_GET_PRIVATE (UFO_READ_TASK (task));
 
-    if (!priv->reader || !ufo_reader_data_available (priv->reader)) {
-        while (TRUE) {
-            /* Keep skipping files until we find one with enough images to start
-             * reading at priv->image_start index. */
-            if (priv->reader) {
-                ufo_reader_close (priv->reader);
-                priv->current_element = g_list_nth (priv->current_element, priv->step);
-            }
-
-            if (priv->current_element == NULL) {
-                priv->done = TRUE;
-                priv->reader = NULL;
-                return;
-            }
-
-            filename = (gchar *) priv->current_element->data;
-            priv->reader = get_reader (priv, filename);
+    if (priv->batch > 1) {
+        get_batch_requisition (priv, requisition, error);
+        return;
+    }
 
-            if (!ufo_reader_open (priv->reader, filename, priv->image_start, error))
-                return;
-            if (!ufo_reader_get_meta (priv->reader, requisition, &num_images, &priv->depth, error))
-                return;
+    if (priv->workers != NULL) {
+        get_read_ahead_requisition (priv, requisition, error);
 
-            if (priv->roi_y >= requisition->dims[1]) {
-                g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_GET_REQUISITION,
-                             "read: vertical ROI start %i >= height %zu",
-                             priv->roi_y, requisition->dims[1]);
-                return;
-            }
+        if (!priv->done)
+            prepare_references (priv, requisition, error);
 
-            if (!priv->roi_height) {
-                priv->roi_height = requisition->dims[1] - priv->roi_y;
-            }
-            else {
-                if (priv->roi_y + priv->roi_height > requisition->dims[1]) {
-                    g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_GET_REQUISITION,
-                                 "read: vertical ROI start + height %i >= height %zu",
-                                 priv->roi_y + priv->roi_height, requisition->dims[1]);
-                    return;
-                }
-            }
-            if (priv->image_start >= num_images) {
-                priv->image_start -= num_images;
-            } else {
-                priv->image_start = 0;
-                break;
-            }
-        }
+        return;
     }
 
+    if (!priv->reader || !ufo_reader_data_available (priv->reader)) {
+        if (!open_next_file (priv, error) || priv->done)
+            return;
+    }
 
-    if (priv->depth > 32)
-        /*
-         * We have to take care of this in the writers, because we cannot
-         * allocate larger buffers than those with float elements.
-         */
-        priv->depth = UFO_BUFFER_DEPTH_32F;
-
-    /* update height for reduced vertical ROI and allow things like roi_height=1
-     * and roi_step=20 */
-    requisition->dims[1] = (priv->roi_height - 1) / priv->roi_step + 1;
+    *requisition = priv->frame;
+    prepare_references (priv, requisition, error);
 }
 
 static guint
@@ -334,7 +1491,47 @@ ufo_read_task_get_num_dimensions (UfoTask *task,
 static UfoTaskMode
 ufo_read_task_get_mode (UfoTask *task)
 {
-    return UFO_TASK_MODE_GENERATOR | UFO_TASK_MODE_CPU;
+    UfoReadTaskPrivate *priv;
+
+    priv = UFO_READ_TASK_GET_PRIVATE (task);
+    return UFO_TASK_MODE_GENERATOR | (priv->device_convert ? UFO_TASK_MODE_GPU : UFO_TASK_MODE_CPU);
+}
+
+static gboolean
+generate_batch (UfoTask *task,
+                UfoBuffer *output,
+                UfoRequisition *requisition)
+{
+    UfoReadTaskPrivate *priv;
+    GValue value = G_VALUE_INIT;
+
+    priv = UFO_READ_TASK_GET_PRIVATE (UFO_READ_TASK (task));
+
+    /* A short last batch is still delivered even though we are done */
+    if (priv->num_batched == 0)
+        return FALSE;
+
+    if (needs_device_conversion (priv, priv->batch_depth)) {
+        convert_on_device (task, priv->staging, priv->batch_depth, output, requisition);
+    }
+    else {
+        memcpy (ufo_buffer_get_host_array (output, NULL),
+                ufo_buffer_get_host_array (priv->staging, NULL),
+                priv->num_batched * priv->batch_frame_size);
+
+        if ((priv->batch_depth != UFO_BUFFER_DEPTH_32F) && priv->convert)
+            ufo_buffer_convert (output, priv->batch_depth);
+    }
+
+    /* Tell consumers that a depth of three is a stack and not RGB */
+    g_value_init (&value, G_TYPE_UINT);
+    g_value_set_uint (&value, priv->num_batched);
+    ufo_buffer_set_metadata (output, "batch", &value);
+    g_value_unset (&value);
+
+    priv->current += priv->num_batched;
+    priv->num_batched = 0;
+    return TRUE;
 }
 
 static gboolean
@@ -343,18 +1540,49 @@ ufo_read_task_generate (UfoTask *task,
                         UfoRequisition *requisition)
 {
     UfoReadTaskPrivate *priv;
+    UfoBuffer *target = output;
     guint num_processed;
 
     priv = UFO_READ_TASK_GET_PRIVATE (UFO_READ_TASK (task));
 
+    if (priv->batch > 1)
+        return generate_batch (task, output, requisition);
+
     if (priv->current == priv->number || priv->done)
         return FALSE;
 
-    num_processed = ufo_reader_read (priv->reader, output, requisition, priv->roi_y, priv->roi_height,
-                                   priv->roi_step, priv->image_step);
+    if (priv->workers != NULL) {
+        ReadAheadItem *item = priv->item;
+
+        if (needs_device_conversion (priv, item->depth))
+            convert_on_device (task, item->buffer, item->depth, output, requisition);
+        else
+            ufo_buffer_copy (item->buffer, output);
+
+        g_async_queue_push (priv->workers[priv->current_worker].free_queue, item);
+        priv->item = NULL;
+        priv->current++;
+        return TRUE;
+    }
+
+    if (needs_device_conversion (priv, priv->depth)) {
+        /* Read into a separate host buffer so that only native data is uploaded */
+        if (priv->native == NULL)
+            priv->native = ufo_buffer_new (requisition, priv->context);
+        else if (ufo_buffer_cmp_dimensions (priv->native, requisition))
+            ufo_buffer_resize (priv->native, requisition);
+
+        target = priv->native;
+    }
+
+    num_processed = ufo_reader_read (priv->reader, ufo_buffer_get_host_array (target, NULL), requisition, 1,
+                                     priv->roi_x, priv->roi_width, priv->roi_x_step,
+                                     priv->roi_y, priv->roi_height, priv->roi_step, priv->image_step);
     priv->image_start = priv->image_step - num_processed;
 
-    if ((priv->depth != UFO_BUFFER_DEPTH_32F) && priv->convert)
+    if (target != output)
+        convert_on_device (task, target, priv->depth, output, requisition);
+    else if ((priv->depth != UFO_BUFFER_DEPTH_32F) && priv->convert)
         ufo_buffer_convert (output, priv->depth);
 
     priv->current++;
@@ -377,6 +1605,15 @@ ufo_read_task_set_property (GObject *object,
         case PROP_STEP:
             priv->step = g_value_get_uint (value);
             break;
+        case PROP_ROI_X:
+            priv->roi_x = g_value_get_uint (value);
+            break;
+        case PROP_ROI_WIDTH:
+            priv->roi_width = g_value_get_uint (value);
+            break;
+        case PROP_ROI_X_STEP:
+            priv->roi_x_step = g_value_get_uint (value);
+            break;
         case PROP_ROI_Y:
             priv->roi_y = g_value_get_uint (value);
             break;
@@ -416,9 +1653,61 @@ ufo_read_task_set_property (GObject *object,
         case PROP_RAW_POST_OFFSET:
             g_object_set_property (G_OBJECT (priv->raw_reader), "post-offset", value);
             break;
+        case PROP_RAW_MMAP:
+            g_object_set_property (G_OBJECT (priv->raw_reader), "mmap", value);
+            break;
+        case PROP_TIFF_INDEX_CACHE:
+#ifdef HAVE_TIFF
+            g_object_set_property (G_OBJECT (priv->tiff_reader), "index-cache", value);
+#endif
+            break;
+        case PROP_HDF5_BATCH:
+#ifdef WITH_HDF5
+            g_object_set_property (G_OBJECT (priv->hdf5_reader), "batch", value);
+#endif
+            break;
+        case PROP_HDF5_SWMR:
+#ifdef WITH_HDF5
+            g_object_set_property (G_OBJECT (priv->hdf5_reader), "swmr", value);
+#endif
+            break;
+        case PROP_HDF5_SWMR_TIMEOUT:
+#ifdef WITH_HDF5
+            g_object_set_property (G_OBJECT (priv->hdf5_reader), "swmr-timeout", value);
+#endif
+            break;
+        case PROP_HDF5_DECOMPRESS_THREADS:
+#ifdef WITH_HDF5
+            g_object_set_property (G_OBJECT (priv->hdf5_reader), "decompress-threads", value);
+#endif
+            break;
         case PROP_TYPE:
             priv->type = g_value_get_enum (value);
             break;
+        case PROP_PREFETCH:
+            priv->prefetch = g_value_get_uint (value);
+            break;
+        case PROP_IO_THREADS:
+            priv->io_threads = g_value_get_uint (value);
+            break;
+        case PROP_MANIFEST:
+            g_free (priv->manifest);
+            priv->manifest = g_value_dup_string (value);
+            break;
+        case PROP_DEVICE_CONVERT:
+            priv->device_convert = g_value_get_boolean (value);
+            break;
+        case PROP_DARK:
+            g_free (priv->dark);
+            priv->dark = g_value_dup_string (value);
+            break;
+        case PROP_FLAT:
+            g_free (priv->flat);
+            priv->flat = g_value_dup_string (value);
+            break;
+        case PROP_BATCH:
+            priv->batch = g_value_get_uint (value);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -440,6 +1729,15 @@ ufo_read_task_get_property (GObject *object,
         case PROP_STEP:
             g_value_set_uint (value, priv->step);
             break;
+        case PROP_ROI_X:
+            g_value_set_uint (value, priv->roi_x);
+            break;
+        case PROP_ROI_WIDTH:
+            g_value_set_uint (value, priv->roi_width);
+            break;
+        case PROP_ROI_X_STEP:
+            g_value_set_uint (value, priv->roi_x_step);
+            break;
         case PROP_ROI_Y:
             g_value_set_uint (value, priv->roi_y);
             break;
@@ -479,9 +1777,58 @@ ufo_read_task_get_property (GObject *object,
         case PROP_RAW_POST_OFFSET:
             g_object_get_property (G_OBJECT (priv->raw_reader), "post-offset", value);
             break;
+        case PROP_RAW_MMAP:
+            g_object_get_property (G_OBJECT (priv->raw_reader), "mmap", value);
+            break;
+        case PROP_TIFF_INDEX_CACHE:
+#ifdef HAVE_TIFF
+            g_object_get_property (G_OBJECT (priv->tiff_reader), "index-cache", value);
+#endif
+            break;
+        case PROP_HDF5_BATCH:
+#ifdef WITH_HDF5
+            g_object_get_property (G_OBJECT (priv->hdf5_reader), "batch", value);
+#endif
+            break;
+        case PROP_HDF5_SWMR:
+#ifdef WITH_HDF5
+            g_object_get_property (G_OBJECT (priv->hdf5_reader), "swmr", value);
+#endif
+            break;
+        case PROP_HDF5_SWMR_TIMEOUT:
+#ifdef WITH_HDF5
+            g_object_get_property (G_OBJECT (priv->hdf5_reader), "swmr-timeout", value);
+#endif
+            break;
+        case PROP_HDF5_DECOMPRESS_THREADS:
+#ifdef WITH_HDF5
+            g_object_get_property (G_OBJECT (priv->hdf5_reader), "decompress-threads", value);
+#endif
+            break;
         case PROP_TYPE:
             g_value_set_enum (value, priv->type);
             break;
+        case PROP_PREFETCH:
+            g_value_set_uint (value, priv->prefetch);
+            break;
+        case PROP_IO_THREADS:
+            g_value_set_uint (value, priv->io_threads);
+            break;
+        case PROP_MANIFEST:
+            g_value_set_string (value, priv->manifest);
+            break;
+        case PROP_DEVICE_CONVERT:
+            g_value_set_boolean (value, priv->device_convert);
+            break;
+        case PROP_DARK:
+            g_value_set_string (value, priv->dark);
+            break;
+        case PROP_FLAT:
+            g_value_set_string (value, priv->flat);
+            break;
+        case PROP_BATCH:
+            g_value_set_uint (value, priv->batch);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -495,6 +1842,8 @@ ufo_read_task_dispose (GObject *object)
 
     priv = UFO_READ_TASK_GET_PRIVATE (object);
 
+    stop_read_ahead (priv);
+
     g_object_unref (priv->edf_reader);
     g_object_unref (priv->raw_reader);
 
@@ -519,6 +1868,17 @@ ufo_read_task_finalize (GObject *object)
     g_free (priv->path);
     priv->path = NULL;
 
+    g_free (priv->manifest);
+    priv->manifest = NULL;
+
+    g_free (priv->dark);
+    priv->dark = NULL;
+
+    g_free (priv->flat);
+    priv->flat = NULL;
+
+    release_device_data (priv);
+
     if (priv->filenames != NULL) {
         g_list_free_full (priv->filenames, (GDestroyNotify) g_free);
         priv->filenames = NULL;
@@ -562,6 +1922,27 @@ ufo_read_task_class_init(UfoReadTaskClass *klass)
             1, G_MAXUINT, 1,
             G_PARAM_READWRITE);
 
+    properties[PROP_ROI_X] =
+        g_param_spec_uint ("x",
+            "Horizontal coordinate",
+            "Horizontal coordinate from where to start reading the image",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_ROI_WIDTH] =
+        g_param_spec_uint ("width",
+            "Width",
+            "Width of the region of interest to read",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_ROI_X_STEP] =
+        g_param_spec_uint ("x-step",
+            "Read every \"step\" column",
+            "Read every \"step\" column",
+            1, G_MAXUINT, 1,
+            G_PARAM_READWRITE);
+
     properties[PROP_ROI_Y] =
         g_param_spec_uint ("y",
             "Vertical coordinate",
@@ -653,6 +2034,48 @@ ufo_read_task_class_init(UfoReadTaskClass *klass)
             0, G_MAXULONG, 0,
             G_PARAM_READWRITE);
 
+    properties[PROP_RAW_MMAP] =
+        g_param_spec_boolean ("raw-mmap",
+            "Map raw files into memory",
+            "Map raw files into memory instead of reading them with stdio",
+            FALSE,
+            G_PARAM_READWRITE);
+
+    properties[PROP_TIFF_INDEX_CACHE] =
+        g_param_spec_boolean ("tiff-index-cache",
+            "Cache page offsets of multi-page TIFF files",
+            "Cache page offsets of multi-page TIFF files in the user cache directory",
+            FALSE,
+            G_PARAM_READWRITE);
+
+    properties[PROP_HDF5_BATCH] =
+        g_param_spec_uint ("hdf5-batch",
+            "Number of HDF5 frames read at once",
+            "Number of HDF5 frames read at once",
+            1, G_MAXUINT, 1,
+            G_PARAM_READWRITE);
+
+    properties[PROP_HDF5_SWMR] =
+        g_param_spec_boolean ("hdf5-swmr",
+            "Open HDF5 files in single-writer/multiple-reader mode",
+            "Open HDF5 files in single-writer/multiple-reader mode and follow a growing data set",
+            FALSE,
+            G_PARAM_READWRITE);
+
+    properties[PROP_HDF5_SWMR_TIMEOUT] =
+        g_param_spec_uint ("hdf5-swmr-timeout",
+            "Seconds to wait for new HDF5 frames in SWMR mode",
+            "Seconds to wait for new HDF5 frames in SWMR mode",
+            0, G_MAXUINT, 5,
+            G_PARAM_READWRITE);
+
+    properties[PROP_HDF5_DECOMPRESS_THREADS] =
+        g_param_spec_uint ("hdf5-decompress-threads",
+            "Number of threads decompressing HDF5 chunks",
+            "Number of threads decompressing HDF5 chunks, 0 lets HDF5 decompress",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
     properties[PROP_TYPE] =
         g_param_spec_enum ("type",
             "Override type detection based on extension",
@@ -661,6 +2084,55 @@ ufo_read_task_class_init(UfoReadTaskClass *klass)
             TYPE_UNSPECIFIED,
             G_PARAM_READWRITE);
 
+    properties[PROP_PREFETCH] =
+        g_param_spec_uint ("prefetch",
+            "Number of images to read ahead",
+            "Number of images to read ahead in background threads, 0 reads synchronously",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_IO_THREADS] =
+        g_param_spec_uint ("io-threads",
+            "Number of threads reading files in parallel",
+            "Number of threads reading files in parallel if prefetch is enabled",
+            1, G_MAXUINT, 1,
+            G_PARAM_READWRITE);
+
+    properties[PROP_MANIFEST] =
+        g_param_spec_string ("manifest",
+            "File caching the list of matching files",
+            "File caching the list of matching files, rewritten when the directory changes",
+            NULL,
+            G_PARAM_READWRITE);
+
+    properties[PROP_DEVICE_CONVERT] =
+        g_param_spec_boolean ("device-convert",
+            "Convert integer data on the GPU",
+            "Upload integer data with its native depth and convert it to float on the GPU",
+            FALSE,
+            G_PARAM_READWRITE);
+
+    properties[PROP_DARK] =
+        g_param_spec_string ("dark",
+            "Dark field subtracted during device conversion",
+            "Dark field subtracted during device conversion",
+            NULL,
+            G_PARAM_READWRITE);
+
+    properties[PROP_FLAT] =
+        g_param_spec_string ("flat",
+            "Flat field divided by during device conversion",
+            "Flat field divided by during device conversion",
+            NULL,
+            G_PARAM_READWRITE);
+
+    properties[PROP_BATCH] =
+        g_param_spec_uint ("batch",
+            "Number of frames produced at once",
+            "Number of frames stacked into one three-dimensional output",
+            1, G_MAXUINT, 1,
+            G_PARAM_READWRITE);
+
     for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
         g_object_class_install_property (gobject_class, i, properties[i]);
 
@@ -674,7 +2146,22 @@ ufo_read_task_init(UfoReadTask *self)
 
     self->priv = priv = UFO_READ_TASK_GET_PRIVATE (self);
     priv->path = g_strdup (".");
+    priv->manifest = NULL;
+    priv->device_convert = FALSE;
+    priv->dark = NULL;
+    priv->flat = NULL;
+    priv->native = NULL;
+    priv->native_mem = NULL;
+    priv->native_size = 0;
+    priv->dark_mem = NULL;
+    priv->flat_mem = NULL;
+
+    for (guint i = 0; i < G_N_ELEMENTS (convert_kernels); i++)
+        priv->kernels[i] = NULL;
     priv->step = 1;
+    priv->roi_x = 0;
+    priv->roi_width = 0;
+    priv->roi_x_step = 1;
     priv->roi_y = 0;
     priv->roi_height = 0;
     priv->roi_step = 1;
@@ -700,4 +2187,11 @@ ufo_read_task_init(UfoReadTask *self)
     priv->done = FALSE;
     priv->single = FALSE;
     priv->type = TYPE_UNSPECIFIED;
+    priv->prefetch = 0;
+    priv->io_threads = 1;
+    priv->batch = 1;
+    priv->workers = NULL;
+    priv->num_workers = 0;
+    priv->item = NULL;
+    priv->context = NULL;
 }
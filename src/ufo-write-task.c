@@ -27,12 +27,16 @@
 #include <glib/gstdio.h>
 #include <gmodule.h>
 #include <string.h>
+#include <stdio.h>
+#include <unistd.h>
 #include <errno.h>
 #include <math.h>
 
 #include "ufo-write-task.h"
 #include "writers/ufo-writer.h"
 #include "writers/ufo-raw-writer.h"
+#include "writers/ufo-zarr-writer.h"
+#include "common/ufo-histogram.h"
 
 #ifdef HAVE_TIFF
 #include "writers/ufo-tiff-writer.h"
@@ -46,6 +50,29 @@
 #include "writers/ufo-hdf5-writer.h"
 #endif
 
+typedef struct {
+    guint8         *data;
+    gsize           size;
+    UfoRequisition  requisition;
+    guint64         index;
+    gboolean        converted;
+} WriteItem;
+
+typedef enum {
+    RESCALE_FRAME,
+    RESCALE_PREFIX,
+    RESCALE_SPILL
+} RescaleMode;
+
+static const gchar *rescale_modes[] = { "frame", "prefix", "spill" };
+
+#define HISTOGRAM_BINS      65536
+
+/* Work groups computing partial minima and maxima on the device, the local
+ * size is at most MIN_MAX_LOCAL_SIZE and less if the kernel does not allow it */
+#define MIN_MAX_GROUPS      64
+#define MIN_MAX_LOCAL_SIZE  256
+
 struct _UfoWriteTaskPrivate {
     gchar *filename;
     guint counter;
@@ -62,6 +89,19 @@ struct _UfoWriteTaskPrivate {
     gfloat minimum;
     gfloat maximum;
     gboolean rescale;
+    gboolean device_convert;
+
+    RescaleMode rescale_mode;
+    guint rescale_prefix;
+    gfloat low_percentile;
+    gfloat high_percentile;
+    UfoHistogram *histogram;
+    GQueue *collected;
+    FILE *spill;
+    gboolean spill_failed;
+    gboolean limits_known;
+    gfloat min_limit;
+    gfloat max_limit;
 
     guint num_fmt_specifiers;
     gboolean opened;
@@ -70,8 +110,17 @@ struct _UfoWriteTaskPrivate {
     cl_kernel kernel;
     UfoBuffer *tmp;
 
+    cl_kernel min_max_kernel;
+    gsize min_max_local_size;
+    cl_kernel convert_kernel;
+    cl_mem partial_mem;
+    cl_mem converted_mem;
+    gsize converted_size;
+    guint8 *converted;
+
     UfoWriter     *writer;
     UfoRawWriter  *raw_writer;
+    UfoZarrWriter *zarr_writer;
 
 #ifdef HAVE_TIFF
     UfoTiffWriter *tiff_writer;
@@ -85,6 +134,17 @@ struct _UfoWriteTaskPrivate {
 #ifdef WITH_HDF5
     UfoHdf5Writer *hdf5_writer;
 #endif
+
+    gboolean       async;
+    guint          queue_depth;
+    guint          io_threads;
+    GThread      **threads;
+    GAsyncQueue   *free_queue;
+    GAsyncQueue   *ready_queue;
+    GMutex         lock;
+    GCond          written;
+    guint64        num_queued;
+    guint64        next_index;
 };
 
 static void ufo_task_interface_init (UfoTaskIface *iface);
@@ -106,12 +166,49 @@ enum {
     PROP_MINIMUM,
     PROP_MAXIMUM,
     PROP_RESCALE,
+    PROP_DEVICE_CONVERT,
+    PROP_RESCALE_MODE,
+    PROP_RESCALE_PREFIX,
+    PROP_RESCALE_LOW_PERCENTILE,
+    PROP_RESCALE_HIGH_PERCENTILE,
 #ifdef HAVE_JPEG
     PROP_JPEG_QUALITY,
+    PROP_JPEG_THREADS,
+    PROP_JPEG_LEVELS,
 #endif
 #ifdef HAVE_TIFF
     PROP_TIFF_BIGTIFF,
+    PROP_TIFF_COMPRESSION,
+    PROP_TIFF_COMPRESSION_LEVEL,
+    PROP_TIFF_PREDICTOR,
+    PROP_TIFF_TILE_WIDTH,
+    PROP_TIFF_TILE_HEIGHT,
+    PROP_TIFF_ROWS_PER_STRIP,
+    PROP_TIFF_THREADS,
 #endif
+#ifdef WITH_HDF5
+    PROP_HDF5_CHUNK_FRAMES,
+    PROP_HDF5_CHUNK_HEIGHT,
+    PROP_HDF5_CHUNK_WIDTH,
+    PROP_HDF5_COMPRESSION,
+    PROP_HDF5_COMPRESSION_LEVEL,
+    PROP_HDF5_SHUFFLE,
+    PROP_HDF5_NUM_FRAMES,
+    PROP_HDF5_BATCH,
+#endif
+    PROP_ZARR_CHUNK_DEPTH,
+    PROP_ZARR_CHUNK_HEIGHT,
+    PROP_ZARR_CHUNK_WIDTH,
+    PROP_ZARR_COMPRESSION,
+    PROP_ZARR_COMPRESSION_LEVEL,
+    PROP_ZARR_LEVELS,
+    PROP_ZARR_THREADS,
+    PROP_RAW_DIRECT,
+    PROP_RAW_BUFFER_SIZE,
+    PROP_RAW_PREALLOCATE,
+    PROP_ASYNC,
+    PROP_QUEUE_DEPTH,
+    PROP_IO_THREADS,
     N_PROPERTIES
 };
 
@@ -163,6 +260,272 @@ can_be_written (const gchar *filename, GError **error)
     return TRUE;
 }
 
+/*
+ * Write an image that has been converted already, opening and closing files
+ * as needed. Must be called in input order.
+ */
+static void
+write_image (UfoWriteTaskPrivate *priv, UfoWriterImage *image)
+{
+    gsize out_size;
+
+    out_size = image->requisition->dims[0] * image->requisition->dims[1] * priv->bits_per_sample / 8;
+
+retry:
+    if (!priv->opened) {
+        GError *error = NULL;
+        gchar *filename = get_current_filename (priv);
+
+        if (filename && !can_be_written (filename, &error)) {
+            g_warning ("%s", error->message);
+            g_free (filename);
+            g_error_free (error);
+            priv->counter += priv->counter_step;
+            goto retry;
+        }
+
+        ufo_writer_open (priv->writer, filename);
+        if (filename) {
+            g_free (filename);
+        }
+        priv->opened = TRUE;
+    }
+
+    ufo_writer_write_converted (priv->writer, image);
+    priv->num_written_bytes += out_size;
+
+    if (priv->num_fmt_specifiers && priv->num_written_bytes + out_size > priv->bytes_per_file) {
+        ufo_writer_close (priv->writer);
+        priv->opened = FALSE;
+        priv->num_written_bytes = 0;
+        priv->counter += priv->counter_step;
+    }
+}
+
+static void
+init_image (UfoWriteTaskPrivate *priv, UfoWriterImage *image, UfoRequisition *requisition, gpointer data)
+{
+    image->data = data;
+    image->requisition = requisition;
+    image->depth = priv->depth;
+    image->min = priv->min_limit;
+    image->max = priv->max_limit;
+    image->rescale = priv->rescale;
+}
+
+static gpointer
+write_behind_worker (UfoWriteTaskPrivate *priv)
+{
+    while (TRUE) {
+        UfoWriterImage image;
+        WriteItem *item;
+
+        item = g_async_queue_pop (priv->ready_queue);
+
+        /* An item without data tells us to stop */
+        if (item->data == NULL) {
+            g_free (item);
+            break;
+        }
+
+        /* Conversion runs in parallel, writing happens in input order */
+        init_image (priv, &image, &item->requisition, item->data);
+
+        if (!item->converted)
+            ufo_writer_convert_inplace (&image);
+
+        g_mutex_lock (&priv->lock);
+
+        while (priv->next_index != item->index)
+            g_cond_wait (&priv->written, &priv->lock);
+
+        write_image (priv, &image);
+        priv->next_index++;
+        g_cond_broadcast (&priv->written);
+        g_mutex_unlock (&priv->lock);
+
+        g_async_queue_push (priv->free_queue, item);
+    }
+
+    return NULL;
+}
+
+static void
+start_write_behind (UfoWriteTaskPrivate *priv)
+{
+    priv->free_queue = g_async_queue_new ();
+    priv->ready_queue = g_async_queue_new ();
+    priv->num_queued = 0;
+    priv->next_index = 0;
+
+    /* Frames are copied into these when queued, their number bounds memory use */
+    for (guint i = 0; i < priv->queue_depth; i++)
+        g_async_queue_push (priv->free_queue, g_new0 (WriteItem, 1));
+
+    priv->threads = g_new0 (GThread *, priv->io_threads);
+
+    for (guint i = 0; i < priv->io_threads; i++)
+        priv->threads[i] = g_thread_new ("write-behind", (GThreadFunc) write_behind_worker, priv);
+}
+
+static void
+stop_write_behind (UfoWriteTaskPrivate *priv)
+{
+    WriteItem *item;
+
+    if (priv->threads == NULL)
+        return;
+
+    /* Markers queue up behind the remaining frames, so these are still written */
+    for (guint i = 0; i < priv->io_threads; i++)
+        g_async_queue_push (priv->ready_queue, g_new0 (WriteItem, 1));
+
+    for (guint i = 0; i < priv->io_threads; i++)
+        g_thread_join (priv->threads[i]);
+
+    while ((item = g_async_queue_try_pop (priv->free_queue)) != NULL) {
+        g_free (item->data);
+        g_free (item);
+    }
+
+    g_async_queue_unref (priv->free_queue);
+    g_async_queue_unref (priv->ready_queue);
+    g_free (priv->threads);
+    priv->threads = NULL;
+}
+
+static void
+release_global_limits (UfoWriteTaskPrivate *priv)
+{
+    WriteItem *item;
+
+    if (priv->collected != NULL) {
+        while ((item = g_queue_pop_head (priv->collected)) != NULL) {
+            g_free (item->data);
+            g_free (item);
+        }
+
+        g_queue_free (priv->collected);
+        priv->collected = NULL;
+    }
+
+    if (priv->spill != NULL) {
+        fclose (priv->spill);
+        priv->spill = NULL;
+    }
+
+    if (priv->histogram != NULL) {
+        ufo_histogram_free (priv->histogram);
+        priv->histogram = NULL;
+    }
+}
+
+/*
+ * Unless the user fixed both limits, the global rescale modes hold frames back
+ * until the limits are known: prefix mode keeps the first frames in memory,
+ * spill mode writes all of them to an unlinked temporary file.
+ */
+static void
+setup_global_limits (UfoWriteTaskPrivate *priv,
+                     GError **error)
+{
+    gchar *name;
+    gint fd;
+
+    release_global_limits (priv);
+    priv->spill_failed = FALSE;
+    priv->min_limit = priv->minimum;
+    priv->max_limit = priv->maximum;
+    priv->limits_known = !priv->rescale || priv->depth == UFO_BUFFER_DEPTH_32F ||
+                         priv->rescale_mode == RESCALE_FRAME ||
+                         (priv->minimum < G_MAXFLOAT && priv->maximum > -G_MAXFLOAT);
+
+    if (priv->limits_known)
+        return;
+
+    priv->histogram = ufo_histogram_new (HISTOGRAM_BINS);
+    priv->collected = g_queue_new ();
+
+    if (priv->rescale_mode != RESCALE_SPILL)
+        return;
+
+    fd = g_file_open_tmp ("ufo-write-XXXXXX", &name, error);
+
+    if (fd < 0)
+        return;
+
+    g_unlink (name);
+    g_free (name);
+    priv->spill = fdopen (fd, "w+b");
+
+    if (priv->spill == NULL) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "Could not open spill file: %s", strerror (errno));
+        close (fd);
+    }
+}
+
+static void
+release_device_conversion (UfoWriteTaskPrivate *priv)
+{
+    if (priv->min_max_kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->min_max_kernel));
+        priv->min_max_kernel = NULL;
+    }
+
+    if (priv->convert_kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->convert_kernel));
+        priv->convert_kernel = NULL;
+    }
+
+    if (priv->partial_mem) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->partial_mem));
+        priv->partial_mem = NULL;
+    }
+
+    if (priv->converted_mem) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->converted_mem));
+        priv->converted_mem = NULL;
+        priv->converted_size = 0;
+    }
+
+    priv->min_max_local_size = 0;
+}
+
+static void
+setup_device_conversion (UfoWriteTaskPrivate *priv,
+                         UfoResources *resources,
+                         GError **error)
+{
+    const gchar *name;
+    cl_int errcode;
+
+    /* A repeated setup must not leak the kernels of the previous one */
+    release_device_conversion (priv);
+
+    if (!priv->device_convert || priv->depth == UFO_BUFFER_DEPTH_32F)
+        return;
+
+    name = priv->depth == UFO_BUFFER_DEPTH_8U ? "convert_8bit" : "convert_16bit";
+    priv->convert_kernel = ufo_resources_get_kernel (resources, "split.cl", name, NULL, error);
+
+    if (priv->convert_kernel == NULL)
+        return;
+
+    UFO_RESOURCES_CHECK_SET_AND_RETURN (clRetainKernel (priv->convert_kernel), error);
+
+    priv->min_max_kernel = ufo_resources_get_kernel (resources, "split.cl", "min_max", NULL, error);
+
+    if (priv->min_max_kernel == NULL)
+        return;
+
+    UFO_RESOURCES_CHECK_SET_AND_RETURN (clRetainKernel (priv->min_max_kernel), error);
+
+    priv->partial_mem = clCreateBuffer (priv->context, CL_MEM_WRITE_ONLY,
+                                        2 * MIN_MAX_GROUPS * sizeof (gfloat), NULL, &errcode);
+    UFO_RESOURCES_CHECK_SET_AND_RETURN (errcode, error);
+}
+
 static void
 ufo_write_task_setup (UfoTask *task,
                       UfoResources *resources,
@@ -172,10 +535,20 @@ ufo_write_task_setup (UfoTask *task,
     gchar *dirname;
 
     priv = UFO_WRITE_TASK_GET_PRIVATE (task);
+    stop_write_behind (priv);
+
+    priv->context = ufo_resources_get_context (resources);
+    UFO_RESOURCES_CHECK_SET_AND_RETURN (clRetainContext (priv->context), error);
 
     /* If no filename has been specified we write to stdout */
     if (priv->filename == NULL) {
         priv->writer = UFO_WRITER (priv->raw_writer);
+        setup_device_conversion (priv, resources, error);
+        setup_global_limits (priv, error);
+
+        if (priv->async)
+            start_write_behind (priv);
+
         return;
     }
 
@@ -200,9 +573,23 @@ ufo_write_task_setup (UfoTask *task,
     if (ufo_writer_can_open (UFO_WRITER (priv->raw_writer), priv->filename)) {
         priv->writer = UFO_WRITER (priv->raw_writer);
     }
+    else if (ufo_writer_can_open (UFO_WRITER (priv->zarr_writer), priv->filename)) {
+        priv->writer = UFO_WRITER (priv->zarr_writer);
+    }
 #ifdef HAVE_TIFF
     else if (ufo_writer_can_open (UFO_WRITER (priv->tiff_writer), priv->filename)) {
+        guint tile_width;
+        guint tile_height;
+
         priv->writer = UFO_WRITER (priv->tiff_writer);
+        g_object_get (priv->tiff_writer, "tile-width", &tile_width, "tile-height", &tile_height, NULL);
+
+        if ((tile_width > 0) != (tile_height > 0)) {
+            g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                         "`tiff-tile-width' and `tiff-tile-height' must be set together");
+            g_free (dirname);
+            return;
+        }
     }
 #endif
 #ifdef WITH_HDF5
@@ -259,13 +646,16 @@ ufo_write_task_setup (UfoTask *task,
 
     g_free (dirname);
 
-    priv->context = ufo_resources_get_context (resources);
-    UFO_RESOURCES_CHECK_SET_AND_RETURN (clRetainContext (priv->context), error);
-
     priv->kernel = ufo_resources_get_kernel (resources, "split.cl", "unsplit", NULL, error);
 
     if (priv->kernel != NULL)
         UFO_RESOURCES_CHECK_SET_AND_RETURN (clRetainKernel (priv->kernel), error);
+
+    setup_device_conversion (priv, resources, error);
+    setup_global_limits (priv, error);
+
+    if (priv->async)
+        start_write_behind (priv);
 }
 
 static void
@@ -297,6 +687,266 @@ ufo_write_task_get_mode (UfoTask *task)
     return UFO_TASK_MODE_SINK | UFO_TASK_MODE_GPU;
 }
 
+static void
+get_min_max_on_device (UfoWriteTaskPrivate *priv,
+                       UfoProfiler *profiler,
+                       cl_command_queue cmd_queue,
+                       cl_mem in_mem,
+                       cl_ulong offset,
+                       cl_ulong size,
+                       gfloat *min,
+                       gfloat *max)
+{
+    gfloat partial[2 * MIN_MAX_GROUPS];
+    gsize global_size;
+    gsize local_size;
+    gboolean user_min = priv->min_limit < G_MAXFLOAT;
+    gboolean user_max = priv->max_limit > -G_MAXFLOAT;
+
+    *min = priv->min_limit;
+    *max = priv->max_limit;
+
+    if (user_min && user_max)
+        return;
+
+    if (priv->min_max_local_size == 0) {
+        cl_device_id device;
+        gsize max_size;
+
+        UFO_RESOURCES_CHECK_CLERR (clGetCommandQueueInfo (cmd_queue, CL_QUEUE_DEVICE,
+                                                          sizeof (cl_device_id), &device, NULL));
+        UFO_RESOURCES_CHECK_CLERR (clGetKernelWorkGroupInfo (priv->min_max_kernel, device, CL_KERNEL_WORK_GROUP_SIZE,
+                                                             sizeof (gsize), &max_size, NULL));
+
+        /* The reduction in the kernel needs a power of two */
+        priv->min_max_local_size = MIN_MAX_LOCAL_SIZE;
+
+        while (priv->min_max_local_size > 1 && priv->min_max_local_size > max_size)
+            priv->min_max_local_size /= 2;
+    }
+
+    local_size = priv->min_max_local_size;
+    global_size = MIN_MAX_GROUPS * local_size;
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->min_max_kernel, 0, sizeof (cl_mem), &in_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->min_max_kernel, 1, sizeof (cl_mem), &priv->partial_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->min_max_kernel, 2, local_size * sizeof (gfloat), NULL));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->min_max_kernel, 3, local_size * sizeof (gfloat), NULL));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->min_max_kernel, 4, sizeof (cl_ulong), &offset));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->min_max_kernel, 5, sizeof (cl_ulong), &size));
+    ufo_profiler_call (profiler, cmd_queue, priv->min_max_kernel, 1, &global_size, &local_size);
+
+    /* Only the partial results of the work groups are downloaded */
+    UFO_RESOURCES_CHECK_CLERR (clEnqueueReadBuffer (cmd_queue, priv->partial_mem, CL_TRUE, 0, sizeof (partial),
+                                                    partial, 0, NULL, NULL));
+
+    if (!user_min) {
+        *min = G_MAXFLOAT;
+
+        for (guint i = 0; i < MIN_MAX_GROUPS; i++)
+            *min = MIN (*min, partial[2 * i]);
+    }
+
+    if (!user_max) {
+        *max = -G_MAXFLOAT;
+
+        for (guint i = 0; i < MIN_MAX_GROUPS; i++)
+            *max = MAX (*max, partial[2 * i + 1]);
+    }
+}
+
+/*
+ * Rescale, clamp and narrow size pixels of in_mem starting at offset on the
+ * device, so that only the final 8 or 16 bit data crosses the bus. Returns the
+ * downloaded pixels, which are valid until the next call.
+ */
+static guint8 *
+convert_on_device (UfoWriteTaskPrivate *priv,
+                   UfoProfiler *profiler,
+                   cl_command_queue cmd_queue,
+                   cl_mem in_mem,
+                   cl_ulong offset,
+                   gsize size)
+{
+    gfloat min = 0.0f;
+    gfloat max;
+    gfloat lower = -G_MAXFLOAT;
+    gfloat upper = G_MAXFLOAT;
+    gfloat scale = 1.0f;
+    gsize out_size;
+    cl_int errcode;
+
+    out_size = size * priv->bits_per_sample / 8;
+
+    if (out_size > priv->converted_size) {
+        if (priv->converted_mem != NULL)
+            UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->converted_mem));
+
+        priv->converted_mem = clCreateBuffer (priv->context, CL_MEM_WRITE_ONLY, out_size, NULL, &errcode);
+        UFO_RESOURCES_CHECK_CLERR (errcode);
+        priv->converted = g_realloc (priv->converted, out_size);
+        priv->converted_size = out_size;
+    }
+
+    /*
+     * Same rescaling as ufo_writer_convert_inplace, min > max inverts. Without
+     * rescale, values outside of the output range saturate, whereas the host
+     * cast leaves them undefined.
+     */
+    if (priv->rescale) {
+        get_min_max_on_device (priv, profiler, cmd_queue, in_mem, offset, size, &min, &max);
+        lower = MIN (min, max);
+        upper = MAX (min, max);
+        scale = (priv->depth == UFO_BUFFER_DEPTH_8U ? 255.0f : 65535.0f) / (max - min);
+    }
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->convert_kernel, 0, sizeof (cl_mem), &in_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->convert_kernel, 1, sizeof (cl_mem), &priv->converted_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->convert_kernel, 2, sizeof (cl_ulong), &offset));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->convert_kernel, 3, sizeof (gfloat), &min));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->convert_kernel, 4, sizeof (gfloat), &lower));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->convert_kernel, 5, sizeof (gfloat), &upper));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->convert_kernel, 6, sizeof (gfloat), &scale));
+    ufo_profiler_call (profiler, cmd_queue, priv->convert_kernel, 1, &size, NULL);
+
+    UFO_RESOURCES_CHECK_CLERR (clEnqueueReadBuffer (cmd_queue, priv->converted_mem, CL_TRUE, 0, out_size,
+                                                    priv->converted, 0, NULL, NULL));
+
+    return priv->converted;
+}
+
+/*
+ * Hand a frame to the write-behind threads or write it right away. Queued
+ * frames are copied, so data may be reused once this returns.
+ */
+static void
+submit_frame (UfoWriteTaskPrivate *priv,
+              UfoRequisition *requisition,
+              guint8 *data,
+              gsize size,
+              gboolean converted)
+{
+    UfoWriterImage image;
+
+    if (priv->threads != NULL) {
+        WriteItem *item;
+
+        /* Blocks only if the writer threads fall behind by a full queue */
+        item = g_async_queue_pop (priv->free_queue);
+
+        if (item->size < size) {
+            g_free (item->data);
+            item->data = g_malloc (size);
+            item->size = size;
+        }
+
+        memcpy (item->data, data, size);
+        item->requisition = *requisition;
+        item->index = priv->num_queued++;
+        item->converted = converted;
+        g_async_queue_push (priv->ready_queue, item);
+        return;
+    }
+
+    init_image (priv, &image, requisition, data);
+
+    if (!converted)
+        ufo_writer_convert_inplace (&image);
+
+    write_image (priv, &image);
+}
+
+/*
+ * Fix the limits from the histogram of the frames seen so far and write the
+ * frames that were held back.
+ */
+static void
+finish_global_limits (UfoWriteTaskPrivate *priv)
+{
+    WriteItem *item;
+    guint8 *buffer = NULL;
+    gsize buffer_size = 0;
+
+    if (priv->min_limit >= G_MAXFLOAT)
+        priv->min_limit = ufo_histogram_get_percentile (priv->histogram, priv->low_percentile);
+
+    if (priv->max_limit <= -G_MAXFLOAT)
+        priv->max_limit = ufo_histogram_get_percentile (priv->histogram, priv->high_percentile);
+
+    priv->limits_known = TRUE;
+    g_debug ("write: rescaling to [%g, %g]", priv->min_limit, priv->max_limit);
+
+    if (priv->spill != NULL)
+        rewind (priv->spill);
+
+    while ((item = g_queue_pop_head (priv->collected)) != NULL) {
+        if (priv->spill != NULL) {
+            if (item->size > buffer_size) {
+                buffer = g_realloc (buffer, item->size);
+                buffer_size = item->size;
+            }
+
+            /* Once a read fails all following frames would be misaligned */
+            if (!priv->spill_failed && fread (buffer, 1, item->size, priv->spill) != item->size) {
+                g_warning ("write: could not read back spilled frame, dropping it and all following frames: %s",
+                           strerror (errno));
+                priv->spill_failed = TRUE;
+            }
+
+            if (!priv->spill_failed)
+                submit_frame (priv, &item->requisition, buffer, item->size, FALSE);
+        }
+        else {
+            submit_frame (priv, &item->requisition, item->data, item->size, FALSE);
+        }
+
+        g_free (item->data);
+        g_free (item);
+    }
+
+    g_free (buffer);
+    release_global_limits (priv);
+}
+
+static void
+collect_frame (UfoWriteTaskPrivate *priv,
+               UfoRequisition *requisition,
+               guint8 *data,
+               gsize size)
+{
+    WriteItem *item;
+
+    if (priv->spill_failed)
+        return;
+
+    /*
+     * Frames are read back in the order they were queued, so a frame missing
+     * from the file would shift all following ones. Limits from a part of the
+     * stream would be wrong as well, hence nothing is written at all.
+     */
+    if (priv->spill != NULL && fwrite (data, 1, size, priv->spill) != size) {
+        g_warning ("write: could not spill frame, no frames will be written: %s", strerror (errno));
+        priv->spill_failed = TRUE;
+        return;
+    }
+
+    ufo_histogram_add (priv->histogram, (gfloat *) data, size / sizeof (gfloat));
+
+    item = g_new0 (WriteItem, 1);
+    item->requisition = *requisition;
+    item->size = size;
+
+    if (priv->spill == NULL) {
+        item->data = g_malloc (size);
+        memcpy (item->data, data, size);
+    }
+
+    g_queue_push_tail (priv->collected, item);
+
+    if (priv->rescale_mode == RESCALE_PREFIX && g_queue_get_length (priv->collected) >= priv->rescale_prefix)
+        finish_global_limits (priv);
+}
+
 static gboolean
 ufo_write_task_process (UfoTask *task,
                         UfoBuffer **inputs,
@@ -304,91 +954,107 @@ ufo_write_task_process (UfoTask *task,
                         UfoRequisition *requisition)
 {
     UfoWriteTaskPrivate *priv;
-    UfoWriterImage image;
+    UfoGpuNode *node;
+    UfoProfiler *profiler;
     UfoRequisition in_req;
-    guint8 *data;
+    UfoRequisition frame_req;
+    cl_command_queue cmd_queue;
+    cl_mem in_mem = NULL;
+    guint8 *data = NULL;
+    gboolean on_device;
     guint num_frames;
-    gsize offset, out_size;
+    gsize num_pixels;
+    gsize offset;
 
     priv = UFO_WRITE_TASK_GET_PRIVATE (UFO_WRITE_TASK (task));
     ufo_buffer_get_requisition (inputs[0], &in_req);
+    frame_req = in_req;
+
+    node = UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task)));
+    cmd_queue = ufo_gpu_node_get_cmd_queue (node);
+    profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
+    /* Frames held back for global limits are needed as floats on the host */
+    on_device = priv->convert_kernel != NULL && priv->limits_known;
 
     /* 
      * If we have a cube with a depth of three planes we try to write color
      * images further down the line otherwise split it up and write the planes
-     * as single files.
+     * as single files. Batches of the read task are marked and always split.
      */
-    if (in_req.n_dims == 3 && in_req.dims[2] == 3) {
-        UfoGpuNode *node;
-        UfoProfiler *profiler;
-        cl_command_queue cmd_queue;
-        cl_mem in_mem;
-        cl_mem out_mem;
+    if (in_req.n_dims == 3 && in_req.dims[2] == 3 && ufo_buffer_get_metadata (inputs[0], "batch") == NULL) {
+        cl_mem tmp_mem;
 
         if (!priv->tmp)
             priv->tmp = ufo_buffer_new (&in_req, priv->context);
 
-        node = UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task)));
-        cmd_queue = ufo_gpu_node_get_cmd_queue (node);
         in_mem = ufo_buffer_get_device_array (inputs[0], cmd_queue);
-        out_mem = ufo_buffer_get_device_array (priv->tmp, cmd_queue);
+        tmp_mem = ufo_buffer_get_device_array (priv->tmp, cmd_queue);
 
         UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 0, sizeof (cl_mem), &in_mem));
-        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 1, sizeof (cl_mem), &out_mem));
-        profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 1, sizeof (cl_mem), &tmp_mem));
         ufo_profiler_call (profiler, cmd_queue, priv->kernel, 3, in_req.dims, NULL);
 
         num_frames = 1;
-        data = (guint8 *) ufo_buffer_get_host_array (priv->tmp, NULL);
+        num_pixels = in_req.dims[0] * in_req.dims[1] * 3;
+        in_mem = tmp_mem;
+
+        if (!on_device)
+            data = (guint8 *) ufo_buffer_get_host_array (priv->tmp, NULL);
     }
     else {
         num_frames = in_req.n_dims == 3 ? in_req.dims[2] : 1;
-        data = (guint8 *) ufo_buffer_get_host_array (inputs[0], NULL);
+        num_pixels = in_req.dims[0] * in_req.dims[1];
+
+        if (on_device)
+            in_mem = ufo_buffer_get_device_array (inputs[0], cmd_queue);
+        else
+            data = (guint8 *) ufo_buffer_get_host_array (inputs[0], NULL);
+
+        /* Each plane of a stack is written as a frame of its own */
+        frame_req.n_dims = 2;
     }
 
     offset = ufo_buffer_get_size (inputs[0]) / num_frames;
-    out_size = in_req.dims[0] * in_req.dims[1] * priv->bits_per_sample / 8;
-
-    image.requisition = &in_req;
-    image.depth = priv->depth;
-    image.min = priv->minimum;
-    image.max = priv->maximum;
-    image.rescale = priv->rescale;
 
     for (guint i = 0; i < num_frames; i++) {
-retry:
-        if (!priv->opened) {
-            GError *error = NULL;
-            gchar *filename = get_current_filename (priv);
-
-            if (filename && !can_be_written (filename, &error)) {
-                g_warning ("%s", error->message);
-                g_free (filename);
-                g_error_free (error);
-                priv->counter += priv->counter_step;
-                goto retry;
-            }
+        if (!priv->limits_known)
+            collect_frame (priv, &frame_req, data + i * offset, offset);
+        else if (on_device) {
+            guint8 *converted;
 
-            ufo_writer_open (priv->writer, filename);
-            if (filename) {
-                g_free (filename);
-            }
-            priv->opened = TRUE;
+            converted = convert_on_device (priv, profiler, cmd_queue, in_mem, i * num_pixels, num_pixels);
+            submit_frame (priv, &frame_req, converted, num_pixels * priv->bits_per_sample / 8, TRUE);
         }
+        else
+            submit_frame (priv, &frame_req, data + i * offset, offset, FALSE);
+    }
 
-        image.data = data + i * offset;
-        ufo_writer_write (priv->writer, &image);
-        priv->num_written_bytes += out_size;
+    return TRUE;
+}
 
-        if (priv->num_fmt_specifiers && priv->num_written_bytes + out_size > priv->bytes_per_file) {
-            ufo_writer_close (priv->writer);
-            priv->opened = FALSE;
-            priv->num_written_bytes = 0;
-            priv->counter += priv->counter_step;
-        }
+static void
+inputs_stopped_callback (UfoTask *task)
+{
+    UfoWriteTaskPrivate *priv = UFO_WRITE_TASK_GET_PRIVATE (task);
+
+    /* Short streams end before the prefix or spill mode fixed the limits */
+    if (!priv->limits_known)
+        finish_global_limits (priv);
+
+    /* Make sure everything is on disk once the stream ends */
+    stop_write_behind (priv);
+
+    /* Writers may hold back data until they are closed */
+    if (priv->opened) {
+        ufo_writer_close (priv->writer);
+        priv->opened = FALSE;
     }
 
-    return TRUE;
+#ifdef HAVE_JPEG
+    /* JPEG frames are encoded in the background */
+    if (priv->writer == UFO_WRITER (priv->jpeg_writer))
+        ufo_jpeg_writer_flush (priv->jpeg_writer);
+#endif
 }
 
 static void
@@ -450,17 +1116,135 @@ ufo_write_task_set_property (GObject *object,
         case PROP_RESCALE:
             priv->rescale = g_value_get_boolean (value);
             break;
+        case PROP_DEVICE_CONVERT:
+            priv->device_convert = g_value_get_boolean (value);
+            break;
+        case PROP_RESCALE_MODE:
+            {
+                const gchar *mode = g_value_get_string (value);
+
+                for (guint i = 0; i < G_N_ELEMENTS (rescale_modes); i++) {
+                    if (!g_strcmp0 (mode, rescale_modes[i])) {
+                        priv->rescale_mode = (RescaleMode) i;
+                        return;
+                    }
+                }
+
+                g_warning ("Write::rescale-mode can only be frame, prefix or spill");
+            }
+            break;
+        case PROP_RESCALE_PREFIX:
+            priv->rescale_prefix = g_value_get_uint (value);
+            break;
+        case PROP_RESCALE_LOW_PERCENTILE:
+            priv->low_percentile = g_value_get_float (value);
+            break;
+        case PROP_RESCALE_HIGH_PERCENTILE:
+            priv->high_percentile = g_value_get_float (value);
+            break;
 #ifdef HAVE_JPEG
         case PROP_JPEG_QUALITY:
             priv->jpeg_quality = g_value_get_uint (value);
             ufo_jpeg_writer_set_quality (priv->jpeg_writer, priv->jpeg_quality);
             break;
+        case PROP_JPEG_THREADS:
+            g_object_set_property (G_OBJECT (priv->jpeg_writer), "threads", value);
+            break;
+        case PROP_JPEG_LEVELS:
+            g_object_set_property (G_OBJECT (priv->jpeg_writer), "levels", value);
+            break;
 #endif
 #ifdef HAVE_TIFF
         case PROP_TIFF_BIGTIFF:
             g_object_set_property (G_OBJECT (priv->tiff_writer), "bigtiff", value);
             break;
+        case PROP_TIFF_COMPRESSION:
+            g_object_set_property (G_OBJECT (priv->tiff_writer), "compression", value);
+            break;
+        case PROP_TIFF_COMPRESSION_LEVEL:
+            g_object_set_property (G_OBJECT (priv->tiff_writer), "compression-level", value);
+            break;
+        case PROP_TIFF_PREDICTOR:
+            g_object_set_property (G_OBJECT (priv->tiff_writer), "predictor", value);
+            break;
+        case PROP_TIFF_TILE_WIDTH:
+            g_object_set_property (G_OBJECT (priv->tiff_writer), "tile-width", value);
+            break;
+        case PROP_TIFF_TILE_HEIGHT:
+            g_object_set_property (G_OBJECT (priv->tiff_writer), "tile-height", value);
+            break;
+        case PROP_TIFF_ROWS_PER_STRIP:
+            g_object_set_property (G_OBJECT (priv->tiff_writer), "rows-per-strip", value);
+            break;
+        case PROP_TIFF_THREADS:
+            g_object_set_property (G_OBJECT (priv->tiff_writer), "threads", value);
+            break;
+#endif
+#ifdef WITH_HDF5
+        case PROP_HDF5_CHUNK_FRAMES:
+            g_object_set_property (G_OBJECT (priv->hdf5_writer), "chunk-frames", value);
+            break;
+        case PROP_HDF5_CHUNK_HEIGHT:
+            g_object_set_property (G_OBJECT (priv->hdf5_writer), "chunk-height", value);
+            break;
+        case PROP_HDF5_CHUNK_WIDTH:
+            g_object_set_property (G_OBJECT (priv->hdf5_writer), "chunk-width", value);
+            break;
+        case PROP_HDF5_COMPRESSION:
+            g_object_set_property (G_OBJECT (priv->hdf5_writer), "compression", value);
+            break;
+        case PROP_HDF5_COMPRESSION_LEVEL:
+            g_object_set_property (G_OBJECT (priv->hdf5_writer), "compression-level", value);
+            break;
+        case PROP_HDF5_SHUFFLE:
+            g_object_set_property (G_OBJECT (priv->hdf5_writer), "shuffle", value);
+            break;
+        case PROP_HDF5_NUM_FRAMES:
+            g_object_set_property (G_OBJECT (priv->hdf5_writer), "num-frames", value);
+            break;
+        case PROP_HDF5_BATCH:
+            g_object_set_property (G_OBJECT (priv->hdf5_writer), "batch", value);
+            break;
 #endif
+        case PROP_ZARR_CHUNK_DEPTH:
+            g_object_set_property (G_OBJECT (priv->zarr_writer), "chunk-depth", value);
+            break;
+        case PROP_ZARR_CHUNK_HEIGHT:
+            g_object_set_property (G_OBJECT (priv->zarr_writer), "chunk-height", value);
+            break;
+        case PROP_ZARR_CHUNK_WIDTH:
+            g_object_set_property (G_OBJECT (priv->zarr_writer), "chunk-width", value);
+            break;
+        case PROP_ZARR_COMPRESSION:
+            g_object_set_property (G_OBJECT (priv->zarr_writer), "compression", value);
+            break;
+        case PROP_ZARR_COMPRESSION_LEVEL:
+            g_object_set_property (G_OBJECT (priv->zarr_writer), "compression-level", value);
+            break;
+        case PROP_ZARR_LEVELS:
+            g_object_set_property (G_OBJECT (priv->zarr_writer), "levels", value);
+            break;
+        case PROP_ZARR_THREADS:
+            g_object_set_property (G_OBJECT (priv->zarr_writer), "threads", value);
+            break;
+        case PROP_RAW_DIRECT:
+            g_object_set_property (G_OBJECT (priv->raw_writer), "direct", value);
+            break;
+        case PROP_RAW_BUFFER_SIZE:
+            g_object_set_property (G_OBJECT (priv->raw_writer), "buffer-size", value);
+            break;
+        case PROP_RAW_PREALLOCATE:
+            g_object_set_property (G_OBJECT (priv->raw_writer), "preallocate", value);
+            break;
+        case PROP_ASYNC:
+            priv->async = g_value_get_boolean (value);
+            break;
+        case PROP_QUEUE_DEPTH:
+            priv->queue_depth = g_value_get_uint (value);
+            break;
+        case PROP_IO_THREADS:
+            priv->io_threads = g_value_get_uint (value);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -510,16 +1294,123 @@ ufo_write_task_get_property (GObject *object,
         case PROP_RESCALE:
             g_value_set_boolean (value, priv->rescale);
             break;
+        case PROP_DEVICE_CONVERT:
+            g_value_set_boolean (value, priv->device_convert);
+            break;
+        case PROP_RESCALE_MODE:
+            g_value_set_string (value, rescale_modes[priv->rescale_mode]);
+            break;
+        case PROP_RESCALE_PREFIX:
+            g_value_set_uint (value, priv->rescale_prefix);
+            break;
+        case PROP_RESCALE_LOW_PERCENTILE:
+            g_value_set_float (value, priv->low_percentile);
+            break;
+        case PROP_RESCALE_HIGH_PERCENTILE:
+            g_value_set_float (value, priv->high_percentile);
+            break;
 #ifdef HAVE_JPEG
         case PROP_JPEG_QUALITY:
             g_value_set_uint (value, priv->jpeg_quality);
             break;
+        case PROP_JPEG_THREADS:
+            g_object_get_property (G_OBJECT (priv->jpeg_writer), "threads", value);
+            break;
+        case PROP_JPEG_LEVELS:
+            g_object_get_property (G_OBJECT (priv->jpeg_writer), "levels", value);
+            break;
 #endif
 #ifdef HAVE_TIFF
         case PROP_TIFF_BIGTIFF:
             g_object_get_property (G_OBJECT (priv->tiff_writer), "bigtiff", value);
             break;
+        case PROP_TIFF_COMPRESSION:
+            g_object_get_property (G_OBJECT (priv->tiff_writer), "compression", value);
+            break;
+        case PROP_TIFF_COMPRESSION_LEVEL:
+            g_object_get_property (G_OBJECT (priv->tiff_writer), "compression-level", value);
+            break;
+        case PROP_TIFF_PREDICTOR:
+            g_object_get_property (G_OBJECT (priv->tiff_writer), "predictor", value);
+            break;
+        case PROP_TIFF_TILE_WIDTH:
+            g_object_get_property (G_OBJECT (priv->tiff_writer), "tile-width", value);
+            break;
+        case PROP_TIFF_TILE_HEIGHT:
+            g_object_get_property (G_OBJECT (priv->tiff_writer), "tile-height", value);
+            break;
+        case PROP_TIFF_ROWS_PER_STRIP:
+            g_object_get_property (G_OBJECT (priv->tiff_writer), "rows-per-strip", value);
+            break;
+        case PROP_TIFF_THREADS:
+            g_object_get_property (G_OBJECT (priv->tiff_writer), "threads", value);
+            break;
 #endif
+#ifdef WITH_HDF5
+        case PROP_HDF5_CHUNK_FRAMES:
+            g_object_get_property (G_OBJECT (priv->hdf5_writer), "chunk-frames", value);
+            break;
+        case PROP_HDF5_CHUNK_HEIGHT:
+            g_object_get_property (G_OBJECT (priv->hdf5_writer), "chunk-height", value);
+            break;
+        case PROP_HDF5_CHUNK_WIDTH:
+            g_object_get_property (G_OBJECT (priv->hdf5_writer), "chunk-width", value);
+            break;
+        case PROP_HDF5_COMPRESSION:
+            g_object_get_property (G_OBJECT (priv->hdf5_writer), "compression", value);
+            break;
+        case PROP_HDF5_COMPRESSION_LEVEL:
+            g_object_get_property (G_OBJECT (priv->hdf5_writer), "compression-level", value);
+            break;
+        case PROP_HDF5_SHUFFLE:
+            g_object_get_property (G_OBJECT (priv->hdf5_writer), "shuffle", value);
+            break;
+        case PROP_HDF5_NUM_FRAMES:
+            g_object_get_property (G_OBJECT (priv->hdf5_writer), "num-frames", value);
+            break;
+        case PROP_HDF5_BATCH:
+            g_object_get_property (G_OBJECT (priv->hdf5_writer), "batch", value);
+            break;
+#endif
+        case PROP_ZARR_CHUNK_DEPTH:
+            g_object_get_property (G_OBJECT (priv->zarr_writer), "chunk-depth", value);
+            break;
+        case PROP_ZARR_CHUNK_HEIGHT:
+            g_object_get_property (G_OBJECT (priv->zarr_writer), "chunk-height", value);
+            break;
+        case PROP_ZARR_CHUNK_WIDTH:
+            g_object_get_property (G_OBJECT (priv->zarr_writer), "chunk-width", value);
+            break;
+        case PROP_ZARR_COMPRESSION:
+            g_object_get_property (G_OBJECT (priv->zarr_writer), "compression", value);
+            break;
+        case PROP_ZARR_COMPRESSION_LEVEL:
+            g_object_get_property (G_OBJECT (priv->zarr_writer), "compression-level", value);
+            break;
+        case PROP_ZARR_LEVELS:
+            g_object_get_property (G_OBJECT (priv->zarr_writer), "levels", value);
+            break;
+        case PROP_ZARR_THREADS:
+            g_object_get_property (G_OBJECT (priv->zarr_writer), "threads", value);
+            break;
+        case PROP_RAW_DIRECT:
+            g_object_get_property (G_OBJECT (priv->raw_writer), "direct", value);
+            break;
+        case PROP_RAW_BUFFER_SIZE:
+            g_object_get_property (G_OBJECT (priv->raw_writer), "buffer-size", value);
+            break;
+        case PROP_RAW_PREALLOCATE:
+            g_object_get_property (G_OBJECT (priv->raw_writer), "preallocate", value);
+            break;
+        case PROP_ASYNC:
+            g_value_set_boolean (value, priv->async);
+            break;
+        case PROP_QUEUE_DEPTH:
+            g_value_set_uint (value, priv->queue_depth);
+            break;
+        case PROP_IO_THREADS:
+            g_value_set_uint (value, priv->io_threads);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -533,7 +1424,10 @@ ufo_write_task_dispose (GObject *object)
 
     priv = UFO_WRITE_TASK_GET_PRIVATE (object);
 
+    stop_write_behind (priv);
+    release_global_limits (priv);
     g_object_unref (priv->raw_writer);
+    g_object_unref (priv->zarr_writer);
 
 #ifdef HAVE_TIFF
     if (priv->tiff_writer)
@@ -575,11 +1469,17 @@ ufo_write_task_finalize (GObject *object)
         priv->tmp = NULL;
     }
 
+    release_device_conversion (priv);
+    g_free (priv->converted);
+
     if (priv->context) {
         UFO_RESOURCES_CHECK_CLERR (clReleaseContext (priv->context));
         priv->context = NULL;
     }
 
+    g_mutex_clear (&priv->lock);
+    g_cond_clear (&priv->written);
+
     G_OBJECT_CLASS (ufo_write_task_parent_class)->finalize (object);
 }
 
@@ -667,12 +1567,62 @@ ufo_write_task_class_init (UfoWriteTaskClass *klass)
             TRUE,
             G_PARAM_READWRITE);
 
+    properties[PROP_DEVICE_CONVERT] =
+        g_param_spec_boolean ("device-convert",
+            "Rescale and narrow on the GPU",
+            "Rescale, clamp and narrow 8 and 16 bit output on the GPU before downloading it",
+            FALSE,
+            G_PARAM_READWRITE);
+
+    properties[PROP_RESCALE_MODE] =
+        g_param_spec_string ("rescale-mode",
+            "Scope of automatic rescaling",
+            "Scope of automatic rescaling, one of frame (limits per frame), "
+                "prefix (limits from the first frames) or spill (limits from all frames)",
+            "frame",
+            G_PARAM_READWRITE);
+
+    properties[PROP_RESCALE_PREFIX] =
+        g_param_spec_uint ("rescale-prefix",
+            "Number of frames determining the limits in prefix mode",
+            "Number of frames determining the limits in prefix mode",
+            1, G_MAXUINT, 16,
+            G_PARAM_READWRITE);
+
+    properties[PROP_RESCALE_LOW_PERCENTILE] =
+        g_param_spec_float ("rescale-low-percentile",
+            "Percentile mapped to zero in prefix and spill mode",
+            "Percentile mapped to zero in prefix and spill mode",
+            0.0f, 100.0f, 0.0f,
+            G_PARAM_READWRITE);
+
+    properties[PROP_RESCALE_HIGH_PERCENTILE] =
+        g_param_spec_float ("rescale-high-percentile",
+            "Percentile mapped to the largest value in prefix and spill mode",
+            "Percentile mapped to the largest value in prefix and spill mode",
+            0.0f, 100.0f, 100.0f,
+            G_PARAM_READWRITE);
+
 #ifdef HAVE_JPEG
     properties[PROP_JPEG_QUALITY] =
         g_param_spec_uint ("jpeg-quality",
             "JPEG quality",
             "JPEG quality between 0 and 100",
             0, 100, 95, G_PARAM_READWRITE);
+
+    properties[PROP_JPEG_THREADS] =
+        g_param_spec_uint ("jpeg-threads",
+            "Number of JPEG encoding threads",
+            "Number of threads encoding consecutive JPEG frames, 0 for one per processor",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_JPEG_LEVELS] =
+        g_param_spec_uint ("jpeg-levels",
+            "Number of JPEG preview levels",
+            "Number of JPEG resolution levels written per frame, each halving width and height",
+            1, 16, 1,
+            G_PARAM_READWRITE);
 #endif
 
 #ifdef HAVE_TIFF
@@ -682,8 +1632,206 @@ ufo_write_task_class_init (UfoWriteTaskClass *klass)
             "Write BigTiff format",
             TRUE,
             G_PARAM_READWRITE);
+
+    properties[PROP_TIFF_COMPRESSION] =
+        g_param_spec_string ("tiff-compression",
+            "TIFF compression scheme",
+            "TIFF compression scheme, one of none, lzw, deflate or zstd",
+            "none",
+            G_PARAM_READWRITE);
+
+    properties[PROP_TIFF_COMPRESSION_LEVEL] =
+        g_param_spec_uint ("tiff-compression-level",
+            "TIFF compression level",
+            "TIFF compression level for deflate and zstd, 0 for the default",
+            0, 22, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_TIFF_PREDICTOR] =
+        g_param_spec_boolean ("tiff-predictor",
+            "Use a predictor before TIFF compression",
+            "Use horizontal differencing for integers and the floating point predictor for floats",
+            FALSE,
+            G_PARAM_READWRITE);
+
+    properties[PROP_TIFF_TILE_WIDTH] =
+        g_param_spec_uint ("tiff-tile-width",
+            "TIFF tile width",
+            "TIFF tile width, a multiple of 16, 0 to write strips",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_TIFF_TILE_HEIGHT] =
+        g_param_spec_uint ("tiff-tile-height",
+            "TIFF tile height",
+            "TIFF tile height, a multiple of 16, 0 to write strips",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_TIFF_ROWS_PER_STRIP] =
+        g_param_spec_uint ("tiff-rows-per-strip",
+            "TIFF rows per strip",
+            "TIFF rows per strip, 0 to choose automatically",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_TIFF_THREADS] =
+        g_param_spec_uint ("tiff-threads",
+            "Number of TIFF compression threads",
+            "Number of threads compressing TIFF strips or tiles, 0 for one per processor",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+#endif
+
+#ifdef WITH_HDF5
+    properties[PROP_HDF5_CHUNK_FRAMES] =
+        g_param_spec_uint ("hdf5-chunk-frames",
+            "Number of frames per HDF5 chunk",
+            "Number of frames per HDF5 chunk",
+            1, G_MAXUINT, 1,
+            G_PARAM_READWRITE);
+
+    properties[PROP_HDF5_CHUNK_HEIGHT] =
+        g_param_spec_uint ("hdf5-chunk-height",
+            "HDF5 chunk height",
+            "HDF5 chunk height, 0 for the full frame height",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_HDF5_CHUNK_WIDTH] =
+        g_param_spec_uint ("hdf5-chunk-width",
+            "HDF5 chunk width",
+            "HDF5 chunk width, 0 for the full frame width",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_HDF5_COMPRESSION] =
+        g_param_spec_string ("hdf5-compression",
+            "HDF5 compression filter",
+            "HDF5 compression filter, one of none, deflate, lz4, zstd or bitshuffle",
+            "none",
+            G_PARAM_READWRITE);
+
+    properties[PROP_HDF5_COMPRESSION_LEVEL] =
+        g_param_spec_uint ("hdf5-compression-level",
+            "HDF5 compression level",
+            "HDF5 compression level, 0 for the default of the filter",
+            0, 22, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_HDF5_SHUFFLE] =
+        g_param_spec_boolean ("hdf5-shuffle",
+            "Shuffle bytes before HDF5 compression",
+            "Shuffle bytes before HDF5 compression",
+            FALSE,
+            G_PARAM_READWRITE);
+
+    properties[PROP_HDF5_NUM_FRAMES] =
+        g_param_spec_uint ("hdf5-num-frames",
+            "Number of frames to allocate in the HDF5 data set",
+            "Number of frames allocated when the HDF5 data set is created, 0 if unknown",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_HDF5_BATCH] =
+        g_param_spec_uint ("hdf5-batch",
+            "Number of frames per HDF5 write",
+            "Number of frames collected before they are written to HDF5 at once",
+            1, G_MAXUINT, 1,
+            G_PARAM_READWRITE);
 #endif
 
+    properties[PROP_ZARR_CHUNK_DEPTH] =
+        g_param_spec_uint ("zarr-chunk-depth",
+            "Number of slices per Zarr chunk",
+            "Number of slices per Zarr chunk",
+            1, G_MAXUINT, 64,
+            G_PARAM_READWRITE);
+
+    properties[PROP_ZARR_CHUNK_HEIGHT] =
+        g_param_spec_uint ("zarr-chunk-height",
+            "Zarr chunk height",
+            "Zarr chunk height",
+            1, G_MAXUINT, 256,
+            G_PARAM_READWRITE);
+
+    properties[PROP_ZARR_CHUNK_WIDTH] =
+        g_param_spec_uint ("zarr-chunk-width",
+            "Zarr chunk width",
+            "Zarr chunk width",
+            1, G_MAXUINT, 256,
+            G_PARAM_READWRITE);
+
+    properties[PROP_ZARR_COMPRESSION] =
+        g_param_spec_string ("zarr-compression",
+            "Zarr chunk compression",
+            "Zarr chunk compression, one of none, zlib or zstd",
+            "none",
+            G_PARAM_READWRITE);
+
+    properties[PROP_ZARR_COMPRESSION_LEVEL] =
+        g_param_spec_uint ("zarr-compression-level",
+            "Zarr compression level",
+            "Zarr compression level for zlib and zstd, 0 for the default",
+            0, 22, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_ZARR_LEVELS] =
+        g_param_spec_uint ("zarr-levels",
+            "Number of Zarr resolution levels",
+            "Number of Zarr resolution levels, each halving the slice width and height",
+            1, 32, 1,
+            G_PARAM_READWRITE);
+
+    properties[PROP_ZARR_THREADS] =
+        g_param_spec_uint ("zarr-threads",
+            "Number of Zarr compression threads",
+            "Number of threads compressing and writing Zarr chunks, 0 for one per processor",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_RAW_DIRECT] =
+        g_param_spec_boolean ("raw-direct",
+            "Write raw files bypassing the page cache",
+            "If true, raw files are written with O_DIRECT from aligned, double-buffered staging memory",
+            FALSE,
+            G_PARAM_READWRITE);
+
+    properties[PROP_RAW_BUFFER_SIZE] =
+        g_param_spec_uint64 ("raw-buffer-size",
+            "Size of a direct raw write in bytes",
+            "Size of each of the two staging buffers used for direct raw writes in bytes",
+            4096, G_MAXUINT64, 16 << 20,
+            G_PARAM_READWRITE);
+
+    properties[PROP_RAW_PREALLOCATE] =
+        g_param_spec_uint64 ("raw-preallocate",
+            "Number of bytes to preallocate per raw file",
+            "Number of bytes to reserve on disk for each raw file, unused space is released on close, 0 to disable",
+            0, G_MAXUINT64, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_ASYNC] =
+        g_param_spec_boolean ("async",
+            "Write in background threads",
+            "If true, frames are queued and written by background threads",
+            FALSE,
+            G_PARAM_READWRITE);
+
+    properties[PROP_QUEUE_DEPTH] =
+        g_param_spec_uint ("queue-depth",
+            "Number of frames queued for writing",
+            "Number of frames that can be queued before processing blocks",
+            1, G_MAXUINT, 8,
+            G_PARAM_READWRITE);
+
+    properties[PROP_IO_THREADS] =
+        g_param_spec_uint ("io-threads",
+            "Number of writer threads",
+            "Number of threads converting and writing queued frames",
+            1, G_MAXUINT, 1,
+            G_PARAM_READWRITE);
+
     for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
         g_object_class_install_property (gobject_class, i, properties[i]);
 
@@ -706,13 +1854,26 @@ ufo_write_task_init(UfoWriteTask *self)
     self->priv->minimum = G_MAXFLOAT;
     self->priv->maximum = -G_MAXFLOAT;
     self->priv->rescale = TRUE;
+    self->priv->device_convert = FALSE;
+    self->priv->rescale_mode = RESCALE_FRAME;
+    self->priv->rescale_prefix = 16;
+    self->priv->low_percentile = 0.0f;
+    self->priv->high_percentile = 100.0f;
+    self->priv->limits_known = TRUE;
     self->priv->writer = NULL;
     self->priv->opened = FALSE;
     self->priv->filename = NULL;
     self->priv->raw_writer = ufo_raw_writer_new ();
+    self->priv->zarr_writer = ufo_zarr_writer_new ();
     self->priv->context = NULL;
     self->priv->kernel = NULL;
     self->priv->tmp = NULL;
+    self->priv->async = FALSE;
+    self->priv->queue_depth = 8;
+    self->priv->io_threads = 1;
+    self->priv->threads = NULL;
+    g_mutex_init (&self->priv->lock);
+    g_cond_init (&self->priv->written);
 
 #ifdef HAVE_TIFF
     self->priv->tiff_writer = ufo_tiff_writer_new ();
@@ -726,4 +1887,6 @@ ufo_write_task_init(UfoWriteTask *self)
 #ifdef WITH_HDF5
     self->priv->hdf5_writer = ufo_hdf5_writer_new ();
 #endif
+
+    g_signal_connect (self, "inputs_stopped", (GCallback) inputs_stopped_callback, NULL);
 }
@@ -0,0 +1,520 @@
+/*
+ * Copyright (C) 2011-2013 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <glib/gstdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ufo-write-volume-task.h"
+#include "writers/ufo-writer.h"
+
+/*
+ * Writes slices into one raw volume file at positions given by the input
+ * rather than by arrival order. The file is only ever grown, never truncated,
+ * so several pipelines can fill disjoint slices of the same volume at once.
+ */
+struct _UfoWriteVolumeTaskPrivate {
+    gchar *filename;
+    guint number;
+    guint offset;
+    gchar *index_key;
+
+    UfoBufferDepth depth;
+    guint bits_per_sample;
+    gfloat minimum;
+    gfloat maximum;
+    gboolean rescale;
+
+    guint8 *map;
+    gsize map_size;
+    gsize width;
+    gsize height;
+    guint64 count;
+    gboolean failed;
+};
+
+static void ufo_task_interface_init (UfoTaskIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (UfoWriteVolumeTask, ufo_write_volume_task, UFO_TYPE_TASK_NODE,
+                         G_IMPLEMENT_INTERFACE (UFO_TYPE_TASK,
+                                                ufo_task_interface_init))
+
+#define UFO_WRITE_VOLUME_TASK_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), UFO_TYPE_WRITE_VOLUME_TASK, UfoWriteVolumeTaskPrivate))
+
+enum {
+    PROP_0,
+    PROP_FILENAME,
+    PROP_NUMBER,
+    PROP_OFFSET,
+    PROP_INDEX_KEY,
+    PROP_BITS,
+    PROP_MINIMUM,
+    PROP_MAXIMUM,
+    PROP_RESCALE,
+    N_PROPERTIES
+};
+
+static GParamSpec *properties[N_PROPERTIES] = { NULL, };
+
+UfoNode *
+ufo_write_volume_task_new (void)
+{
+    return UFO_NODE (g_object_new (UFO_TYPE_WRITE_VOLUME_TASK, NULL));
+}
+
+static void
+unmap_volume (UfoWriteVolumeTaskPrivate *priv)
+{
+    if (priv->map == NULL)
+        return;
+
+    if (msync (priv->map, priv->map_size, MS_SYNC))
+        g_warning ("write-volume: could not sync `%s': %s", priv->filename, strerror (errno));
+
+    munmap (priv->map, priv->map_size);
+    priv->map = NULL;
+}
+
+/*
+ * Grow the file to hold the whole volume without touching existing data, which
+ * other instances may already have written, and map it.
+ */
+static gboolean
+map_volume (UfoWriteVolumeTaskPrivate *priv, gsize width, gsize height)
+{
+    struct stat st;
+    gsize size;
+    gint fd;
+
+    size = ((gsize) priv->number) * width * height * priv->bits_per_sample / 8;
+    fd = g_open (priv->filename, O_RDWR | O_CREAT, 0644);
+
+    if (fd < 0) {
+        g_warning ("write-volume: could not open `%s': %s", priv->filename, strerror (errno));
+        return FALSE;
+    }
+
+    if (fstat (fd, &st)) {
+        g_warning ("write-volume: could not stat `%s': %s", priv->filename, strerror (errno));
+        close (fd);
+        return FALSE;
+    }
+
+    if ((gsize) st.st_size < size) {
+#ifndef __APPLE__
+        /* Reserve the blocks up front, sparse files fragment when filled out of order */
+        if (posix_fallocate (fd, 0, size) == 0)
+            st.st_size = size;
+#endif
+        if ((gsize) st.st_size < size && ftruncate (fd, size)) {
+            g_warning ("write-volume: could not allocate %zu bytes for `%s': %s",
+                       size, priv->filename, strerror (errno));
+            close (fd);
+            return FALSE;
+        }
+    }
+
+    priv->map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close (fd);
+
+    if (priv->map == MAP_FAILED) {
+        g_warning ("write-volume: could not map `%s': %s", priv->filename, strerror (errno));
+        priv->map = NULL;
+        return FALSE;
+    }
+
+    priv->map_size = size;
+    priv->width = width;
+    priv->height = height;
+    return TRUE;
+}
+
+static guint64
+get_index (UfoWriteVolumeTaskPrivate *priv, UfoBuffer *buffer)
+{
+    GValue *value = NULL;
+    GValue index = G_VALUE_INIT;
+    guint64 result;
+
+    if (priv->index_key != NULL && priv->index_key[0] != '\0')
+        value = ufo_buffer_get_metadata (buffer, priv->index_key);
+
+    if (value == NULL)
+        return priv->offset + priv->count;
+
+    g_value_init (&index, G_TYPE_UINT64);
+
+    if (!g_value_transform (value, &index)) {
+        g_warning ("write-volume: metadata `%s' is not an integer", priv->index_key);
+        return priv->offset + priv->count;
+    }
+
+    result = priv->offset + g_value_get_uint64 (&index);
+    g_value_unset (&index);
+    return result;
+}
+
+static void
+inputs_stopped_callback (UfoTask *task)
+{
+    unmap_volume (UFO_WRITE_VOLUME_TASK_GET_PRIVATE (task));
+}
+
+static void
+ufo_write_volume_task_setup (UfoTask *task,
+                             UfoResources *resources,
+                             GError **error)
+{
+    UfoWriteVolumeTaskPrivate *priv;
+    gchar *dirname;
+
+    priv = UFO_WRITE_VOLUME_TASK_GET_PRIVATE (task);
+
+    if (priv->filename == NULL) {
+        g_set_error_literal (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                             "write-volume: `filename' must be set");
+        return;
+    }
+
+    if (priv->number == 0) {
+        g_set_error_literal (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                             "write-volume: `number' of slices must be set");
+        return;
+    }
+
+    dirname = g_path_get_dirname (priv->filename);
+
+    if (g_mkdir_with_parents (dirname, 0755)) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "Could not create `%s'.", dirname);
+        g_free (dirname);
+        return;
+    }
+
+    g_free (dirname);
+    unmap_volume (priv);
+    priv->count = 0;
+    priv->failed = FALSE;
+}
+
+static void
+ufo_write_volume_task_get_requisition (UfoTask *task,
+                                       UfoBuffer **inputs,
+                                       UfoRequisition *requisition,
+                                       GError **error)
+{
+    requisition->n_dims = 0;
+}
+
+static guint
+ufo_write_volume_task_get_num_inputs (UfoTask *task)
+{
+    return 1;
+}
+
+static guint
+ufo_write_volume_task_get_num_dimensions (UfoTask *task,
+                                          guint input)
+{
+    g_return_val_if_fail (input == 0, 0);
+    return 2;
+}
+
+static UfoTaskMode
+ufo_write_volume_task_get_mode (UfoTask *task)
+{
+    return UFO_TASK_MODE_SINK | UFO_TASK_MODE_CPU;
+}
+
+static gboolean
+ufo_write_volume_task_process (UfoTask *task,
+                               UfoBuffer **inputs,
+                               UfoBuffer *output,
+                               UfoRequisition *requisition)
+{
+    UfoWriteVolumeTaskPrivate *priv;
+    UfoRequisition in_req;
+    UfoRequisition frame_req;
+    UfoWriterImage image;
+    guint8 *data;
+    guint64 index;
+    guint num_frames;
+    gsize in_size;
+    gsize out_size;
+
+    priv = UFO_WRITE_VOLUME_TASK_GET_PRIVATE (task);
+
+    if (priv->failed)
+        return TRUE;
+
+    ufo_buffer_get_requisition (inputs[0], &in_req);
+
+    if (priv->map == NULL && !map_volume (priv, in_req.dims[0], in_req.dims[1])) {
+        priv->failed = TRUE;
+        return TRUE;
+    }
+
+    if (in_req.dims[0] != priv->width || in_req.dims[1] != priv->height) {
+        g_warning ("write-volume: input size %zu x %zu does not match volume slices of %zu x %zu",
+                   in_req.dims[0], in_req.dims[1], priv->width, priv->height);
+        return TRUE;
+    }
+
+    /* The planes of a stack go to consecutive slices */
+    num_frames = in_req.n_dims == 3 ? in_req.dims[2] : 1;
+    frame_req = in_req;
+    frame_req.n_dims = 2;
+    in_size = priv->width * priv->height * sizeof (gfloat);
+    out_size = priv->width * priv->height * priv->bits_per_sample / 8;
+    data = (guint8 *) ufo_buffer_get_host_array (inputs[0], NULL);
+    index = get_index (priv, inputs[0]);
+
+    for (guint i = 0; i < num_frames; i++, index++) {
+        if (index >= priv->number) {
+            g_warning ("write-volume: slice %" G_GUINT64_FORMAT " is outside of the volume", index);
+            continue;
+        }
+
+        image.data = data + i * in_size;
+        image.requisition = &frame_req;
+        image.depth = priv->depth;
+        image.min = priv->minimum;
+        image.max = priv->maximum;
+        image.rescale = priv->rescale;
+        ufo_writer_convert_inplace (&image);
+
+        memcpy (priv->map + index * out_size, image.data, out_size);
+    }
+
+    priv->count += num_frames;
+    return TRUE;
+}
+
+static void
+ufo_task_interface_init (UfoTaskIface *iface)
+{
+    iface->setup = ufo_write_volume_task_setup;
+    iface->get_num_inputs = ufo_write_volume_task_get_num_inputs;
+    iface->get_num_dimensions = ufo_write_volume_task_get_num_dimensions;
+    iface->get_mode = ufo_write_volume_task_get_mode;
+    iface->get_requisition = ufo_write_volume_task_get_requisition;
+    iface->process = ufo_write_volume_task_process;
+}
+
+static void
+ufo_write_volume_task_set_property (GObject *object,
+                                    guint property_id,
+                                    const GValue *value,
+                                    GParamSpec *pspec)
+{
+    UfoWriteVolumeTaskPrivate *priv = UFO_WRITE_VOLUME_TASK_GET_PRIVATE (object);
+
+    switch (property_id) {
+        case PROP_FILENAME:
+            g_free (priv->filename);
+            priv->filename = g_value_dup_string (value);
+            break;
+        case PROP_NUMBER:
+            priv->number = g_value_get_uint (value);
+            break;
+        case PROP_OFFSET:
+            priv->offset = g_value_get_uint (value);
+            break;
+        case PROP_INDEX_KEY:
+            g_free (priv->index_key);
+            priv->index_key = g_value_dup_string (value);
+            break;
+        case PROP_BITS:
+            {
+                guint val = g_value_get_uint (value);
+
+                if (val != 8 && val != 16 && val != 32) {
+                    g_warning ("WriteVolume::bits can only 8, 16 or 32");
+                    return;
+                }
+
+                priv->bits_per_sample = val;
+                priv->depth = val == 8 ? UFO_BUFFER_DEPTH_8U :
+                              val == 16 ? UFO_BUFFER_DEPTH_16U : UFO_BUFFER_DEPTH_32F;
+            }
+            break;
+        case PROP_MINIMUM:
+            priv->minimum = g_value_get_float (value);
+            break;
+        case PROP_MAXIMUM:
+            priv->maximum = g_value_get_float (value);
+            break;
+        case PROP_RESCALE:
+            priv->rescale = g_value_get_boolean (value);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+ufo_write_volume_task_get_property (GObject *object,
+                                    guint property_id,
+                                    GValue *value,
+                                    GParamSpec *pspec)
+{
+    UfoWriteVolumeTaskPrivate *priv = UFO_WRITE_VOLUME_TASK_GET_PRIVATE (object);
+
+    switch (property_id) {
+        case PROP_FILENAME:
+            g_value_set_string (value, priv->filename ? priv->filename : "");
+            break;
+        case PROP_NUMBER:
+            g_value_set_uint (value, priv->number);
+            break;
+        case PROP_OFFSET:
+            g_value_set_uint (value, priv->offset);
+            break;
+        case PROP_INDEX_KEY:
+            g_value_set_string (value, priv->index_key ? priv->index_key : "");
+            break;
+        case PROP_BITS:
+            g_value_set_uint (value, priv->bits_per_sample);
+            break;
+        case PROP_MINIMUM:
+            g_value_set_float (value, priv->minimum);
+            break;
+        case PROP_MAXIMUM:
+            g_value_set_float (value, priv->maximum);
+            break;
+        case PROP_RESCALE:
+            g_value_set_boolean (value, priv->rescale);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+ufo_write_volume_task_finalize (GObject *object)
+{
+    UfoWriteVolumeTaskPrivate *priv;
+
+    priv = UFO_WRITE_VOLUME_TASK_GET_PRIVATE (object);
+
+    unmap_volume (priv);
+    g_free (priv->filename);
+    g_free (priv->index_key);
+
+    G_OBJECT_CLASS (ufo_write_volume_task_parent_class)->finalize (object);
+}
+
+static void
+ufo_write_volume_task_class_init (UfoWriteVolumeTaskClass *klass)
+{
+    GObjectClass *oclass;
+    oclass = G_OBJECT_CLASS (klass);
+
+    oclass->set_property = ufo_write_volume_task_set_property;
+    oclass->get_property = ufo_write_volume_task_get_property;
+    oclass->finalize = ufo_write_volume_task_finalize;
+
+    properties[PROP_FILENAME] =
+        g_param_spec_string ("filename",
+            "Path of the raw volume file",
+            "Path of the raw volume file",
+            "",
+            G_PARAM_READWRITE);
+
+    properties[PROP_NUMBER] =
+        g_param_spec_uint ("number",
+            "Number of slices in the volume",
+            "Number of slices in the volume",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_OFFSET] =
+        g_param_spec_uint ("offset",
+            "Index of the first slice written by this instance",
+            "Index of the first slice written by this instance, added to indices from metadata",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_INDEX_KEY] =
+        g_param_spec_string ("index-key",
+            "Metadata key holding the slice index",
+            "Metadata key holding the slice index, slices are numbered in arrival order if unset",
+            "",
+            G_PARAM_READWRITE);
+
+    properties[PROP_BITS] =
+        g_param_spec_uint ("bits",
+            "Number of bits per sample",
+            "Number of bits per sample. Possible values in [8, 16, 32].",
+            8, 32, 32, G_PARAM_READWRITE);
+
+    properties[PROP_MINIMUM] =
+        g_param_spec_float ("minimum",
+            "Lowest value to be used for spreading",
+            "Lowest value to be used for spreading",
+            -G_MAXFLOAT, G_MAXFLOAT, G_MAXFLOAT,
+            G_PARAM_READWRITE);
+
+    properties[PROP_MAXIMUM] =
+        g_param_spec_float ("maximum",
+            "Highest value to be used for spreading",
+            "Highest value to be used for spreading",
+            -G_MAXFLOAT, G_MAXFLOAT, -G_MAXFLOAT,
+            G_PARAM_READWRITE);
+
+    properties[PROP_RESCALE] =
+        g_param_spec_boolean ("rescale",
+            "If true rescale values automatically or according to set min and max",
+            "If true rescale values automatically or according to set min and max",
+            TRUE,
+            G_PARAM_READWRITE);
+
+    for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
+        g_object_class_install_property (oclass, i, properties[i]);
+
+    g_type_class_add_private(klass, sizeof (UfoWriteVolumeTaskPrivate));
+}
+
+static void
+ufo_write_volume_task_init(UfoWriteVolumeTask *self)
+{
+    UfoWriteVolumeTaskPrivate *priv;
+
+    self->priv = priv = UFO_WRITE_VOLUME_TASK_GET_PRIVATE (self);
+    priv->filename = NULL;
+    priv->number = 0;
+    priv->offset = 0;
+    priv->index_key = NULL;
+    priv->depth = UFO_BUFFER_DEPTH_32F;
+    priv->bits_per_sample = 32;
+    priv->minimum = G_MAXFLOAT;
+    priv->maximum = -G_MAXFLOAT;
+    priv->rescale = TRUE;
+    priv->map = NULL;
+
+    g_signal_connect (self, "inputs_stopped", (GCallback) inputs_stopped_callback, NULL);
+}
@@ -17,7 +17,10 @@
  * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <string.h>
+
 #include "common/hdf5.h"
+#include "common/hdf5-filters.h"
 #include "writers/ufo-writer.h"
 #include "writers/ufo-hdf5-writer.h"
 
@@ -27,6 +30,22 @@ struct _UfoHdf5WriterPrivate {
     hid_t file_id;
     hid_t dataset_id;
     guint current;
+
+    guint chunk_frames;
+    guint chunk_height;
+    guint chunk_width;
+    gchar *compression;
+    guint compression_level;
+    gboolean shuffle;
+    guint num_frames;
+    guint batch;
+
+    hid_t mem_type;
+    hsize_t extent;
+    hsize_t frame_dims[2];
+    gsize frame_size;
+    guint8 *pending;
+    guint num_pending;
 };
 
 static void ufo_writer_interface_init (UfoWriterIface *iface);
@@ -37,6 +56,23 @@ G_DEFINE_TYPE_WITH_CODE (UfoHdf5Writer, ufo_hdf5_writer, G_TYPE_OBJECT,
 
 #define UFO_HDF5_WRITER_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), UFO_TYPE_HDF5_WRITER, UfoHdf5WriterPrivate))
 
+enum {
+    PROP_0,
+    PROP_CHUNK_FRAMES,
+    PROP_CHUNK_HEIGHT,
+    PROP_CHUNK_WIDTH,
+    PROP_COMPRESSION,
+    PROP_COMPRESSION_LEVEL,
+    PROP_SHUFFLE,
+    PROP_NUM_FRAMES,
+    PROP_BATCH,
+    N_PROPERTIES
+};
+
+static GParamSpec *properties[N_PROPERTIES] = { NULL, };
+
+static const gchar *compressions[] = { "none", "deflate", "lz4", "zstd", "bitshuffle", NULL };
+
 UfoHdf5Writer *
 ufo_hdf5_writer_new (void)
 {
@@ -77,6 +113,45 @@ ufo_hdf5_writer_open (UfoWriter *writer,
 
     g_strfreev (components);
     priv->current = 0;
+    priv->dataset_id = -1;
+    priv->num_pending = 0;
+}
+
+static void
+write_frames (UfoHdf5WriterPrivate *priv, gconstpointer data, guint num_frames)
+{
+    hid_t dst_dataspace_id;
+    hid_t src_dataspace_id;
+    hsize_t offset[3] = { priv->current, 0, 0 };
+    hsize_t count[3] = { num_frames, priv->frame_dims[0], priv->frame_dims[1] };
+
+    /* Only touch the extent if we run past what was allocated up front */
+    if (priv->current + num_frames > priv->extent) {
+        hsize_t dims[3] = { priv->current + num_frames, priv->frame_dims[0], priv->frame_dims[1] };
+
+        H5Dset_extent (priv->dataset_id, dims);
+        priv->extent = dims[0];
+    }
+
+    dst_dataspace_id = H5Dget_space (priv->dataset_id);
+    src_dataspace_id = H5Screate_simple (3, count, NULL);
+
+    H5Sselect_hyperslab (dst_dataspace_id, H5S_SELECT_SET, offset, NULL, count, NULL);
+    H5Dwrite (priv->dataset_id, priv->mem_type, src_dataspace_id, dst_dataspace_id, H5P_DEFAULT, data);
+
+    H5Sclose (src_dataspace_id);
+    H5Sclose (dst_dataspace_id);
+    priv->current += num_frames;
+}
+
+static void
+flush_pending (UfoHdf5WriterPrivate *priv)
+{
+    if (priv->num_pending == 0)
+        return;
+
+    write_frames (priv, priv->pending, priv->num_pending);
+    priv->num_pending = 0;
 }
 
 static void
@@ -85,8 +160,22 @@ ufo_hdf5_writer_close (UfoWriter *writer)
     UfoHdf5WriterPrivate *priv;
 
     priv = UFO_HDF5_WRITER_GET_PRIVATE (writer);
-    H5Dclose (priv->dataset_id);
+
+    if (priv->dataset_id >= 0) {
+        flush_pending (priv);
+
+        /* Give back pre-allocated frames that were never written */
+        if (priv->current < priv->extent) {
+            hsize_t dims[3] = { priv->current, priv->frame_dims[0], priv->frame_dims[1] };
+            H5Dset_extent (priv->dataset_id, dims);
+        }
+
+        H5Dclose (priv->dataset_id);
+        priv->dataset_id = -1;
+    }
+
     H5Fclose (priv->file_id);
+    priv->file_id = -1;
 }
 
 static hid_t
@@ -170,57 +259,233 @@ buffer_depth_to_hdf5_type (UfoBufferDepth depth)
     }
 }
 
+static void
+set_plugin_filter (hid_t dcpl, H5Z_filter_t filter, const gchar *name, guint n_values, const guint *values)
+{
+    /* Third-party filters are loaded at run time and may be missing */
+    if (H5Zfilter_avail (filter) <= 0) {
+        g_warning ("hdf5: %s filter plugin not available, writing uncompressed data", name);
+        return;
+    }
+
+    H5Pset_filter (dcpl, filter, H5Z_FLAG_OPTIONAL, n_values, values);
+}
+
+static hid_t
+create_dataset_plist (UfoHdf5WriterPrivate *priv, hsize_t *chunk)
+{
+    hid_t dcpl;
+
+    dcpl = H5Pcreate (H5P_DATASET_CREATE);
+    H5Pset_chunk (dcpl, 3, chunk);
+
+    /* Every allocated element gets written, so do not fill chunks first */
+    H5Pset_fill_time (dcpl, H5D_FILL_TIME_NEVER);
+
+    if (priv->compression == NULL || !g_strcmp0 (priv->compression, "none"))
+        return dcpl;
+
+    if (priv->shuffle && g_strcmp0 (priv->compression, "bitshuffle"))
+        H5Pset_shuffle (dcpl);
+
+    if (!g_strcmp0 (priv->compression, "deflate")) {
+        H5Pset_deflate (dcpl, priv->compression_level ? MIN (priv->compression_level, 9) : 4);
+    }
+    else if (!g_strcmp0 (priv->compression, "lz4")) {
+        set_plugin_filter (dcpl, UFO_HDF5_FILTER_LZ4, "LZ4", 0, NULL);
+    }
+    else if (!g_strcmp0 (priv->compression, "zstd")) {
+        guint level = priv->compression_level ? priv->compression_level : 3;
+
+        set_plugin_filter (dcpl, UFO_HDF5_FILTER_ZSTD, "Zstandard", 1, &level);
+    }
+    else if (!g_strcmp0 (priv->compression, "bitshuffle")) {
+        /* The first three values are filled in by the filter, LZ4 on top */
+        guint values[5] = { 0, 0, 0, 0, 2 };
+
+        set_plugin_filter (dcpl, UFO_HDF5_FILTER_BITSHUFFLE, "bitshuffle", 5, values);
+    }
+
+    return dcpl;
+}
+
+static void
+open_dataset (UfoHdf5WriterPrivate *priv, UfoWriterImage *image)
+{
+    hid_t dapl;
+    hsize_t chunk[3];
+
+    priv->mem_type = buffer_depth_to_hdf5_type (image->depth);
+    priv->frame_dims[0] = image->requisition->dims[1];
+    priv->frame_dims[1] = image->requisition->dims[0];
+    priv->frame_size = priv->frame_dims[0] * priv->frame_dims[1] * H5Tget_size (priv->mem_type);
+
+    chunk[0] = MAX (priv->chunk_frames, 1);
+    chunk[1] = priv->chunk_height ? MIN (priv->chunk_height, priv->frame_dims[0]) : priv->frame_dims[0];
+    chunk[2] = priv->chunk_width ? MIN (priv->chunk_width, priv->frame_dims[1]) : priv->frame_dims[1];
+
+    /*
+     * Multi-slice chunks are filled by several writes, keep one layer of them
+     * in the cache so that each chunk is compressed and written only once.
+     */
+    dapl = H5Pcreate (H5P_DATASET_ACCESS);
+    H5Pset_chunk_cache (dapl, H5D_CHUNK_CACHE_NSLOTS_DEFAULT, chunk[0] * priv->frame_size, 1.0);
+
+    if (dataset_exists (priv->file_id, priv->dataset)) {
+        hid_t dataspace_id;
+        hsize_t dims[3];
+
+        priv->dataset_id = H5Dopen (priv->file_id, priv->dataset, dapl);
+        dataspace_id = H5Dget_space (priv->dataset_id);
+        H5Sget_simple_extent_dims (dataspace_id, dims, NULL);
+        H5Sclose (dataspace_id);
+        priv->extent = dims[0];
+    }
+    else {
+        hid_t group_id;
+        hid_t dcpl;
+        hid_t dst_dataspace_id;
+        hsize_t dims[3] = { priv->num_frames, priv->frame_dims[0], priv->frame_dims[1] };
+        hsize_t max_dims[3] = { H5S_UNLIMITED, priv->frame_dims[0], priv->frame_dims[1] };
+
+        group_id = make_groups (priv->file_id, priv->dataset);
+
+        /* If we know how many frames will come, allocate them once */
+        dst_dataspace_id = H5Screate_simple (3, dims, max_dims);
+        dcpl = create_dataset_plist (priv, chunk);
+        priv->dataset_id = H5Dcreate (group_id, priv->dataset, priv->mem_type, dst_dataspace_id,
+                                      H5P_DEFAULT, dcpl, dapl);
+        priv->extent = dims[0];
+
+        H5Pclose (dcpl);
+        H5Sclose (dst_dataspace_id);
+    }
+
+    H5Pclose (dapl);
+
+    if (priv->batch > 1) {
+        g_free (priv->pending);
+        priv->pending = g_malloc (priv->batch * priv->frame_size);
+    }
+}
+
 static void
 ufo_hdf5_writer_write (UfoWriter *writer,
                        UfoWriterImage *image)
 {
     UfoHdf5WriterPrivate *priv;
-    hid_t dst_dataspace_id;
-    hid_t src_dataspace_id;
-    hid_t mem_type;
 
     priv = UFO_HDF5_WRITER_GET_PRIVATE (writer);
 
-    hsize_t offset[3] = { priv->current, 0, 0 };
-    hsize_t count[3] = { 1, image->requisition->dims[1], image->requisition->dims[0] };
-    hsize_t dims[3] = { priv->current + 1, image->requisition->dims[1], image->requisition->dims[0] };
-    hsize_t src_dims[2] = { image->requisition->dims[0], image->requisition->dims[1] };
-    mem_type = buffer_depth_to_hdf5_type (image->depth);
-
-    if (priv->current == 0) {
-        if (dataset_exists (priv->file_id, priv->dataset)) {
-            priv->dataset_id = H5Dopen (priv->file_id, priv->dataset, H5P_DEFAULT);
-        }
-        else {
-            hid_t group_id;
-            hid_t dcpl;
-            hsize_t max_dims[3] = { H5S_UNLIMITED, image->requisition->dims[1], image->requisition->dims[0] };
+    if (priv->dataset_id < 0)
+        open_dataset (priv, image);
 
-            group_id = make_groups (priv->file_id, priv->dataset);
+    if (priv->batch <= 1) {
+        write_frames (priv, image->data, 1);
+        return;
+    }
 
-            dst_dataspace_id = H5Screate_simple (3, dims, max_dims);
-            dcpl = H5Pcreate (H5P_DATASET_CREATE);
-            H5Pset_chunk (dcpl, 3, dims);
-            priv->dataset_id = H5Dcreate (group_id, priv->dataset, mem_type, dst_dataspace_id,
-                                          H5P_DEFAULT, dcpl, H5P_DEFAULT);
+    /* Collect frames and write them with a single H5Dwrite */
+    memcpy (priv->pending + priv->num_pending * priv->frame_size, image->data, priv->frame_size);
+    priv->num_pending++;
 
-            H5Pclose (dcpl);
-            H5Sclose (dst_dataspace_id);
-        }
-    }
-    else {
-        H5Dset_extent (priv->dataset_id, dims);
+    if (priv->num_pending == priv->batch)
+        flush_pending (priv);
+}
+
+static gboolean
+is_valid_compression (const gchar *name)
+{
+    for (guint i = 0; compressions[i] != NULL; i++) {
+        if (!g_strcmp0 (compressions[i], name))
+            return TRUE;
     }
 
-    dst_dataspace_id = H5Dget_space (priv->dataset_id);
-    src_dataspace_id = H5Screate_simple (2, src_dims, NULL);
+    return FALSE;
+}
 
-    H5Sselect_hyperslab (dst_dataspace_id, H5S_SELECT_SET, offset, NULL, count, NULL);
-    H5Dwrite (priv->dataset_id, mem_type, src_dataspace_id, dst_dataspace_id, H5P_DEFAULT, image->data);
+static void
+ufo_hdf5_writer_set_property (GObject *object,
+                              guint property_id,
+                              const GValue *value,
+                              GParamSpec *pspec)
+{
+    UfoHdf5WriterPrivate *priv = UFO_HDF5_WRITER_GET_PRIVATE (object);
 
-    H5Sclose (src_dataspace_id);
-    H5Sclose (dst_dataspace_id);
-    priv->current++;
+    switch (property_id) {
+        case PROP_CHUNK_FRAMES:
+            priv->chunk_frames = g_value_get_uint (value);
+            break;
+        case PROP_CHUNK_HEIGHT:
+            priv->chunk_height = g_value_get_uint (value);
+            break;
+        case PROP_CHUNK_WIDTH:
+            priv->chunk_width = g_value_get_uint (value);
+            break;
+        case PROP_COMPRESSION:
+            if (!is_valid_compression (g_value_get_string (value))) {
+                g_warning ("hdf5: compression must be one of none, deflate, lz4, zstd or bitshuffle");
+                return;
+            }
+
+            g_free (priv->compression);
+            priv->compression = g_value_dup_string (value);
+            break;
+        case PROP_COMPRESSION_LEVEL:
+            priv->compression_level = g_value_get_uint (value);
+            break;
+        case PROP_SHUFFLE:
+            priv->shuffle = g_value_get_boolean (value);
+            break;
+        case PROP_NUM_FRAMES:
+            priv->num_frames = g_value_get_uint (value);
+            break;
+        case PROP_BATCH:
+            priv->batch = g_value_get_uint (value);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+ufo_hdf5_writer_get_property (GObject *object,
+                              guint property_id,
+                              GValue *value,
+                              GParamSpec *pspec)
+{
+    UfoHdf5WriterPrivate *priv = UFO_HDF5_WRITER_GET_PRIVATE (object);
+
+    switch (property_id) {
+        case PROP_CHUNK_FRAMES:
+            g_value_set_uint (value, priv->chunk_frames);
+            break;
+        case PROP_CHUNK_HEIGHT:
+            g_value_set_uint (value, priv->chunk_height);
+            break;
+        case PROP_CHUNK_WIDTH:
+            g_value_set_uint (value, priv->chunk_width);
+            break;
+        case PROP_COMPRESSION:
+            g_value_set_string (value, priv->compression);
+            break;
+        case PROP_COMPRESSION_LEVEL:
+            g_value_set_uint (value, priv->compression_level);
+            break;
+        case PROP_SHUFFLE:
+            g_value_set_boolean (value, priv->shuffle);
+            break;
+        case PROP_NUM_FRAMES:
+            g_value_set_uint (value, priv->num_frames);
+            break;
+        case PROP_BATCH:
+            g_value_set_uint (value, priv->batch);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
 }
 
 static void
@@ -229,7 +494,14 @@ ufo_hdf5_writer_finalize (GObject *object)
     UfoHdf5WriterPrivate *priv;
 
     priv = UFO_HDF5_WRITER_GET_PRIVATE (object);
+
+    /* Do not lose frames still waiting for a batch to fill up */
+    if (priv->file_id >= 0)
+        ufo_hdf5_writer_close (UFO_WRITER (object));
+
     g_free (priv->dataset);
+    g_free (priv->compression);
+    g_free (priv->pending);
 
     G_OBJECT_CLASS (ufo_hdf5_writer_parent_class)->finalize (object);
 }
@@ -248,8 +520,69 @@ ufo_hdf5_writer_class_init (UfoHdf5WriterClass *klass)
 {
     GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
 
+    gobject_class->set_property = ufo_hdf5_writer_set_property;
+    gobject_class->get_property = ufo_hdf5_writer_get_property;
     gobject_class->finalize = ufo_hdf5_writer_finalize;
 
+    properties[PROP_CHUNK_FRAMES] =
+        g_param_spec_uint ("chunk-frames",
+            "Number of frames per chunk",
+            "Number of frames per chunk",
+            1, G_MAXUINT, 1,
+            G_PARAM_READWRITE);
+
+    properties[PROP_CHUNK_HEIGHT] =
+        g_param_spec_uint ("chunk-height",
+            "Chunk height",
+            "Chunk height, 0 for the full frame height",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_CHUNK_WIDTH] =
+        g_param_spec_uint ("chunk-width",
+            "Chunk width",
+            "Chunk width, 0 for the full frame width",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_COMPRESSION] =
+        g_param_spec_string ("compression",
+            "Compression filter",
+            "Compression filter, one of none, deflate, lz4, zstd or bitshuffle",
+            "none",
+            G_PARAM_READWRITE);
+
+    properties[PROP_COMPRESSION_LEVEL] =
+        g_param_spec_uint ("compression-level",
+            "Compression level",
+            "Compression level, 0 for the default of the filter",
+            0, 22, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_SHUFFLE] =
+        g_param_spec_boolean ("shuffle",
+            "Shuffle bytes before compression",
+            "Shuffle bytes before compression",
+            FALSE,
+            G_PARAM_READWRITE);
+
+    properties[PROP_NUM_FRAMES] =
+        g_param_spec_uint ("num-frames",
+            "Number of frames to allocate",
+            "Number of frames allocated when the data set is created, 0 if unknown",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_BATCH] =
+        g_param_spec_uint ("batch",
+            "Number of frames per write",
+            "Number of frames collected before they are written at once",
+            1, G_MAXUINT, 1,
+            G_PARAM_READWRITE);
+
+    for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
+        g_object_class_install_property (gobject_class, i, properties[i]);
+
     g_type_class_add_private (gobject_class, sizeof (UfoHdf5WriterPrivate));
 }
 
@@ -260,4 +593,10 @@ ufo_hdf5_writer_init (UfoHdf5Writer *self)
 
     self->priv = priv = UFO_HDF5_WRITER_GET_PRIVATE (self);
     priv->dataset = NULL;
+    priv->file_id = -1;
+    priv->dataset_id = -1;
+    priv->chunk_frames = 1;
+    priv->compression = g_strdup ("none");
+    priv->batch = 1;
+    priv->pending = NULL;
 }
@@ -18,18 +18,39 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include <jpeglib.h>
 #include <jerror.h>
+#include <glib/gstdio.h>
 
 #include "writers/ufo-writer.h"
 #include "writers/ufo-jpeg-writer.h"
 
+/* Frames that may be queued per encoding thread before write blocks */
+#define JOBS_PER_THREAD     2
+
+typedef struct {
+    gchar *filename;
+    guint8 *data;
+    gsize width;
+    gsize height;
+    gint components;
+    gint quality;
+    guint levels;
+    guint64 sequence;
+} Job;
 
 struct _UfoJpegWriterPrivate {
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr error;
-    FILE *fp;
+    gchar *filename;
     int quality;
+    guint threads;
+    guint levels;
+
+    GThreadPool *pool;
+    GMutex lock;
+    GCond cond;
+    guint64 submitted;
+    guint64 committed;
 };
 
 static void ufo_writer_interface_init (UfoWriterIface *iface);
@@ -40,6 +61,15 @@ G_DEFINE_TYPE_WITH_CODE (UfoJpegWriter, ufo_jpeg_writer, G_TYPE_OBJECT,
 
 #define UFO_JPEG_WRITER_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), UFO_TYPE_JPEG_WRITER, UfoJpegWriterPrivate))
 
+enum {
+    PROP_0,
+    PROP_THREADS,
+    PROP_LEVELS,
+    N_PROPERTIES
+};
+
+static GParamSpec *properties[N_PROPERTIES] = { NULL, };
+
 UfoJpegWriter *
 ufo_jpeg_writer_new (void)
 {
@@ -53,6 +83,25 @@ ufo_jpeg_writer_set_quality (UfoJpegWriter *writer, gint quality)
     writer->priv->quality = quality;
 }
 
+/**
+ * ufo_jpeg_writer_flush:
+ * @writer: A #UfoJpegWriter
+ *
+ * Wait until all frames passed so far have been encoded and written.
+ */
+void
+ufo_jpeg_writer_flush (UfoJpegWriter *writer)
+{
+    UfoJpegWriterPrivate *priv = writer->priv;
+
+    g_mutex_lock (&priv->lock);
+
+    while (priv->committed != priv->submitted)
+        g_cond_wait (&priv->cond, &priv->lock);
+
+    g_mutex_unlock (&priv->lock);
+}
+
 static gboolean
 ufo_jpeg_writer_can_open (UfoWriter *writer,
                           const gchar *filename)
@@ -67,7 +116,8 @@ ufo_jpeg_writer_open (UfoWriter *writer,
     UfoJpegWriterPrivate *priv;
 
     priv = UFO_JPEG_WRITER_GET_PRIVATE (writer);
-    priv->fp = fopen (filename, "wb");
+    g_free (priv->filename);
+    priv->filename = g_strdup (filename);
 }
 
 static void
@@ -76,9 +126,156 @@ ufo_jpeg_writer_close (UfoWriter *writer)
     UfoJpegWriterPrivate *priv;
 
     priv = UFO_JPEG_WRITER_GET_PRIVATE (writer);
-    g_assert (priv->fp != NULL);
-    fclose (priv->fp);
-    priv->fp = NULL;
+    g_assert (priv->filename != NULL);
+    g_free (priv->filename);
+    priv->filename = NULL;
+}
+
+/*
+ * Preview level @level of frame.jpg is stored as frame_<2^level>.jpg, i.e.
+ * frame_2.jpg holds the frame at half the width and height.
+ */
+static gchar *
+get_level_filename (const gchar *filename, guint level)
+{
+    const gchar *extension;
+    gchar *stem;
+    gchar *result;
+
+    if (level == 0)
+        return g_strdup (filename);
+
+    extension = strrchr (filename, '.');
+    stem = g_strndup (filename, extension - filename);
+    result = g_strdup_printf ("%s_%u%s", stem, 1 << level, extension);
+    g_free (stem);
+    return result;
+}
+
+/* Average 2 x 2 pixels in place, returns FALSE if the frame is too small */
+static gboolean
+downsample (guint8 *data, gsize *width, gsize *height, gint components)
+{
+    gsize in_width = *width;
+    gsize out_width = in_width / 2;
+    gsize out_height = *height / 2;
+
+    if (out_width == 0 || out_height == 0)
+        return FALSE;
+
+    for (gsize y = 0; y < out_height; y++) {
+        const guint8 *row0 = data + 2 * y * in_width * components;
+        const guint8 *row1 = row0 + in_width * components;
+        guint8 *out = data + y * out_width * components;
+
+        for (gsize x = 0; x < out_width; x++) {
+            for (gint c = 0; c < components; c++) {
+                gsize i = 2 * x * components + c;
+
+                out[x * components + c] = (guint8) ((row0[i] + row0[i + components] +
+                                                     row1[i] + row1[i + components] + 2) / 4);
+            }
+        }
+    }
+
+    *width = out_width;
+    *height = out_height;
+    return TRUE;
+}
+
+static gboolean
+encode (const gchar *filename, const guint8 *data, gsize width, gsize height,
+        gint components, gint quality)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr error;
+    gsize row_stride;
+    FILE *fp;
+
+    if ((fp = g_fopen (filename, "wb")) == NULL)
+        return FALSE;
+
+    cinfo.err = jpeg_std_error (&error);
+    jpeg_create_compress (&cinfo);
+    jpeg_stdio_dest (&cinfo, fp);
+
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = components;
+    cinfo.in_color_space = components == 3 ? JCS_RGB : JCS_GRAYSCALE;
+
+    jpeg_set_defaults (&cinfo);
+    jpeg_set_quality (&cinfo, quality, 1);
+    jpeg_start_compress (&cinfo, TRUE);
+
+    row_stride = width * components;
+
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row_pointer[1];
+        row_pointer[0] = (JSAMPROW) (data + cinfo.next_scanline * row_stride);
+        jpeg_write_scanlines (&cinfo, row_pointer, 1);
+    }
+
+    jpeg_finish_compress (&cinfo);
+    jpeg_destroy_compress (&cinfo);
+    return fclose (fp) == 0;
+}
+
+/*
+ * Frames are encoded into temporary files in any order but renamed in the
+ * order they were passed to the writer. A preview consumer therefore never
+ * sees a partially written file nor a newer frame before an older one.
+ */
+static void
+encode_job (Job *job, UfoJpegWriterPrivate *priv)
+{
+    gchar **filenames;
+    gchar **tmp_filenames;
+    gsize width = job->width;
+    gsize height = job->height;
+    guint levels = 0;
+
+    filenames = g_new0 (gchar *, job->levels);
+    tmp_filenames = g_new0 (gchar *, job->levels);
+
+    for (guint level = 0; level < job->levels; level++) {
+        if (level > 0 && !downsample (job->data, &width, &height, job->components))
+            break;
+
+        filenames[level] = get_level_filename (job->filename, level);
+        tmp_filenames[level] = g_strconcat (filenames[level], ".tmp", NULL);
+        levels++;
+
+        if (!encode (tmp_filenames[level], job->data, width, height, job->components, job->quality))
+            g_warning ("jpeg: could not write `%s'", tmp_filenames[level]);
+    }
+
+    g_mutex_lock (&priv->lock);
+
+    while (priv->committed != job->sequence)
+        g_cond_wait (&priv->cond, &priv->lock);
+
+    g_mutex_unlock (&priv->lock);
+
+    for (guint level = 0; level < levels; level++) {
+        if (g_rename (tmp_filenames[level], filenames[level]))
+            g_warning ("jpeg: could not rename `%s'", tmp_filenames[level]);
+
+        g_free (filenames[level]);
+        g_free (tmp_filenames[level]);
+    }
+
+    g_free (filenames);
+    g_free (tmp_filenames);
+
+    g_mutex_lock (&priv->lock);
+    priv->committed++;
+    g_cond_broadcast (&priv->cond);
+    g_mutex_unlock (&priv->lock);
+
+    g_free (job->filename);
+    g_free (job->data);
+    g_free (job);
 }
 
 static void
@@ -86,16 +283,12 @@ ufo_jpeg_writer_write (UfoWriter *writer,
                        UfoWriterImage *image)
 {
     UfoJpegWriterPrivate *priv;
-    gint row_stride;
+    guint num_threads;
     gboolean is_rgb;
+    Job *job;
 
     is_rgb = image->requisition->n_dims == 3 && image->requisition->dims[2] == 3;
-
     priv = UFO_JPEG_WRITER_GET_PRIVATE (writer);
-    priv->cinfo.image_width = image->requisition->dims[0];
-    priv->cinfo.image_height = image->requisition->dims[1];
-    priv->cinfo.input_components = is_rgb ? 3 : 1;
-    priv->cinfo.in_color_space = is_rgb ? JCS_RGB : JCS_GRAYSCALE;
 
     /*
      * We have to ignore the given bit depth for JPEG. Note that this way, we
@@ -108,21 +301,76 @@ ufo_jpeg_writer_write (UfoWriter *writer,
         ufo_writer_convert_inplace (image);
     }
 
-    jpeg_stdio_dest (&priv->cinfo, priv->fp);
-    jpeg_set_defaults (&priv->cinfo);
-    jpeg_set_quality (&priv->cinfo, priv->quality, 1);
-    jpeg_start_compress (&priv->cinfo, TRUE);
+    job = g_new0 (Job, 1);
+    job->filename = g_strdup (priv->filename);
+    job->width = image->requisition->dims[0];
+    job->height = image->requisition->dims[1];
+    job->components = is_rgb ? 3 : 1;
+    job->quality = priv->quality;
+    job->levels = priv->levels;
+    job->data = g_malloc (job->width * job->height * job->components);
+    memcpy (job->data, image->data, job->width * job->height * job->components);
 
-    row_stride = (gint) image->requisition->dims[0] * priv->cinfo.input_components;
+    num_threads = priv->threads ? priv->threads : g_get_num_processors ();
 
-    while (priv->cinfo.next_scanline < priv->cinfo.image_height) {
-        JSAMPROW row_pointer[1];
-        row_pointer[0] = (JSAMPROW) (((gchar *) image->data) + priv->cinfo.next_scanline * row_stride);
-        jpeg_write_scanlines (&priv->cinfo, row_pointer, 1);
+    if (priv->pool == NULL)
+        priv->pool = g_thread_pool_new ((GFunc) encode_job, priv, num_threads, TRUE, NULL);
+
+    /* Bound the memory held by queued frames */
+    g_mutex_lock (&priv->lock);
+
+    while (priv->submitted - priv->committed >= num_threads * JOBS_PER_THREAD)
+        g_cond_wait (&priv->cond, &priv->lock);
+
+    job->sequence = priv->submitted++;
+    g_mutex_unlock (&priv->lock);
+
+    g_thread_pool_push (priv->pool, job, NULL);
+}
+
+static void
+ufo_jpeg_writer_set_property (GObject *object,
+                              guint property_id,
+                              const GValue *value,
+                              GParamSpec *pspec)
+{
+    UfoJpegWriterPrivate *priv = UFO_JPEG_WRITER_GET_PRIVATE (object);
+
+    switch (property_id) {
+        case PROP_THREADS:
+            priv->threads = g_value_get_uint (value);
+
+            if (priv->pool != NULL)
+                g_thread_pool_set_max_threads (priv->pool, priv->threads ? priv->threads : g_get_num_processors (), NULL);
+            break;
+        case PROP_LEVELS:
+            priv->levels = g_value_get_uint (value);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
     }
+}
 
-    jpeg_finish_compress (&priv->cinfo);
-    jpeg_abort_compress (&priv->cinfo);
+static void
+ufo_jpeg_writer_get_property (GObject *object,
+                              guint property_id,
+                              GValue *value,
+                              GParamSpec *pspec)
+{
+    UfoJpegWriterPrivate *priv = UFO_JPEG_WRITER_GET_PRIVATE (object);
+
+    switch (property_id) {
+        case PROP_THREADS:
+            g_value_set_uint (value, priv->threads);
+            break;
+        case PROP_LEVELS:
+            g_value_set_uint (value, priv->levels);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
 }
 
 static void
@@ -132,10 +380,12 @@ ufo_jpeg_writer_finalize (GObject *object)
 
     priv = UFO_JPEG_WRITER_GET_PRIVATE (object);
 
-    jpeg_destroy_compress (&priv->cinfo);
+    if (priv->pool != NULL)
+        g_thread_pool_free (priv->pool, FALSE, TRUE);
 
-    if (priv->fp != NULL)
-        ufo_jpeg_writer_close (UFO_WRITER (object));
+    g_mutex_clear (&priv->lock);
+    g_cond_clear (&priv->cond);
+    g_free (priv->filename);
 
     G_OBJECT_CLASS (ufo_jpeg_writer_parent_class)->finalize (object);
 }
@@ -154,8 +404,27 @@ ufo_jpeg_writer_class_init(UfoJpegWriterClass *klass)
 {
     GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
 
+    gobject_class->set_property = ufo_jpeg_writer_set_property;
+    gobject_class->get_property = ufo_jpeg_writer_get_property;
     gobject_class->finalize = ufo_jpeg_writer_finalize;
 
+    properties[PROP_THREADS] =
+        g_param_spec_uint ("threads",
+            "Number of encoding threads",
+            "Number of threads encoding consecutive frames, 0 for one per processor",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_LEVELS] =
+        g_param_spec_uint ("levels",
+            "Number of preview levels",
+            "Number of resolution levels written per frame, each halving width and height",
+            1, 16, 1,
+            G_PARAM_READWRITE);
+
+    for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
+        g_object_class_install_property (gobject_class, i, properties[i]);
+
     g_type_class_add_private (gobject_class, sizeof (UfoJpegWriterPrivate));
 }
 
@@ -165,8 +434,13 @@ ufo_jpeg_writer_init (UfoJpegWriter *self)
     UfoJpegWriterPrivate *priv = NULL;
 
     self->priv = priv = UFO_JPEG_WRITER_GET_PRIVATE (self);
-    priv->fp = NULL;
+    priv->filename = NULL;
     priv->quality = 95;
-    priv->cinfo.err = jpeg_std_error (&priv->error);
-    jpeg_create_compress (&priv->cinfo);
+    priv->threads = 0;
+    priv->levels = 1;
+    priv->pool = NULL;
+    priv->submitted = 0;
+    priv->committed = 0;
+    g_mutex_init (&priv->lock);
+    g_cond_init (&priv->cond);
 }
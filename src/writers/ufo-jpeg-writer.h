@@ -48,6 +48,7 @@ struct _UfoJpegWriterClass {
 
 UfoJpegWriter  *ufo_jpeg_writer_new         (void);
 void            ufo_jpeg_writer_set_quality (UfoJpegWriter *writer, gint quality);
+void            ufo_jpeg_writer_flush       (UfoJpegWriter *writer);
 GType           ufo_jpeg_writer_get_type    (void);
 
 G_END_DECLS
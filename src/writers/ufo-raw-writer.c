@@ -17,14 +17,54 @@
  * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/* O_DIRECT is a Linux extension */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
 
 #include "writers/ufo-writer.h"
 #include "writers/ufo-raw-writer.h"
 
+/*
+ * O_DIRECT requires buffer addresses, sizes and file offsets to be multiples
+ * of the logical block size, which is at most this on common devices.
+ */
+#define DIRECT_ALIGNMENT    4096
+
+/* One block is filled while the other is being written */
+#define NUM_BLOCKS          2
+
+typedef struct {
+    guint8 *data;
+    gsize size;
+    guint64 offset;
+} Block;
 
 struct _UfoRawWriterPrivate {
     FILE *fp;
+
+    gboolean direct;
+    gsize buffer_size;
+    guint64 preallocate;
+    guint64 num_written;
+    guint num_dropped;
+
+    gint fd;
+    Block blocks[NUM_BLOCKS];
+    Block stop;
+    Block *current;
+    GAsyncQueue *free_queue;
+    GAsyncQueue *full_queue;
+    GThread *thread;
+    gint error;
 };
 
 static void ufo_writer_interface_init (UfoWriterIface *iface);
@@ -35,6 +75,16 @@ G_DEFINE_TYPE_WITH_CODE (UfoRawWriter, ufo_raw_writer, G_TYPE_OBJECT,
 
 #define UFO_RAW_WRITER_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), UFO_TYPE_RAW_WRITER, UfoRawWriterPrivate))
 
+enum {
+    PROP_0,
+    PROP_DIRECT,
+    PROP_BUFFER_SIZE,
+    PROP_PREALLOCATE,
+    N_PROPERTIES
+};
+
+static GParamSpec *properties[N_PROPERTIES] = { NULL, };
+
 UfoRawWriter *
 ufo_raw_writer_new (void)
 {
@@ -49,6 +99,134 @@ ufo_raw_writer_can_open (UfoWriter *writer,
     return g_str_has_suffix (filename, ".raw");
 }
 
+static void
+preallocate (UfoRawWriterPrivate *priv, gint fd)
+{
+    if (priv->preallocate == 0)
+        return;
+
+#ifndef __APPLE__
+    /* Reserving all blocks up front keeps the file contiguous on disk */
+    if (posix_fallocate (fd, 0, (off_t) priv->preallocate))
+        g_debug ("raw: could not preallocate %" G_GUINT64_FORMAT " bytes", priv->preallocate);
+#endif
+}
+
+static gpointer
+submit_worker (UfoRawWriterPrivate *priv)
+{
+    Block *block;
+
+    while ((block = g_async_queue_pop (priv->full_queue)) != &priv->stop) {
+        gsize written = 0;
+
+        while (written < block->size && !g_atomic_int_get (&priv->error)) {
+            gssize result = pwrite (priv->fd, block->data + written, block->size - written,
+                                    (off_t) (block->offset + written));
+
+            if (result > 0)
+                written += (gsize) result;
+            else if (result == 0)
+                g_atomic_int_set (&priv->error, EIO);
+            else if (errno != EINTR)
+                g_atomic_int_set (&priv->error, errno);
+        }
+
+        g_async_queue_push (priv->free_queue, block);
+    }
+
+    return NULL;
+}
+
+static void
+submit_current (UfoRawWriterPrivate *priv)
+{
+    priv->current->offset = priv->num_written - priv->current->size;
+    g_async_queue_push (priv->full_queue, priv->current);
+    priv->current = NULL;
+}
+
+static gboolean
+open_direct (UfoRawWriterPrivate *priv, const gchar *filename)
+{
+    gint flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+#ifdef O_DIRECT
+    priv->fd = g_open (filename, flags | O_DIRECT, 0644);
+
+    /* Some file systems such as tmpfs refuse O_DIRECT */
+    if (priv->fd < 0 && errno == EINVAL) {
+        g_debug ("raw: `%s' does not support O_DIRECT, writing through the page cache", filename);
+        priv->fd = g_open (filename, flags, 0644);
+    }
+#else
+    priv->fd = g_open (filename, flags, 0644);
+#endif
+
+    if (priv->fd < 0) {
+        g_warning ("raw: could not open `%s': %s", filename, strerror (errno));
+        return FALSE;
+    }
+
+    preallocate (priv, priv->fd);
+
+    priv->buffer_size = (priv->buffer_size + DIRECT_ALIGNMENT - 1) / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+    priv->free_queue = g_async_queue_new ();
+    priv->full_queue = g_async_queue_new ();
+    priv->error = 0;
+
+    for (guint i = 0; i < NUM_BLOCKS; i++) {
+        if (posix_memalign ((void **) &priv->blocks[i].data, DIRECT_ALIGNMENT, priv->buffer_size))
+            g_error ("raw: could not allocate %zu bytes", priv->buffer_size);
+
+        priv->blocks[i].size = 0;
+        g_async_queue_push (priv->free_queue, &priv->blocks[i]);
+    }
+
+    priv->current = g_async_queue_pop (priv->free_queue);
+    priv->thread = g_thread_new ("raw-submit", (GThreadFunc) submit_worker, priv);
+    return TRUE;
+}
+
+static void
+close_direct (UfoRawWriterPrivate *priv)
+{
+    if (priv->current->size > 0) {
+        gsize size = priv->current->size;
+
+        /* Pad the tail to a full block and cut it off again afterwards */
+        priv->current->size = (size + DIRECT_ALIGNMENT - 1) / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+        memset (priv->current->data + size, 0, priv->current->size - size);
+        priv->current->offset = priv->num_written - size;
+        g_async_queue_push (priv->full_queue, priv->current);
+    }
+    else {
+        g_async_queue_push (priv->free_queue, priv->current);
+    }
+
+    priv->current = NULL;
+    g_async_queue_push (priv->full_queue, &priv->stop);
+    g_thread_join (priv->thread);
+    priv->thread = NULL;
+
+    if (priv->error)
+        g_warning ("raw: could not write data: %s", strerror (priv->error));
+
+    if (ftruncate (priv->fd, (off_t) priv->num_written))
+        g_warning ("raw: could not truncate file: %s", strerror (errno));
+
+    close (priv->fd);
+    priv->fd = -1;
+
+    for (guint i = 0; i < NUM_BLOCKS; i++) {
+        free (priv->blocks[i].data);
+        priv->blocks[i].data = NULL;
+    }
+
+    g_async_queue_unref (priv->free_queue);
+    g_async_queue_unref (priv->full_queue);
+}
+
 static void
 ufo_raw_writer_open (UfoWriter *writer,
                      const gchar *filename)
@@ -56,7 +234,23 @@ ufo_raw_writer_open (UfoWriter *writer,
     UfoRawWriterPrivate *priv;
     
     priv = UFO_RAW_WRITER_GET_PRIVATE (writer);
+    priv->num_written = 0;
+    priv->num_dropped = 0;
+
+    if (priv->direct && filename != NULL) {
+        open_direct (priv, filename);
+        return;
+    }
+
     priv->fp = filename == NULL ? stdout : fopen (filename, "wb");
+
+    if (priv->fp == NULL) {
+        g_warning ("raw: could not open `%s': %s", filename, strerror (errno));
+        return;
+    }
+
+    if (filename != NULL)
+        preallocate (priv, fileno (priv->fp));
 }
 
 static void
@@ -65,7 +259,27 @@ ufo_raw_writer_close (UfoWriter *writer)
     UfoRawWriterPrivate *priv;
     
     priv = UFO_RAW_WRITER_GET_PRIVATE (writer);
-    g_assert (priv->fp != NULL);
+
+    if (priv->fd >= 0) {
+        close_direct (priv);
+        return;
+    }
+
+    if (priv->fp == NULL) {
+        if (priv->num_dropped > 0)
+            g_warning ("raw: %u frames were not written because the file could not be opened", priv->num_dropped);
+
+        return;
+    }
+
+    /* Cut off the part of the preallocated space that was not needed */
+    if (priv->preallocate > priv->num_written && priv->fp != stdout) {
+        fflush (priv->fp);
+
+        if (ftruncate (fileno (priv->fp), (off_t) priv->num_written))
+            g_warning ("raw: could not truncate file: %s", strerror (errno));
+    }
+
     fclose (priv->fp);
     priv->fp = NULL;
 }
@@ -84,6 +298,26 @@ bytes_per_pixel (UfoBufferDepth depth)
     }
 }
 
+static void
+write_direct (UfoRawWriterPrivate *priv, const guint8 *data, gsize size)
+{
+    while (size > 0) {
+        gsize n = MIN (size, priv->buffer_size - priv->current->size);
+
+        memcpy (priv->current->data + priv->current->size, data, n);
+        priv->current->size += n;
+        priv->num_written += n;
+        data += n;
+        size -= n;
+
+        if (priv->current->size == priv->buffer_size) {
+            submit_current (priv);
+            priv->current = g_async_queue_pop (priv->free_queue);
+            priv->current->size = 0;
+        }
+    }
+}
+
 static void
 ufo_raw_writer_write (UfoWriter *writer,
                       UfoWriterImage *image)
@@ -96,7 +330,67 @@ ufo_raw_writer_write (UfoWriter *writer,
     for (guint i = 0; i < image->requisition->n_dims; i++)
         size *= image->requisition->dims[i];
 
+    if (priv->fd >= 0) {
+        write_direct (priv, image->data, size);
+        return;
+    }
+
+    /* Opening failed and was reported, count what is lost */
+    if (priv->fp == NULL) {
+        priv->num_dropped++;
+        return;
+    }
+
     fwrite (image->data, 1, size, priv->fp);
+    priv->num_written += size;
+}
+
+static void
+ufo_raw_writer_set_property (GObject *object,
+                             guint property_id,
+                             const GValue *value,
+                             GParamSpec *pspec)
+{
+    UfoRawWriterPrivate *priv = UFO_RAW_WRITER_GET_PRIVATE (object);
+
+    switch (property_id) {
+        case PROP_DIRECT:
+            priv->direct = g_value_get_boolean (value);
+            break;
+        case PROP_BUFFER_SIZE:
+            priv->buffer_size = g_value_get_uint64 (value);
+            break;
+        case PROP_PREALLOCATE:
+            priv->preallocate = g_value_get_uint64 (value);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+ufo_raw_writer_get_property (GObject *object,
+                             guint property_id,
+                             GValue *value,
+                             GParamSpec *pspec)
+{
+    UfoRawWriterPrivate *priv = UFO_RAW_WRITER_GET_PRIVATE (object);
+
+    switch (property_id) {
+        case PROP_DIRECT:
+            g_value_set_boolean (value, priv->direct);
+            break;
+        case PROP_BUFFER_SIZE:
+            g_value_set_uint64 (value, priv->buffer_size);
+            break;
+        case PROP_PREALLOCATE:
+            g_value_set_uint64 (value, priv->preallocate);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
 }
 
 static void
@@ -106,7 +400,7 @@ ufo_raw_writer_finalize (GObject *object)
     
     priv = UFO_RAW_WRITER_GET_PRIVATE (object);
 
-    if (priv->fp != NULL)
+    if (priv->fp != NULL || priv->fd >= 0)
         ufo_raw_writer_close (UFO_WRITER (object));
 
     G_OBJECT_CLASS (ufo_raw_writer_parent_class)->finalize (object);
@@ -126,8 +420,34 @@ ufo_raw_writer_class_init(UfoRawWriterClass *klass)
 {
     GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
 
+    gobject_class->set_property = ufo_raw_writer_set_property;
+    gobject_class->get_property = ufo_raw_writer_get_property;
     gobject_class->finalize = ufo_raw_writer_finalize;
 
+    properties[PROP_DIRECT] =
+        g_param_spec_boolean ("direct",
+            "Bypass the page cache",
+            "If true, write with O_DIRECT from aligned buffers in a background thread",
+            FALSE,
+            G_PARAM_READWRITE);
+
+    properties[PROP_BUFFER_SIZE] =
+        g_param_spec_uint64 ("buffer-size",
+            "Size of a direct write in bytes",
+            "Size of each of the two staging buffers used for direct writes in bytes",
+            DIRECT_ALIGNMENT, G_MAXUINT64, 16 << 20,
+            G_PARAM_READWRITE);
+
+    properties[PROP_PREALLOCATE] =
+        g_param_spec_uint64 ("preallocate",
+            "Number of bytes to preallocate",
+            "Number of bytes to reserve on disk when opening a file, 0 to disable",
+            0, G_MAXUINT64, 0,
+            G_PARAM_READWRITE);
+
+    for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
+        g_object_class_install_property (gobject_class, i, properties[i]);
+
     g_type_class_add_private (gobject_class, sizeof (UfoRawWriterPrivate));
 }
 
@@ -138,4 +458,10 @@ ufo_raw_writer_init (UfoRawWriter *self)
 
     self->priv = priv = UFO_RAW_WRITER_GET_PRIVATE (self);
     priv->fp = NULL;
+    priv->fd = -1;
+    priv->direct = FALSE;
+    priv->buffer_size = 16 << 20;
+    priv->preallocate = 0;
+    priv->current = NULL;
+    priv->thread = NULL;
 }
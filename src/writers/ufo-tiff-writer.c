@@ -20,14 +20,60 @@
 #include <tiffio.h>
 #include <string.h>
 
+#include "config.h"
 #include "writers/ufo-writer.h"
 #include "writers/ufo-tiff-writer.h"
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/* Older libtiff headers do not know about Zstandard yet */
+#ifndef COMPRESSION_ZSTD
+#define COMPRESSION_ZSTD    50000
+#endif
+
+/* Compressed strips are made larger than the default so that there is enough
+ * work to spread over threads */
+#define COMPRESSED_STRIP_SIZE   (256 * 1024)
+
+typedef struct {
+    guint8 *data;
+    gsize size;
+    gsize width;
+    gsize height;
+    guint8 *encoded;
+    gsize encoded_size;
+    gboolean success;
+} Segment;
 
 struct _UfoTiffWriterPrivate {
     TIFF *tiff;
     guint page;
     gboolean bigtiff;
+
+    gchar *compression;
+    guint scheme;
+    guint compression_level;
+    gboolean predictor;
+    guint tile_width;
+    guint tile_height;
+    guint rows_per_strip;
+    guint threads;
+
+    /* State of the segment currently being written */
+    guint samples;
+    guint bytes_per_sample;
+    gboolean floating;
+
+    GThreadPool *pool;
+    GMutex lock;
+    GCond finished;
+    guint pending;
 };
 
 static void ufo_writer_interface_init (UfoWriterIface *iface);
@@ -41,11 +87,28 @@ G_DEFINE_TYPE_WITH_CODE (UfoTiffWriter, ufo_tiff_writer, G_TYPE_OBJECT,
 enum {
     PROP_0,
     PROP_BIGTIFF,
+    PROP_COMPRESSION,
+    PROP_COMPRESSION_LEVEL,
+    PROP_PREDICTOR,
+    PROP_TILE_WIDTH,
+    PROP_TILE_HEIGHT,
+    PROP_ROWS_PER_STRIP,
+    PROP_THREADS,
     N_PROPERTIES
 };
 
 static GParamSpec *properties[N_PROPERTIES] = { NULL, };
 
+static struct {
+    const gchar *name;
+    guint scheme;
+} compressions[] = {
+    { "none",       COMPRESSION_NONE },
+    { "lzw",        COMPRESSION_LZW },
+    { "deflate",    COMPRESSION_ADOBE_DEFLATE },
+    { "zstd",       COMPRESSION_ZSTD },
+};
+
 UfoTiffWriter *
 ufo_tiff_writer_new (void)
 {
@@ -82,28 +145,305 @@ ufo_tiff_writer_close (UfoWriter *writer)
     priv->tiff = NULL;
 }
 
+static void
+predict_floating_point (guint8 *row, guint8 *tmp, gsize row_size, guint samples, guint bytes_per_sample)
+{
+    gsize n = row_size / bytes_per_sample;
+
+    /* Same layout as libtiff: byte planes, most significant first, then differences */
+    memcpy (tmp, row, row_size);
+
+    for (gsize i = 0; i < n; i++) {
+        for (guint b = 0; b < bytes_per_sample; b++) {
+#if G_BYTE_ORDER == G_BIG_ENDIAN
+            row[b * n + i] = tmp[bytes_per_sample * i + b];
+#else
+            row[(bytes_per_sample - b - 1) * n + i] = tmp[bytes_per_sample * i + b];
+#endif
+        }
+    }
+
+    for (gsize i = row_size - 1; i >= samples; i--)
+        row[i] -= row[i - samples];
+}
+
+static void
+predict (UfoTiffWriterPrivate *priv, Segment *segment)
+{
+    gsize row_size;
+    gsize n;
+    guint8 *tmp = NULL;
+
+    row_size = segment->width * priv->samples * priv->bytes_per_sample;
+    n = segment->width * priv->samples;
+
+    if (priv->floating)
+        tmp = g_malloc (row_size);
+
+    for (gsize y = 0; y < segment->height; y++) {
+        guint8 *row = segment->data + y * row_size;
+
+        if (priv->floating) {
+            predict_floating_point (row, tmp, row_size, priv->samples, priv->bytes_per_sample);
+            continue;
+        }
+
+        /* Horizontal differencing from the back so that we can do it in place */
+        switch (priv->bytes_per_sample) {
+            case 1:
+                for (gsize i = n - 1; i >= priv->samples; i--)
+                    row[i] -= row[i - priv->samples];
+                break;
+            case 2:
+                for (gsize i = n - 1; i >= priv->samples; i--)
+                    ((guint16 *) row)[i] -= ((guint16 *) row)[i - priv->samples];
+                break;
+            default:
+                for (gsize i = n - 1; i >= priv->samples; i--)
+                    ((guint32 *) row)[i] -= ((guint32 *) row)[i - priv->samples];
+        }
+    }
+
+    g_free (tmp);
+}
+
+static gboolean
+can_encode (UfoTiffWriterPrivate *priv)
+{
+#ifdef HAVE_ZLIB
+    if (priv->scheme == COMPRESSION_ADOBE_DEFLATE)
+        return TRUE;
+#endif
+#ifdef HAVE_ZSTD
+    if (priv->scheme == COMPRESSION_ZSTD)
+        return TRUE;
+#endif
+    return FALSE;
+}
+
+static void
+encode_segment (Segment *segment, UfoTiffWriterPrivate *priv)
+{
+    gboolean success = FALSE;
+
+    if (priv->predictor)
+        predict (priv, segment);
+
+#ifdef HAVE_ZLIB
+    if (priv->scheme == COMPRESSION_ADOBE_DEFLATE) {
+        uLongf size = compressBound (segment->size);
+        gint level = priv->compression_level ? (gint) MIN (priv->compression_level, 9) : Z_DEFAULT_COMPRESSION;
+
+        segment->encoded = g_malloc (size);
+        success = compress2 (segment->encoded, &size, segment->data, segment->size, level) == Z_OK;
+        segment->encoded_size = size;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (priv->scheme == COMPRESSION_ZSTD) {
+        gsize size = ZSTD_compressBound (segment->size);
+        gint level = priv->compression_level ? (gint) priv->compression_level : ZSTD_CLEVEL_DEFAULT;
+
+        segment->encoded = g_malloc (size);
+        size = ZSTD_compress (segment->encoded, size, segment->data, segment->size, level);
+        success = !ZSTD_isError (size);
+        segment->encoded_size = size;
+    }
+#endif
+
+    segment->success = success;
+
+    g_mutex_lock (&priv->lock);
+
+    if (--priv->pending == 0)
+        g_cond_signal (&priv->finished);
+
+    g_mutex_unlock (&priv->lock);
+}
+
+/*
+ * Copy strip or tile @index of @image into @segment, encoding may modify it
+ * with the predictor.
+ */
+static void
+copy_segment (UfoTiffWriterPrivate *priv, UfoWriterImage *image, gboolean tiled,
+              guint32 rows_per_strip, guint num_columns, guint index, Segment *segment)
+{
+    const guint8 *src;
+    gsize pixel_size;
+    gsize stride;
+    gsize width;
+    gsize height;
+
+    width = image->requisition->dims[0];
+    height = image->requisition->dims[1];
+    pixel_size = priv->samples * priv->bytes_per_sample;
+    stride = width * pixel_size;
+    src = (const guint8 *) image->data;
+
+    if (tiled) {
+        gsize x = (index % num_columns) * priv->tile_width;
+        gsize y = (index / num_columns) * priv->tile_height;
+        gsize copy_width = MIN (priv->tile_width, width - x);
+        gsize copy_height = MIN (priv->tile_height, height - y);
+
+        /* Tiles at the border are padded to full size */
+        segment->width = priv->tile_width;
+        segment->height = priv->tile_height;
+        segment->size = segment->width * segment->height * pixel_size;
+        segment->data = g_malloc0 (segment->size);
+
+        for (gsize row = 0; row < copy_height; row++)
+            memcpy (segment->data + row * segment->width * pixel_size,
+                    src + (y + row) * stride + x * pixel_size, copy_width * pixel_size);
+    }
+    else {
+        segment->width = width;
+        segment->height = MIN (rows_per_strip, height - index * rows_per_strip);
+        segment->size = segment->height * stride;
+        segment->data = g_malloc (segment->size);
+        memcpy (segment->data, src + index * rows_per_strip * stride, segment->size);
+    }
+}
+
+static void
+write_segments (UfoTiffWriterPrivate *priv, UfoWriterImage *image, gboolean tiled, guint32 rows_per_strip)
+{
+    Segment *segments;
+    gsize width;
+    gsize height;
+    guint num_segments;
+    guint num_columns = 1;
+
+    width = image->requisition->dims[0];
+    height = image->requisition->dims[1];
+
+    if (tiled) {
+        num_columns = (width + priv->tile_width - 1) / priv->tile_width;
+        num_segments = num_columns * ((height + priv->tile_height - 1) / priv->tile_height);
+    }
+    else {
+        num_segments = (height + rows_per_strip - 1) / rows_per_strip;
+    }
+
+    segments = g_new0 (Segment, num_segments);
+
+    for (guint i = 0; i < num_segments; i++)
+        copy_segment (priv, image, tiled, rows_per_strip, num_columns, i, &segments[i]);
+
+    if (can_encode (priv)) {
+        if (priv->pool == NULL)
+            priv->pool = g_thread_pool_new ((GFunc) encode_segment, priv,
+                                            priv->threads ? priv->threads : g_get_num_processors (), TRUE, NULL);
+
+        priv->pending = num_segments;
+
+        for (guint i = 0; i < num_segments; i++)
+            g_thread_pool_push (priv->pool, &segments[i], NULL);
+
+        g_mutex_lock (&priv->lock);
+
+        while (priv->pending > 0)
+            g_cond_wait (&priv->finished, &priv->lock);
+
+        g_mutex_unlock (&priv->lock);
+
+        /* libtiff is not thread-safe, so only the encoding runs in parallel */
+        for (guint i = 0; i < num_segments; i++) {
+            if (!segments[i].success) {
+                /* The predictor may have changed the data, start over from the
+                 * image and let libtiff encode this segment */
+                g_warning ("tiff: could not compress segment %u of page %u, using libtiff", i, priv->page);
+                g_free (segments[i].data);
+                copy_segment (priv, image, tiled, rows_per_strip, num_columns, i, &segments[i]);
+
+                if ((tiled ? TIFFWriteEncodedTile (priv->tiff, i, segments[i].data, segments[i].size) :
+                             TIFFWriteEncodedStrip (priv->tiff, i, segments[i].data, segments[i].size)) < 0)
+                    g_warning ("tiff: could not write segment %u of page %u", i, priv->page);
+
+                continue;
+            }
+
+            if (tiled)
+                TIFFWriteRawTile (priv->tiff, i, segments[i].encoded, segments[i].encoded_size);
+            else
+                TIFFWriteRawStrip (priv->tiff, i, segments[i].encoded, segments[i].encoded_size);
+        }
+    }
+    else {
+        /* libtiff applies predictor and compression itself */
+        for (guint i = 0; i < num_segments; i++) {
+            if (tiled)
+                TIFFWriteEncodedTile (priv->tiff, i, segments[i].data, segments[i].size);
+            else
+                TIFFWriteEncodedStrip (priv->tiff, i, segments[i].data, segments[i].size);
+        }
+    }
+
+    for (guint i = 0; i < num_segments; i++) {
+        g_free (segments[i].data);
+        g_free (segments[i].encoded);
+    }
+
+    g_free (segments);
+}
+
 static void
 ufo_tiff_writer_write (UfoWriter *writer,
                        UfoWriterImage *image)
 {
     UfoTiffWriterPrivate *priv;
     guint bits_per_sample;
+    guint32 rows_per_strip = 0;
     gsize stride;
     gchar *buff;
     gboolean is_rgb;
+    gboolean tiled;
 
     priv = UFO_TIFF_WRITER_GET_PRIVATE (writer);
     g_assert (priv->tiff != NULL);
 
     is_rgb = image->requisition->n_dims == 3 && image->requisition->dims[2] == 3;
+    tiled = priv->tile_width > 0 && priv->tile_height > 0;
+
+    switch (image->depth) {
+        case UFO_BUFFER_DEPTH_8U:
+            bits_per_sample = 8;
+            break;
+        case UFO_BUFFER_DEPTH_16U:
+        case UFO_BUFFER_DEPTH_16S:
+            bits_per_sample = 16;
+            break;
+        default:
+            bits_per_sample = 32;
+    }
+
+    stride = image->requisition->dims[0] * bits_per_sample / 8;
+    stride *= is_rgb ? image->requisition->dims[2] : 1;
 
     TIFFSetField (priv->tiff, TIFFTAG_SUBFILETYPE, FILETYPE_PAGE);
     TIFFSetField (priv->tiff, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
     TIFFSetField (priv->tiff, TIFFTAG_IMAGEWIDTH, image->requisition->dims[0]);
     TIFFSetField (priv->tiff, TIFFTAG_IMAGELENGTH, image->requisition->dims[1]);
     TIFFSetField (priv->tiff, TIFFTAG_SAMPLESPERPIXEL, is_rgb ? 3 : 1);
-    TIFFSetField (priv->tiff, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize (priv->tiff, (guint32) - 1));
     TIFFSetField (priv->tiff, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+    TIFFSetField (priv->tiff, TIFFTAG_COMPRESSION, priv->scheme);
+
+    if (tiled) {
+        TIFFSetField (priv->tiff, TIFFTAG_TILEWIDTH, priv->tile_width);
+        TIFFSetField (priv->tiff, TIFFTAG_TILELENGTH, priv->tile_height);
+    }
+    else {
+        if (priv->rows_per_strip)
+            rows_per_strip = priv->rows_per_strip;
+        else if (priv->scheme != COMPRESSION_NONE)
+            rows_per_strip = MAX (COMPRESSED_STRIP_SIZE / stride, 1);
+        else
+            rows_per_strip = TIFFDefaultStripSize (priv->tiff, (guint32) - 1);
+
+        rows_per_strip = MIN (rows_per_strip, image->requisition->dims[1]);
+        TIFFSetField (priv->tiff, TIFFTAG_ROWSPERSTRIP, rows_per_strip);
+    }
 
     /*
      * I seriously don't know if this is supposed to be supported by the format,
@@ -112,30 +452,34 @@ ufo_tiff_writer_write (UfoWriter *writer,
      */
     TIFFSetField (priv->tiff, TIFFTAG_PAGENUMBER, priv->page, priv->page);
 
-    switch (image->depth) {
-        case UFO_BUFFER_DEPTH_8U:
-            TIFFSetField (priv->tiff, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_UINT);
-            bits_per_sample = 8;
-            break;
-        case UFO_BUFFER_DEPTH_16U:
-        case UFO_BUFFER_DEPTH_16S:
-            TIFFSetField (priv->tiff, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_UINT);
-            bits_per_sample = 16;
-            break;
-        default:
-            TIFFSetField (priv->tiff, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_IEEEFP);
-            bits_per_sample = 32;
-    }
-
+    TIFFSetField (priv->tiff, TIFFTAG_SAMPLEFORMAT, bits_per_sample == 32 ? SAMPLEFORMAT_IEEEFP : SAMPLEFORMAT_UINT);
     TIFFSetField (priv->tiff, TIFFTAG_BITSPERSAMPLE, bits_per_sample);
 
-    stride = image->requisition->dims[0] * bits_per_sample / 8;
-    stride *= is_rgb ? image->requisition->dims[2] : 1;
-    buff = (gchar *) image->data;
+    priv->samples = is_rgb ? 3 : 1;
+    priv->bytes_per_sample = bits_per_sample / 8;
+    priv->floating = bits_per_sample == 32;
+
+    if (priv->predictor && priv->scheme != COMPRESSION_NONE)
+        TIFFSetField (priv->tiff, TIFFTAG_PREDICTOR, priv->floating ? PREDICTOR_FLOATINGPOINT : PREDICTOR_HORIZONTAL);
+
+    if (priv->compression_level && priv->scheme == COMPRESSION_ADOBE_DEFLATE)
+        TIFFSetField (priv->tiff, TIFFTAG_ZIPQUALITY, MIN (priv->compression_level, 9));
+
+#ifdef TIFFTAG_ZSTD_LEVEL
+    if (priv->compression_level && priv->scheme == COMPRESSION_ZSTD)
+        TIFFSetField (priv->tiff, TIFFTAG_ZSTD_LEVEL, priv->compression_level);
+#endif
 
-    for (guint y = 0; y < image->requisition->dims[1]; y++) {
-        TIFFWriteScanline (priv->tiff, buff, y, 0);
-        buff += stride;
+    if (!tiled && priv->scheme == COMPRESSION_NONE) {
+        buff = (gchar *) image->data;
+
+        for (guint y = 0; y < image->requisition->dims[1]; y++) {
+            TIFFWriteScanline (priv->tiff, buff, y, 0);
+            buff += stride;
+        }
+    }
+    else {
+        write_segments (priv, image, tiled, rows_per_strip);
     }
 
     TIFFWriteDirectory (priv->tiff);
@@ -154,6 +498,53 @@ ufo_tiff_writer_set_property (GObject *object,
         case PROP_BIGTIFF:
             priv->bigtiff = g_value_get_boolean (value);
             break;
+        case PROP_COMPRESSION:
+            {
+                const gchar *name = g_value_get_string (value);
+                guint i;
+
+                for (i = 0; i < G_N_ELEMENTS (compressions); i++) {
+                    if (!g_strcmp0 (compressions[i].name, name))
+                        break;
+                }
+
+                if (i == G_N_ELEMENTS (compressions)) {
+                    g_warning ("tiff: compression must be one of none, lzw, deflate or zstd");
+                    return;
+                }
+
+                g_free (priv->compression);
+                priv->compression = g_strdup (name);
+                priv->scheme = compressions[i].scheme;
+            }
+            break;
+        case PROP_COMPRESSION_LEVEL:
+            priv->compression_level = g_value_get_uint (value);
+            break;
+        case PROP_PREDICTOR:
+            priv->predictor = g_value_get_boolean (value);
+            break;
+        case PROP_TILE_WIDTH:
+        case PROP_TILE_HEIGHT:
+            if (g_value_get_uint (value) % 16) {
+                g_warning ("tiff: tile sizes must be multiples of 16");
+                return;
+            }
+
+            if (property_id == PROP_TILE_WIDTH)
+                priv->tile_width = g_value_get_uint (value);
+            else
+                priv->tile_height = g_value_get_uint (value);
+            break;
+        case PROP_ROWS_PER_STRIP:
+            priv->rows_per_strip = g_value_get_uint (value);
+            break;
+        case PROP_THREADS:
+            priv->threads = g_value_get_uint (value);
+
+            if (priv->pool != NULL)
+                g_thread_pool_set_max_threads (priv->pool, priv->threads ? priv->threads : g_get_num_processors (), NULL);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -171,6 +562,27 @@ ufo_tiff_writer_get_property (GObject *object,
         case PROP_BIGTIFF:
             g_value_set_boolean (value, priv->bigtiff);
             break;
+        case PROP_COMPRESSION:
+            g_value_set_string (value, priv->compression);
+            break;
+        case PROP_COMPRESSION_LEVEL:
+            g_value_set_uint (value, priv->compression_level);
+            break;
+        case PROP_PREDICTOR:
+            g_value_set_boolean (value, priv->predictor);
+            break;
+        case PROP_TILE_WIDTH:
+            g_value_set_uint (value, priv->tile_width);
+            break;
+        case PROP_TILE_HEIGHT:
+            g_value_set_uint (value, priv->tile_height);
+            break;
+        case PROP_ROWS_PER_STRIP:
+            g_value_set_uint (value, priv->rows_per_strip);
+            break;
+        case PROP_THREADS:
+            g_value_set_uint (value, priv->threads);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -187,6 +599,13 @@ ufo_tiff_writer_finalize (GObject *object)
     if (priv->tiff != NULL)
         ufo_tiff_writer_close (UFO_WRITER (object));
 
+    if (priv->pool != NULL)
+        g_thread_pool_free (priv->pool, FALSE, TRUE);
+
+    g_mutex_clear (&priv->lock);
+    g_cond_clear (&priv->finished);
+    g_free (priv->compression);
+
     G_OBJECT_CLASS (ufo_tiff_writer_parent_class)->finalize (object);
 }
 
@@ -215,6 +634,55 @@ ufo_tiff_writer_class_init(UfoTiffWriterClass *klass)
             TRUE,
             G_PARAM_READWRITE);
 
+    properties[PROP_COMPRESSION] =
+        g_param_spec_string ("compression",
+            "Compression scheme",
+            "Compression scheme, one of none, lzw, deflate or zstd",
+            "none",
+            G_PARAM_READWRITE);
+
+    properties[PROP_COMPRESSION_LEVEL] =
+        g_param_spec_uint ("compression-level",
+            "Compression level",
+            "Compression level for deflate and zstd, 0 for the default",
+            0, 22, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_PREDICTOR] =
+        g_param_spec_boolean ("predictor",
+            "Use a predictor before compression",
+            "Use horizontal differencing for integers and the floating point predictor for floats",
+            FALSE,
+            G_PARAM_READWRITE);
+
+    properties[PROP_TILE_WIDTH] =
+        g_param_spec_uint ("tile-width",
+            "Tile width",
+            "Tile width, a multiple of 16, 0 to write strips",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_TILE_HEIGHT] =
+        g_param_spec_uint ("tile-height",
+            "Tile height",
+            "Tile height, a multiple of 16, 0 to write strips",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_ROWS_PER_STRIP] =
+        g_param_spec_uint ("rows-per-strip",
+            "Rows per strip",
+            "Rows per strip, 0 to choose automatically",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_THREADS] =
+        g_param_spec_uint ("threads",
+            "Number of compression threads",
+            "Number of threads compressing strips or tiles, 0 for one per processor",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
     for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
         g_object_class_install_property (gobject_class, i, properties[i]);
 
@@ -229,4 +697,9 @@ ufo_tiff_writer_init (UfoTiffWriter *self)
     self->priv = priv = UFO_TIFF_WRITER_GET_PRIVATE (self);
     priv->tiff = NULL;
     priv->bigtiff = TRUE;
+    priv->compression = g_strdup ("none");
+    priv->scheme = COMPRESSION_NONE;
+    priv->pool = NULL;
+    g_mutex_init (&priv->lock);
+    g_cond_init (&priv->finished);
 }
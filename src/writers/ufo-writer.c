@@ -51,6 +51,49 @@ ufo_writer_write (UfoWriter *writer,
     UFO_WRITER_GET_IFACE (writer)->write (writer, image);
 }
 
+/**
+ * ufo_writer_write_converted:
+ * @writer: A #UfoWriter
+ * @image: Image that has already been passed to ufo_writer_convert_inplace()
+ *
+ * Write @image without converting it again. This allows converting images in
+ * parallel and writing them in order afterwards.
+ */
+void
+ufo_writer_write_converted (UfoWriter *writer,
+                            UfoWriterImage *image)
+{
+    UFO_WRITER_GET_IFACE (writer)->write (writer, image);
+}
+
+/*
+ * Number of pixels converted by one thread at a time. Large enough to amortize
+ * the scheduling overhead, small enough to keep all threads busy.
+ */
+#define CONVERSION_BLOCK_SIZE   (1 << 16)
+
+typedef struct {
+    gfloat min;
+    gfloat lower;
+    gfloat upper;
+    gfloat scale;
+} Scaling;
+
+typedef void (*ConvertRangeFunc) (gfloat *src, gsize start, gsize end, const Scaling *scaling);
+
+static gsize
+get_number_of_pixels (UfoWriterImage *image)
+{
+    gsize size;
+
+    size = image->requisition->dims[0] * image->requisition->dims[1];
+
+    if (image->requisition->n_dims == 3 && image->requisition->dims[2] == 3)
+        size *= image->requisition->dims[2];
+
+    return size;
+}
+
 static void
 get_min_max (UfoWriterImage *image, gfloat *src, gsize n_elements, gfloat *min, gfloat *max)
 {
@@ -66,141 +109,156 @@ get_min_max (UfoWriterImage *image, gfloat *src, gsize n_elements, gfloat *min,
     gfloat cmax = -G_MAXFLOAT;
     gfloat cmin = G_MAXFLOAT;
 
+    /* Both extrema in one pass, the reduction vectorizes and ignores NaNs */
+#pragma omp parallel for simd reduction(min:cmin) reduction(max:cmax) if (n_elements > CONVERSION_BLOCK_SIZE)
     for (gsize i = 0; i < n_elements; i++) {
-        if (!user_min && src[i] < cmin) {
-            cmin = src[i];
-        }
-
-        if (!user_max && src[i] > cmax) {
-            cmax = src[i];
-        }
+        cmin = src[i] < cmin ? src[i] : cmin;
+        cmax = src[i] > cmax ? src[i] : cmax;
     }
 
     *max = user_max ? image->max : cmax;
     *min = user_min ? image->min : cmin;
 }
 
-static gsize
-get_number_of_pixels (UfoWriterImage *image)
+static void
+get_scaling (UfoWriterImage *image, gfloat *src, gsize n_elements, gfloat range, Scaling *scaling)
 {
-    gsize size;
+    gfloat min, max;
 
-    size = image->requisition->dims[0] * image->requisition->dims[1];
+    get_min_max (image, src, n_elements, &min, &max);
 
-    if (image->requisition->n_dims == 3 && image->requisition->dims[2] == 3)
-        size *= image->requisition->dims[2];
+    /* min > max inverts the gray values, clip to the interval either way */
+    scaling->min = min;
+    scaling->lower = MIN (min, max);
+    scaling->upper = MAX (min, max);
+    scaling->scale = range / (max - min);
+}
 
-    return size;
+/*
+ * The range functions clip and scale in a single pass without branches so that
+ * the compiler can emit packed SSE/AVX/NEON instructions for them. They are
+ * only called on ranges whose output does not overlap their own input.
+ */
+static void
+rescale_range_to_8bit (gfloat *src, gsize start, gsize end, const Scaling *scaling)
+{
+    guint8 *dst = (guint8 *) src;
+    const gfloat min = scaling->min;
+    const gfloat lower = scaling->lower;
+    const gfloat upper = scaling->upper;
+    const gfloat scale = scaling->scale;
+
+#pragma omp simd
+    for (gsize i = start; i < end; i++) {
+        gfloat value = src[i] < lower ? lower : (src[i] > upper ? upper : src[i]);
+        dst[i] = (guint8) ((value - min) * scale);
+    }
 }
 
 static void
-convert_and_rescale_to_8bit (UfoWriterImage *image)
+convert_range_to_8bit (gfloat *src, gsize start, gsize end, const Scaling *scaling)
 {
-    gfloat *src;
-    guint8 *dst;
-    gfloat max, min, scale;
-    gsize size;
+    guint8 *dst = (guint8 *) src;
 
-    size = get_number_of_pixels (image);
-    src = (gfloat *) image->data;
-    dst = (guint8 *) src;
-    get_min_max (image, src, size, &min, &max);
-    scale = 255.0f / (max - min);
-
-    /* first clip */
-    if (min < max) {
-        for (gsize i = 0; i < size; i++) {
-            if (src[i] < min)
-                src[i] = min;
-            else if (src[i] > max)
-                src[i] = max;
-        }
-    }
-    else {
-        for (gsize i = 0; i < size; i++) {
-            if (src[i] < max)
-                src[i] = max;
-            else if (src[i] > min)
-                src[i] = min;
-        }
+#pragma omp simd
+    for (gsize i = start; i < end; i++)
+        dst[i] = (guint8) src[i];
+}
+
+static void
+rescale_range_to_16bit (gfloat *src, gsize start, gsize end, const Scaling *scaling)
+{
+    guint16 *dst = (guint16 *) src;
+    const gfloat min = scaling->min;
+    const gfloat lower = scaling->lower;
+    const gfloat upper = scaling->upper;
+    const gfloat scale = scaling->scale;
+
+#pragma omp simd
+    for (gsize i = start; i < end; i++) {
+        gfloat value = src[i] < lower ? lower : (src[i] > upper ? upper : src[i]);
+        dst[i] = (guint16) ((value - min) * scale);
     }
+}
 
-    /* then rescale */
-    for (gsize i = 0; i < size; i++)
-        dst[i] = (guint8) ((src[i] - min) * scale);
+static void
+convert_range_to_16bit (gfloat *src, gsize start, gsize end, const Scaling *scaling)
+{
+    guint16 *dst = (guint16 *) src;
 
-    image->depth = UFO_BUFFER_DEPTH_8U;
+#pragma omp simd
+    for (gsize i = start; i < end; i++)
+        dst[i] = (guint16) src[i];
 }
 
+/*
+ * Narrow @n_elements floats in place to @dst_size bytes each. The output of
+ * pixels [start, end) overwrites the input of pixels [start / ratio, end /
+ * ratio), hence once all pixels before start have been read, every pixel up to
+ * start * ratio can be converted concurrently. The ranges grow geometrically,
+ * so a whole image takes only a few parallel rounds.
+ */
 static void
-convert_to_8bit (UfoWriterImage *image)
+convert_inplace (gfloat *src, gsize n_elements, gsize dst_size,
+                 ConvertRangeFunc func, const Scaling *scaling)
 {
-    gfloat *src;
-    guint8 *dst;
-    gsize size;
+    const gsize ratio = sizeof (gfloat) / dst_size;
+    gsize start = 0;
+    gsize end = 1;
 
-    size = get_number_of_pixels (image);
-    src = (gfloat *) image->data;
-    dst = (guint8 *) src;
+    while (start < n_elements) {
+        const gsize stop = MIN (end, n_elements);
+        const gsize n_blocks = (stop - start + CONVERSION_BLOCK_SIZE - 1) / CONVERSION_BLOCK_SIZE;
 
-    for (gsize i = 0; i < size; i++)
-        dst[i] = (guint8) src[i];
+#pragma omp parallel for if (n_blocks > 1)
+        for (gsize block = 0; block < n_blocks; block++) {
+            gsize first = start + block * CONVERSION_BLOCK_SIZE;
 
-    image->depth = UFO_BUFFER_DEPTH_8U;
+            func (src, first, MIN (first + CONVERSION_BLOCK_SIZE, stop), scaling);
+        }
+
+        start = stop;
+        end = stop * ratio;
+    }
 }
 
 static void
-convert_and_rescale_to_16bit (UfoWriterImage *image)
+convert_and_rescale_to_8bit (UfoWriterImage *image)
 {
-    gfloat *src;
-    guint16 *dst;
-    gfloat max, min, scale;
+    Scaling scaling;
     gsize size;
 
     size = get_number_of_pixels (image);
-    src = (gfloat *) image->data;
-    dst = (guint16 *) src;
-    get_min_max (image, src, size, &min, &max);
-    scale = 65535.0f / (max - min);
-
-    if (min < max) {
-        for (gsize i = 0; i < size; i++) {
-            if (src[i] < min)
-                src[i] = min;
-            else if (src[i] > max)
-                src[i] = max;
-        }
-    }
-    else {
-        for (gsize i = 0; i < size; i++) {
-            if (src[i] < max)
-                src[i] = max;
-            else if (src[i] > min)
-                src[i] = min;
-        }
-    }
-
-    /* TODO: good opportunity for some SSE acceleration */
-    for (gsize i = 0; i < size; i++)
-        dst[i] = (guint16) ((src[i] - min) * scale);
+    get_scaling (image, (gfloat *) image->data, size, 255.0f, &scaling);
+    convert_inplace ((gfloat *) image->data, size, sizeof (guint8), rescale_range_to_8bit, &scaling);
+    image->depth = UFO_BUFFER_DEPTH_8U;
+}
 
-    image->depth = UFO_BUFFER_DEPTH_16U;
+static void
+convert_to_8bit (UfoWriterImage *image)
+{
+    convert_inplace ((gfloat *) image->data, get_number_of_pixels (image), sizeof (guint8),
+                     convert_range_to_8bit, NULL);
+    image->depth = UFO_BUFFER_DEPTH_8U;
 }
 
 static void
-convert_to_16bit (UfoWriterImage *image)
+convert_and_rescale_to_16bit (UfoWriterImage *image)
 {
-    gfloat *src;
-    guint16 *dst;
+    Scaling scaling;
     gsize size;
 
     size = get_number_of_pixels (image);
-    src = (gfloat *) image->data;
-    dst = (guint16 *) src;
-
-    for (gsize i = 0; i < size; i++)
-        dst[i] = (guint16) src[i];
+    get_scaling (image, (gfloat *) image->data, size, 65535.0f, &scaling);
+    convert_inplace ((gfloat *) image->data, size, sizeof (guint16), rescale_range_to_16bit, &scaling);
+    image->depth = UFO_BUFFER_DEPTH_16U;
+}
 
+static void
+convert_to_16bit (UfoWriterImage *image)
+{
+    convert_inplace ((gfloat *) image->data, get_number_of_pixels (image), sizeof (guint16),
+                     convert_range_to_16bit, NULL);
     image->depth = UFO_BUFFER_DEPTH_16U;
 }
 
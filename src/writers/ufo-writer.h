@@ -62,6 +62,9 @@ void     ufo_writer_open     (UfoWriter      *writer,
 void     ufo_writer_close    (UfoWriter      *writer);
 void     ufo_writer_write    (UfoWriter      *writer,
                               UfoWriterImage *image);
+void     ufo_writer_write_converted
+                             (UfoWriter      *writer,
+                              UfoWriterImage *image);
 void     ufo_writer_convert_inplace
                              (UfoWriterImage *image);
 
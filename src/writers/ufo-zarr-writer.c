@@ -0,0 +1,782 @@
+/*
+ * Copyright (C) 2011-2015 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <glib/gstdio.h>
+#include <string.h>
+
+#include "config.h"
+#include "writers/ufo-writer.h"
+#include "writers/ufo-zarr-writer.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/*
+ * A Zarr v2 group with one array per resolution level, described by OME-NGFF
+ * multiscales metadata. Slices are collected until they fill a layer of
+ * chunks, which are then compressed and written to files of their own by a
+ * pool of threads.
+ */
+
+typedef enum {
+    COMPRESSION_NONE,
+    COMPRESSION_ZLIB,
+    COMPRESSION_ZSTD,
+} Compression;
+
+typedef struct {
+    gsize width;
+    gsize height;
+    gsize chunk_width;
+    gsize chunk_height;
+    guint8 *slab;
+} Level;
+
+typedef struct {
+    guint level;
+    gsize z;
+    gsize y;
+    gsize x;
+    guint num_slices;
+} Chunk;
+
+struct _UfoZarrWriterPrivate {
+    gchar *path;
+
+    guint chunk_depth;
+    guint chunk_height;
+    guint chunk_width;
+    gchar *compression;
+    Compression scheme;
+    guint compression_level;
+    guint levels;
+    guint threads;
+
+    /* State of the volume currently being written */
+    UfoBufferDepth depth;
+    gsize bytes_per_sample;
+    Level *pyramid;
+    guint num_levels;
+    gsize num_slices;
+    guint slab_slices;
+    gsize slab_index;
+
+    GThreadPool *pool;
+    GMutex lock;
+    GCond finished;
+    guint pending;
+    gboolean failed;
+};
+
+static void ufo_writer_interface_init (UfoWriterIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (UfoZarrWriter, ufo_zarr_writer, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (UFO_TYPE_WRITER,
+                                                ufo_writer_interface_init))
+
+#define UFO_ZARR_WRITER_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), UFO_TYPE_ZARR_WRITER, UfoZarrWriterPrivate))
+
+enum {
+    PROP_0,
+    PROP_CHUNK_DEPTH,
+    PROP_CHUNK_HEIGHT,
+    PROP_CHUNK_WIDTH,
+    PROP_COMPRESSION,
+    PROP_COMPRESSION_LEVEL,
+    PROP_LEVELS,
+    PROP_THREADS,
+    N_PROPERTIES
+};
+
+static GParamSpec *properties[N_PROPERTIES] = { NULL, };
+
+static const gchar *compressions[] = { "none", "zlib", "zstd" };
+
+UfoZarrWriter *
+ufo_zarr_writer_new (void)
+{
+    UfoZarrWriter *writer = g_object_new (UFO_TYPE_ZARR_WRITER, NULL);
+    return writer;
+}
+
+static gboolean
+ufo_zarr_writer_can_open (UfoWriter *writer,
+                          const gchar *filename)
+{
+    return g_str_has_suffix (filename, ".zarr") || g_str_has_suffix (filename, ".zarr/");
+}
+
+static gboolean
+write_metadata (UfoZarrWriterPrivate *priv, const gchar *name, const gchar *contents)
+{
+    GError *error = NULL;
+    gchar *filename;
+
+    filename = g_build_filename (priv->path, name, NULL);
+
+    if (!g_file_set_contents (filename, contents, -1, &error)) {
+        g_warning ("zarr: %s", error->message);
+        g_error_free (error);
+        g_free (filename);
+        return FALSE;
+    }
+
+    g_free (filename);
+    return TRUE;
+}
+
+static void
+ufo_zarr_writer_open (UfoWriter *writer,
+                      const gchar *filename)
+{
+    UfoZarrWriterPrivate *priv;
+
+    priv = UFO_ZARR_WRITER_GET_PRIVATE (writer);
+    g_free (priv->path);
+    priv->path = g_strdup (filename);
+    priv->pyramid = NULL;
+    priv->num_slices = 0;
+    priv->slab_slices = 0;
+    priv->slab_index = 0;
+    priv->failed = FALSE;
+
+    if (g_mkdir_with_parents (priv->path, 0755)) {
+        g_warning ("zarr: could not create `%s'", priv->path);
+        priv->failed = TRUE;
+        return;
+    }
+
+    write_metadata (priv, ".zgroup", "{\n    \"zarr_format\": 2\n}\n");
+}
+
+static gsize
+get_bytes_per_sample (UfoBufferDepth depth)
+{
+    switch (depth) {
+        case UFO_BUFFER_DEPTH_8U:
+            return 1;
+        case UFO_BUFFER_DEPTH_16U:
+        case UFO_BUFFER_DEPTH_16S:
+            return 2;
+        default:
+            return 4;
+    }
+}
+
+static const gchar *
+get_dtype (UfoBufferDepth depth)
+{
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+    switch (depth) {
+        case UFO_BUFFER_DEPTH_8U:
+            return "|u1";
+        case UFO_BUFFER_DEPTH_16U:
+            return "<u2";
+        case UFO_BUFFER_DEPTH_16S:
+            return "<i2";
+        default:
+            return "<f4";
+    }
+#else
+    switch (depth) {
+        case UFO_BUFFER_DEPTH_8U:
+            return "|u1";
+        case UFO_BUFFER_DEPTH_16U:
+            return ">u2";
+        case UFO_BUFFER_DEPTH_16S:
+            return ">i2";
+        default:
+            return ">f4";
+    }
+#endif
+}
+
+static gint
+get_level (UfoZarrWriterPrivate *priv)
+{
+#ifdef HAVE_ZLIB
+    if (priv->scheme == COMPRESSION_ZLIB)
+        return priv->compression_level ? (gint) MIN (priv->compression_level, 9) : 6;
+#endif
+#ifdef HAVE_ZSTD
+    if (priv->scheme == COMPRESSION_ZSTD)
+        return priv->compression_level ? (gint) priv->compression_level : ZSTD_CLEVEL_DEFAULT;
+#endif
+    return 0;
+}
+
+static void
+encode_chunk (Chunk *chunk, UfoZarrWriterPrivate *priv)
+{
+    Level *level = &priv->pyramid[chunk->level];
+    const gsize bps = priv->bytes_per_sample;
+    GError *error = NULL;
+    guint8 *data;
+    guint8 *encoded = NULL;
+    gchar *filename;
+    gsize size;
+    gsize encoded_size;
+    gsize rows;
+    gsize cols;
+    gboolean success = TRUE;
+
+    /* Chunks on the border are padded with the fill value */
+    size = priv->chunk_depth * level->chunk_height * level->chunk_width * bps;
+    data = g_malloc0 (size);
+    rows = MIN (level->chunk_height, level->height - chunk->y * level->chunk_height);
+    cols = MIN (level->chunk_width, level->width - chunk->x * level->chunk_width);
+
+    for (guint z = 0; z < chunk->num_slices; z++) {
+        for (gsize r = 0; r < rows; r++) {
+            gsize src_offset = (z * level->height + chunk->y * level->chunk_height + r) * level->width +
+                               chunk->x * level->chunk_width;
+
+            memcpy (data + ((z * level->chunk_height + r) * level->chunk_width) * bps,
+                    level->slab + src_offset * bps, cols * bps);
+        }
+    }
+
+    encoded_size = size;
+
+#ifdef HAVE_ZLIB
+    if (priv->scheme == COMPRESSION_ZLIB) {
+        uLongf bound = compressBound (size);
+
+        encoded = g_malloc (bound);
+        success = compress2 (encoded, &bound, data, size, get_level (priv)) == Z_OK;
+        encoded_size = bound;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (priv->scheme == COMPRESSION_ZSTD) {
+        encoded = g_malloc (ZSTD_compressBound (size));
+        encoded_size = ZSTD_compress (encoded, ZSTD_compressBound (size), data, size, get_level (priv));
+        success = !ZSTD_isError (encoded_size);
+    }
+#endif
+
+    filename = g_strdup_printf ("%s%c%u%c%zu.%zu.%zu", priv->path, G_DIR_SEPARATOR, chunk->level,
+                                G_DIR_SEPARATOR, chunk->z, chunk->y, chunk->x);
+
+    if (!success) {
+        g_warning ("zarr: could not compress `%s'", filename);
+    }
+    else if (!g_file_set_contents (filename, (const gchar *) (encoded != NULL ? encoded : data),
+                                   encoded_size, &error)) {
+        g_warning ("zarr: %s", error->message);
+        g_error_free (error);
+        success = FALSE;
+    }
+
+    g_free (filename);
+    g_free (encoded);
+    g_free (data);
+    g_free (chunk);
+
+    g_mutex_lock (&priv->lock);
+
+    if (!success)
+        priv->failed = TRUE;
+
+    if (--priv->pending == 0)
+        g_cond_signal (&priv->finished);
+
+    g_mutex_unlock (&priv->lock);
+}
+
+/*
+ * Write all chunks of the current slab concurrently and wait for them, because
+ * the slab is filled with the next slices afterwards.
+ */
+static void
+flush_slab (UfoZarrWriterPrivate *priv)
+{
+    if (priv->slab_slices == 0)
+        return;
+
+    if (priv->pool == NULL) {
+        priv->pool = g_thread_pool_new ((GFunc) encode_chunk, priv,
+                                        priv->threads ? priv->threads : g_get_num_processors (),
+                                        FALSE, NULL);
+    }
+
+    g_mutex_lock (&priv->lock);
+
+    for (guint l = 0; l < priv->num_levels; l++) {
+        Level *level = &priv->pyramid[l];
+        gsize num_rows = (level->height + level->chunk_height - 1) / level->chunk_height;
+        gsize num_cols = (level->width + level->chunk_width - 1) / level->chunk_width;
+
+        for (gsize y = 0; y < num_rows; y++) {
+            for (gsize x = 0; x < num_cols; x++) {
+                Chunk *chunk = g_new0 (Chunk, 1);
+
+                chunk->level = l;
+                chunk->z = priv->slab_index;
+                chunk->y = y;
+                chunk->x = x;
+                chunk->num_slices = priv->slab_slices;
+                priv->pending++;
+                g_thread_pool_push (priv->pool, chunk, NULL);
+            }
+        }
+    }
+
+    while (priv->pending > 0)
+        g_cond_wait (&priv->finished, &priv->lock);
+
+    g_mutex_unlock (&priv->lock);
+
+    priv->slab_index++;
+    priv->slab_slices = 0;
+}
+
+#define DOWNSAMPLE(type, acc_type, round)                                           \
+    for (gsize y = 0; y < height / 2; y++) {                                        \
+        const type *row = ((const type *) src) + 2 * y * width;                     \
+        type *out = ((type *) dst) + y * (width / 2);                               \
+                                                                                    \
+        for (gsize x = 0; x < width / 2; x++) {                                     \
+            acc_type sum = (acc_type) row[2 * x] + row[2 * x + 1] +                 \
+                           row[width + 2 * x] + row[width + 2 * x + 1];             \
+            out[x] = (type) ((sum + round) / 4);                                    \
+        }                                                                           \
+    }
+
+/* Average 2 x 2 blocks into the next level, dropping odd rows and columns */
+static void
+downsample (UfoBufferDepth depth, const guint8 *src, gsize width, gsize height, guint8 *dst)
+{
+    switch (depth) {
+        case UFO_BUFFER_DEPTH_8U:
+            DOWNSAMPLE (guint8, guint, 2)
+            break;
+        case UFO_BUFFER_DEPTH_16U:
+            DOWNSAMPLE (guint16, guint32, 2)
+            break;
+        case UFO_BUFFER_DEPTH_16S:
+            DOWNSAMPLE (gint16, gint32, 0)
+            break;
+        default:
+            DOWNSAMPLE (gfloat, gfloat, 0.0f)
+            break;
+    }
+}
+
+static void
+create_pyramid (UfoZarrWriterPrivate *priv, UfoWriterImage *image)
+{
+    gsize width = image->requisition->dims[0];
+    gsize height = image->requisition->dims[1];
+
+    priv->depth = image->depth;
+    priv->bytes_per_sample = get_bytes_per_sample (image->depth);
+    priv->num_levels = 0;
+    priv->pyramid = g_new0 (Level, MAX (priv->levels, 1));
+
+    for (guint l = 0; l < MAX (priv->levels, 1) && width > 0 && height > 0; l++) {
+        Level *level = &priv->pyramid[l];
+        gchar *dirname;
+
+        level->width = width;
+        level->height = height;
+        level->chunk_width = MIN (priv->chunk_width, width);
+        level->chunk_height = MIN (priv->chunk_height, height);
+        level->slab = g_malloc (priv->chunk_depth * width * height * priv->bytes_per_sample);
+
+        dirname = g_strdup_printf ("%s%c%u", priv->path, G_DIR_SEPARATOR, l);
+
+        if (g_mkdir_with_parents (dirname, 0755)) {
+            g_warning ("zarr: could not create `%s'", dirname);
+            priv->failed = TRUE;
+        }
+
+        g_free (dirname);
+
+        priv->num_levels++;
+        width /= 2;
+        height /= 2;
+    }
+}
+
+static void
+ufo_zarr_writer_write (UfoWriter *writer,
+                       UfoWriterImage *image)
+{
+    UfoZarrWriterPrivate *priv;
+    gsize slice_size;
+
+    priv = UFO_ZARR_WRITER_GET_PRIVATE (writer);
+
+    if (priv->failed)
+        return;
+
+    if (image->requisition->n_dims == 3) {
+        g_warning ("zarr: color images cannot be written");
+        return;
+    }
+
+    if (priv->pyramid == NULL) {
+        create_pyramid (priv, image);
+
+        if (priv->failed)
+            return;
+    }
+
+    if (image->requisition->dims[0] != priv->pyramid[0].width ||
+        image->requisition->dims[1] != priv->pyramid[0].height ||
+        image->depth != priv->depth) {
+        g_warning ("zarr: all slices of a volume must have the same size and depth");
+        return;
+    }
+
+    slice_size = priv->pyramid[0].width * priv->pyramid[0].height * priv->bytes_per_sample;
+    memcpy (priv->pyramid[0].slab + priv->slab_slices * slice_size, image->data, slice_size);
+
+    for (guint l = 1; l < priv->num_levels; l++) {
+        Level *prev = &priv->pyramid[l - 1];
+        Level *level = &priv->pyramid[l];
+
+        downsample (priv->depth,
+                    prev->slab + priv->slab_slices * prev->width * prev->height * priv->bytes_per_sample,
+                    prev->width, prev->height,
+                    level->slab + priv->slab_slices * level->width * level->height * priv->bytes_per_sample);
+    }
+
+    priv->num_slices++;
+
+    if (++priv->slab_slices == priv->chunk_depth)
+        flush_slab (priv);
+}
+
+static void
+write_array_metadata (UfoZarrWriterPrivate *priv, guint index)
+{
+    Level *level = &priv->pyramid[index];
+    gchar *compressor;
+    gchar *contents;
+    gchar *name;
+
+    if (priv->scheme == COMPRESSION_NONE)
+        compressor = g_strdup ("null");
+    else
+        compressor = g_strdup_printf ("{\"id\": \"%s\", \"level\": %i}",
+                                      compressions[priv->scheme], get_level (priv));
+
+    contents = g_strdup_printf ("{\n"
+                                "    \"zarr_format\": 2,\n"
+                                "    \"shape\": [%zu, %zu, %zu],\n"
+                                "    \"chunks\": [%u, %zu, %zu],\n"
+                                "    \"dtype\": \"%s\",\n"
+                                "    \"compressor\": %s,\n"
+                                "    \"fill_value\": 0,\n"
+                                "    \"order\": \"C\",\n"
+                                "    \"filters\": null,\n"
+                                "    \"dimension_separator\": \".\"\n"
+                                "}\n",
+                                priv->num_slices, level->height, level->width,
+                                priv->chunk_depth, level->chunk_height, level->chunk_width,
+                                get_dtype (priv->depth), compressor);
+
+    name = g_strdup_printf ("%u%c.zarray", index, G_DIR_SEPARATOR);
+    write_metadata (priv, name, contents);
+
+    g_free (name);
+    g_free (contents);
+    g_free (compressor);
+}
+
+static void
+write_multiscales (UfoZarrWriterPrivate *priv)
+{
+    GString *contents;
+
+    contents = g_string_new ("{\n"
+                             "    \"multiscales\": [{\n"
+                             "        \"version\": \"0.4\",\n"
+                             "        \"axes\": [\n"
+                             "            {\"name\": \"z\", \"type\": \"space\"},\n"
+                             "            {\"name\": \"y\", \"type\": \"space\"},\n"
+                             "            {\"name\": \"x\", \"type\": \"space\"}\n"
+                             "        ],\n"
+                             "        \"datasets\": [\n");
+
+    /* Levels are only downsampled within slices */
+    for (guint l = 0; l < priv->num_levels; l++) {
+        g_string_append_printf (contents,
+                                "            {\"path\": \"%u\", \"coordinateTransformations\": "
+                                "[{\"type\": \"scale\", \"scale\": [1.0, %u.0, %u.0]}]}%s\n",
+                                l, 1 << l, 1 << l, l + 1 < priv->num_levels ? "," : "");
+    }
+
+    g_string_append (contents, "        ]\n    }]\n}\n");
+    write_metadata (priv, ".zattrs", contents->str);
+    g_string_free (contents, TRUE);
+}
+
+static void
+ufo_zarr_writer_close (UfoWriter *writer)
+{
+    UfoZarrWriterPrivate *priv;
+
+    priv = UFO_ZARR_WRITER_GET_PRIVATE (writer);
+
+    if (priv->pyramid == NULL)
+        return;
+
+    /* The last layer of chunks may be incomplete */
+    flush_slab (priv);
+
+    for (guint l = 0; l < priv->num_levels; l++)
+        write_array_metadata (priv, l);
+
+    write_multiscales (priv);
+
+    for (guint l = 0; l < priv->num_levels; l++)
+        g_free (priv->pyramid[l].slab);
+
+    g_free (priv->pyramid);
+    priv->pyramid = NULL;
+
+    if (priv->failed)
+        g_warning ("zarr: not all chunks of `%s' could be written", priv->path);
+}
+
+static void
+ufo_zarr_writer_set_property (GObject *object,
+                              guint property_id,
+                              const GValue *value,
+                              GParamSpec *pspec)
+{
+    UfoZarrWriterPrivate *priv = UFO_ZARR_WRITER_GET_PRIVATE (object);
+
+    switch (property_id) {
+        case PROP_CHUNK_DEPTH:
+            priv->chunk_depth = g_value_get_uint (value);
+            break;
+        case PROP_CHUNK_HEIGHT:
+            priv->chunk_height = g_value_get_uint (value);
+            break;
+        case PROP_CHUNK_WIDTH:
+            priv->chunk_width = g_value_get_uint (value);
+            break;
+        case PROP_COMPRESSION:
+            {
+                const gchar *name = g_value_get_string (value);
+                guint i;
+
+                for (i = 0; i < G_N_ELEMENTS (compressions); i++) {
+                    if (!g_strcmp0 (compressions[i], name))
+                        break;
+                }
+
+#ifndef HAVE_ZLIB
+                if (i == COMPRESSION_ZLIB) {
+                    g_warning ("zarr: zlib compression is not available");
+                    return;
+                }
+#endif
+#ifndef HAVE_ZSTD
+                if (i == COMPRESSION_ZSTD) {
+                    g_warning ("zarr: zstd compression is not available");
+                    return;
+                }
+#endif
+
+                if (i == G_N_ELEMENTS (compressions)) {
+                    g_warning ("zarr: compression must be one of none, zlib or zstd");
+                    return;
+                }
+
+                g_free (priv->compression);
+                priv->compression = g_strdup (name);
+                priv->scheme = (Compression) i;
+            }
+            break;
+        case PROP_COMPRESSION_LEVEL:
+            priv->compression_level = g_value_get_uint (value);
+            break;
+        case PROP_LEVELS:
+            priv->levels = g_value_get_uint (value);
+            break;
+        case PROP_THREADS:
+            priv->threads = g_value_get_uint (value);
+
+            if (priv->pool != NULL)
+                g_thread_pool_set_max_threads (priv->pool, priv->threads ? priv->threads : g_get_num_processors (), NULL);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+ufo_zarr_writer_get_property (GObject *object,
+                              guint property_id,
+                              GValue *value,
+                              GParamSpec *pspec)
+{
+    UfoZarrWriterPrivate *priv = UFO_ZARR_WRITER_GET_PRIVATE (object);
+
+    switch (property_id) {
+        case PROP_CHUNK_DEPTH:
+            g_value_set_uint (value, priv->chunk_depth);
+            break;
+        case PROP_CHUNK_HEIGHT:
+            g_value_set_uint (value, priv->chunk_height);
+            break;
+        case PROP_CHUNK_WIDTH:
+            g_value_set_uint (value, priv->chunk_width);
+            break;
+        case PROP_COMPRESSION:
+            g_value_set_string (value, priv->compression);
+            break;
+        case PROP_COMPRESSION_LEVEL:
+            g_value_set_uint (value, priv->compression_level);
+            break;
+        case PROP_LEVELS:
+            g_value_set_uint (value, priv->levels);
+            break;
+        case PROP_THREADS:
+            g_value_set_uint (value, priv->threads);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+ufo_zarr_writer_finalize (GObject *object)
+{
+    UfoZarrWriterPrivate *priv;
+
+    priv = UFO_ZARR_WRITER_GET_PRIVATE (object);
+
+    if (priv->pyramid != NULL)
+        ufo_zarr_writer_close (UFO_WRITER (object));
+
+    if (priv->pool != NULL)
+        g_thread_pool_free (priv->pool, FALSE, TRUE);
+
+    g_mutex_clear (&priv->lock);
+    g_cond_clear (&priv->finished);
+    g_free (priv->compression);
+    g_free (priv->path);
+
+    G_OBJECT_CLASS (ufo_zarr_writer_parent_class)->finalize (object);
+}
+
+static void
+ufo_writer_interface_init (UfoWriterIface *iface)
+{
+    iface->can_open = ufo_zarr_writer_can_open;
+    iface->open = ufo_zarr_writer_open;
+    iface->close = ufo_zarr_writer_close;
+    iface->write = ufo_zarr_writer_write;
+}
+
+static void
+ufo_zarr_writer_class_init (UfoZarrWriterClass *klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+    gobject_class->set_property = ufo_zarr_writer_set_property;
+    gobject_class->get_property = ufo_zarr_writer_get_property;
+    gobject_class->finalize = ufo_zarr_writer_finalize;
+
+    properties[PROP_CHUNK_DEPTH] =
+        g_param_spec_uint ("chunk-depth",
+            "Number of slices per chunk",
+            "Number of slices per chunk",
+            1, G_MAXUINT, 64,
+            G_PARAM_READWRITE);
+
+    properties[PROP_CHUNK_HEIGHT] =
+        g_param_spec_uint ("chunk-height",
+            "Chunk height",
+            "Chunk height",
+            1, G_MAXUINT, 256,
+            G_PARAM_READWRITE);
+
+    properties[PROP_CHUNK_WIDTH] =
+        g_param_spec_uint ("chunk-width",
+            "Chunk width",
+            "Chunk width",
+            1, G_MAXUINT, 256,
+            G_PARAM_READWRITE);
+
+    properties[PROP_COMPRESSION] =
+        g_param_spec_string ("compression",
+            "Chunk compression",
+            "Chunk compression, one of none, zlib or zstd",
+            "none",
+            G_PARAM_READWRITE);
+
+    properties[PROP_COMPRESSION_LEVEL] =
+        g_param_spec_uint ("compression-level",
+            "Compression level",
+            "Compression level for zlib and zstd, 0 for the default",
+            0, 22, 0,
+            G_PARAM_READWRITE);
+
+    properties[PROP_LEVELS] =
+        g_param_spec_uint ("levels",
+            "Number of resolution levels",
+            "Number of resolution levels, each halving the slice width and height",
+            1, 32, 1,
+            G_PARAM_READWRITE);
+
+    properties[PROP_THREADS] =
+        g_param_spec_uint ("threads",
+            "Number of compression threads",
+            "Number of threads compressing and writing chunks, 0 for one per processor",
+            0, G_MAXUINT, 0,
+            G_PARAM_READWRITE);
+
+    for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
+        g_object_class_install_property (gobject_class, i, properties[i]);
+
+    g_type_class_add_private (gobject_class, sizeof (UfoZarrWriterPrivate));
+}
+
+static void
+ufo_zarr_writer_init (UfoZarrWriter *self)
+{
+    UfoZarrWriterPrivate *priv = NULL;
+
+    self->priv = priv = UFO_ZARR_WRITER_GET_PRIVATE (self);
+    priv->path = NULL;
+    priv->chunk_depth = 64;
+    priv->chunk_height = 256;
+    priv->chunk_width = 256;
+    priv->compression = g_strdup ("none");
+    priv->scheme = COMPRESSION_NONE;
+    priv->levels = 1;
+    priv->pyramid = NULL;
+    priv->pool = NULL;
+    g_mutex_init (&priv->lock);
+    g_cond_init (&priv->finished);
+}
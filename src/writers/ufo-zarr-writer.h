@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2011-2015 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UFO_ZARR_WRITER_ZARR_H
+#define UFO_ZARR_WRITER_ZARR_H
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define UFO_TYPE_ZARR_WRITER             (ufo_zarr_writer_get_type())
+#define UFO_ZARR_WRITER(obj)             (G_TYPE_CHECK_INSTANCE_CAST((obj), UFO_TYPE_ZARR_WRITER, UfoZarrWriter))
+#define UFO_IS_ZARR_WRITER(obj)          (G_TYPE_CHECK_INSTANCE_TYPE((obj), UFO_TYPE_ZARR_WRITER))
+#define UFO_ZARR_WRITER_CLASS(klass)     (G_TYPE_CHECK_CLASS_CAST((klass), UFO_TYPE_ZARR_WRITER, UfoZarrWriterClass))
+#define UFO_IS_ZARR_WRITER_CLASS(klass)  (G_TYPE_CHECK_CLASS_TYPE((klass), UFO_TYPE_ZARR_WRITER))
+#define UFO_ZARR_WRITER_GET_CLASS(obj)   (G_TYPE_INSTANCE_GET_CLASS((obj), UFO_TYPE_ZARR_WRITER, UfoZarrWriterClass))
+
+
+typedef struct _UfoZarrWriter           UfoZarrWriter;
+typedef struct _UfoZarrWriterClass      UfoZarrWriterClass;
+typedef struct _UfoZarrWriterPrivate    UfoZarrWriterPrivate;
+
+struct _UfoZarrWriter {
+    GObject parent_instance;
+
+    UfoZarrWriterPrivate *priv;
+};
+
+struct _UfoZarrWriterClass {
+    GObjectClass parent_class;
+};
+
+UfoZarrWriter  *ufo_zarr_writer_new       (void);
+GType           ufo_zarr_writer_get_type  (void);
+
+G_END_DECLS
+
+#endif
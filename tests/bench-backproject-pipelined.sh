@@ -0,0 +1,40 @@
+#!/bin/bash
+#
+# Times general-backproject with and without pipelined projection upload and
+# prints the best wall time of each mode and the speedup:
+#
+#   bench-backproject-pipelined.sh [width [projections [slices [repetitions]]]]
+#
+# Projections are width x width pixels and the volume has width x width x
+# slices voxels. Select the device with UFO_DEVICES, e.g. UFO_DEVICES=0, and
+# run once per device to compare CPU and discrete GPU devices.
+
+width=${1:-1024}
+projections=${2:-1500}
+slices=${3:-128}
+repetitions=${4:-3}
+
+run () {
+    local best=""
+
+    for i in $(seq $repetitions); do
+        start=$(date +%s.%N)
+        ufo-launch -q dummy-data width=$width height=$width number=$projections init=1 ! \
+            general-backproject burst=16 pipelined=$1 num-projections=$projections \
+                center-position-x=$((width / 2)) center-position-z=$((width / 2)) \
+                region=$((-slices / 2)),$((slices / 2)),1 ! \
+            null finish=True || exit 1
+        stop=$(date +%s.%N)
+        best=$(echo "$start $stop $best" | awk '{ t = $2 - $1; if ($3 == "" || t < $3) print t; else print $3 }')
+    done
+
+    echo $best
+}
+
+sequential=$(run False)
+pipelined=$(run True)
+
+echo "projections: $projections x $width x $width, volume: $width x $width x $slices"
+echo "sequential:  $sequential s"
+echo "pipelined:   $pipelined s"
+echo "speedup:     $(echo "$sequential $pipelined" | awk '{ printf "%.2f", $1 / $2 }')"
@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2011-2015 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compares the bit depth conversion of UfoWriter with the scalar loops it
+ * replaced and checks that both produce identical output:
+ *
+ *   bench-writer-convert [width [height [iterations]]]
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "writers/ufo-writer.h"
+
+static void
+reference_get_min_max (gfloat *src, gsize size, gfloat *min, gfloat *max)
+{
+    *min = G_MAXFLOAT;
+    *max = -G_MAXFLOAT;
+
+    for (gsize i = 0; i < size; i++) {
+        if (src[i] < *min)
+            *min = src[i];
+
+        if (src[i] > *max)
+            *max = src[i];
+    }
+}
+
+static void
+reference_convert (UfoWriterImage *image, gsize size)
+{
+    gfloat *src = (gfloat *) image->data;
+    gfloat min, max, scale;
+
+    if (!image->rescale) {
+        if (image->depth == UFO_BUFFER_DEPTH_8U) {
+            for (gsize i = 0; i < size; i++)
+                ((guint8 *) src)[i] = (guint8) src[i];
+        }
+        else {
+            for (gsize i = 0; i < size; i++)
+                ((guint16 *) src)[i] = (guint16) src[i];
+        }
+
+        return;
+    }
+
+    reference_get_min_max (src, size, &min, &max);
+    scale = (image->depth == UFO_BUFFER_DEPTH_8U ? 255.0f : 65535.0f) / (max - min);
+
+    for (gsize i = 0; i < size; i++) {
+        if (src[i] < min)
+            src[i] = min;
+        else if (src[i] > max)
+            src[i] = max;
+    }
+
+    if (image->depth == UFO_BUFFER_DEPTH_8U) {
+        for (gsize i = 0; i < size; i++)
+            ((guint8 *) src)[i] = (guint8) ((src[i] - min) * scale);
+    }
+    else {
+        for (gsize i = 0; i < size; i++)
+            ((guint16 *) src)[i] = (guint16) ((src[i] - min) * scale);
+    }
+}
+
+static gboolean
+run (const gchar *name, gfloat *input, gsize width, gsize height, guint iterations,
+     UfoBufferDepth depth, gboolean rescale)
+{
+    UfoRequisition requisition;
+    UfoWriterImage image;
+    GTimer *timer;
+    gfloat *reference;
+    gfloat *data;
+    gsize size;
+    gsize n_bytes;
+    gdouble reference_time = 0.0;
+    gdouble time = 0.0;
+    gboolean equal;
+
+    size = width * height;
+    n_bytes = size * (depth == UFO_BUFFER_DEPTH_8U ? 1 : 2);
+    reference = g_malloc (size * sizeof (gfloat));
+    data = g_malloc (size * sizeof (gfloat));
+    timer = g_timer_new ();
+
+    requisition.n_dims = 2;
+    requisition.dims[0] = width;
+    requisition.dims[1] = height;
+    image.requisition = &requisition;
+    image.min = G_MAXFLOAT;
+    image.max = -G_MAXFLOAT;
+    image.rescale = rescale;
+
+    for (guint i = 0; i < iterations; i++) {
+        memcpy (reference, input, size * sizeof (gfloat));
+        image.data = reference;
+        image.depth = depth;
+        g_timer_start (timer);
+        reference_convert (&image, size);
+        reference_time += g_timer_elapsed (timer, NULL);
+
+        memcpy (data, input, size * sizeof (gfloat));
+        image.data = data;
+        image.depth = depth;
+        g_timer_start (timer);
+        ufo_writer_convert_inplace (&image);
+        time += g_timer_elapsed (timer, NULL);
+    }
+
+    equal = memcmp (reference, data, n_bytes) == 0;
+    g_print ("%-16s %10.2f ms %10.2f ms %8.2fx  %s\n", name,
+             reference_time / iterations * 1000.0, time / iterations * 1000.0,
+             reference_time / time, equal ? "ok" : "MISMATCH");
+
+    g_timer_destroy (timer);
+    g_free (reference);
+    g_free (data);
+    return equal;
+}
+
+int
+main (int argc, char **argv)
+{
+    gsize width = argc > 1 ? (gsize) atol (argv[1]) : 8192;
+    gsize height = argc > 2 ? (gsize) atol (argv[2]) : width;
+    guint iterations = argc > 3 ? (guint) atoi (argv[3]) : 5;
+    gfloat *input;
+    gfloat *integral;
+    gboolean success = TRUE;
+
+    input = g_malloc (width * height * sizeof (gfloat));
+    integral = g_malloc (width * height * sizeof (gfloat));
+
+    for (gsize i = 0; i < width * height; i++) {
+        input[i] = (gfloat) g_random_double_range (-1.0, 1.0);
+        integral[i] = (gfloat) g_random_int_range (0, 256);
+    }
+
+    g_print ("%zu x %zu pixels, %u iterations\n\n", width, height, iterations);
+    g_print ("%-16s %13s %13s %9s\n", "conversion", "scalar", "writer", "speedup");
+
+    success &= run ("rescale 8 bit", input, width, height, iterations, UFO_BUFFER_DEPTH_8U, TRUE);
+    success &= run ("rescale 16 bit", input, width, height, iterations, UFO_BUFFER_DEPTH_16U, TRUE);
+    success &= run ("cast 8 bit", integral, width, height, iterations, UFO_BUFFER_DEPTH_8U, FALSE);
+    success &= run ("cast 16 bit", integral, width, height, iterations, UFO_BUFFER_DEPTH_16U, FALSE);
+
+    g_free (input);
+    g_free (integral);
+    return success ? 0 : 1;
+}
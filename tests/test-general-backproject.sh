@@ -0,0 +1,96 @@
+#!/bin/bash
+
+# Reconstructions with tuned launch parameters, on all devices or in slabs
+# that fit into a small device memory limit must match the regular
+# single-device, in-core reconstruction up to the rounding differences of a
+# different summation order.
+export XDG_CACHE_HOME=$(mktemp -d)
+tests/make-input gbp-in.tif float32 60 32 64 1
+status=0
+
+reconstruct () {
+    out=$1
+    shift
+    ufo-launch -q read path=gbp-in.tif ! \
+        general-backproject num-projections=60 center-position-x=32 center-position-z=16 region=${region:--8,8,1} "$@" ! \
+        write filename=$out tiff-bigtiff=False
+}
+
+compare () {
+    tests/check-equal gbp-ref.tif gbp-out.tif 0.5
+
+    if [ $? -ne 0 ]; then
+        echo "Reconstruction with $* differs"
+        status=1
+    fi
+}
+
+reconstruct gbp-ref.tif burst=8
+
+# The first run tunes and stores the parameters, the second one reuses them
+for run in tune reuse; do
+    reconstruct gbp-out.tif autotune=True
+    compare autotune $run
+done
+
+if [ ! -s $XDG_CACHE_HOME/ufo/general-backproject.tuning ]; then
+    echo "No tuning parameters stored"
+    status=1
+fi
+
+# Overlapping uploads with single-device, in-core backprojection must not
+# change the result of the blocking path
+reconstruct gbp-out.tif burst=8 pipelined=True
+compare pipelined
+
+# UFO_GBP_NUM_DEVICES spreads the chunks over three devices that share the
+# available queues, so broadcasting to all projection sets and gathering
+# slices through the host run even on a single device
+for options in "burst=8" "burst=8 pipelined=True" "autotune=True"; do
+    UFO_GBP_NUM_DEVICES=3 reconstruct gbp-out.tif multi-device=True $options
+    compare multi-device $options
+done
+
+# 64 KB of projections per set and 16 slices of 16 KB in chunks of at most a
+# quarter of the limit, i.e. two slabs of two chunks each
+for options in "" "pipelined=True" "cache-directory=." "autotune=True"; do
+    UFO_GBP_DEVICE_MEMORY_LIMIT=262144 reconstruct gbp-out.tif burst=8 out-of-core=True $options
+    compare out-of-core $options
+done
+
+if ls ufo-projections-* >/dev/null 2>&1; then
+    echo "Projection cache was not removed"
+    status=1
+fi
+
+# Too small for the regular path and for one chunk next to the projections
+if UFO_GBP_DEVICE_MEMORY_LIMIT=262144 reconstruct gbp-out.tif burst=8 2>/dev/null; then
+    echo "Volume larger than the limit did not fail without out-of-core"
+    status=1
+fi
+
+if UFO_GBP_DEVICE_MEMORY_LIMIT=65536 reconstruct gbp-out.tif burst=8 out-of-core=True 2>/dev/null; then
+    echo "Projections larger than the limit did not fail"
+    status=1
+fi
+
+# Three chunks of 32 KB per device do not fit next to the projections, slabs
+# are only supported on a single device
+UFO_GBP_NUM_DEVICES=3 UFO_GBP_DEVICE_MEMORY_LIMIT=131072 \
+    reconstruct gbp-out.tif burst=8 out-of-core=True multi-device=True 2> gbp-err.txt
+
+if ! grep -q "not supported on multiple devices" gbp-err.txt; then
+    echo "Out-of-core on multiple devices did not fail as unsupported"
+    status=1
+fi
+
+# An odd number of slices does not split evenly across devices
+region=-8,9,1
+reconstruct gbp-ref.tif burst=8
+UFO_GBP_NUM_DEVICES=3 reconstruct gbp-out.tif burst=8 multi-device=True
+compare multi-device with 17 slices
+unset region
+
+rm -rf $XDG_CACHE_HOME gbp-in.tif gbp-ref.tif gbp-out.tif gbp-err.txt
+
+exit $status
@@ -0,0 +1,39 @@
+#!/bin/bash
+
+# Data sets compressed by the reference filters must be decoded by the
+# built-in decoders without any HDF5 filter plugins installed.
+unset HDF5_PLUGIN_PATH
+status=0
+
+datasets=$(tests/make-input-hdf5-filters)
+
+for dataset in $datasets; do
+    for threads in 1 4; do
+        ufo-launch -q read path=hdf5-filters.h5:/$dataset hdf5-decompress-threads=$threads ! write filename=hdf5-filters-out.tif tiff-bigtiff=False
+        tests/check-equal hdf5-filters.h5:/reference hdf5-filters-out.tif
+
+        if [ $? -ne 0 ]; then
+            echo "Decoding $dataset with $threads threads failed"
+            status=1
+        fi
+    done
+
+    ufo-launch -q read path=hdf5-filters.h5:/$dataset y=5 height=20 image-start=1 image-step=2 hdf5-decompress-threads=2 ! write filename=hdf5-filters-out.tif tiff-bigtiff=False
+    ufo-launch -q read path=hdf5-filters.h5:/reference y=5 height=20 image-start=1 image-step=2 ! write filename=hdf5-filters-ref.tif tiff-bigtiff=False
+    tests/check-equal hdf5-filters-ref.tif hdf5-filters-out.tif || status=1
+done
+
+# Chunks that were never written read as the fill value
+for threads in 0 3; do
+    ufo-launch -q read path=hdf5-filters.h5:/sparse hdf5-decompress-threads=$threads ! write filename=hdf5-filters-out.tif tiff-bigtiff=False
+    tests/check-equal hdf5-filters.h5:/sparse-reference hdf5-filters-out.tif
+
+    if [ $? -ne 0 ]; then
+        echo "Unwritten chunks with $threads threads do not match the fill value"
+        status=1
+    fi
+done
+
+rm -f hdf5-filters.h5 hdf5-filters-out.tif hdf5-filters-ref.tif
+
+exit $status
@@ -0,0 +1,33 @@
+#!/bin/bash
+
+# The first run compiles the backprojection kernels and stores their binaries
+# in the user cache, the second run must load them from there and produce the
+# same volume.
+export XDG_CACHE_HOME=$(mktemp -d)
+export G_MESSAGES_DEBUG=gbp
+tests/make-input kc-in.tif float32 30 16 32 1
+status=0
+
+reconstruct () {
+    ufo-launch -q read path=kc-in.tif ! \
+        general-backproject num-projections=30 center-position-x=16 center-position-z=8 region=-4,4,1 ! \
+        write filename=$1 tiff-bigtiff=False 2>&1
+}
+
+reconstruct kc-first.tif > /dev/null
+
+if ! ls $XDG_CACHE_HOME/ufo/kernels/*.bin >/dev/null 2>&1; then
+    echo "No kernel binaries stored in $XDG_CACHE_HOME/ufo/kernels"
+    status=1
+fi
+
+if ! reconstruct kc-second.tif | grep -q "from kernel cache"; then
+    echo "Kernels were not loaded from the cache"
+    status=1
+fi
+
+tests/check-equal kc-first.tif kc-second.tif 0 || status=1
+
+rm -rf $XDG_CACHE_HOME kc-in.tif kc-first.tif kc-second.tif
+
+exit $status
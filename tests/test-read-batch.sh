@@ -0,0 +1,52 @@
+#!/bin/bash
+
+# Stacking frames into batches, also across file boundaries, must produce
+# the same frames as reading them one by one. Stacks with a depth of three
+# must not be taken for RGB images.
+tests/make-input batch-in-{}.tif uint16 22 24 40 1 7
+status=0
+
+ufo-launch -q read path=batch-in-*.tif ! write filename=batch-single.tif tiff-bigtiff=False
+
+for batch in 4 5; do
+    ufo-launch -q read path=batch-in-*.tif batch=$batch ! write filename=batch-stacked.tif tiff-bigtiff=False
+    tests/check-equal batch-single.tif batch-stacked.tif || status=1
+
+    ufo-launch -q read path=batch-in-*.tif batch=$batch prefetch=4 io-threads=2 ! write filename=batch-stacked.tif tiff-bigtiff=False
+    tests/check-equal batch-single.tif batch-stacked.tif || status=1
+
+    ufo-launch -q read path=batch-in-*.tif batch=$batch device-convert=True ! write filename=batch-stacked.tif tiff-bigtiff=False
+    tests/check-equal batch-single.tif batch-stacked.tif || status=1
+done
+
+# 22 frames leave a remainder of three, batch=3 makes every stack three deep
+for batch in 3 19; do
+    ufo-launch -q read path=batch-in-*.tif batch=$batch ! write filename=batch-stacked.tif tiff-bigtiff=False
+    tests/check-equal batch-single.tif batch-stacked.tif || status=1
+
+    ufo-launch -q read path=batch-in-*.tif batch=$batch ! write filename=batch-stacked-%04i.tif tiff-bigtiff=False
+    tests/check-equal batch-single.tif "batch-stacked-*.tif" || status=1
+    rm -f batch-stacked-*.tif
+done
+
+ufo-launch -q read path=batch-in-*.tif image-step=3 y=2 height=17 ! write filename=batch-single.tif tiff-bigtiff=False
+# 22 frames leave a remainder of three, batch=3 makes every stack three deep
+for batch in 3 19; do
+    ufo-launch -q read path=batch-in-*.tif batch=$batch ! write filename=batch-stacked.tif tiff-bigtiff=False
+    tests/check-equal batch-single.tif batch-stacked.tif || status=1
+
+    ufo-launch -q read path=batch-in-*.tif batch=$batch ! write filename=batch-stacked-%04i.tif tiff-bigtiff=False
+    tests/check-equal batch-single.tif "batch-stacked-*.tif" || status=1
+    rm -f batch-stacked-*.tif
+done
+
+ufo-launch -q read path=batch-in-*.tif image-step=3 y=2 height=17 batch=4 ! write filename=batch-stacked.tif tiff-bigtiff=False
+tests/check-equal batch-single.tif batch-stacked.tif || status=1
+
+tests/make-input-flat-field
+ufo-launch -q read path=flat-field-proj-*.tif batch=4 device-convert=True dark=flat-field-dark.tif flat=flat-field-flat.tif ! write filename=batch-stacked.tif tiff-bigtiff=False
+tests/check-equal flat-field-expected.tif batch-stacked.tif 1e-5 || status=1
+
+rm -f batch-in-*.tif batch-single.tif batch-stacked.tif flat-field-*.tif
+
+exit $status
@@ -0,0 +1,37 @@
+#!/bin/bash
+
+# Converting integer data on the device must match the conversion on the
+# host, with and without dark and flat field correction.
+status=0
+
+for dtype in uint8 uint16 int16; do
+    tests/make-input convert-in.tif $dtype 5 24 40 1
+    ufo-launch -q read path=convert-in.tif ! write filename=convert-host.tif tiff-bigtiff=False
+    ufo-launch -q read path=convert-in.tif device-convert=True ! write filename=convert-device.tif tiff-bigtiff=False
+    tests/check-equal convert-host.tif convert-device.tif || status=1
+done
+
+tests/make-input-flat-field
+
+ufo-launch -q read path=flat-field-proj-*.tif device-convert=True dark=flat-field-dark.tif flat=flat-field-flat.tif ! write filename=convert-device.tif tiff-bigtiff=False
+tests/check-equal flat-field-expected.tif convert-device.tif 1e-5 || status=1
+
+ufo-launch -q read path=flat-field-proj-*.tif device-convert=True dark=flat-field-dark.tif ! write filename=convert-device.tif tiff-bigtiff=False
+tests/check-equal flat-field-expected-dark.tif convert-device.tif || status=1
+
+# A region of interest must crop the references the same way
+ufo-launch -q read path=flat-field-proj-*.tif y=4 height=12 x=3 width=20 device-convert=True dark=flat-field-dark.tif flat=flat-field-flat.tif ! write filename=convert-device.tif tiff-bigtiff=False
+ufo-launch -q read path=flat-field-expected.tif y=4 height=12 x=3 width=20 ! write filename=convert-host.tif tiff-bigtiff=False
+tests/check-equal convert-host.tif convert-device.tif 1e-5 || status=1
+
+# References are only applied on the device, without it they must be refused
+for references in "dark=flat-field-dark.tif" "flat=flat-field-flat.tif"; do
+    if ufo-launch -q read path=flat-field-proj-*.tif $references ! null 2>/dev/null; then
+        echo "'$references' without device-convert did not fail"
+        status=1
+    fi
+done
+
+rm -f convert-in.tif convert-host.tif convert-device.tif flat-field-*.tif
+
+exit $status
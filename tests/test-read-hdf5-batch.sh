@@ -0,0 +1,38 @@
+#!/bin/bash
+
+# Batched HDF5 reads must match frame-by-frame reads and a SWMR reader must
+# follow a data set that is still being appended to.
+tests/make-input hdf5-in.h5 float32 21 24 40 1
+status=0
+
+ufo-launch -q read path=hdf5-in.h5:/images ! write filename=hdf5-single.tif tiff-bigtiff=False
+tests/check-equal hdf5-in.h5:/images hdf5-single.tif || status=1
+
+ufo-launch -q read path=hdf5-in.h5:/images hdf5-batch=4 ! write filename=hdf5-batch.tif tiff-bigtiff=False
+tests/check-equal hdf5-single.tif hdf5-batch.tif || status=1
+
+ufo-launch -q read path=hdf5-in.h5:/images image-start=2 image-step=3 ! write filename=hdf5-single.tif tiff-bigtiff=False
+ufo-launch -q read path=hdf5-in.h5:/images image-start=2 image-step=3 hdf5-batch=5 ! write filename=hdf5-batch.tif tiff-bigtiff=False
+tests/check-equal hdf5-single.tif hdf5-batch.tif || status=1
+
+ufo-launch -q read path=hdf5-in.h5:/images y=3 height=11 x=5 width=17 hdf5-batch=1 ! write filename=hdf5-single.tif tiff-bigtiff=False
+ufo-launch -q read path=hdf5-in.h5:/images y=3 height=11 x=5 width=17 hdf5-batch=8 ! write filename=hdf5-batch.tif tiff-bigtiff=False
+tests/check-equal hdf5-single.tif hdf5-batch.tif || status=1
+
+# SWMR
+rm -f hdf5-swmr.h5 hdf5-swmr.h5.ready
+tests/append-hdf5-swmr hdf5-swmr.h5 12 16 16 &
+writer=$!
+
+for i in $(seq 50); do
+    [ -f hdf5-swmr.h5.ready ] && break
+    sleep 0.1
+done
+
+ufo-launch -q read path=hdf5-swmr.h5:/images hdf5-swmr=True hdf5-swmr-timeout=3 ! write filename=hdf5-swmr.tif tiff-bigtiff=False
+wait $writer
+tests/check-equal hdf5-swmr.h5:/images hdf5-swmr.tif || status=1
+
+rm -f hdf5-in.h5 hdf5-single.tif hdf5-batch.tif hdf5-swmr.h5 hdf5-swmr.h5.ready hdf5-swmr.tif
+
+exit $status
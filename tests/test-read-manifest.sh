@@ -0,0 +1,36 @@
+#!/bin/bash
+
+# Files are read in natural order, directories matching the pattern are
+# skipped and the manifest is reused until the directory changes.
+rm -rf manifest-dir manifest.txt
+mkdir -p manifest-dir/img-5.tif
+status=0
+
+for i in 1 2 10 3 20; do
+    ufo-launch -q dummy-data width=8 height=8 number=1 init=$i ! write filename=manifest-dir/img-$i.tif tiff-bigtiff=False
+done
+
+ufo-launch -q read path=manifest-dir/img-*.tif ! write filename=manifest-out.tif tiff-bigtiff=False
+tests/check-sequence manifest-out.tif 1 2 3 10 20 || status=1
+
+ufo-launch -q read path=manifest-dir/img-*.tif manifest=manifest.txt ! write filename=manifest-out.tif tiff-bigtiff=False
+tests/check-sequence manifest-out.tif 1 2 3 10 20 || status=1
+inode=$(stat -c %i manifest.txt)
+
+ufo-launch -q read path=manifest-dir/img-*.tif manifest=manifest.txt ! write filename=manifest-out.tif tiff-bigtiff=False
+tests/check-sequence manifest-out.tif 1 2 3 10 20 || status=1
+
+if [ "$(stat -c %i manifest.txt)" != "$inode" ]; then
+    echo "Valid manifest was rewritten"
+    status=1
+fi
+
+# Usually lands within the same second as the manifest
+ufo-launch -q dummy-data width=8 height=8 number=1 init=4 ! write filename=manifest-dir/img-4.tif tiff-bigtiff=False
+
+ufo-launch -q read path=manifest-dir/img-*.tif manifest=manifest.txt ! write filename=manifest-out.tif tiff-bigtiff=False
+tests/check-sequence manifest-out.tif 1 2 3 4 10 20 || status=1
+
+rm -rf manifest-dir manifest.txt manifest-out.tif
+
+exit $status
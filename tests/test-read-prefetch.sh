@@ -0,0 +1,23 @@
+#!/bin/bash
+
+# Prefetching with several I/O threads must produce the same frames in the
+# same order as the synchronous read, also across file boundaries.
+tests/make-input prefetch-in-{}.tif uint16 23 32 48 1 5
+
+status=0
+
+ufo-launch -q read path=prefetch-in-*.tif ! write filename=prefetch-sync.tif tiff-bigtiff=False
+ufo-launch -q read path=prefetch-in-*.tif prefetch=6 io-threads=3 ! write filename=prefetch-async.tif tiff-bigtiff=False
+tests/check-equal prefetch-sync.tif prefetch-async.tif || status=1
+
+ufo-launch -q read path=prefetch-in-*.tif image-start=3 image-step=4 ! write filename=prefetch-sync.tif tiff-bigtiff=False
+ufo-launch -q read path=prefetch-in-*.tif image-start=3 image-step=4 prefetch=6 io-threads=3 ! write filename=prefetch-async.tif tiff-bigtiff=False
+tests/check-equal prefetch-sync.tif prefetch-async.tif || status=1
+
+ufo-launch -q read path=prefetch-in-*.tif number=7 prefetch=2 io-threads=4 ! write filename=prefetch-async.tif tiff-bigtiff=False
+ufo-launch -q read path=prefetch-in-*.tif number=7 ! write filename=prefetch-sync.tif tiff-bigtiff=False
+tests/check-equal prefetch-sync.tif prefetch-async.tif || status=1
+
+rm -f prefetch-in-*.tif prefetch-sync.tif prefetch-async.tif
+
+exit $status
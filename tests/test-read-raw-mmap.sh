@@ -0,0 +1,32 @@
+#!/bin/bash
+
+# Memory-mapped raw reads must match stdio reads, also for regions of
+# interest, image steps, headers and empty files.
+tests/make-input rawm-in-{}.raw uint16 14 24 40 1 5
+: > rawm-in-empty.raw
+status=0
+
+raw="raw-width=40 raw-height=24 raw-bitdepth=16"
+
+for options in "" "x=3 width=31 x-step=2 y=5 height=13 y-step=3" "image-start=2 image-step=3"; do
+    ufo-launch -q read path=rawm-in-*.raw $raw $options ! write filename=rawm-stdio.tif tiff-bigtiff=False
+    ufo-launch -q read path=rawm-in-*.raw $raw raw-mmap=True $options ! write filename=rawm-mmap.tif tiff-bigtiff=False
+    tests/check-equal rawm-stdio.tif rawm-mmap.tif
+
+    if [ $? -ne 0 ]; then
+        echo "Mapped read with '$options' differs"
+        status=1
+    fi
+done
+
+ufo-launch -q read path=rawm-in-0000.raw $raw raw-mmap=True ! write filename=rawm-mmap.tif tiff-bigtiff=False
+tests/check-equal rawm-in-0000.raw:uint16:5x24x40 rawm-mmap.tif || status=1
+
+# 16 byte header and 8 byte trailer per frame
+ufo-launch -q read path=rawm-in-0000.raw $raw raw-pre-offset=16 raw-post-offset=8 ! write filename=rawm-stdio.tif tiff-bigtiff=False
+ufo-launch -q read path=rawm-in-0000.raw $raw raw-pre-offset=16 raw-post-offset=8 raw-mmap=True ! write filename=rawm-mmap.tif tiff-bigtiff=False
+tests/check-equal rawm-stdio.tif rawm-mmap.tif || status=1
+
+rm -f rawm-in-*.raw rawm-stdio.tif rawm-mmap.tif
+
+exit $status
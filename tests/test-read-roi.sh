@@ -0,0 +1,29 @@
+#!/bin/bash
+
+# Every reader must return the same pixels for a region of interest, given as
+# x, width, x-step, y, height and y-step.
+tests/make-input-roi
+status=0
+
+raw="raw-width=53 raw-height=29 raw-bitdepth=16"
+
+for region in "8 33 4 2 10 3" "0 0 1 0 0 1" "5 0 1 0 0 1" "0 7 1 3 0 2" "52 1 1 28 1 1" "17 20 3 4 19 1"; do
+    set -- $region
+    roi="x=$1 width=$2 x-step=$3 y=$4 height=$5 y-step=$6"
+
+    tests/make-input-roi $region
+
+    for path in roi-in.tif "roi-in.raw $raw" "roi-in-*.edf" roi-in.h5:/images; do
+        ufo-launch -q read path=$path $roi ! write filename=roi-out.tif tiff-bigtiff=False
+        tests/check-equal roi-expected.tif roi-out.tif
+
+        if [ $? -ne 0 ]; then
+            echo "Reading '$path' with '$roi' failed"
+            status=1
+        fi
+    done
+done
+
+rm -f roi-in.tif roi-in.raw roi-in-*.edf roi-in.h5 roi-expected.tif roi-out.tif
+
+exit $status
@@ -0,0 +1,32 @@
+#!/bin/bash
+
+# Whole strips and tiles are decoded at once. Every layout must read the same
+# pixels as one row per strip, with and without a region of interest.
+tests/make-input-tiff-layouts
+status=0
+
+for dtype in uint8 uint16 float32 float64 rgb; do
+    for options in "" "x=5 width=30 x-step=3 y=7 height=25 y-step=2" "x=33 y=30 height=7" "x=17 width=1 y=36"; do
+        ufo-launch -q read path=tiff-layout-$dtype-scanline.tif $options ! write filename=tiff-layout-ref.tif tiff-bigtiff=False
+
+        for layout in strips single tiled deflate; do
+            ufo-launch -q read path=tiff-layout-$dtype-$layout.tif $options ! write filename=tiff-layout-out.tif tiff-bigtiff=False
+            tests/check-equal tiff-layout-ref.tif tiff-layout-out.tif
+
+            if [ $? -ne 0 ]; then
+                echo "$dtype $layout with '$options' differs from the scanline layout"
+                status=1
+            fi
+        done
+    done
+
+    # The reference itself must match the input
+    if [ "$dtype" != "rgb" ]; then
+        ufo-launch -q read path=tiff-layout-$dtype-scanline.tif ! write filename=tiff-layout-ref.tif tiff-bigtiff=False
+        tests/check-equal tiff-layout-$dtype-scanline.tif tiff-layout-ref.tif || status=1
+    fi
+done
+
+rm -f tiff-layout-*.tif
+
+exit $status
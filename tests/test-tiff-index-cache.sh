@@ -0,0 +1,49 @@
+#!/bin/bash
+
+# The page index of a multi-page TIFF is written on first use, reused while
+# the file is unchanged and rebuilt once the file is modified.
+export XDG_CACHE_HOME=$(mktemp -d)
+status=0
+
+tests/make-input index-in.tif uint16 10 16 24 1
+
+ufo-launch -q read path=index-in.tif tiff-index-cache=True ! write filename=index-out.tif tiff-bigtiff=False
+tests/check-equal index-in.tif index-out.tif || status=1
+
+index=$(ls $XDG_CACHE_HOME/ufo/tiff-index/* 2>/dev/null)
+
+if [ -z "$index" ]; then
+    echo "No index written"
+    status=1
+else
+    inode=$(stat -c %i $index)
+
+    ufo-launch -q read path=index-in.tif tiff-index-cache=True ! write filename=index-out.tif tiff-bigtiff=False
+    tests/check-equal index-in.tif index-out.tif || status=1
+
+    if [ "$(stat -c %i $index)" != "$inode" ]; then
+        echo "Valid index was rewritten"
+        status=1
+    fi
+
+    # Different number of pages and a different modification time
+    tests/make-input index-in.tif uint16 13 16 24 2
+    touch -d "2001-01-01 00:00:00" index-in.tif
+
+    ufo-launch -q read path=index-in.tif tiff-index-cache=True ! write filename=index-out.tif tiff-bigtiff=False
+    tests/check-equal index-in.tif index-out.tif || status=1
+
+    if [ "$(stat -c %i $index)" == "$inode" ]; then
+        echo "Stale index was not rewritten"
+        status=1
+    fi
+
+    # A corrupted index must be ignored
+    echo "garbage" > $index
+    ufo-launch -q read path=index-in.tif tiff-index-cache=True ! write filename=index-out.tif tiff-bigtiff=False
+    tests/check-equal index-in.tif index-out.tif || status=1
+fi
+
+rm -rf $XDG_CACHE_HOME index-in.tif index-out.tif
+
+exit $status
@@ -0,0 +1,41 @@
+#!/bin/bash
+
+# Writing in background threads must produce the same files with the same
+# contents as writing synchronously, also when frames are split into several
+# files by size and when they are converted to a lower bit depth.
+tests/make-input async-in.tif float32 23 24 40 1
+rm -rf async-sync async-async
+mkdir async-sync async-async
+status=0
+
+# 24 * 40 * 4 bytes per float frame, so two of them go into each file
+for options in "" "bits=16" "bits=8 minimum=0 maximum=1000"; do
+    rm -f async-sync/* async-async/*
+    ufo-launch -q read path=async-in.tif ! write filename=async-sync/out-%04i.tif bytes-per-file=8000 tiff-bigtiff=False $options
+
+    if [ -z "$options" ] && [ "$(ls async-sync | wc -l)" != "12" ]; then
+        echo "Expected 12 files"
+        status=1
+    fi
+
+    for threads in 1 3; do
+        rm -f async-async/*
+        ufo-launch -q read path=async-in.tif ! write filename=async-async/out-%04i.tif bytes-per-file=8000 tiff-bigtiff=False async=True queue-depth=3 io-threads=$threads $options
+
+        if [ "$(ls async-sync)" != "$(ls async-async)" ]; then
+            echo "File lists differ for '$options' with $threads threads"
+            status=1
+        fi
+
+        for f in $(ls async-sync); do
+            tests/check-equal async-sync/$f async-async/$f || status=1
+        done
+    done
+done
+
+ufo-launch -q read path=async-in.tif ! write filename=async-async/out.raw async=True io-threads=2
+tests/check-equal async-in.tif async-async/out.raw:float32:23x24x40 || status=1
+
+rm -rf async-in.tif async-sync async-async
+
+exit $status
@@ -0,0 +1,37 @@
+#!/bin/bash
+
+# Narrowing to 8 and 16 bits on the device must match the host conversion
+# up to rounding differences of the device arithmetic.
+tests/make-input wconvert-in.tif float32 6 37 53 1
+status=0
+
+for bits in 8 16; do
+    for options in "" "minimum=100 maximum=900" "minimum=900 maximum=100"; do
+        ufo-launch -q read path=wconvert-in.tif ! write filename=wconvert-host.tif tiff-bigtiff=False bits=$bits $options
+        ufo-launch -q read path=wconvert-in.tif ! write filename=wconvert-device.tif tiff-bigtiff=False bits=$bits device-convert=True $options
+        tests/check-equal wconvert-host.tif wconvert-device.tif 1
+
+        if [ $? -ne 0 ]; then
+            echo "Conversion to $bits bits with '$options' differs"
+            status=1
+        fi
+    done
+done
+
+ufo-launch -q read path=wconvert-in.tif ! write filename=wconvert-host.tif tiff-bigtiff=False bits=16 rescale=False
+ufo-launch -q read path=wconvert-in.tif ! write filename=wconvert-device.tif tiff-bigtiff=False bits=16 rescale=False device-convert=True
+tests/check-equal wconvert-host.tif wconvert-device.tif 1 || status=1
+
+# Without rescaling, values beyond 255 saturate on the device
+python3 -c "import numpy, tifffile; tifffile.imsave('wconvert-host.tif', numpy.clip(tifffile.imread('wconvert-in.tif'), 0, 255).astype(numpy.uint8))"
+ufo-launch -q read path=wconvert-in.tif ! write filename=wconvert-device.tif tiff-bigtiff=False bits=8 rescale=False device-convert=True
+tests/check-equal wconvert-host.tif wconvert-device.tif 1 || status=1
+
+# Frames converted on the device and written in the background
+ufo-launch -q read path=wconvert-in.tif ! write filename=wconvert-device.tif tiff-bigtiff=False bits=8 device-convert=True async=True io-threads=2
+ufo-launch -q read path=wconvert-in.tif ! write filename=wconvert-host.tif tiff-bigtiff=False bits=8
+tests/check-equal wconvert-host.tif wconvert-device.tif 1 || status=1
+
+rm -f wconvert-in.tif wconvert-host.tif wconvert-device.tif
+
+exit $status
@@ -0,0 +1,49 @@
+#!/bin/bash
+
+# Round-trip through the HDF5 writer with chunking, compression, batched
+# writes and a preallocated extent that must shrink to the written frames.
+unset HDF5_PLUGIN_PATH
+tests/make-input hdf5w-in.tif float32 23 24 40 1
+status=0
+
+check () {
+    tests/check-hdf5-layout "$@" || status=1
+    tests/check-equal hdf5w-in.tif hdf5w-out.h5:/images || status=1
+    ufo-launch -q read path=hdf5w-out.h5:/images ! write filename=hdf5w-back.tif tiff-bigtiff=False
+    tests/check-equal hdf5w-in.tif hdf5w-back.tif || status=1
+}
+
+rm -f hdf5w-out.h5
+ufo-launch -q read path=hdf5w-in.tif ! write filename=hdf5w-out.h5:/images
+check hdf5w-out.h5:/images 23x24x40 1x24x40
+
+rm -f hdf5w-out.h5
+ufo-launch -q read path=hdf5w-in.tif ! write filename=hdf5w-out.h5:/images hdf5-chunk-frames=4 hdf5-chunk-height=10 hdf5-chunk-width=16
+check hdf5w-out.h5:/images 23x24x40 4x10x16
+
+rm -f hdf5w-out.h5
+ufo-launch -q read path=hdf5w-in.tif ! write filename=hdf5w-out.h5:/images hdf5-chunk-frames=5 hdf5-compression=deflate hdf5-compression-level=6 hdf5-shuffle=True
+check hdf5w-out.h5:/images 23x24x40 5x24x40 1 2
+
+rm -f hdf5w-out.h5
+ufo-launch -q read path=hdf5w-in.tif ! write filename=hdf5w-out.h5:/images hdf5-batch=4 hdf5-chunk-frames=3 hdf5-compression=deflate
+check hdf5w-out.h5:/images 23x24x40 3x24x40 1
+
+# Preallocated extent larger and smaller than the number of written frames
+for num_frames in 40 10; do
+    rm -f hdf5w-out.h5
+    ufo-launch -q read path=hdf5w-in.tif ! write filename=hdf5w-out.h5:/images hdf5-num-frames=$num_frames hdf5-batch=6 hdf5-chunk-frames=4
+    check hdf5w-out.h5:/images 23x24x40 4x24x40
+done
+
+# Plugin filters may be missing in which case the data is written plain
+for compression in lz4 zstd bitshuffle; do
+    rm -f hdf5w-out.h5
+    ufo-launch -q read path=hdf5w-in.tif ! write filename=hdf5w-out.h5:/images hdf5-chunk-frames=2 hdf5-compression=$compression
+    ufo-launch -q read path=hdf5w-out.h5:/images hdf5-decompress-threads=2 ! write filename=hdf5w-back.tif tiff-bigtiff=False
+    tests/check-equal hdf5w-in.tif hdf5w-back.tif || status=1
+done
+
+rm -f hdf5w-in.tif hdf5w-out.h5 hdf5w-back.tif
+
+exit $status
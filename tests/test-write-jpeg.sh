@@ -0,0 +1,46 @@
+#!/bin/bash
+
+# Preview levels are written with the expected names and sizes, temporary
+# files are gone and frames encoded in parallel are renamed in input order.
+tests/make-input jpeg-in.tif float32 7 37 53 1
+rm -rf jpeg-out
+mkdir jpeg-out
+status=0
+
+ufo-launch -q read path=jpeg-in.tif ! write filename=jpeg-out/frame-%04i.jpg jpeg-levels=3 jpeg-threads=3
+
+for i in 0000 0006; do
+    tests/check-jpeg jpeg-out/frame-$i.jpg 53 37 jpeg-out/frame-${i}_2.jpg 26 18 jpeg-out/frame-${i}_4.jpg 13 9 || status=1
+done
+
+if [ "$(ls jpeg-out | wc -l)" != "21" ]; then
+    echo "Expected 21 files"
+    ls jpeg-out
+    status=1
+fi
+
+# Levels stop once the frame cannot be halved anymore
+rm -f jpeg-out/*
+ufo-launch -q read path=jpeg-in.tif number=1 ! write filename=jpeg-out/small.jpg jpeg-levels=10
+tests/check-jpeg jpeg-out/small_16.jpg 3 2 jpeg-out/small_32.jpg 1 1 || status=1
+
+if [ -e jpeg-out/small_64.jpg ]; then
+    echo "Level of size zero written"
+    status=1
+fi
+
+# Every frame overwrites the same files, the last frame must win
+rm -f jpeg-out/*
+ufo-launch -q read path=jpeg-in.tif ! write filename=jpeg-out/single.jpg jpeg-levels=2 jpeg-threads=4
+ufo-launch -q read path=jpeg-in.tif image-start=6 ! write filename=jpeg-out/last.jpg jpeg-levels=2
+cmp -s jpeg-out/single.jpg jpeg-out/last.jpg || { echo "single.jpg is not the last frame"; status=1; }
+cmp -s jpeg-out/single_2.jpg jpeg-out/last_2.jpg || { echo "single_2.jpg is not the last frame"; status=1; }
+
+if ls jpeg-out | grep -q tmp; then
+    echo "Temporary files left"
+    status=1
+fi
+
+rm -rf jpeg-in.tif jpeg-out
+
+exit $status
@@ -0,0 +1,49 @@
+#!/bin/bash
+
+# Direct writes pad to the alignment internally but the files must end up
+# with exactly the bytes of the frames, also when space was preallocated.
+tests/make-input rawd-in.tif float32 23 37 53 1
+rm -rf rawd-out
+mkdir rawd-out
+status=0
+
+check_size () {
+    size=$(stat -c %s $1)
+
+    if [ "$size" != "$2" ]; then
+        echo "$1 has $size bytes instead of $2"
+        status=1
+    fi
+}
+
+ufo-launch -q read path=rawd-in.tif ! write filename=rawd-out/sync.raw
+check_size rawd-out/sync.raw $((23 * 37 * 53 * 4))
+tests/check-equal rawd-in.tif rawd-out/sync.raw:float32:23x37x53 || status=1
+
+# 37 * 53 * 4 bytes per frame is not a multiple of the 4096 byte alignment
+for options in "" "raw-buffer-size=4096" "raw-buffer-size=10000" "raw-preallocate=1048576" "raw-preallocate=100 raw-buffer-size=8192"; do
+    ufo-launch -q read path=rawd-in.tif ! write filename=rawd-out/direct.raw raw-direct=True $options
+    check_size rawd-out/direct.raw $((23 * 37 * 53 * 4))
+    cmp -s rawd-out/sync.raw rawd-out/direct.raw || { echo "Contents differ with '$options'"; status=1; }
+done
+
+ufo-launch -q read path=rawd-in.tif ! write filename=rawd-out/sync.raw raw-preallocate=1048576
+check_size rawd-out/sync.raw $((23 * 37 * 53 * 4))
+
+# Narrowed frames and one file per two frames
+ufo-launch -q read path=rawd-in.tif ! write filename=rawd-out/sync-%04i.raw bits=16 bytes-per-file=8000
+ufo-launch -q read path=rawd-in.tif ! write filename=rawd-out/direct-%04i.raw bits=16 bytes-per-file=8000 raw-direct=True raw-preallocate=65536
+
+for f in rawd-out/sync-*.raw; do
+    cmp -s $f ${f/sync/direct} || { echo "$f differs"; status=1; }
+done
+
+check_size rawd-out/direct-0011.raw $((37 * 53 * 2))
+
+# Overwriting a longer file must truncate it
+ufo-launch -q read path=rawd-in.tif number=3 ! write filename=rawd-out/direct.raw raw-direct=True
+check_size rawd-out/direct.raw $((3 * 37 * 53 * 4))
+
+rm -rf rawd-in.tif rawd-out
+
+exit $status
@@ -0,0 +1,40 @@
+#!/bin/bash
+
+# Limits of the automatic rescaling per frame, from a prefix of the stream
+# and from the whole stream spilled to disk, with and without percentiles.
+tests/check-rescale make
+status=0
+
+run () {
+    ufo-launch -q read path=rescale-in.tif ! write filename=rescale-out.tif tiff-bigtiff=False "$@"
+}
+
+for bits in 8 16; do
+    run bits=$bits
+    tests/check-rescale rescale-out.tif $bits 0 0 100 || status=1
+
+    run bits=$bits rescale-mode=prefix rescale-prefix=3
+    tests/check-rescale rescale-out.tif $bits 3 0 100 || status=1
+
+    run bits=$bits rescale-mode=spill
+    tests/check-rescale rescale-out.tif $bits 10 0 100 || status=1
+
+    # A prefix longer than the stream behaves like spill
+    run bits=$bits rescale-mode=prefix rescale-prefix=20
+    tests/check-rescale rescale-out.tif $bits 10 0 100 || status=1
+done
+
+# The histogram interpolates percentiles within a bin
+run bits=8 rescale-mode=prefix rescale-prefix=4 rescale-low-percentile=1 rescale-high-percentile=99
+tests/check-rescale rescale-out.tif 8 4 1 99 2 || status=1
+
+run bits=8 rescale-mode=spill rescale-low-percentile=0.5 rescale-high-percentile=99.5
+tests/check-rescale rescale-out.tif 8 10 0.5 99.5 2 || status=1
+
+run bits=16 rescale-mode=spill rescale-low-percentile=0.5 rescale-high-percentile=99.5 async=True
+ufo-launch -q read path=rescale-in.tif ! write filename=rescale-sync.tif tiff-bigtiff=False bits=16 rescale-mode=spill rescale-low-percentile=0.5 rescale-high-percentile=99.5
+tests/check-equal rescale-sync.tif rescale-out.tif || status=1
+
+rm -f rescale-in.tif rescale-out.tif rescale-sync.tif
+
+exit $status
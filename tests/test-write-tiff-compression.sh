@@ -0,0 +1,43 @@
+#!/bin/bash
+
+# Every TIFF compression, with and without predictor, in strips and tiles
+# and at every bit depth must read back as the uncompressed data.
+tests/make-input tiffc-in.tif float32 5 37 53 1
+status=0
+
+for bits in 32 16 8; do
+    ufo-launch -q read path=tiffc-in.tif ! write filename=tiffc-ref.tif bits=$bits minimum=0 maximum=1000 tiff-bigtiff=False
+    ufo-launch -q read path=tiffc-ref.tif ! write filename=tiffc-ref-back.tif tiff-bigtiff=False
+
+    if [ $bits == 32 ]; then
+        tests/check-equal tiffc-in.tif tiffc-ref-back.tif || status=1
+    fi
+
+    for compression in none lzw deflate zstd; do
+        for predictor in False True; do
+            for layout in "" "tiff-rows-per-strip=5" "tiff-tile-width=16 tiff-tile-height=32"; do
+                ufo-launch -q read path=tiffc-in.tif ! write filename=tiffc-out.tif bits=$bits minimum=0 maximum=1000 tiff-bigtiff=False \
+                    tiff-compression=$compression tiff-predictor=$predictor tiff-threads=3 $layout
+                ufo-launch -q read path=tiffc-out.tif ! write filename=tiffc-back.tif tiff-bigtiff=False
+                tests/check-equal tiffc-ref-back.tif tiffc-back.tif
+
+                if [ $? -ne 0 ]; then
+                    echo "Round-trip failed for bits=$bits $compression predictor=$predictor $layout"
+                    status=1
+                fi
+            done
+        done
+    done
+done
+
+# Only one tile dimension must not silently fall back to strips
+for tile in "tiff-tile-width=16" "tiff-tile-height=16"; do
+    if ufo-launch -q read path=tiffc-in.tif ! write filename=tiffc-out.tif $tile 2>/dev/null; then
+        echo "'$tile' alone did not fail"
+        status=1
+    fi
+done
+
+rm -f tiffc-in.tif tiffc-ref.tif tiffc-ref-back.tif tiffc-out.tif tiffc-back.tif
+
+exit $status
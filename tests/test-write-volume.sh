@@ -0,0 +1,36 @@
+#!/bin/bash
+
+# Slices must land at their index in the preallocated volume regardless of
+# the order in which they arrive or which pipeline writes them.
+tests/make-input volume-in.tif float32 23 24 40 1
+status=0
+
+rm -f volume-out.raw
+ufo-launch -q read path=volume-in.tif image-start=12 ! write-volume filename=volume-out.raw number=23 offset=12
+ufo-launch -q read path=volume-in.tif number=12 ! write-volume filename=volume-out.raw number=23
+tests/check-equal volume-in.tif volume-out.raw:float32:23x24x40 || status=1
+
+# Independent pipelines writing into the same file at the same time
+rm -f volume-out.raw
+ufo-launch -q read path=volume-in.tif number=8 ! write-volume filename=volume-out.raw number=23 &
+ufo-launch -q read path=volume-in.tif image-start=8 number=8 ! write-volume filename=volume-out.raw number=23 offset=8 &
+ufo-launch -q read path=volume-in.tif image-start=16 ! write-volume filename=volume-out.raw number=23 offset=16 &
+wait
+tests/check-equal volume-in.tif volume-out.raw:float32:23x24x40 || status=1
+
+# Indices from metadata, slices before the offset stay zero
+rm -f volume-out.raw
+ufo-launch -q dummy-data width=8 height=8 number=5 init=7 metadata=True ! write-volume filename=volume-out.raw number=8 offset=3 index-key=meta
+ufo-launch -q read path=volume-out.raw raw-width=8 raw-height=8 raw-bitdepth=32 ! write filename=volume-meta.tif tiff-bigtiff=False
+tests/check-sequence volume-meta.tif 0 0 0 7 7 7 7 7 || status=1
+
+# A directory that cannot be created must fail the setup
+touch volume-file
+if ufo-launch -q read path=volume-in.tif ! write-volume filename=volume-file/sub/volume-out.raw number=23 2>/dev/null; then
+    echo "Writing below a regular file did not fail"
+    status=1
+fi
+
+rm -f volume-in.tif volume-out.raw volume-meta.tif volume-file
+
+exit $status
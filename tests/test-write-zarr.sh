@@ -0,0 +1,28 @@
+#!/bin/bash
+
+# Zarr metadata and chunk layout with partial chunks in every dimension,
+# several resolution levels and every compression.
+tests/make-input zarr-in.tif float32 11 37 53 1
+status=0
+
+for compression in none zlib zstd; do
+    rm -rf zarr-out.zarr
+    ufo-launch -q read path=zarr-in.tif ! write filename=zarr-out.zarr zarr-chunk-depth=4 zarr-chunk-height=16 zarr-chunk-width=32 \
+        zarr-levels=3 zarr-compression=$compression zarr-threads=3
+    tests/check-zarr zarr-out.zarr zarr-in.tif 3 4 16 32 $compression || status=1
+done
+
+# Chunks larger than the data and a single level
+rm -rf zarr-out.zarr
+ufo-launch -q read path=zarr-in.tif ! write filename=zarr-out.zarr
+tests/check-zarr zarr-out.zarr zarr-in.tif 1 64 256 256 none || status=1
+
+# A level directory that cannot be created must be reported right away
+rm -rf zarr-out.zarr
+mkdir zarr-out.zarr
+touch zarr-out.zarr/1
+ufo-launch -q read path=zarr-in.tif ! write filename=zarr-out.zarr zarr-levels=2 2>&1 | grep -q "could not create" || status=1
+
+rm -rf zarr-in.tif zarr-out.zarr
+
+exit $status